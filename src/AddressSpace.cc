@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <iterator>
 #include <limits>
 
 #include "rr/rr.h"
@@ -20,6 +22,7 @@
 #include "Session.h"
 #include "Task.h"
 #include "log.h"
+#include "x86_decoder.h"
 
 using namespace std;
 
@@ -554,6 +557,8 @@ KernelMapping AddressSpace::map(Task* t, remote_ptr<void> addr,
   }
 
   remove_range(dont_fork, MemoryRange(addr, num_bytes));
+  software_watch_range_changed(MemoryRange(addr, num_bytes));
+  condition_stub_range_changed(MemoryRange(addr, num_bytes), true);
 
   // The mmap() man page doesn't specifically describe
   // what should happen if an existing map is
@@ -640,6 +645,9 @@ void AddressSpace::protect(Task* t, remote_ptr<void> addr, size_t num_bytes,
                            int prot) {
   LOG(debug) << "mprotect(" << addr << ", " << num_bytes << ", " << HEX(prot)
              << ")";
+  software_watch_range_changed(MemoryRange(addr, ceil_page_size(num_bytes)));
+  condition_stub_range_changed(MemoryRange(addr, ceil_page_size(num_bytes)),
+                               false);
 
   MemoryRange last_overlap;
   auto protector = [this, prot, &last_overlap](const Mapping& mm,
@@ -772,6 +780,7 @@ void AddressSpace::remap(Task* t, remote_ptr<void> old_addr,
 
 void AddressSpace::remove_breakpoint(remote_code_ptr addr,
                                      BreakpointType type) {
+  condition_stub_breakpoint_changed(addr);
   auto it = breakpoints.find(addr);
   if (it == breakpoints.end() || it->second.unref(type) > 0) {
     return;
@@ -780,6 +789,7 @@ void AddressSpace::remove_breakpoint(remote_code_ptr addr,
 }
 
 bool AddressSpace::add_breakpoint(remote_code_ptr addr, BreakpointType type) {
+  condition_stub_breakpoint_changed(addr);
   auto it = breakpoints.find(addr);
   if (it == breakpoints.end()) {
     uint8_t overwritten_data;
@@ -809,6 +819,7 @@ void AddressSpace::remove_all_breakpoints() {
 }
 
 void AddressSpace::suspend_breakpoint_at(remote_code_ptr addr) {
+  condition_stub_breakpoint_changed(addr);
   auto it = breakpoints.find(addr);
   if (it != breakpoints.end()) {
     Task* t = *task_set().begin();
@@ -817,6 +828,7 @@ void AddressSpace::suspend_breakpoint_at(remote_code_ptr addr) {
 }
 
 void AddressSpace::restore_breakpoint_at(remote_code_ptr addr) {
+  condition_stub_breakpoint_changed(addr);
   auto it = breakpoints.find(addr);
   if (it != breakpoints.end()) {
     Task* t = *task_set().begin();
@@ -970,6 +982,8 @@ void AddressSpace::unmap(Task* t, remote_ptr<void> addr, ssize_t num_bytes) {
 void AddressSpace::unmap_internal(Task*, remote_ptr<void> addr,
                                   ssize_t num_bytes) {
   LOG(debug) << "munmap(" << addr << ", " << num_bytes << ")";
+  software_watch_range_changed(MemoryRange(addr, num_bytes));
+  condition_stub_range_changed(MemoryRange(addr, num_bytes), true);
 
   auto unmapper = [this](const Mapping& mm, const MemoryRange& rem) {
     LOG(debug) << "  unmapping (" << rem << ") ...";
@@ -1254,7 +1268,12 @@ AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
       monkeypatch_state(t->session().is_recording() ? new Monkeypatcher()
                                                     : nullptr),
       syscallbuf_enabled_(false),
-      first_run_event_(0) {
+      has_shared_mappings_(false),
+      first_run_event_(0),
+      software_write_watchpoints(false),
+      software_watch_protection_dirty_(false),
+      condition_stub_page_used(0),
+      condition_stub_page_failed(false) {
   // TODO: this is a workaround of
   // https://github.com/mozilla/rr/issues/1113 .
   if (session_->done_initial_exec()) {
@@ -1287,8 +1306,17 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       traced_syscall_ip_(o.traced_syscall_ip_),
       privileged_traced_syscall_ip_(o.privileged_traced_syscall_ip_),
       syscallbuf_enabled_(o.syscallbuf_enabled_),
+      has_shared_mappings_(o.has_shared_mappings_),
       saved_auxv_(o.saved_auxv_),
-      first_run_event_(0) {
+      first_run_event_(0),
+      software_write_watchpoints(o.software_write_watchpoints),
+      software_watch_pages(o.software_watch_pages),
+      software_watch_protection_dirty_(!o.software_watch_pages.empty() ||
+                                       o.software_watch_protection_dirty_),
+      condition_stubs(o.condition_stubs),
+      condition_stub_page(o.condition_stub_page),
+      condition_stub_page_used(o.condition_stub_page_used),
+      condition_stub_page_failed(o.condition_stub_page_failed) {
   for (auto& m : mem) {
     // The original address space continues to have exclusive ownership of
     // all local mappings.
@@ -1381,7 +1409,8 @@ static void configure_watch_registers(vector<WatchConfig>& regs,
 }
 
 vector<WatchConfig> AddressSpace::get_watch_configs(
-    WillSetTaskState will_set_task_state) {
+    WillSetTaskState will_set_task_state,
+    IncludeWriteWatchpoints include_write) {
   vector<WatchConfig> result;
   for (auto& kv : watchpoints) {
     vector<int8_t>* assigned_regs = nullptr;
@@ -1396,7 +1425,7 @@ vector<WatchConfig> AddressSpace::get_watch_configs(
     }
     if (READ_BIT & watching) {
       configure_watch_registers(result, r, WATCH_READWRITE, assigned_regs);
-    } else if (WRITE_BIT & watching) {
+    } else if ((WRITE_BIT & watching) && include_write == INCLUDE_WRITE) {
       configure_watch_registers(result, r, WATCH_WRITE, nullptr);
     }
   }
@@ -1454,22 +1483,44 @@ bool AddressSpace::has_exec_watchpoint_fired(remote_code_ptr addr) {
   return false;
 }
 
+static bool set_all_debug_regs(const set<Task*>& tasks,
+                               const Task::DebugRegs& regs) {
+  if (regs.size() > 0x7f) {
+    return false;
+  }
+  bool ok = true;
+  for (auto t : tasks) {
+    if (!t->set_debug_regs(regs)) {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
 bool AddressSpace::allocate_watchpoints() {
-  Task::DebugRegs regs = get_watch_configs(SETTING_TASK_STATE);
+  bool was_software = software_write_watchpoints;
+  software_write_watchpoints = false;
+  if (set_all_debug_regs(task_set(),
+                         get_watch_configs(SETTING_TASK_STATE))) {
+    software_watch_protection_dirty_ |= was_software;
+    return true;
+  }
 
-  if (regs.size() <= 0x7f) {
-    bool ok = true;
-    for (auto t : task_set()) {
-      if (!t->set_debug_regs(regs)) {
-        ok = false;
-      }
-    }
-    if (ok) {
-      return true;
-    }
+  // Write watchpoints can be checked by write-protecting their pages
+  // instead. We only do that during replay, where we can cheaply step
+  // over the faults, and the kernel doesn't write to tracee memory behind
+  // our back (mostly; see the comment in update_software_watch_protection).
+  if (session()->is_replaying() && session()->done_initial_exec() &&
+      set_all_debug_regs(task_set(), get_watch_configs(SETTING_TASK_STATE,
+                                                       EXCLUDE_WRITE))) {
+    LOG(debug) << "Out of debug registers; using software write watchpoints";
+    software_write_watchpoints = true;
+    software_watch_protection_dirty_ = true;
+    return true;
   }
+  software_watch_protection_dirty_ |= was_software;
 
-  regs.clear();
+  Task::DebugRegs regs;
   for (auto t2 : task_set()) {
     t2->set_debug_regs(regs);
   }
@@ -1479,6 +1530,137 @@ bool AddressSpace::allocate_watchpoints() {
   return false;
 }
 
+set<remote_ptr<void>> AddressSpace::wanted_software_watch_pages() const {
+  set<remote_ptr<void>> result;
+  if (!software_write_watchpoints || !session()->is_replaying()) {
+    return result;
+  }
+  for (auto& kv : watchpoints) {
+    int watching = kv.second.watched_bits();
+    if (!(WRITE_BIT & watching) || (READ_BIT & watching)) {
+      continue;
+    }
+    for (remote_ptr<void> page = floor_page_size(kv.first.start());
+         page < kv.first.end(); page += page_size()) {
+      if (!has_mapping(page)) {
+        continue;
+      }
+      const Mapping& m = mapping_of(page);
+      // Don't protect memory that rr itself or the kernel writes to
+      // directly.
+      if ((m.map.prot() & PROT_WRITE) && !m.flags &&
+          !m.monitored_shared_memory && !(m.map.flags() & MAP_SHARED)) {
+        result.insert(page);
+      }
+    }
+  }
+  return result;
+}
+
+static void mprotect_pages(AutoRemoteSyscalls& remote,
+                           const AddressSpace::Mapping& m,
+                           remote_ptr<void> start, remote_ptr<void> end,
+                           bool writable) {
+  int prot = m.map.prot();
+  if (!writable) {
+    prot &= ~PROT_WRITE;
+  }
+  remote.infallible_syscall(syscall_number_for_mprotect(remote.arch()), start,
+                            end - start, prot);
+}
+
+/**
+ * Call mprotect on runs of consecutive pages in |pages| that are in the same
+ * mapping.
+ */
+static void mprotect_page_runs(AutoRemoteSyscalls& remote, AddressSpace& as,
+                               const vector<remote_ptr<void>>& pages,
+                               bool writable) {
+  size_t i = 0;
+  while (i < pages.size()) {
+    const AddressSpace::Mapping& m = as.mapping_of(pages[i]);
+    size_t j = i + 1;
+    while (j < pages.size() && pages[j] == pages[j - 1] + page_size() &&
+           m.map.contains(pages[j])) {
+      ++j;
+    }
+    mprotect_pages(remote, m, pages[i], pages[j - 1] + page_size(), writable);
+    i = j;
+  }
+}
+
+void AddressSpace::update_software_watch_protection(Task* t) {
+  // Syscalls that replay actually performs (e.g. clone() writing the new
+  // tid into a protected page) would fail with EFAULT, so
+  // drop_software_watch_protection is called before them, and their writes
+  // aren't watched.
+  set<remote_ptr<void>> wanted = wanted_software_watch_pages();
+  vector<remote_ptr<void>> to_protect;
+  vector<remote_ptr<void>> to_unprotect;
+  set_difference(wanted.begin(), wanted.end(), software_watch_pages.begin(),
+                 software_watch_pages.end(), back_inserter(to_protect));
+  set_difference(software_watch_pages.begin(), software_watch_pages.end(),
+                 wanted.begin(), wanted.end(), back_inserter(to_unprotect));
+  software_watch_protection_dirty_ = false;
+  if (to_protect.empty() && to_unprotect.empty()) {
+    return;
+  }
+
+  LOG(debug) << "Write-protecting " << to_protect.size()
+             << " pages and unprotecting " << to_unprotect.size()
+             << " pages for software watchpoints";
+  AutoRemoteSyscalls remote(t, AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
+  mprotect_page_runs(remote, *this, to_unprotect, true);
+  mprotect_page_runs(remote, *this, to_protect, false);
+  software_watch_pages = move(wanted);
+}
+
+void AddressSpace::drop_software_watch_protection(AutoRemoteSyscalls& remote) {
+  if (software_watch_pages.empty()) {
+    return;
+  }
+  LOG(debug) << "Unprotecting " << software_watch_pages.size()
+             << " pages for remote syscalls";
+  // Clear |software_watch_pages| first: our own mprotect calls go through
+  // |remote| too.
+  vector<remote_ptr<void>> pages(software_watch_pages.begin(),
+                                 software_watch_pages.end());
+  software_watch_pages.clear();
+  software_watch_protection_dirty_ = true;
+  mprotect_page_runs(remote, *this, pages, true);
+}
+
+void AddressSpace::software_watch_range_changed(const MemoryRange& range) {
+  if (!software_write_watchpoints && software_watch_pages.empty()) {
+    return;
+  }
+  // The kernel replaced the protection of these pages, so they're no longer
+  // protected by us.
+  software_watch_pages.erase(
+      software_watch_pages.lower_bound(floor_page_size(range.start())),
+      software_watch_pages.lower_bound(range.end()));
+  software_watch_protection_dirty_ = true;
+}
+
+bool AddressSpace::is_software_watchpoint_fault(const siginfo_t& si) const {
+  return si.si_signo == SIGSEGV && si.si_code == SEGV_ACCERR &&
+         software_watch_pages.count(
+             floor_page_size(remote_ptr<void>((uintptr_t)si.si_addr)));
+}
+
+void AddressSpace::set_software_watch_page_writable(Task* t,
+                                                    remote_ptr<void> page,
+                                                    bool writable) {
+  AutoRemoteSyscalls remote(t, AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
+  mprotect_pages(remote, mapping_of(page), page, page + page_size(),
+                 writable);
+}
+
+bool AddressSpace::notify_software_watchpoint_write(remote_ptr<void> page) {
+  update_watchpoint_values(page, page + page_size());
+  return has_any_watchpoint_changes();
+}
+
 static inline void assert_coalesceable(Task* t,
                                        const AddressSpace::Mapping& lower,
                                        const AddressSpace::Mapping& higher) {
@@ -1543,10 +1725,364 @@ void AddressSpace::coalesce_around(Task* t, MemoryMap::iterator it) {
   assert(ins.second); // key didn't already exist
 }
 
+// Length of the jump to a condition stub, "jmp *slot".
+static const size_t condition_stub_jump_length = 7;
+// Length of the jump to a condition stub within +-2GB, "jmp rel32".
+static const size_t condition_stub_near_jump_length = 5;
+// Size of the stub code that doesn't depend on the condition or the
+// displaced instructions.
+static const size_t condition_stub_fixed_size = 8 + 28 + 1 + 23 + 6 + 5 + 14;
+
+static void append_bytes(vector<uint8_t>& code,
+                         std::initializer_list<uint8_t> bytes) {
+  code.insert(code.end(), bytes);
+}
+
+template <typename T> static void append_value(vector<uint8_t>& code, T v) {
+  uint8_t bytes[sizeof(T)];
+  memcpy(bytes, &v, sizeof(T));
+  code.insert(code.end(), bytes, bytes + sizeof(T));
+}
+
+bool AddressSpace::allocate_condition_stub_pages(Task* t) {
+  if (condition_stub_page_failed || !has_mapping(rr_page_start())) {
+    return false;
+  }
+  // Leave a guard page on each side.
+  remote_ptr<void> free_mem =
+      find_free_memory(4 * page_size(), rr_page_start());
+  remote_ptr<void> addr = free_mem + page_size();
+  // The stubs' absolute addresses are sign-extended 32-bit immediates.
+  if ((addr + 2 * page_size()).as_int() > uintptr_t(INT32_MAX)) {
+    LOG(debug) << "Can't find space for condition stubs in the low 2GB";
+    condition_stub_page_failed = true;
+    return false;
+  }
+
+  int flags = MAP_ANONYMOUS | MAP_FIXED | MAP_PRIVATE;
+  {
+    AutoRemoteSyscalls remote(t);
+    remote.infallible_mmap_syscall(addr, page_size(), PROT_READ | PROT_EXEC,
+                                   flags, -1, 0);
+    remote.infallible_mmap_syscall(addr + page_size(), page_size(),
+                                   PROT_READ | PROT_WRITE, flags, -1, 0);
+  }
+  map(t, addr, page_size(), PROT_READ | PROT_EXEC, flags, 0, string());
+  map(t, addr + page_size(), page_size(), PROT_READ | PROT_WRITE, flags, 0,
+      string());
+  condition_stub_page = addr.cast<uint8_t>();
+  condition_stub_page_used = 0;
+  return true;
+}
+
+bool AddressSpace::install_condition_stub(
+    Task* t, remote_code_ptr addr, int user_refs,
+    const vector<uint8_t>& condition_code, const vector<MemoryRange>& loads) {
+  // Relocated instructions don't trigger exec watchpoints, and write faults
+  // for software watchpoints in them would confuse us.
+  if (t->arch() != x86_64 || !session_->is_replaying() ||
+      !watchpoints.empty()) {
+    return false;
+  }
+  auto bp = breakpoints.find(addr);
+  if (bp == breakpoints.end() || bp->second.user_count != user_refs ||
+      bp->second.internal_count != 0 ||
+      !is_breakpoint_in_private_read_only_memory(addr)) {
+    return false;
+  }
+  auto existing = condition_stubs.find(addr);
+  if (existing != condition_stubs.end() && existing->second.installed) {
+    return true;
+  }
+
+  // Only the instruction at the breakpoint is displaced. Code after it may
+  // be a branch target (e.g. a loop head), and a jump back there must not
+  // land in the middle of our jump.
+  remote_ptr<uint8_t> site = addr.to_data_ptr<uint8_t>();
+  uint8_t code[16];
+  size_t available =
+      min(sizeof(code), size_t(mapping_of(site).map.end() - site));
+  if (t->read_bytes_fallible(site, available, code) != ssize_t(available)) {
+    return false;
+  }
+  replace_breakpoints_with_original_values(code, available, site);
+  X86Instruction insn;
+  if (!decode_x86_64_instruction(code, available, &insn) ||
+      insn.is_control_flow || insn.is_special ||
+      insn.length < condition_stub_near_jump_length) {
+    return false;
+  }
+  size_t length = insn.length;
+  // Nothing else may stop inside the displaced instruction.
+  MemoryRange displaced(site, length);
+  for (auto& b : breakpoints) {
+    remote_ptr<void> p = b.first.to_data_ptr<void>();
+    if (b.first != addr && displaced.contains(p)) {
+      return false;
+    }
+  }
+  for (auto& s : condition_stubs) {
+    if (s.first != addr && s.second.installed &&
+        displaced.intersects(MemoryRange(s.first.to_data_ptr<void>(),
+                                         s.second.displaced_length))) {
+      return false;
+    }
+  }
+  for (Task* task : task_set()) {
+    remote_ptr<void> ip = task->ip().to_data_ptr<void>();
+    if (ip != site && displaced.contains(ip)) {
+      return false;
+    }
+  }
+
+  ConditionStub* stub = nullptr;
+  if (existing != condition_stubs.end() &&
+      existing->second.condition_code == condition_code &&
+      existing->second.loads == loads &&
+      existing->second.displaced_length == length) {
+    stub = &existing->second;
+  } else {
+    if (condition_stub_page.is_null() && !allocate_condition_stub_pages(t)) {
+      return false;
+    }
+    size_t size = condition_stub_fixed_size + condition_code.size() + length;
+    if (condition_stub_page_used + size > page_size()) {
+      // Reuse the page if no stubs are installed, so no task can be in one.
+      for (auto& s : condition_stubs) {
+        if (s.second.installed) {
+          return false;
+        }
+      }
+      condition_stubs.clear();
+      condition_stub_page_used = 0;
+      if (size > page_size()) {
+        return false;
+      }
+    }
+
+    remote_ptr<uint8_t> slot = condition_stub_page + condition_stub_page_used;
+    remote_ptr<uint8_t> start = slot + 8;
+    remote_ptr<uint8_t> saved_rsp = condition_stub_page + page_size();
+    remote_ptr<uint8_t> stack_top = saved_rsp + page_size();
+    vector<uint8_t> stub_code;
+    append_value(stub_code, uint64_t(start.as_int()));
+    // mov %rsp,saved_rsp; mov $stack_top,%rsp; push saved_rsp
+    append_bytes(stub_code, { 0x48, 0x89, 0x24, 0x25 });
+    append_value(stub_code, uint32_t(saved_rsp.as_int()));
+    append_bytes(stub_code, { 0x48, 0xc7, 0xc4 });
+    append_value(stub_code, uint32_t(stack_top.as_int()));
+    append_bytes(stub_code, { 0xff, 0x34, 0x25 });
+    append_value(stub_code, uint32_t(saved_rsp.as_int()));
+    // pushf; push %rax; push %rcx; push %rdx; push $0
+    append_bytes(stub_code, { 0x9c, 0x50, 0x51, 0x52, 0x6a, 0x00 });
+    stub_code.insert(stub_code.end(), condition_code.begin(),
+                     condition_code.end());
+    // Pick the true or false path without a conditional branch:
+    // pop %rax; lea false(%rip),%rcx; lea true(%rip),%rdx;
+    // test %rax,%rax; cmovne %rdx,%rcx; jmp *%rcx
+    append_bytes(stub_code, { 0x58, 0x48, 0x8d, 0x0d });
+    append_value(stub_code, uint32_t(7 + 3 + 4 + 2 + 6));
+    append_bytes(stub_code, { 0x48, 0x8d, 0x15 });
+    append_value(stub_code, uint32_t(3 + 4 + 2));
+    append_bytes(stub_code,
+                 { 0x48, 0x85, 0xc0, 0x48, 0x0f, 0x45, 0xca, 0xff, 0xe1 });
+    // True: pop %rdx; pop %rcx; pop %rax; popf; pop %rsp; int3
+    append_bytes(stub_code, { 0x5a, 0x59, 0x58, 0x9d, 0x5c });
+    remote_ptr<uint8_t> trap_addr = slot + stub_code.size();
+    append_bytes(stub_code, { breakpoint_insn });
+    // False: restore registers, run the displaced instructions and
+    // jmp *0(%rip) back.
+    append_bytes(stub_code, { 0x5a, 0x59, 0x58, 0x9d, 0x5c });
+    remote_ptr<uint8_t> relocated = slot + stub_code.size();
+    stub_code.resize(stub_code.size() + length);
+    if (!relocate_x86_64_instructions(code, length, site.as_int(),
+                                      relocated.as_int(),
+                                      stub_code.data() + stub_code.size() -
+                                          length)) {
+      return false;
+    }
+    append_bytes(stub_code, { 0xff, 0x25, 0, 0, 0, 0 });
+    append_value(stub_code, uint64_t((site + length).as_int()));
+    assert(stub_code.size() == size);
+
+    bool ok = true;
+    t->write_bytes_helper(slot, stub_code.size(), stub_code.data(), &ok);
+    if (!ok) {
+      return false;
+    }
+    condition_stub_page_used += size;
+
+    stub = &condition_stubs[addr];
+    stub->condition_code = condition_code;
+    stub->loads = loads;
+    stub->start = slot;
+    stub->trap_addr = trap_addr;
+    stub->relocated = relocated;
+    stub->displaced_length = length;
+    stub->installed = false;
+  }
+
+  // jmp *slot, or jmp rel32 if the instruction is too short for that,
+  // padded with breakpoint instructions.
+  vector<uint8_t> jump;
+  if (length >= condition_stub_jump_length) {
+    append_bytes(jump, { 0xff, 0x24, 0x25 });
+    append_value(jump, uint32_t(stub->start.as_int()));
+  } else {
+    int64_t offset = stub->start.as_int() -
+                     (site + condition_stub_near_jump_length).as_int();
+    if (offset != int64_t(int32_t(offset))) {
+      return false;
+    }
+    append_bytes(jump, { 0xe9 });
+    append_value(jump, int32_t(offset));
+  }
+  jump.resize(length, breakpoint_insn);
+  stub->saved_bytes.resize(length);
+  if (t->read_bytes_fallible(site, length, stub->saved_bytes.data()) !=
+      ssize_t(length)) {
+    return false;
+  }
+  bool ok = true;
+  t->write_bytes_helper(site, length, jump.data(), &ok);
+  if (!ok) {
+    return false;
+  }
+  stub->installed = true;
+  LOG(debug) << "Installed condition stub for breakpoint at " << addr
+             << " displacing " << length << " bytes";
+  return true;
+}
+
+void AddressSpace::uninstall_condition_stub(remote_code_ptr addr,
+                                            ConditionStub& stub,
+                                            const MemoryRange& replaced) {
+  if (!stub.installed) {
+    return;
+  }
+  stub.installed = false;
+  if (task_set().empty()) {
+    return;
+  }
+  Task* t = *task_set().begin();
+  remote_ptr<uint8_t> site = addr.to_data_ptr<uint8_t>();
+  size_t i = 0;
+  while (i < stub.displaced_length) {
+    // Write back each run of bytes that wasn't replaced.
+    size_t end = i;
+    while (end < stub.displaced_length && !replaced.contains(site + end)) {
+      ++end;
+    }
+    if (end > i) {
+      bool ok = true;
+      t->write_bytes_helper(site + i, end - i, stub.saved_bytes.data() + i,
+                            &ok);
+    }
+    i = end + 1;
+  }
+}
+
+void AddressSpace::remove_condition_stubs() {
+  for (auto& s : condition_stubs) {
+    uninstall_condition_stub(s.first, s.second);
+  }
+}
+
+void AddressSpace::free_condition_stub_pages(Task* t) {
+  if (condition_stub_page.is_null()) {
+    return;
+  }
+  remove_condition_stubs();
+  condition_stubs.clear();
+  remote_ptr<void> addr = condition_stub_page;
+  condition_stub_page = nullptr;
+  condition_stub_page_used = 0;
+  LOG(debug) << "Unmapping condition stub pages at " << addr;
+  {
+    AutoRemoteSyscalls remote(t);
+    remote.infallible_syscall(syscall_number_for_munmap(remote.arch()), addr,
+                              2 * page_size());
+  }
+  unmap(t, addr, 2 * page_size());
+}
+
+remote_code_ptr AddressSpace::translate_condition_stub_ip(remote_code_ptr ip,
+                                                          bool* trapped) {
+  *trapped = false;
+  remote_ptr<uint8_t> p = ip.to_data_ptr<uint8_t>();
+  if (condition_stub_page.is_null() || p < condition_stub_page ||
+      p >= condition_stub_page + page_size()) {
+    return remote_code_ptr();
+  }
+  remote_code_ptr result;
+  for (auto& s : condition_stubs) {
+    const ConditionStub& stub = s.second;
+    if (p == stub.trap_addr + 1) {
+      *trapped = true;
+      result = s.first.increment_by_bkpt_insn_length(x86_64);
+      break;
+    }
+    if (stub.relocated <= p && p <= stub.relocated + stub.displaced_length) {
+      result = s.first + (p - stub.relocated);
+      break;
+    }
+  }
+  if (result.is_null()) {
+    LOG(debug) << "Stopped in condition stub code at " << ip;
+    return result;
+  }
+  remove_condition_stubs();
+  return result;
+}
+
+void AddressSpace::condition_stub_breakpoint_changed(remote_code_ptr addr) {
+  for (auto& s : condition_stubs) {
+    if (s.second.installed &&
+        MemoryRange(s.first.to_data_ptr<void>(), s.second.displaced_length)
+            .contains(addr.to_data_ptr<void>())) {
+      uninstall_condition_stub(s.first, s.second);
+    }
+  }
+}
+
+void AddressSpace::condition_stub_range_changed(const MemoryRange& range,
+                                                bool contents_replaced) {
+  if (condition_stub_page.is_null()) {
+    return;
+  }
+  MemoryRange replaced = contents_replaced ? range : MemoryRange();
+  if (range.intersects(MemoryRange(condition_stub_page, 2 * page_size()))) {
+    for (auto& s : condition_stubs) {
+      uninstall_condition_stub(s.first, s.second, replaced);
+    }
+    condition_stubs.clear();
+    condition_stub_page = nullptr;
+    return;
+  }
+  for (auto& s : condition_stubs) {
+    if (!s.second.installed) {
+      continue;
+    }
+    if (range.intersects(MemoryRange(s.first.to_data_ptr<void>(),
+                                     s.second.displaced_length))) {
+      uninstall_condition_stub(s.first, s.second, replaced);
+      continue;
+    }
+    // The condition's loads must not fault.
+    for (auto& load : s.second.loads) {
+      if (range.intersects(load)) {
+        uninstall_condition_stub(s.first, s.second);
+        break;
+      }
+    }
+  }
+}
+
 void AddressSpace::destroy_breakpoint(BreakpointMap::const_iterator it) {
   if (task_set().empty()) {
     return;
   }
+  condition_stub_breakpoint_changed(it->first);
   Task* t = *task_set().begin();
   LOG(debug) << "Writing back " << std::hex << (int)it->second.overwritten_data
              << std::dec;
@@ -1556,6 +2092,7 @@ void AddressSpace::destroy_breakpoint(BreakpointMap::const_iterator it) {
 
 void AddressSpace::maybe_update_breakpoints(Task* t, remote_ptr<uint8_t> addr,
                                             size_t len) {
+  condition_stub_range_changed(MemoryRange(addr, len), true);
   for (auto& it : breakpoints) {
     remote_ptr<uint8_t> bp_addr = it.first.to_data_ptr<uint8_t>();
     if (addr <= bp_addr && bp_addr < addr + len - 1) {
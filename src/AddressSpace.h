@@ -225,6 +225,7 @@ struct WatchConfig {
  * of mapped pages, and the resources those mappings refer to.
  */
 class AddressSpace : public HasTaskSet {
+  friend class ReplaySession;
   friend class Session;
   friend struct VerifyAddressSpace;
 
@@ -577,6 +578,89 @@ public:
    */
   std::vector<WatchConfig> consume_watchpoint_changes();
 
+  /**
+   * When the debug registers can't hold all the watchpoints during replay,
+   * write-only watchpoints are implemented in software: the pages containing
+   * them are write-protected, and the task steps over each faulting write
+   * with its page made writable before checking the watched values.
+   */
+  bool has_software_watchpoints() const {
+    return !software_watch_pages.empty();
+  }
+  /**
+   * Return true if |si| is a write fault on a page we've write-protected to
+   * implement software watchpoints.
+   */
+  bool is_software_watchpoint_fault(const siginfo_t& si) const;
+  /**
+   * Temporarily make a page we've write-protected writable again, or
+   * write-protect it again.
+   */
+  void set_software_watch_page_writable(Task* t, remote_ptr<void> page,
+                                        bool writable);
+  /**
+   * Notify that the tracee wrote to the write-protected |page|. Returns true
+   * if any watchpoint triggered.
+   */
+  bool notify_software_watchpoint_write(remote_ptr<void> page);
+  /**
+   * Return true if the pages we write-protect need to be updated (by
+   * update_software_watch_protection) before |t| runs.
+   */
+  bool software_watch_protection_dirty() const {
+    return software_watch_protection_dirty_;
+  }
+  /**
+   * Make the pages write-protected in the tracee match the current software
+   * watchpoints and memory map, using remote mprotect calls in |t|.
+   */
+  void update_software_watch_protection(Task* t);
+  /**
+   * Make every page we've write-protected for software watchpoints
+   * writable again, using |remote|, so syscalls that rr runs in the tracee
+   * don't fail with EFAULT. The protection is restored before user code
+   * next runs.
+   */
+  void drop_software_watch_protection(AutoRemoteSyscalls& remote);
+
+  /**
+   * During replay, simple conditions of user breakpoints are evaluated in the
+   * tracee. The instruction at the breakpoint is displaced into a stub
+   * that runs the condition code and only executes a breakpoint instruction
+   * when the condition is true; otherwise it runs the displaced instruction
+   * and jumps back, without a ptrace stop. The stub contains no conditional
+   * branches so ticks are unaffected.
+   *
+   * Install a stub at |addr|, where |user_refs| user breakpoints are set,
+   * running |condition_code| (see GdbExpression::generate_x86_64_code),
+   * which reads |loads|. Returns false if a stub can't be installed there,
+   * e.g. because the instruction there is too short to hold the jump to the
+   * stub; the breakpoint then traps as usual.
+   * Stubs must be removed by remove_condition_stubs before anything else
+   * observes the tracee's code.
+   */
+  bool install_condition_stub(Task* t, remote_code_ptr addr, int user_refs,
+                              const std::vector<uint8_t>& condition_code,
+                              const std::vector<MemoryRange>& loads);
+  /**
+   * Restore the original code at all installed condition stubs.
+   */
+  void remove_condition_stubs();
+  /**
+   * Remove all condition stubs and unmap the pages holding them, which
+   * aren't part of the recording.
+   */
+  void free_condition_stub_pages(Task* t);
+  bool has_condition_stubs() const { return !condition_stub_page.is_null(); }
+  /**
+   * If |ip| is in a condition stub, return the corresponding address in the
+   * original code and remove all condition stubs. |*trapped| is set if the
+   * stub's breakpoint instruction was executed; the result is then the
+   * address just after the original breakpoint. Otherwise returns null.
+   */
+  remote_code_ptr translate_condition_stub_ip(remote_code_ptr ip,
+                                              bool* trapped);
+
   /**
    * Make [addr, addr + num_bytes) inaccessible within this
    * address space.
@@ -682,6 +766,15 @@ public:
    */
   void did_fork_into(Task* t);
 
+  /**
+   * A tracee created a mapping in this address space that may be shared with
+   * other processes (MAP_SHARED or SysV shm). Only tracked during recording,
+   * where tasks in address spaces without such mappings can be scheduled in
+   * parallel with each other.
+   */
+  void set_has_shared_mappings() { has_shared_mappings_ = true; }
+  bool has_shared_mappings() const { return has_shared_mappings_; }
+
   void set_first_run_event(TraceFrame::Time event) { first_run_event_ = event; }
   TraceFrame::Time first_run_event() { return first_run_event_; }
 
@@ -762,8 +855,10 @@ private:
   std::vector<WatchConfig> get_watchpoints_internal(WatchpointFilter filter);
 
   enum WillSetTaskState { SETTING_TASK_STATE, NOT_SETTING_TASK_STATE };
+  enum IncludeWriteWatchpoints { INCLUDE_WRITE, EXCLUDE_WRITE };
   std::vector<WatchConfig> get_watch_configs(
-      WillSetTaskState will_set_task_state);
+      WillSetTaskState will_set_task_state,
+      IncludeWriteWatchpoints include_write = INCLUDE_WRITE);
 
   /**
    * Construct a minimal set of watchpoints to be enabled based
@@ -772,6 +867,56 @@ private:
    */
   bool allocate_watchpoints();
 
+  /**
+   * The pages that should be write-protected to implement the current
+   * software watchpoints.
+   */
+  std::set<remote_ptr<void>> wanted_software_watch_pages() const;
+  /**
+   * Note that the tracee's protection of |range| was reset by a mapping
+   * change.
+   */
+  void software_watch_range_changed(const MemoryRange& range);
+
+  struct ConditionStub {
+    std::vector<uint8_t> condition_code;
+    std::vector<MemoryRange> loads;
+    // The stub's code, preceded by a slot holding its address for the jump
+    // at the breakpoint.
+    remote_ptr<uint8_t> start;
+    // The breakpoint instruction executed when the condition is true.
+    remote_ptr<uint8_t> trap_addr;
+    // The relocated copy of the displaced instructions.
+    remote_ptr<uint8_t> relocated;
+    size_t displaced_length;
+    // The bytes (including the breakpoint instruction) that the jump to the
+    // stub replaced.
+    std::vector<uint8_t> saved_bytes;
+    bool installed;
+  };
+  /**
+   * Allocate the pages for condition stubs: a code page and a data page for
+   * the stubs' scratch stack, within the low 2GB so they can be addressed
+   * with 32-bit absolute addresses.
+   */
+  bool allocate_condition_stub_pages(Task* t);
+  /**
+   * Restore the original code at |addr|, except for bytes in |replaced|
+   * whose contents have been replaced since the stub was installed.
+   */
+  void uninstall_condition_stub(remote_code_ptr addr, ConditionStub& stub,
+                                const MemoryRange& replaced = MemoryRange());
+  /**
+   * Note that the breakpoints at |addr| changed.
+   */
+  void condition_stub_breakpoint_changed(remote_code_ptr addr);
+  /**
+   * Note that the mapping or protection of |range| changed, replacing its
+   * contents if |contents_replaced|.
+   */
+  void condition_stub_range_changed(const MemoryRange& range,
+                                    bool contents_replaced);
+
   /**
    * Merge the mappings adjacent to |it| in memory that are
    * semantically "adjacent mappings" of the same resource as
@@ -1004,6 +1149,8 @@ private:
   remote_code_ptr traced_syscall_ip_;
   remote_code_ptr privileged_traced_syscall_ip_;
   bool syscallbuf_enabled_;
+  // Sticky; we don't clear this when the shared mappings go away.
+  bool has_shared_mappings_;
 
   std::vector<uint8_t> saved_auxv_;
 
@@ -1013,6 +1160,22 @@ private:
    */
   TraceFrame::Time first_run_event_;
 
+  // True when the debug registers couldn't hold all the watchpoints, so
+  // write-only watchpoints are implemented by write-protecting their pages.
+  bool software_write_watchpoints;
+  // The pages currently write-protected in the tracee for software
+  // watchpoints.
+  std::set<remote_ptr<void>> software_watch_pages;
+  bool software_watch_protection_dirty_;
+
+  // Condition stubs by breakpoint address, installed or not.
+  std::map<remote_code_ptr, ConditionStub> condition_stubs;
+  // The code page for condition stubs, followed by their data page.
+  remote_ptr<uint8_t> condition_stub_page;
+  size_t condition_stub_page_used;
+  // True if we couldn't allocate condition_stub_page in the low 2GB.
+  bool condition_stub_page_failed;
+
   /**
    * For each architecture, the offset of a syscall instruction with that
    * architecture's VDSO, or 0 if not known.
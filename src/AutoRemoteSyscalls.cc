@@ -68,6 +68,7 @@ AutoRemoteSyscalls::AutoRemoteSyscalls(Task* t,
       pending_syscallno(-1),
       scratch_mem_was_mapped(false),
       enable_mem_params_(enable_mem_params) {
+  ++t->software_watch_suspended;
   // We could use privilged_traced_syscall_ip() here, but we don't actually
   // need privileges because tracee seccomp filters are modified to only
   // produce PTRACE_SECCOMP_EVENTs that we ignore. And before the rr page is
@@ -135,7 +136,10 @@ void AutoRemoteSyscalls::maybe_fix_stack_pointer() {
   initial_regs.set_sp(fixed_sp);
 }
 
-AutoRemoteSyscalls::~AutoRemoteSyscalls() { restore_state_to(t); }
+AutoRemoteSyscalls::~AutoRemoteSyscalls() {
+  restore_state_to(t);
+  --t->software_watch_suspended;
+}
 
 void AutoRemoteSyscalls::restore_state_to(Task* t) {
   // Unmap our scatch region if required
@@ -165,6 +169,11 @@ void AutoRemoteSyscalls::syscall_helper(SyscallWaiting wait, int syscallno,
                                         Registers& callregs) {
   LOG(debug) << "syscall " << syscall_name(syscallno, t->arch());
 
+  // mprotect doesn't touch tracee memory, and it's how we unprotect pages.
+  if (syscallno != syscall_number_for_mprotect(t->arch())) {
+    t->vm()->drop_software_watch_protection(*this);
+  }
+
   callregs.set_syscallno(syscallno);
   t->set_regs(callregs);
 
@@ -563,4 +572,225 @@ void AutoRemoteSyscalls::check_syscall_result(int syscallno) {
   }
 }
 
+/**
+ * The loop injected by RemoteSyscallBatch. The stack pointer points at the
+ * batch's entries: each is a syscall number, six arguments and a slot for
+ * the result. The loop pops the number and arguments, makes the syscall and
+ * stores the result in the slot, until it pops a syscall number of -1; then
+ * it traps. Using the stack pointer as the cursor leaves every other
+ * register free for syscall arguments.
+ */
+static const uint8_t x86_batch_loop[] = {
+  0x58,                               // loop: pop %eax
+  0x83, 0xf8, 0xff,                   // cmp $-1,%eax
+  0x74, 0x10,                         // je done
+  0x5b, 0x59, 0x5a, 0x5e, 0x5f, 0x5d, // pop %ebx..%ebp
+  0xcd, 0x80,                         // int $0x80
+  0x89, 0x04, 0x24,                   // mov %eax,(%esp)
+  0x83, 0xc4, 0x04,                   // add $4,%esp
+  0xeb, 0xea,                         // jmp loop
+  0xcc                                // done: int3
+};
+
+static const uint8_t x64_batch_loop[] = {
+  0x58,                               // loop: pop %rax
+  0x48, 0x83, 0xf8, 0xff,             // cmp $-1,%rax
+  0x74, 0x15,                         // je done
+  0x5f, 0x5e, 0x5a,                   // pop %rdi,%rsi,%rdx
+  0x41, 0x5a, 0x41, 0x58, 0x41, 0x59, // pop %r10,%r8,%r9
+  0x0f, 0x05,                         // syscall
+  0x48, 0x89, 0x04, 0x24,             // mov %rax,(%rsp)
+  0x48, 0x83, 0xc4, 0x08,             // add $8,%rsp
+  0xeb, 0xe4,                         // jmp loop
+  0xcc                                // done: int3
+};
+
+/* Syscall number, six arguments and the result. */
+static const size_t words_per_batch_entry = 8;
+
+size_t RemoteSyscallBatch::add_mmap(remote_ptr<void> addr, size_t length,
+                                    int prot, int flags, int child_fd,
+                                    uint64_t offset_pages) {
+  SupportedArch arch = remote.arch();
+  return has_mmap2_syscall(arch)
+             ? add(syscall_number_for_mmap2(arch), addr, length, prot, flags,
+                   child_fd, (off_t)offset_pages)
+             : add(syscall_number_for_mmap(arch), addr, length, prot, flags,
+                   child_fd, offset_pages * page_size());
+}
+
+RemoteSyscallBatch::DataRef RemoteSyscallBatch::add_data(const void* mem,
+                                                         size_t num_bytes) {
+  DataRef ref = { data.size() };
+  data.insert(data.end(), (const uint8_t*)mem,
+              (const uint8_t*)mem + num_bytes);
+  data.resize(align_size(data.size()));
+  return ref;
+}
+
+uintptr_t RemoteSyscallBatch::arg_value(const Syscall& s, int index,
+                                        remote_ptr<void> data_addr) const {
+  if (s.data_args & (1 << index)) {
+    return (data_addr + s.args[index]).as_int();
+  }
+  return s.args[index];
+}
+
+static void append_word(vector<uint8_t>& image, size_t word_size,
+                        uintptr_t value) {
+  if (word_size == 4) {
+    uint32_t v = value;
+    image.insert(image.end(), (uint8_t*)&v, (uint8_t*)&v + sizeof(v));
+  } else {
+    uint64_t v = value;
+    image.insert(image.end(), (uint8_t*)&v, (uint8_t*)&v + sizeof(v));
+  }
+}
+
+static uintptr_t read_word(const uint8_t* p, size_t word_size) {
+  if (word_size == 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void RemoteSyscallBatch::run_one_at_a_time(remote_ptr<void> data_addr) {
+  for (auto& s : syscalls) {
+    Registers callregs = remote.regs();
+    for (int i = 0; i < 6; ++i) {
+      callregs.set_arg(i + 1, arg_value(s, i, data_addr));
+    }
+    remote.syscall_helper(AutoRemoteSyscalls::WAIT, s.syscallno, callregs);
+    s.result = remote.task()->regs().syscall_result();
+  }
+}
+
+void RemoteSyscallBatch::run() {
+  Task* t = remote.task();
+  if (syscalls.empty()) {
+    return;
+  }
+  if (data.empty() && syscalls.size() <= 2) {
+    // Mapping and unmapping the scratch region would cost more than
+    // it saves.
+    run_one_at_a_time(remote_ptr<void>());
+    return;
+  }
+
+  const uint8_t* loop;
+  size_t loop_size;
+  size_t word_size;
+  switch (t->arch()) {
+    case x86:
+      loop = x86_batch_loop;
+      loop_size = sizeof(x86_batch_loop);
+      word_size = 4;
+      break;
+    case x86_64:
+      loop = x64_batch_loop;
+      loop_size = sizeof(x64_batch_loop);
+      word_size = 8;
+      break;
+    default:
+      ASSERT(t, false) << "Unknown arch";
+      return;
+  }
+  size_t entries_offset = align_size(loop_size);
+  size_t data_offset =
+      entries_offset +
+      (syscalls.size() * words_per_batch_entry + 1) * word_size;
+  size_t region_size = ceil_page_size(data_offset + data.size());
+
+  // The scratch region isn't added to the AddressSpace since it's unmapped
+  // again before we return.
+  SupportedArch arch = t->arch();
+  int mmap_syscallno = has_mmap2_syscall(arch) ? syscall_number_for_mmap2(arch)
+                                               : syscall_number_for_mmap(arch);
+  long ret = remote.syscall(mmap_syscallno, remote_ptr<void>(), region_size,
+                            PROT_READ | PROT_WRITE | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bool inject = !(-4096 < ret && ret < 0);
+  remote_ptr<void> region;
+  if (inject) {
+    region = t->regs().syscall_result();
+  } else {
+    LOG(debug) << "Can't map executable scratch memory (errno "
+               << errno_name(-ret) << "); not batching syscalls";
+    region = remote.infallible_mmap_syscall(remote_ptr<void>(), region_size,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  remote_ptr<void> data_addr = region + data_offset;
+
+  vector<uint8_t> image(loop, loop + loop_size);
+  image.resize(entries_offset);
+  for (auto& s : syscalls) {
+    append_word(image, word_size, s.syscallno);
+    for (int i = 0; i < 6; ++i) {
+      append_word(image, word_size, arg_value(s, i, data_addr));
+    }
+    append_word(image, word_size, 0);
+  }
+  append_word(image, word_size, uintptr_t(-1));
+  assert(image.size() == data_offset);
+  image.insert(image.end(), data.begin(), data.end());
+  t->write_bytes_helper(region, image.size(), image.data());
+
+  if (inject) {
+    LOG(debug) << "running " << syscalls.size() << " batched syscalls";
+    Registers callregs = remote.regs();
+    callregs.set_ip(remote_code_ptr(region.as_int()));
+    callregs.set_sp(region + entries_offset);
+    t->set_regs(callregs);
+    do {
+      // Tracee seccomp filters may stop the task at each syscall.
+      t->resume_execution(RESUME_CONT, RESUME_WAIT, RESUME_NO_TICKS);
+    } while (t->is_ptrace_seccomp_event());
+    ASSERT(t, t->stop_sig() == SIGTRAP &&
+                  t->ip() == remote_code_ptr((region + loop_size).as_int()))
+        << "Batched syscalls stopped with " << t->status() << " at "
+        << t->ip();
+
+    size_t entries_size = data_offset - entries_offset;
+    vector<uint8_t> entries(entries_size);
+    t->read_bytes_helper(region + entries_offset, entries_size,
+                         entries.data());
+    for (size_t i = 0; i < syscalls.size(); ++i) {
+      syscalls[i].result = read_word(
+          entries.data() + ((i + 1) * words_per_batch_entry - 1) * word_size,
+          word_size);
+    }
+  } else {
+    run_one_at_a_time(data_addr);
+  }
+
+  remote.infallible_syscall(syscall_number_for_munmap(arch), region,
+                            region_size);
+}
+
+long RemoteSyscallBatch::result(size_t index) const {
+  uintptr_t ret = syscalls[index].result;
+  // Sign-extend as Registers::syscall_result_signed does.
+  return remote.arch() == x86 ? long(int32_t(ret)) : long(ret);
+}
+
+long RemoteSyscallBatch::infallible_result(size_t index) const {
+  long ret = result(index);
+  ASSERT(remote.task(), !(-4096 < ret && ret < 0))
+      << "Batched syscall "
+      << syscall_name(syscalls[index].syscallno, remote.arch())
+      << " failed with errno " << errno_name(-ret);
+  return ret;
+}
+
+remote_ptr<void> RemoteSyscallBatch::infallible_result_ptr(
+    size_t index) const {
+  infallible_result(index);
+  return syscalls[index].result;
+}
+
 } // namespace rr
@@ -201,23 +201,22 @@ public:
    * If |wait| is |WAIT|, the syscall is finished in |t| and the
    * result is returned.  Otherwise if it's |DONT_WAIT|, the
    * syscall is initiated but *not* finished in |t|, and the
-   * return value is undefined.  Call |wait_remote_syscall()| to
+   * return value is undefined.  Call |wait_syscall()| to
    * finish the syscall and get the return value.
    */
   enum SyscallWaiting { WAIT = 1, DONT_WAIT = 0 };
   void syscall_helper(SyscallWaiting wait, int syscallno, Registers& callregs);
-
-  MemParamsEnabled enable_mem_params() { return enable_mem_params_; }
-
-private:
   /**
    * Wait for the |DONT_WAIT| syscall |syscallno| initiated by
-   * |remote_syscall()| to finish, returning the result.
+   * |syscall_helper()| to finish, returning the result.
    * |syscallno| is only for assertion checking. If no value is passed in,
    * everything should work without the assertion checking.
    */
   void wait_syscall(int syscallno = -1);
 
+  MemParamsEnabled enable_mem_params() { return enable_mem_params_; }
+
+private:
   void check_syscall_result(int syscallno);
 
   /**
@@ -260,6 +259,130 @@ private:
   void operator delete(void*) = delete;
 };
 
+/**
+ * A list of syscalls to make in the Task of an AutoRemoteSyscalls with a
+ * single resume, instead of stopping the task at the entry and exit of each
+ * one. Usage looks like
+ *
+ *    RemoteSyscallBatch batch(remote);
+ *    auto path = batch.add_data("foo");
+ *    batch.add(syscall_number_for_open(remote.arch()), path, O_RDONLY);
+ *    batch.add(syscall_number_for_close(remote.arch()), fd);
+ *    batch.run();
+ *    long fd = batch.result(0);
+ *
+ * The syscalls are made in order, so they can't depend on each other's
+ * results. Memory parameters are copied into the batch with |add_data|.
+ *
+ * The syscalls are made by a small loop injected into a scratch mapping. If
+ * an executable scratch mapping can't be created, they're made one at a time
+ * instead.
+ */
+class RemoteSyscallBatch {
+public:
+  /**
+   * Refers to data copied into the batch. Passed as a syscall argument, it
+   * becomes the address of the data in the tracee.
+   */
+  struct DataRef {
+    size_t offset;
+  };
+
+  RemoteSyscallBatch(AutoRemoteSyscalls& remote) : remote(remote) {}
+
+  /**
+   * Append |syscallno| with variadic |args| (limited to 6) to the batch.
+   * Return the index of its result.
+   */
+  template <typename... Rest> size_t add(int syscallno, Rest... args) {
+    static_assert(sizeof...(args) <= 6, "Too many syscall arguments");
+    Syscall s;
+    s.syscallno = syscallno;
+    memset(s.args, 0, sizeof(s.args));
+    s.data_args = 0;
+    s.result = 0;
+    // As for AutoRemoteSyscalls::syscall, the first argument is "arg 1".
+    set_args<1>(s, args...);
+    syscalls.push_back(s);
+    return syscalls.size() - 1;
+  }
+  /**
+   * Append an mmap syscall, selecting either mmap2 or mmap.
+   */
+  size_t add_mmap(remote_ptr<void> addr, size_t length, int prot, int flags,
+                  int child_fd, uint64_t offset_pages);
+
+  /**
+   * Copy |num_bytes| of |mem| into the batch.
+   */
+  DataRef add_data(const void* mem, size_t num_bytes);
+  /**
+   * Copy C string |str| into the batch, including the trailing '\0' byte.
+   */
+  DataRef add_data(const char* str) { return add_data(str, strlen(str) + 1); }
+
+  /**
+   * Make all the syscalls added so far. rr doesn't observe them
+   * individually, so callers are responsible for updating rr's state
+   * (e.g. the AddressSpace) to match, as for any other remote syscall.
+   */
+  void run();
+
+  size_t size() const { return syscalls.size(); }
+  /**
+   * The raw kernel return value of syscall |index|, once the batch has run.
+   */
+  long result(size_t index) const;
+  /**
+   * Like |result|, but asserts that the syscall succeeded.
+   */
+  long infallible_result(size_t index) const;
+  remote_ptr<void> infallible_result_ptr(size_t index) const;
+
+private:
+  struct Syscall {
+    int syscallno;
+    uintptr_t args[6];
+    // Bit i set means args[i] is a DataRef offset.
+    uint32_t data_args;
+    // The result register, zero-extended.
+    uintptr_t result;
+  };
+
+  template <int Index, typename T, typename... Rest>
+  void set_args(Syscall& s, T arg, Rest... args) {
+    set_arg(s, Index, arg);
+    set_args<Index + 1>(s, args...);
+  }
+  template <int Index> void set_args(Syscall&) {}
+
+  static void set_arg(Syscall& s, int index, DataRef ref) {
+    s.args[index - 1] = ref.offset;
+    s.data_args |= 1 << (index - 1);
+  }
+  static void set_arg(Syscall& s, int index, std::nullptr_t) {
+    s.args[index - 1] = 0;
+  }
+  template <typename T>
+  static void set_arg(Syscall& s, int index, remote_ptr<T> value) {
+    s.args[index - 1] = value.as_int();
+  }
+  template <typename T> static void set_arg(Syscall& s, int index, T value) {
+    s.args[index - 1] = uintptr_t(value);
+  }
+
+  uintptr_t arg_value(const Syscall& s, int index,
+                      remote_ptr<void> data_addr) const;
+  void run_one_at_a_time(remote_ptr<void> data_addr);
+
+  AutoRemoteSyscalls& remote;
+  std::vector<Syscall> syscalls;
+  std::vector<uint8_t> data;
+
+  RemoteSyscallBatch& operator=(const RemoteSyscallBatch&) = delete;
+  RemoteSyscallBatch(const RemoteSyscallBatch&) = delete;
+};
+
 } // namespace rr
 
 #endif // RR_AUTO_REMOTE_SYSCALLS_H_
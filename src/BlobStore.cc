@@ -0,0 +1,370 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "BlobStore.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "ScopedFd.h"
+#include "kernel_supplement.h"
+#include "log.h"
+
+using namespace std;
+
+namespace rr {
+
+static const char blob_prefix[] = "mmap_blob_";
+
+/**
+ * Straightforward FIPS 180-4 SHA-256. Blob names only need to be collision
+ * resistant, not fast; reading the file dominates anyway.
+ */
+class Sha256 {
+public:
+  Sha256() : length(0), buffered(0) {
+    static const uint32_t init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19 };
+    memcpy(state, init, sizeof(state));
+  }
+
+  void update(const uint8_t* data, size_t size) {
+    length += size;
+    if (buffered) {
+      size_t n = min(size, sizeof(buffer) - buffered);
+      memcpy(buffer + buffered, data, n);
+      buffered += n;
+      data += n;
+      size -= n;
+      if (buffered < sizeof(buffer)) {
+        return;
+      }
+      process(buffer);
+      buffered = 0;
+    }
+    while (size >= sizeof(buffer)) {
+      process(data);
+      data += sizeof(buffer);
+      size -= sizeof(buffer);
+    }
+    memcpy(buffer, data, size);
+    buffered = size;
+  }
+
+  string hex_digest() {
+    uint64_t bits = length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_size = (buffered < 56 ? 56 : 120) - buffered;
+    for (int i = 0; i < 8; ++i) {
+      pad[pad_size + i] = uint8_t(bits >> (56 - 8 * i));
+    }
+    update(pad, pad_size + 8);
+    assert(buffered == 0);
+
+    static const char hex[] = "0123456789abcdef";
+    string result;
+    for (uint32_t word : state) {
+      for (int shift = 28; shift >= 0; shift -= 4) {
+        result += hex[(word >> shift) & 0xf];
+      }
+    }
+    return result;
+  }
+
+private:
+  static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  void process(const uint8_t* block) {
+    static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) |
+             (uint32_t(block[4 * i + 2]) << 8) | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + k[i] + w[i];
+      uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t buffer[64];
+  size_t buffered;
+};
+
+BlobStore BlobStore::for_trace(const string& trace_dir) {
+  string traces_dir;
+  char resolved[PATH_MAX];
+  if (realpath(trace_dir.c_str(), resolved)) {
+    traces_dir = resolved;
+    size_t last_slash = traces_dir.rfind('/');
+    traces_dir = last_slash == 0 ? string("/")
+                                 : traces_dir.substr(0, last_slash);
+  } else {
+    traces_dir = trace_dir + "/..";
+  }
+  return BlobStore(traces_dir + "/blobs", trace_dir);
+}
+
+string BlobStore::trace_file_name(const string& name) {
+  return blob_prefix + name;
+}
+
+string BlobStore::blob_name(const string& file_name) {
+  static const size_t prefix_len = sizeof(blob_prefix) - 1;
+  if (file_name.compare(0, prefix_len, blob_prefix) != 0) {
+    return string();
+  }
+  return file_name.substr(prefix_len);
+}
+
+bool BlobStore::ensure_dirs() {
+  if ((mkdir(dir.c_str(), S_IRWXU) < 0 && errno != EEXIST) ||
+      (mkdir((dir + "/by-inode").c_str(), S_IRWXU) < 0 && errno != EEXIST)) {
+    LOG(debug) << "Blob store " << dir << " unusable";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * File timestamps are coarse: they come from the kernel's tick-granularity
+ * clock, and some filesystems only store seconds (or two-second units). A
+ * file rewritten to the same size within one tick of being indexed can keep
+ * its ctime, so only files whose ctime is at least this old are indexed.
+ */
+static const int64_t ctime_tick_ns = 2000000000LL;
+
+static bool ctime_is_settled(const struct stat& st) {
+  struct timespec now;
+  if (clock_gettime(CLOCK_REALTIME, &now) < 0) {
+    return false;
+  }
+  int64_t age = (int64_t)(now.tv_sec - st.st_ctim.tv_sec) * 1000000000LL +
+                (now.tv_nsec - st.st_ctim.tv_nsec);
+  return age > ctime_tick_ns;
+}
+
+string BlobStore::index_path(const struct stat& st) const {
+  // ctime changes whenever the file's contents do, and can't be set by
+  // users. add() only uses the index once the ctime has settled.
+  stringstream ss;
+  ss << dir << "/by-inode/" << st.st_dev << "_" << st.st_ino << "_"
+     << st.st_size << "_" << st.st_ctim.tv_sec << "." << st.st_ctim.tv_nsec;
+  return ss.str();
+}
+
+bool BlobStore::link_into_trace(const string& name) {
+  string trace_path = trace_dir + "/" + trace_file_name(name);
+  // The trace may map the same file more than once.
+  return link(path(name).c_str(), trace_path.c_str()) == 0 ||
+         errno == EEXIST;
+}
+
+static bool is_unchanged(int fd, const struct stat& st) {
+  struct stat now;
+  return fstat(fd, &now) == 0 && now.st_dev == st.st_dev &&
+         now.st_ino == st.st_ino && now.st_size == st.st_size &&
+         now.st_ctim.tv_sec == st.st_ctim.tv_sec &&
+         now.st_ctim.tv_nsec == st.st_ctim.tv_nsec;
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = write(fd, data, size);
+    if (ret <= 0) {
+      return false;
+    }
+    data += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+string BlobStore::add(const string& file_name, const struct stat& st) {
+  if (!S_ISREG(st.st_mode) || !ensure_dirs()) {
+    return string();
+  }
+
+  // A file changed within the last tick may have changed again without its
+  // ctime moving; hash it instead of trusting the index.
+  bool use_index = ctime_is_settled(st);
+  string index = index_path(st);
+  char link_buf[PATH_MAX];
+  ssize_t link_len =
+      use_index ? readlink(index.c_str(), link_buf, sizeof(link_buf) - 1) : -1;
+  if (link_len > 0) {
+    string name(link_buf, link_len);
+    // This fails if the blob has been garbage-collected; then store it again.
+    if (link_into_trace(name)) {
+      bytes_shared_ += st.st_size;
+      return name;
+    }
+  }
+
+  ScopedFd src(file_name.c_str(), O_RDONLY);
+  if (!src.is_open() || !is_unchanged(src, st)) {
+    return string();
+  }
+  string tmp_path = dir + "/tmp.XXXXXX";
+  ScopedFd tmp(mkstemp(&tmp_path[0]));
+  if (!tmp.is_open()) {
+    return string();
+  }
+  // If the store is on the same btrfs filesystem as the file, the copy
+  // costs no I/O. We still have to read the file to hash it.
+  bool cloned = ioctl(tmp, BTRFS_IOC_CLONE, src.get()) == 0;
+
+  Sha256 hash;
+  vector<uint8_t> buf(1024 * 1024);
+  bool ok = true;
+  while (true) {
+    ssize_t nread = read(src, buf.data(), buf.size());
+    if (nread < 0) {
+      ok = false;
+    }
+    if (nread <= 0) {
+      break;
+    }
+    hash.update(buf.data(), nread);
+    if (!cloned && !write_all(tmp, buf.data(), nread)) {
+      ok = false;
+      break;
+    }
+  }
+  // If the file was modified while we were reading it, we don't know what
+  // the tracee mapped.
+  if (!ok || !is_unchanged(src, st) || fchmod(tmp, S_IRUSR) < 0) {
+    unlink(tmp_path.c_str());
+    return string();
+  }
+
+  string name = hash.hex_digest();
+  // Never replace an existing blob; replays may have it mapped.
+  if (link(tmp_path.c_str(), path(name).c_str()) == 0) {
+    bytes_stored_ += st.st_size;
+  } else if (errno == EEXIST) {
+    bytes_shared_ += st.st_size;
+  } else {
+    unlink(tmp_path.c_str());
+    return string();
+  }
+  // Link the trace to the blob before dropping our temporary link, so
+  // collect_garbage() never sees it unreferenced. If an existing blob was
+  // collected in the meantime, link our copy instead.
+  bool linked = link_into_trace(name) ||
+                link(tmp_path.c_str(),
+                     (trace_dir + "/" + trace_file_name(name)).c_str()) == 0;
+  unlink(tmp_path.c_str());
+  if (!linked) {
+    LOG(debug) << "Failed to link blob " << name << " into " << trace_dir;
+    return string();
+  }
+
+  if (use_index) {
+    unlink(index.c_str());
+    if (symlink(name.c_str(), index.c_str()) < 0) {
+      LOG(debug) << "Failed to index blob " << name << " for " << file_name;
+    }
+  }
+  LOG(debug) << "Stored " << file_name << " as blob " << name;
+  return name;
+}
+
+static vector<string> list_dir(const string& dir) {
+  vector<string> result;
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return result;
+  }
+  while (struct dirent* e = readdir(d)) {
+    if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+      result.push_back(e->d_name);
+    }
+  }
+  closedir(d);
+  return result;
+}
+
+void BlobStore::collect_garbage() {
+  uint64_t bytes_freed = 0;
+  for (auto& name : list_dir(dir)) {
+    if (name.size() != 64 || name.find_first_not_of("0123456789abcdef") !=
+                                 string::npos) {
+      continue;
+    }
+    // If a recording links to the blob after we stat it, its link keeps the
+    // data alive; the store just stops sharing it.
+    struct stat st;
+    if (lstat(path(name).c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_nlink == 1 && unlink(path(name).c_str()) == 0) {
+      LOG(debug) << "Deleted unreferenced blob " << name;
+      bytes_freed += st.st_size;
+    }
+  }
+  string index_dir = dir + "/by-inode";
+  for (auto& entry : list_dir(index_dir)) {
+    string index = index_dir + "/" + entry;
+    char link_buf[PATH_MAX];
+    ssize_t link_len = readlink(index.c_str(), link_buf, sizeof(link_buf) - 1);
+    if (link_len > 0 &&
+        access(path(string(link_buf, link_len)).c_str(), F_OK) != 0) {
+      unlink(index.c_str());
+    }
+  }
+  LOG(debug) << "Blob store: freed " << bytes_freed << " bytes";
+}
+
+} // namespace rr
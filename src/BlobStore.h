@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_BLOB_STORE_H_
+#define RR_BLOB_STORE_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <string>
+
+namespace rr {
+
+/**
+ * A content-addressed store of the contents of files mapped by tracees,
+ * shared by all the traces saved in the same directory. Files that would
+ * otherwise be copied into every trace's raw data are stored once, named by
+ * the SHA-256 of their contents, and traces refer to them by name.
+ *
+ * The store lives in blobs/ next to the trace directories. by-inode/ maps
+ * (device, inode, size, ctime) of files we've already stored to their blob
+ * names so unchanged files don't have to be read again. Blobs are never
+ * modified once created. If the store can't be used, add() fails and the
+ * caller falls back to copying the data into the trace.
+ *
+ * Each trace using a blob holds a hardlink to it, so a blob's link count is
+ * its reference count: deleting a trace drops its references, and
+ * collect_garbage() removes blobs no trace links to any more. Traces recorded
+ * before traces held these links need `rr pack` to be independent of the
+ * store.
+ */
+class BlobStore {
+public:
+  /**
+   * The store used by the trace in |trace_dir|.
+   */
+  static BlobStore for_trace(const std::string& trace_dir);
+
+  /**
+   * Add the contents of |file_name|, which had metadata |st| when it was
+   * mapped, to the store and link the blob into the trace directory. Returns
+   * the name of the blob, or an empty string if it couldn't be stored (e.g.
+   * because it has since been modified).
+   */
+  std::string add(const std::string& file_name, const struct stat& st);
+
+  /**
+   * Delete blobs that no trace links to, and index entries for deleted
+   * blobs. Safe to run while other recordings are adding blobs: a blob a
+   * trace has linked to stays readable through that link.
+   */
+  void collect_garbage();
+
+  /**
+   * Return the path of the blob |name| in the store.
+   */
+  std::string path(const std::string& name) const {
+    return dir + "/" + name;
+  }
+
+  /**
+   * The file name under which trace directories refer to (and `rr pack`
+   * stores) the blob |name|, and its inverse. blob_name() returns an
+   * empty string if |file_name| doesn't refer to a blob.
+   */
+  static std::string trace_file_name(const std::string& name);
+  static std::string blob_name(const std::string& file_name);
+
+  uint64_t bytes_stored() const { return bytes_stored_; }
+  uint64_t bytes_shared() const { return bytes_shared_; }
+
+private:
+  BlobStore(const std::string& dir, const std::string& trace_dir)
+      : dir(dir), trace_dir(trace_dir), bytes_stored_(0), bytes_shared_(0) {}
+
+  bool ensure_dirs();
+  std::string index_path(const struct stat& st) const;
+  bool link_into_trace(const std::string& name);
+
+  std::string dir;
+  std::string trace_dir;
+  // Bytes of file data we had to write to the store.
+  uint64_t bytes_stored_;
+  // Bytes of file data that were already in the store.
+  uint64_t bytes_shared_;
+};
+
+} // namespace rr
+
+#endif /* RR_BLOB_STORE_H_ */
@@ -3,14 +3,32 @@
 #ifndef RR_BREAKPOINT_CONDITION_H_
 #define RR_BREAKPOINT_CONDITION_H_
 
+#include <stdint.h>
+
+#include <vector>
+
+#include "MemoryRange.h"
+#include "remote_code_ptr.h"
+
 namespace rr {
 
+class AddressSpace;
 class Task;
 
 class BreakpointCondition {
 public:
   virtual ~BreakpointCondition() {}
   virtual bool evaluate(Task* t) const = 0;
+  /**
+   * Generate x86-64 code evaluating this condition in the tracee at |addr|
+   * in |vm|, as described for GdbExpression::generate_x86_64_code. Returns
+   * false if the condition can't be evaluated in the tracee.
+   */
+  virtual bool generate_x86_64_code(AddressSpace&, remote_code_ptr,
+                                    std::vector<uint8_t>*,
+                                    std::vector<MemoryRange>*) const {
+    return false;
+  }
 };
 
 } // namespace rr
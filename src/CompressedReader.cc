@@ -30,6 +30,7 @@ CompressedReader::CompressedReader(const string& filename)
     eof = pread(*fd, &ch, 1, fd_offset) == 0;
   }
   buffer_read_pos = 0;
+  buffer_fd_offset = 0;
   have_saved_state = false;
 }
 
@@ -40,6 +41,7 @@ CompressedReader::CompressedReader(const CompressedReader& other) {
   eof = other.eof;
   buffer_read_pos = other.buffer_read_pos;
   buffer = other.buffer;
+  buffer_fd_offset = other.buffer_fd_offset;
   have_saved_state = false;
   assert(!other.have_saved_state);
 }
@@ -109,6 +111,7 @@ bool CompressedReader::read(void* data, size_t size) {
       have_saved_buffer = true;
     }
 
+    uint64_t header_offset = fd_offset;
     CompressedWriter::BlockHeader header;
     if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
       error = true;
@@ -129,6 +132,7 @@ bool CompressedReader::read(void* data, size_t size) {
 
     buffer.resize(header.uncompressed_length);
     buffer_read_pos = 0;
+    buffer_fd_offset = header_offset;
     if (!do_decompress(compressed_buf, buffer)) {
       error = true;
       return false;
@@ -141,6 +145,7 @@ void CompressedReader::rewind() {
   assert(!have_saved_state);
   fd_offset = 0;
   buffer_read_pos = 0;
+  buffer_fd_offset = 0;
   buffer.clear();
   eof = false;
 }
@@ -153,6 +158,7 @@ void CompressedReader::save_state() {
   have_saved_buffer = false;
   saved_fd_offset = fd_offset;
   saved_buffer_read_pos = buffer_read_pos;
+  saved_buffer_fd_offset = buffer_fd_offset;
 }
 
 void CompressedReader::restore_state() {
@@ -167,6 +173,32 @@ void CompressedReader::restore_state() {
     saved_buffer.clear();
   }
   buffer_read_pos = saved_buffer_read_pos;
+  buffer_fd_offset = saved_buffer_fd_offset;
+}
+
+void CompressedReader::get_position(uint64_t* block_offset,
+                                    uint64_t* offset_in_block) const {
+  if (buffer_read_pos < buffer.size()) {
+    *block_offset = buffer_fd_offset;
+    *offset_in_block = buffer_read_pos;
+  } else {
+    *block_offset = fd_offset;
+    *offset_in_block = 0;
+  }
+}
+
+void CompressedReader::seek(uint64_t block_offset, uint64_t offset_in_block) {
+  assert(!have_saved_state);
+  fd_offset = block_offset;
+  buffer.clear();
+  buffer_read_pos = 0;
+  buffer_fd_offset = block_offset;
+  char ch;
+  eof = pread(*fd, &ch, 1, fd_offset) == 0;
+  if (offset_in_block > 0) {
+    vector<uint8_t> skipped(offset_in_block);
+    read(skipped.data(), skipped.size());
+  }
 }
 
 uint64_t CompressedReader::uncompressed_bytes() const {
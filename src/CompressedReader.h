@@ -41,6 +41,15 @@ public:
    */
   void restore_state();
 
+  /**
+   * Return the current position as the file offset of the block containing
+   * the next byte to be read and the offset of that byte within the
+   * uncompressed block. seek() returns to a position obtained this way;
+   * it must not be called while there is a saved state.
+   */
+  void get_position(uint64_t* block_offset, uint64_t* offset_in_block) const;
+  void seek(uint64_t block_offset, uint64_t offset_in_block);
+
   /**
    * Gathers stats on the file stream. These are independent of what's
    * actually been read.
@@ -88,12 +97,15 @@ protected:
   bool eof;
   std::vector<uint8_t> buffer;
   size_t buffer_read_pos;
+  // File offset of the header of the block in |buffer|.
+  uint64_t buffer_fd_offset;
 
   bool have_saved_state;
   bool have_saved_buffer;
   uint64_t saved_fd_offset;
   std::vector<uint8_t> saved_buffer;
   size_t saved_buffer_read_pos;
+  uint64_t saved_buffer_fd_offset;
 };
 
 } // namespace rr
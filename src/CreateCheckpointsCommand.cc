@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+
+#include "Command.h"
+#include "ReplaySession.h"
+#include "main.h"
+
+using namespace std;
+
+namespace rr {
+
+class CreateCheckpointsCommand : public Command {
+public:
+  virtual int run(vector<string>& args);
+
+protected:
+  CreateCheckpointsCommand(const char* name, const char* help)
+      : Command(name, help) {}
+
+  static CreateCheckpointsCommand singleton;
+};
+
+CreateCheckpointsCommand CreateCheckpointsCommand::singleton(
+    "create-checkpoints",
+    " rr create-checkpoints [OPTION]... [<trace_dir>]\n"
+    "  -i, --interval=<N>         save a checkpoint every <N> events\n"
+    "                             (default 100000)\n"
+    "  Replay the trace and save checkpoints of the replay in the trace\n"
+    "  directory. `rr replay -g` and reverse execution resume from the\n"
+    "  last checkpoint before the event they want to reach instead of\n"
+    "  replaying from the start.\n");
+
+struct CreateCheckpointsFlags {
+  TraceFrame::Time interval;
+
+  CreateCheckpointsFlags() : interval(100000) {}
+};
+
+static bool parse_create_checkpoints_arg(vector<string>& args,
+                                         CreateCheckpointsFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'i', "interval", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'i':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.interval = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+static int create_checkpoints(const string& trace_dir,
+                              const CreateCheckpointsFlags& flags) {
+  auto session = ReplaySession::create(trace_dir);
+  TraceFrame::Time next = flags.interval;
+  int saved = 0;
+  while (true) {
+    // Checkpoints can only be saved at some events, so save one at the first
+    // event where we can after each interval.
+    if (session->current_trace_frame().time() >= next &&
+        session->save_checkpoint()) {
+      ++saved;
+      next = session->current_trace_frame().time() + flags.interval;
+    }
+    if (session->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+      break;
+    }
+  }
+  fprintf(stdout, "Saved %d checkpoints\n", saved);
+  return 0;
+}
+
+int CreateCheckpointsCommand::run(vector<string>& args) {
+  CreateCheckpointsFlags flags;
+  bool found_dir = false;
+  string trace_dir;
+  while (!args.empty()) {
+    if (parse_create_checkpoints_arg(args, flags)) {
+      continue;
+    }
+    if (!found_dir && parse_optional_trace_dir(args, &trace_dir)) {
+      found_dir = true;
+      continue;
+    }
+    print_help(stderr);
+    return 1;
+  }
+
+  return create_checkpoints(trace_dir, flags);
+}
+
+} // namespace rr
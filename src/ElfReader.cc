@@ -4,6 +4,9 @@
 
 #include <elf.h>
 
+#include <iomanip>
+#include <sstream>
+
 #include "log.h"
 
 using namespace std;
@@ -16,6 +19,7 @@ public:
   virtual ~ElfReaderImplBase() {}
   virtual SymbolTable read_symbols(const char* symtab, const char* strtab) = 0;
   virtual DynamicSection read_dynamic() = 0;
+  virtual string read_buildid() = 0;
   bool ok() { return ok_; }
 
 protected:
@@ -28,6 +32,7 @@ public:
   ElfReaderImpl(ElfReader& r);
   virtual SymbolTable read_symbols(const char* symtab, const char* strtab);
   virtual DynamicSection read_dynamic();
+  virtual string read_buildid();
 
 private:
   const typename Arch::ElfShdr* find_section(const char* n);
@@ -214,6 +219,44 @@ template <typename Arch> DynamicSection ElfReaderImpl<Arch>::read_dynamic() {
   return result;
 }
 
+template <typename Arch> string ElfReaderImpl<Arch>::read_buildid() {
+  if (!ok()) {
+    return string();
+  }
+
+  for (auto& section : sections) {
+    if (section.sh_type != SHT_NOTE) {
+      continue;
+    }
+    auto notes = r.read<uint8_t>(section.sh_offset, section.sh_size);
+    size_t offset = 0;
+    // Note headers have the same layout for 32-bit and 64-bit ELF.
+    while (offset + sizeof(Elf32_Nhdr) <= notes.size()) {
+      Elf32_Nhdr nhdr;
+      memcpy(&nhdr, notes.data() + offset, sizeof(nhdr));
+      size_t name_offset = offset + sizeof(nhdr);
+      size_t desc_offset = name_offset + ((nhdr.n_namesz + 3) & ~3);
+      size_t next_offset = desc_offset + ((nhdr.n_descsz + 3) & ~3);
+      if (next_offset > notes.size()) {
+        LOG(debug) << "Invalid ELF file: truncated note";
+        break;
+      }
+      if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 &&
+          memcmp(notes.data() + name_offset, "GNU", 4) == 0 &&
+          nhdr.n_descsz > 0) {
+        stringstream ss;
+        for (size_t i = 0; i < nhdr.n_descsz; ++i) {
+          ss << hex << setw(2) << setfill('0')
+             << (int)notes[desc_offset + i];
+        }
+        return ss.str();
+      }
+      offset = next_offset;
+    }
+  }
+  return string();
+}
+
 ElfReader::ElfReader(SupportedArch arch) : arch(arch) {}
 
 ElfReader::~ElfReader() {}
@@ -231,6 +274,8 @@ SymbolTable ElfReader::read_symbols(const char* symtab, const char* strtab) {
 
 DynamicSection ElfReader::read_dynamic() { return impl().read_dynamic(); }
 
+string ElfReader::read_buildid() { return impl().read_buildid(); }
+
 bool ElfReader::ok() { return impl().ok(); }
 
 static bool read_all(ScopedFd& fd, size_t offset, size_t size, void* buf) {
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "ScopedFd.h"
@@ -70,6 +71,11 @@ public:
   bool ok();
   SymbolTable read_symbols(const char* symtab, const char* strtab);
   DynamicSection read_dynamic();
+  /**
+   * Returns the GNU build ID as a lowercase hex string, or an empty string
+   * if there isn't one.
+   */
+  std::string read_buildid();
 
 private:
   ElfReaderImplBase& impl();
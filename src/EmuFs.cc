@@ -3,16 +3,20 @@
 #include "EmuFs.h"
 
 #include <syscall.h>
+#include <unistd.h>
 
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "AddressSpace.h"
 #include "ReplaySession.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
+#include "kernel_supplement.h"
 #include "log.h"
+#include "util.h"
 
 using namespace std;
 
@@ -30,30 +34,69 @@ EmuFile::~EmuFile() {
   owner.destroyed_file(*this);
 }
 
+/**
+ * Copy [offset, end) of |src| to |dest|, which is sparse, skipping
+ * all-zero pages so they don't get allocated in |dest|.
+ */
+static void copy_data_range(int dest, int src, uint64_t offset, uint64_t end,
+                            vector<uint8_t>& buf) {
+  while (offset < end) {
+    ssize_t ret = pread64(src, buf.data(), min<uint64_t>(end - offset,
+                                                         buf.size()),
+                          offset);
+    if (ret <= 0) {
+      FATAL() << "Couldn't read all the data";
+    }
+    for (ssize_t i = 0; i < ret; i += page_size()) {
+      size_t amount = min<size_t>(ret - i, page_size());
+      if (is_zero(buf.data() + i, amount)) {
+        continue;
+      }
+      if (pwrite64(dest, buf.data() + i, amount, offset + i) !=
+          (ssize_t)amount) {
+        FATAL() << "Couldn't write all the data";
+      }
+    }
+    offset += ret;
+  }
+}
+
 EmuFile::shr_ptr EmuFile::clone(EmuFs& owner) {
   auto f = EmuFile::create(owner, orig_path.c_str(), device(), inode(), size_);
 
-  uint64_t data[65536 / sizeof(uint64_t)];
+  // If SHMEM_FS supports reflinks, the clone shares our blocks until one of
+  // us writes to them.
+  if (ioctl(f->fd(), BTRFS_IOC_CLONE, fd().get()) == 0) {
+    return f;
+  }
+
+  // Otherwise copy only the data extents. Large shared mappings are usually
+  // mostly untouched, so most of the file is holes (or zeroes) that the
+  // clone gets for free.
+  vector<uint8_t> buf(1024 * 1024);
   uint64_t offset = 0;
+  uint64_t copied = 0;
   while (offset < size_) {
-    ssize_t amount = min<uint64_t>(size_ - offset, sizeof(data));
-    ssize_t ret = pread64(fd(), data, amount, offset);
-    if (ret <= 0) {
-      FATAL() << "Couldn't read all the data";
-    }
-    // There could have been a short read
-    amount = ret;
-    uint8_t* data_ptr = reinterpret_cast<uint8_t*>(data);
-    while (amount > 0) {
-      ret = pwrite64(f->fd(), data_ptr, amount, offset);
-      if (ret <= 0) {
-        FATAL() << "Couldn't write all the data";
+    off64_t data = lseek64(fd(), offset, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO) {
+        // No more data.
+        break;
       }
-      amount -= ret;
-      data_ptr += ret;
-      offset += ret;
+      // SEEK_DATA isn't supported; treat the rest of the file as data.
+      data = offset;
+    }
+    off64_t hole = lseek64(fd(), data, SEEK_HOLE);
+    uint64_t end = hole < 0 ? size_ : min<uint64_t>(hole, size_);
+    if ((uint64_t)data >= end) {
+      break;
     }
+    copy_data_range(f->fd(), fd(), data, end, buf);
+    copied += end - data;
+    offset = end;
   }
+  LOG(debug) << "Cloned " << orig_path << ": copied " << copied << " of "
+             << size_ << " bytes";
 
   return f;
 }
@@ -44,6 +44,9 @@ public:
   }
 
   bool is_monitoring(int fd) { return fds.count(fd) > 0; }
+  const std::unordered_map<int, FileMonitor::shr_ptr>& monitors() const {
+    return fds;
+  }
 
   FileMonitor* get_monitor(int fd);
 
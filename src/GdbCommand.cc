@@ -2,6 +2,11 @@
 
 #include "GdbCommand.h"
 
+#include <errno.h>
+#include <stdlib.h>
+
+#include <sstream>
+
 #include "ReplayTask.h"
 #include "log.h"
 
@@ -34,6 +39,109 @@ static SimpleGdbCommand when_tid("when-tid", [](GdbServer&, Task* t,
   return string("Current tid: ") + to_string(t->tid);
 });
 
+static SimpleGdbCommand async_event_stats(
+    "async-event-stats", [](GdbServer&, Task* t, const vector<string>&) {
+      if (!t->session().is_replaying()) {
+        return GdbCommandHandler::cmd_end_diversion();
+      }
+      auto stats = t->session().statistics();
+      return to_string(stats.async_events) +
+             " async signal/timeslice events took " +
+             to_string(stats.async_event_steps) +
+             " steps after the ticks interrupt (skid allowance " +
+             to_string(PerfCounters::skid_size()) + " ticks)";
+    });
+
+static SimpleGdbCommand watch_stats(
+    "watch-stats", [](GdbServer&, Task* t, const vector<string>&) {
+      auto stats = t->session().statistics();
+      return string(t->vm()->has_software_watchpoints()
+                        ? "Software write watchpoints active; "
+                        : "Software write watchpoints inactive; ") +
+             to_string(stats.software_watch_faults) + " write faults took " +
+             to_string(int64_t(stats.software_watch_fault_time * 1000000)) +
+             " microseconds";
+    });
+
+static SimpleGdbCommand block_step_stats(
+    "block-step-stats",
+    [](GdbServer&, Task* t, const vector<string>&) {
+      auto stats = t->session().statistics();
+      return to_string(stats.block_steps) + " block steps retired " +
+             to_string(stats.block_step_ticks) + " ticks, saving at least " +
+             to_string(stats.block_step_min_stops_saved) + " singlesteps; " +
+             to_string(stats.block_step_overshoots) + " overshoots redone";
+    });
+
+// Don't flood gdb's console.
+static const size_t max_find_all_listed = 1000;
+
+static string usage_find_all() {
+  return "Usage: find-all [/b|/h|/w|/g] <value>...\n"
+         "Find every occurrence of the values, each stored in 1, 2, 4 or 8 "
+         "bytes (default: the word size), in the address space.";
+}
+
+static string invoke_find_all(GdbServer&, Task* t, const vector<string>& args) {
+  size_t size = t->arch() == x86 ? 4 : 8;
+  size_t first_value = 1;
+  if (args.size() > 1 && args[1].size() == 2 && args[1][0] == '/') {
+    switch (args[1][1]) {
+      case 'b':
+        size = 1;
+        break;
+      case 'h':
+        size = 2;
+        break;
+      case 'w':
+        size = 4;
+        break;
+      case 'g':
+        size = 8;
+        break;
+      default:
+        return usage_find_all();
+    }
+    first_value = 2;
+  }
+  if (args.size() <= first_value) {
+    return usage_find_all();
+  }
+  vector<vector<uint8_t>> patterns;
+  for (size_t i = first_value; i < args.size(); ++i) {
+    char* end;
+    errno = 0;
+    uint64_t value = strtoull(args[i].c_str(), &end, 0);
+    if (errno || *end || args[i].empty() ||
+        (size < 8 && (value >> (8 * size)) != 0)) {
+      return usage_find_all();
+    }
+    vector<uint8_t> bytes;
+    for (size_t j = 0; j < size; ++j) {
+      bytes.push_back(uint8_t(value >> (8 * j)));
+    }
+    patterns.push_back(bytes);
+  }
+
+  stringstream out;
+  size_t count = 0;
+  GdbServer::search_memory(
+      t, MemoryRange(remote_ptr<void>(), remote_ptr<void>(UINTPTR_MAX)),
+      patterns, [&](remote_ptr<void> addr, size_t i) {
+        if (count < max_find_all_listed) {
+          out << addr << ": " << args[first_value + i] << "\n";
+        }
+        ++count;
+        return true;
+      });
+  if (count > max_find_all_listed) {
+    out << "... (" << count - max_find_all_listed << " more)\n";
+  }
+  out << count << " matches found";
+  return out.str();
+}
+static SimpleGdbCommand find_all("find-all", invoke_find_all);
+
 static std::vector<ReplayTimeline::Mark> back_stack;
 static ReplayTimeline::Mark current_history_cp;
 static std::vector<ReplayTimeline::Mark> forward_stack;
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -54,7 +55,14 @@ static bool request_needs_immediate_response(const GdbRequest* req) {
 }
 
 GdbConnection::GdbConnection(pid_t tgid, const Features& features)
-    : tgid(tgid), cpu_features_(0), no_ack(false), features_(features) {
+    : tgid(tgid),
+      cpu_features_(0),
+      no_ack(false),
+      binary_get_mem(false),
+      vfile_pid(0),
+      detach_on_hangup(false),
+      hung_up(false),
+      features_(features) {
 #ifndef REVERSE_EXECUTION
   features_.reverse_execution = false;
 #endif
@@ -91,10 +99,22 @@ static void poll_outgoing(const ScopedFd& sock_fd, int timeoutMs) {
   poll_socket(sock_fd, POLLOUT /* TODO: |POLLERR */, timeoutMs);
 }
 
+void GdbConnection::hang_up() {
+  if (!detach_on_hangup) {
+    LOG(info) << "(gdb closed debugging socket, exiting)";
+    exit(0);
+  }
+  LOG(info) << "gdb closed debugging socket";
+  hung_up = true;
+  inbuf.clear();
+  outbuf.clear();
+}
+
 /**
  * read() incoming data exactly one time, successfully.  May block.
+ * Returns false if gdb hung up.
  */
-void GdbConnection::read_data_once() {
+bool GdbConnection::read_data_once() {
   ssize_t nread;
   /* Wait until there's data, instead of busy-looping on
    * EAGAIN. */
@@ -102,25 +122,37 @@ void GdbConnection::read_data_once() {
   uint8_t buf[4096];
   nread = read(sock_fd, buf, sizeof(buf));
   if (nread <= 0) {
-    LOG(info) << "(gdb closed debugging socket, exiting)";
-    exit(0);
+    hang_up();
+    return false;
   }
   inbuf.insert(inbuf.end(), buf, buf + nread);
+  return true;
 }
 
 void GdbConnection::write_flush() {
   size_t write_index = 0;
 
-  outbuf.push_back(0);
-  LOG(debug) << "write_flush: '" << outbuf.data() << "'";
-  outbuf.pop_back();
+  if (hung_up) {
+    outbuf.clear();
+    return;
+  }
+
+  if (IS_LOGGING(debug)) {
+    outbuf.push_back(0);
+    LOG(debug) << "write_flush: '" << outbuf.data() << "'";
+    outbuf.pop_back();
+  }
 
   while (write_index < outbuf.size()) {
     ssize_t nwritten;
 
     poll_outgoing(sock_fd, -1 /*wait forever*/);
-    nwritten = write(sock_fd, outbuf.data() + write_index,
-                     outbuf.size() - write_index);
+    nwritten = send(sock_fd, outbuf.data() + write_index,
+                    outbuf.size() - write_index, MSG_NOSIGNAL);
+    if (nwritten < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+      hang_up();
+      return;
+    }
     if (nwritten < 0) {
       FATAL() << "Error writing to gdb";
     }
@@ -141,56 +173,52 @@ void GdbConnection::write_hex(unsigned long hex) {
   write_data_raw((uint8_t*)buf, len);
 }
 
-void GdbConnection::write_packet_bytes(const uint8_t* data, size_t num_bytes) {
-  uint8_t checksum;
-  size_t i;
+size_t GdbConnection::write_packet_start(size_t payload_size) {
+  outbuf.reserve(outbuf.size() + payload_size + 4);
+  outbuf.push_back('$');
+  return outbuf.size();
+}
 
-  write_data_raw((uint8_t*)"$", 1);
-  for (i = 0, checksum = 0; i < num_bytes; ++i) {
-    checksum += data[i];
+void GdbConnection::write_packet_end(size_t start) {
+  uint8_t checksum = 0;
+  for (size_t i = start; i < outbuf.size(); ++i) {
+    checksum += outbuf[i];
   }
-  write_data_raw((uint8_t*)data, num_bytes);
-  write_data_raw((uint8_t*)"#", 1);
+  outbuf.push_back('#');
   write_hex(checksum);
 }
 
+void GdbConnection::write_packet_bytes(const uint8_t* data, size_t num_bytes) {
+  size_t start = write_packet_start(num_bytes);
+  outbuf.insert(outbuf.end(), data, data + num_bytes);
+  write_packet_end(start);
+}
+
 void GdbConnection::write_packet(const char* data) {
   return write_packet_bytes((const uint8_t*)data, strlen(data));
 }
 
 void GdbConnection::write_binary_packet(const char* pfx, const uint8_t* data,
                                         ssize_t num_bytes) {
-  ssize_t pfx_num_chars = strlen(pfx);
-  uint8_t buf[2 * num_bytes + pfx_num_chars];
-  ssize_t buf_num_bytes = 0;
-  int i;
-
-  strncpy((char*)buf, pfx, sizeof(buf) - 1);
-  buf_num_bytes += pfx_num_chars;
-
-  for (i = 0; i < num_bytes; ++i) {
+  size_t pfx_num_chars = strlen(pfx);
+  size_t start = write_packet_start(pfx_num_chars + num_bytes);
+  outbuf.insert(outbuf.end(), pfx, pfx + pfx_num_chars);
+  for (ssize_t i = 0; i < num_bytes; ++i) {
     uint8_t b = data[i];
-
-    if (buf_num_bytes + 2 > ssize_t(sizeof(buf))) {
-      break;
-    }
     switch (b) {
       case '#':
       case '$':
       case '}':
       case '*':
-        buf[buf_num_bytes++] = '}';
-        buf[buf_num_bytes++] = b ^ 0x20;
+        outbuf.push_back('}');
+        outbuf.push_back(b ^ 0x20);
         break;
       default:
-        buf[buf_num_bytes++] = b;
+        outbuf.push_back(b);
         break;
     }
   }
-
-  LOG(debug) << " ***** NOTE: writing binary data, upcoming debug output may "
-                "be truncated";
-  return write_packet_bytes(buf, buf_num_bytes);
+  write_packet_end(start);
 }
 
 void GdbConnection::write_hex_bytes_packet(const char* prefix,
@@ -200,14 +228,18 @@ void GdbConnection::write_hex_bytes_packet(const char* prefix,
     return;
   }
 
-  ssize_t pfx_num_chars = strlen(prefix);
-  char buf[pfx_num_chars + 2 * len + 1];
-  memcpy(buf, prefix, pfx_num_chars);
+  static const char hex_digits[] = "0123456789abcdef";
+  size_t pfx_num_chars = strlen(prefix);
+  size_t start = write_packet_start(pfx_num_chars + 2 * len);
+  outbuf.insert(outbuf.end(), prefix, prefix + pfx_num_chars);
+  size_t hex_start = outbuf.size();
+  outbuf.resize(hex_start + 2 * len);
+  uint8_t* out = outbuf.data() + hex_start;
   for (size_t i = 0; i < len; ++i) {
-    unsigned long b = bytes[i];
-    snprintf(&buf[pfx_num_chars + 2 * i], 3, "%02lx", b);
+    out[2 * i] = hex_digits[bytes[i] >> 4];
+    out[2 * i + 1] = hex_digits[bytes[i] & 0xf];
   }
-  write_packet(buf);
+  write_packet_end(start);
 }
 
 void GdbConnection::write_hex_bytes_packet(const uint8_t* bytes, size_t len) {
@@ -261,6 +293,10 @@ bool GdbConnection::skip_to_packet_start() {
 }
 
 bool GdbConnection::sniff_packet() {
+  if (hung_up) {
+    // get_request() will report a detach.
+    return true;
+  }
   if (skip_to_packet_start()) {
     /* We've already seen a (possibly partial) packet. */
     return true;
@@ -269,7 +305,7 @@ bool GdbConnection::sniff_packet() {
   return poll_incoming(sock_fd, 0 /*don't wait*/);
 }
 
-void GdbConnection::read_packet() {
+bool GdbConnection::read_packet() {
   /* Read and discard bytes until we see the start of a
    * packet.
    *
@@ -280,14 +316,16 @@ void GdbConnection::read_packet() {
    * packet in the first place.
    */
   while (!skip_to_packet_start()) {
-    read_data_once();
+    if (!read_data_once()) {
+      return false;
+    }
   }
 
   if (inbuf[0] == INTERRUPT_CHAR) {
     /* Interrupts are kind of an ugly duckling in the gdb
      * protocol ... */
     packetend = 1;
-    return;
+    return true;
   }
 
   /* Read until we see end-of-packet. */
@@ -300,7 +338,9 @@ void GdbConnection::read_packet() {
       break;
     }
     checkedlen = inbuf.size();
-    read_data_once();
+    if (!read_data_once()) {
+      return false;
+    }
   }
 
   /* NB: we're ignoring the gdb packet checksums here too.  If
@@ -314,6 +354,7 @@ void GdbConnection::read_packet() {
     write_data_raw((uint8_t*)"+", 1);
     write_flush();
   }
+  return true;
 }
 
 static void read_binary_data(const uint8_t* payload, const uint8_t* payload_end,
@@ -473,6 +514,23 @@ bool GdbConnection::xfer(const char* name, char* args) {
     return true;
   }
 
+  if (!strcmp(name, "libraries-svr4")) {
+    if (strcmp(annex, "")) {
+      write_packet("E00");
+      return false;
+    }
+    if (strcmp(mode, "read")) {
+      write_packet("");
+      return false;
+    }
+
+    req = GdbRequest(DREQ_GET_LIBRARIES_SVR4);
+    req.target = query_thread;
+    req.mem().addr = offset;
+    req.mem().len = len;
+    return true;
+  }
+
   if (!strcmp(name, "features")) {
     if (strcmp(mode, "read")) {
       write_packet("");
@@ -617,8 +675,10 @@ bool GdbConnection::query(char* payload) {
                  ";qXfer:auxv:read+"
                  ";qXfer:siginfo:read+"
                  ";qXfer:siginfo:write+"
+                 ";qXfer:libraries-svr4:read+"
                  ";multiprocess+"
-                 ";ConditionalBreakpoints+";
+                 ";ConditionalBreakpoints+"
+                 ";binary-upload+";
     if (features().reverse_execution) {
       supported << ";ReverseContinue+"
                    ";ReverseStep+";
@@ -782,6 +842,8 @@ bool GdbConnection::process_vpacket(char* payload) {
 
       GdbActionType action;
       int signal_to_deliver = 0;
+      uintptr_t range_start = 0;
+      uintptr_t range_end = 0;
       char* endptr = NULL;
       switch (cmd[0]) {
         case 'C':
@@ -798,6 +860,15 @@ bool GdbConnection::process_vpacket(char* payload) {
         case 's':
           action = ACTION_STEP;
           break;
+        case 'r':
+          action = ACTION_STEP;
+          range_start = strtoull(cmd + 1, &endptr, 16);
+          if (*endptr != ',') {
+            UNHANDLED_REQ() << "Unhandled vCont range " << cmd;
+            return false;
+          }
+          range_end = strtoull(endptr + 1, &endptr, 16);
+          break;
         default:
           UNHANDLED_REQ() << "Unhandled vCont command " << cmd << "(" << args
                           << ")";
@@ -807,6 +878,10 @@ bool GdbConnection::process_vpacket(char* payload) {
         UNHANDLED_REQ() << "Unhandled vCont command parameters " << cmd;
         return false;
       }
+      GdbContAction cont_action(action, is_default ? GdbThreadId::ALL : target,
+                                signal_to_deliver);
+      cont_action.range_start = range_start;
+      cont_action.range_end = range_end;
       if (is_default) {
         if (has_default_action) {
           UNHANDLED_REQ()
@@ -814,10 +889,9 @@ bool GdbConnection::process_vpacket(char* payload) {
           return false;
         }
         has_default_action = true;
-        default_action =
-            GdbContAction(action, GdbThreadId::ALL, signal_to_deliver);
+        default_action = cont_action;
       } else {
-        actions.push_back(GdbContAction(action, target, signal_to_deliver));
+        actions.push_back(cont_action);
       }
     }
 
@@ -830,9 +904,13 @@ bool GdbConnection::process_vpacket(char* payload) {
     return true;
   }
 
+  if (!strncmp("File:", name, 5)) {
+    return process_vfile(payload + 5);
+  }
+
   if (!strcmp("Cont?", name)) {
     LOG(debug) << "gdb queries which continue commands we support";
-    write_packet("vCont;c;C;s;S;");
+    write_packet("vCont;c;C;s;S;r;");
     return false;
   }
 
@@ -900,6 +978,74 @@ bool GdbConnection::process_vpacket(char* payload) {
   return false;
 }
 
+bool GdbConnection::process_vfile(char* payload) {
+  const char* name;
+  char* args;
+
+  args = strchr(payload, ':');
+  if (args) {
+    *args++ = '\0';
+  }
+  name = payload;
+
+  if (!strcmp(name, "setfs")) {
+    parser_assert(args);
+    vfile_pid = strtol(args, &args, 16);
+    parser_assert(!*args);
+    write_packet("F0");
+    return false;
+  }
+  if (!strcmp(name, "open")) {
+    parser_assert(args);
+    char* comma = strchr(args, ',');
+    parser_assert(comma && (comma - args) % 2 == 0);
+    req = GdbRequest(DREQ_FILE_OPEN);
+    req.file().pid = vfile_pid;
+    // File names aren't necessarily ASCII.
+    for (char* p = args; p < comma; p += 2) {
+      char enc_byte[] = { p[0], p[1], '\0' };
+      req.file().name += static_cast<char>(strtoul(enc_byte, nullptr, 16));
+    }
+    args = comma + 1;
+    req.file().flags = strtol(args, &args, 16);
+    parser_assert(',' == *args++);
+    req.file().mode = strtol(args, &args, 16);
+    parser_assert(!*args);
+    LOG(debug) << "gdb opens " << req.file().name;
+    return true;
+  }
+  if (!strcmp(name, "pread")) {
+    parser_assert(args);
+    req = GdbRequest(DREQ_FILE_PREAD);
+    req.file().fd = strtol(args, &args, 16);
+    parser_assert(',' == *args++);
+    req.file().len = strtoul(args, &args, 16);
+    parser_assert(',' == *args++);
+    req.file().offset = strtoull(args, &args, 16);
+    parser_assert(!*args);
+    return true;
+  }
+  if (!strcmp(name, "fstat")) {
+    parser_assert(args);
+    req = GdbRequest(DREQ_FILE_FSTAT);
+    req.file().fd = strtol(args, &args, 16);
+    parser_assert(!*args);
+    return true;
+  }
+  if (!strcmp(name, "close")) {
+    parser_assert(args);
+    req = GdbRequest(DREQ_FILE_CLOSE);
+    req.file().fd = strtol(args, &args, 16);
+    parser_assert(!*args);
+    return true;
+  }
+
+  // Writes, unlink and readlink aren't supported; gdb copes.
+  LOG(debug) << "Unhandled vFile packet " << name;
+  write_packet("");
+  return false;
+}
+
 static string to_string(const vector<uint8_t>& bytes, size_t max_len) {
   stringstream ss;
   for (size_t i = 0; i < bytes.size(); ++i) {
@@ -972,8 +1118,14 @@ bool GdbConnection::process_packet() {
     case 'k':
       LOG(info) << "gdb requests kill, exiting";
       write_packet("OK");
-      exit(0);
+      hang_up();
+      req = GdbRequest(DREQ_DETACH);
+      ret = true;
+      break;
     case 'm':
+    case 'x':
+      // 'x' is the binary version of 'm'.
+      binary_get_mem = request == 'x';
       req = GdbRequest(DREQ_GET_MEM);
       req.target = query_thread;
       req.mem().addr = strtoul(payload, &payload, 16);
@@ -1177,7 +1329,10 @@ GdbRequest GdbConnection::get_request() {
     /* There's either new request data, or we have nothing
      * to do.  Either way, block until we read a complete
      * packet from gdb. */
-    read_packet();
+    if (hung_up || !read_packet()) {
+      req = GdbRequest(DREQ_DETACH);
+      return req;
+    }
 
     if (process_packet()) {
       /* We couldn't process the packet internally,
@@ -1411,6 +1566,8 @@ void GdbConnection::reply_get_mem(const vector<uint8_t>& mem) {
 
   if (req.mem().len > 0 && mem.size() == 0) {
     write_packet("E01");
+  } else if (binary_get_mem) {
+    write_binary_packet("b", mem.data(), mem.size());
   } else {
     write_hex_bytes_packet(mem.data(), mem.size());
   }
@@ -1606,4 +1763,134 @@ void GdbConnection::reply_tls_addr(bool ok, remote_ptr<void> address) {
   consume_request();
 }
 
+void GdbConnection::reply_get_libraries_svr4(const string& xml) {
+  assert(DREQ_GET_LIBRARIES_SVR4 == req.type);
+
+  write_xfer_response(xml.data(), xml.size(), req.mem().addr, req.mem().len);
+
+  consume_request();
+}
+
+/**
+ * gdb's File-I/O protocol has its own errno values. They match Linux's
+ * except for ENAMETOOLONG.
+ */
+static int gdb_fileio_errno(int err) {
+  switch (err) {
+    case EPERM:
+    case ENOENT:
+    case EINTR:
+    case EBADF:
+    case EACCES:
+    case EFAULT:
+    case EBUSY:
+    case EEXIST:
+    case ENODEV:
+    case ENOTDIR:
+    case EISDIR:
+    case EINVAL:
+    case ENFILE:
+    case EMFILE:
+    case EFBIG:
+    case ENOSPC:
+    case ESPIPE:
+    case EROFS:
+      return err;
+    case ENAMETOOLONG:
+      return 91;
+    default:
+      return 9999;
+  }
+}
+
+static void write_fileio_error(char* buf, size_t size, int err) {
+  snprintf(buf, size, "F-1,%x", gdb_fileio_errno(err));
+}
+
+void GdbConnection::reply_open_file(int fd, int err) {
+  assert(DREQ_FILE_OPEN == req.type);
+
+  char buf[32];
+  if (fd >= 0) {
+    snprintf(buf, sizeof(buf), "F%x", fd);
+  } else {
+    write_fileio_error(buf, sizeof(buf), err);
+  }
+  write_packet(buf);
+
+  consume_request();
+}
+
+void GdbConnection::reply_pread_file(const vector<uint8_t>& data, int err) {
+  assert(DREQ_FILE_PREAD == req.type);
+
+  char buf[32];
+  if (err) {
+    write_fileio_error(buf, sizeof(buf), err);
+    write_packet(buf);
+  } else {
+    snprintf(buf, sizeof(buf), "F%zx;", data.size());
+    write_binary_packet(buf, data.data(), data.size());
+  }
+
+  consume_request();
+}
+
+/**
+ * Store |value| big-endian in |size| bytes at |p|, as the File-I/O
+ * protocol's struct stat wants.
+ */
+static uint8_t* put_fileio_int(uint8_t* p, uint64_t value, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    p[i] = value >> (8 * (size - 1 - i));
+  }
+  return p + size;
+}
+
+void GdbConnection::reply_fstat_file(const struct stat& st, int err) {
+  assert(DREQ_FILE_FSTAT == req.type);
+
+  if (err) {
+    char buf[32];
+    write_fileio_error(buf, sizeof(buf), err);
+    write_packet(buf);
+  } else {
+    uint8_t fst[64];
+    uint8_t* p = fst;
+    p = put_fileio_int(p, st.st_dev, 4);
+    p = put_fileio_int(p, st.st_ino, 4);
+    p = put_fileio_int(p, st.st_mode, 4);
+    p = put_fileio_int(p, st.st_nlink, 4);
+    p = put_fileio_int(p, st.st_uid, 4);
+    p = put_fileio_int(p, st.st_gid, 4);
+    p = put_fileio_int(p, st.st_rdev, 4);
+    p = put_fileio_int(p, st.st_size, 8);
+    p = put_fileio_int(p, st.st_blksize, 8);
+    p = put_fileio_int(p, st.st_blocks, 8);
+    p = put_fileio_int(p, st.st_atime, 4);
+    p = put_fileio_int(p, st.st_mtime, 4);
+    p = put_fileio_int(p, st.st_ctime, 4);
+    assert(p == fst + sizeof(fst));
+    char buf[32];
+    snprintf(buf, sizeof(buf), "F%zx;", sizeof(fst));
+    write_binary_packet(buf, fst, sizeof(fst));
+  }
+
+  consume_request();
+}
+
+void GdbConnection::reply_close_file(int err) {
+  assert(DREQ_FILE_CLOSE == req.type);
+
+  char buf[32];
+  if (err) {
+    write_fileio_error(buf, sizeof(buf), err);
+  } else {
+    snprintf(buf, sizeof(buf), "F0");
+  }
+  write_packet(buf);
+
+  consume_request();
+}
+
 } // namespace rr
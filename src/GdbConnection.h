@@ -4,6 +4,7 @@
 #define RR_GDB_CONNECTION_H_
 
 #include <stddef.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <memory>
@@ -97,8 +98,10 @@ enum GdbRequestType {
   // Uses .mem for offset/len.
   DREQ_READ_SIGINFO,
   DREQ_SEARCH_MEM,
+  // qXfer:libraries-svr4:read. Uses .mem for offset/len.
+  DREQ_GET_LIBRARIES_SVR4,
   DREQ_MEM_FIRST = DREQ_GET_MEM,
-  DREQ_MEM_LAST = DREQ_SEARCH_MEM,
+  DREQ_MEM_LAST = DREQ_GET_LIBRARIES_SVR4,
 
   DREQ_REMOVE_SW_BREAK,
   DREQ_REMOVE_HW_BREAK,
@@ -132,6 +135,14 @@ enum GdbRequestType {
 
   // qSymbol packet, uses params.sym.
   DREQ_QSYMBOL,
+
+  /* vFile host I/O packets. Use params.file. */
+  DREQ_FILE_OPEN,
+  DREQ_FILE_PREAD,
+  DREQ_FILE_FSTAT,
+  DREQ_FILE_CLOSE,
+  DREQ_FILE_FIRST = DREQ_FILE_OPEN,
+  DREQ_FILE_LAST = DREQ_FILE_CLOSE,
 };
 
 enum GdbRestartType {
@@ -150,6 +161,10 @@ struct GdbContAction {
   GdbActionType type;
   GdbThreadId target;
   int signal_to_deliver;
+  // For ACTION_STEP requested by vCont;r, keep stepping while the pc is in
+  // [range_start, range_end). Empty for ordinary steps.
+  remote_code_ptr range_start;
+  remote_code_ptr range_end;
 };
 
 /**
@@ -170,7 +185,8 @@ struct GdbRequest {
         cont_(other.cont_),
         text_(other.text_),
         tls_(other.tls_),
-        sym_(other.sym_) {}
+        sym_(other.sym_),
+        file_(other.file_) {}
   GdbRequest& operator=(const GdbRequest& other) {
     this->~GdbRequest();
     new (this) GdbRequest(other);
@@ -213,6 +229,19 @@ struct GdbRequest {
     remote_ptr<void> address;
     std::string name;
   } sym_;
+  struct File {
+    // For OPEN requests, the process whose view of the filesystem gdb
+    // selected with vFile:setfs (0 for the debuggee), and the file to open.
+    pid_t pid;
+    std::string name;
+    int flags;
+    int mode;
+    // For the other requests, the fd returned by OPEN.
+    int fd;
+    // For PREAD requests.
+    size_t len;
+    uint64_t offset;
+  } file_;
 
   Mem& mem() {
     assert(type >= DREQ_MEM_FIRST && type <= DREQ_MEM_LAST);
@@ -274,6 +303,14 @@ struct GdbRequest {
     assert(type == DREQ_QSYMBOL);
     return sym_;
   }
+  File& file() {
+    assert(type >= DREQ_FILE_FIRST && type <= DREQ_FILE_LAST);
+    return file_;
+  }
+  const File& file() const {
+    assert(type >= DREQ_FILE_FIRST && type <= DREQ_FILE_LAST);
+    return file_;
+  }
 
   /**
    * Return nonzero if this requires that program execution be resumed
@@ -467,6 +504,35 @@ public:
    */
   void reply_tls_addr(bool ok, remote_ptr<void> address);
 
+  /**
+   * Reply to the DREQ_GET_LIBRARIES_SVR4 request with the complete
+   * library list document |xml|; the requested window of it is sent.
+   */
+  void reply_get_libraries_svr4(const std::string& xml);
+
+  /**
+   * Reply to the DREQ_FILE_OPEN request with the opened |fd|, or with
+   * |err| (an errno value) if |fd| is negative.
+   */
+  void reply_open_file(int fd, int err);
+
+  /**
+   * Reply to the DREQ_FILE_PREAD request with the bytes read, or with
+   * |err| if it's nonzero.
+   */
+  void reply_pread_file(const std::vector<uint8_t>& data, int err);
+
+  /**
+   * Reply to the DREQ_FILE_FSTAT request with |st|, or with |err| if it's
+   * nonzero.
+   */
+  void reply_fstat_file(const struct stat& st, int err);
+
+  /**
+   * Reply to the DREQ_FILE_CLOSE request.
+   */
+  void reply_close_file(int err);
+
   /**
    * Create a checkpoint of the given Session with the given id. Delete the
    * existing checkpoint with that id if there is one.
@@ -500,6 +566,13 @@ public:
   void set_cpu_features(uint32_t features) { cpu_features_ = features; }
   uint32_t cpu_features() const { return cpu_features_; }
 
+  /**
+   * When gdb closes the connection (or kills the target), report a
+   * DREQ_DETACH instead of exiting rr, so the server can shut the replay
+   * down cleanly.
+   */
+  void set_detach_on_hangup() { detach_on_hangup = true; }
+
   GdbConnection(pid_t tgid, const Features& features);
 
   /**
@@ -508,17 +581,34 @@ public:
    */
   void await_debugger(ScopedFd& listen_fd);
 
+  /**
+   * Talk to the debugger that has already connected on |fd|.
+   */
+  void set_debugger_fd(ScopedFd&& fd) { sock_fd = std::move(fd); }
+
 private:
+  /**
+   * gdb went away. Exits rr unless |detach_on_hangup|.
+   */
+  void hang_up();
   /**
    * read() incoming data exactly one time, successfully.  May block.
+   * Returns false if gdb hung up.
    */
-  void read_data_once();
+  bool read_data_once();
   /**
    * Send all pending output to gdb.  May block.
    */
   void write_flush();
   void write_data_raw(const uint8_t* data, ssize_t len);
   void write_hex(unsigned long hex);
+  /**
+   * Begin a packet with a payload of about |payload_size| bytes, to be
+   * appended to outbuf. Returns the start of the payload for
+   * write_packet_end.
+   */
+  size_t write_packet_start(size_t payload_size);
+  void write_packet_end(size_t start);
   void write_packet_bytes(const uint8_t* data, size_t num_bytes);
   void write_packet(const char* data);
   void write_binary_packet(const char* pfx, const uint8_t* data,
@@ -540,9 +630,9 @@ private:
    *    "[^$]*\$[^#]*#.*"
    *
    * has been read from the client fd.  This is one (or more) gdb
-   * packet(s).
+   * packet(s). Returns false if gdb hung up.
    */
-  void read_packet();
+  bool read_packet();
   /**
    * Return true if we need to do something in a debugger request,
    * false if we already handled the packet internally.
@@ -563,6 +653,11 @@ private:
    * false if we already handled the packet internally.
    */
   bool process_vpacket(char* payload);
+  /**
+   * Return true if we need to do something in a debugger request,
+   * false if we already handled the packet internally.
+   */
+  bool process_vfile(char* payload);
   /**
    * Return true if we need to do something in a debugger request,
    * false if we already handled the packet internally.
@@ -591,6 +686,14 @@ private:
   // true when "no-ack mode" enabled, in which we don't have
   // to send ack packets back to gdb.  This is a huge perf win.
   bool no_ack;
+  // True when the current DREQ_GET_MEM came from an 'x' packet, so the
+  // reply is binary rather than hex.
+  bool binary_get_mem;
+  // Process selected by vFile:setfs. 0 means the debuggee.
+  pid_t vfile_pid;
+  bool detach_on_hangup;
+  // True once gdb has gone away; all further output is dropped.
+  bool hung_up;
   ScopedFd sock_fd;
   std::vector<uint8_t> inbuf;  /* buffered input from gdb */
   size_t packetend;            /* index of '#' character */
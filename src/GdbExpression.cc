@@ -2,8 +2,13 @@
 
 #include "GdbExpression.h"
 
+#include <string.h>
+
+#include <algorithm>
+
 #include "GdbServer.h"
 #include "Task.h"
+#include "log.h"
 
 using namespace std;
 
@@ -67,232 +72,532 @@ enum Opcode {
   OP_printf = 0x34,
 };
 
-struct ExpressionState {
-  typedef GdbExpression::Value Value;
+// Opcodes we use internally for decoded instructions. gdb doesn't use these
+// values.
+static const uint8_t OP_internal_nop = 0x00;
+static const uint8_t OP_internal_error = 0xff;
 
-  ExpressionState(const vector<uint8_t>& bytecode)
-      : bytecode(bytecode), pc(0), error(false), end(false) {}
+// Bound the stack so slot numbers fit in an Instruction.
+static const size_t max_stack_size = 1024;
 
-  void set_error() { error = true; }
-
-  // Methods set error to true if there's an error and return some sentinel
-  // Value.
-  Value pop() {
-    if (stack.empty()) {
-      set_error();
-      return Value(-1);
-    }
-    Value v = stack.back();
-    stack.pop_back();
-    return v;
+const GdbRegisterValue& GdbExpression::Cache::reg(GdbRegister which) {
+  auto it = regs.find(which);
+  if (it == regs.end()) {
+    it = regs.insert(make_pair(which, GdbServer::get_reg(t->regs(),
+                                                         t->extra_regs(),
+                                                         which))).first;
   }
-  struct BinaryOperands {
-    BinaryOperands(int64_t a = 0, int64_t b = 0) : a(a), b(b) {}
-    int64_t a;
-    int64_t b;
-  };
-  BinaryOperands pop_a_b() {
-    int64_t b = pop().i;
-    return BinaryOperands(pop().i, b);
+  return it->second;
+}
+
+void GdbExpression::Cache::read_chunks(remote_ptr<void> start, size_t count) {
+  vector<uint8_t> buf(count * CHUNK_SIZE);
+  ssize_t nread = t->read_bytes_fallible(start, buf.size(), buf.data());
+  size_t valid = nread > 0 ? nread : 0;
+  for (size_t i = 0; i < count; ++i) {
+    Chunk& chunk = chunks[start + i * CHUNK_SIZE];
+    size_t offset = i * CHUNK_SIZE;
+    chunk.valid = valid > offset ? min<size_t>(valid - offset, CHUNK_SIZE) : 0;
+    memcpy(chunk.data, buf.data() + offset, CHUNK_SIZE);
   }
-  int64_t nonzero(int64_t v) {
-    if (!v) {
-      set_error();
-      return 1;
+}
+
+static remote_ptr<void> chunk_start(remote_ptr<void> addr, size_t chunk_size) {
+  return addr.as_int() & ~(uintptr_t(chunk_size) - 1);
+}
+
+bool GdbExpression::Cache::read(remote_ptr<void> addr, size_t size,
+                                uint8_t* buf) {
+  while (size > 0) {
+    remote_ptr<void> start = chunk_start(addr, CHUNK_SIZE);
+    auto it = chunks.find(start);
+    if (it == chunks.end()) {
+      read_chunks(start, 1);
+      it = chunks.find(start);
     }
-    return v;
+    size_t offset = addr - start;
+    size_t n = min<size_t>(size, CHUNK_SIZE - offset);
+    if (offset + n > it->second.valid) {
+      return false;
+    }
+    memcpy(buf, it->second.data + offset, n);
+    buf += n;
+    addr += n;
+    size -= n;
   }
-  int64_t pop_a() { return pop().i; }
-  void push(int64_t i) { stack.push_back(Value(i)); }
-  template <typename T> T fetch() {
-    if (pc + sizeof(T) > bytecode.size()) {
-      set_error();
-      return T(-1);
+  return true;
+}
+
+void GdbExpression::Cache::prefetch(const vector<remote_ptr<void>>& addrs) {
+  vector<remote_ptr<void>> starts;
+  for (auto addr : addrs) {
+    // Loads are at most 8 bytes, so can straddle two chunks.
+    for (auto start : { chunk_start(addr, CHUNK_SIZE),
+                        chunk_start(addr + 7, CHUNK_SIZE) }) {
+      if (!chunks.count(start)) {
+        starts.push_back(start);
+      }
     }
-    T v = 0;
-    for (size_t i = 0; i < sizeof(T); ++i) {
-      v = (v << 8) | bytecode[pc + i];
+  }
+  sort(starts.begin(), starts.end());
+  starts.erase(unique(starts.begin(), starts.end()), starts.end());
+  // Read runs of adjacent chunks with a single read.
+  size_t i = 0;
+  while (i < starts.size()) {
+    size_t j = i + 1;
+    while (j < starts.size() &&
+           starts[j] == starts[j - 1] + CHUNK_SIZE &&
+           chunk_start(starts[j], page_size()) ==
+               chunk_start(starts[i], page_size())) {
+      ++j;
     }
-    pc += sizeof(T);
-    return v;
+    read_chunks(starts[i], j - i);
+    i = j;
+  }
+}
+
+template <typename T>
+static bool fetch(const vector<uint8_t>& bytecode, size_t pc, T* v) {
+  if (pc + sizeof(T) > bytecode.size()) {
+    return false;
+  }
+  *v = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    *v = (*v << 8) | bytecode[pc + i];
   }
-  template <typename T> void load(Task* t) {
-    uint64_t addr = pop().i;
-    if (error) {
-      // Don't do unnecessary syscalls if we're already in an error state.
-      return;
+  return true;
+}
+
+static bool is_load(uint8_t opcode) {
+  return opcode == OP_ref8 || opcode == OP_ref16 || opcode == OP_ref32 ||
+         opcode == OP_ref64;
+}
+
+/**
+ * gdb's bytecode compiler guarantees that the stack depth at each
+ * instruction is the same however it's reached, so every stack access can be
+ * resolved to a fixed slot here. Malformed instructions become
+ * OP_internal_error instructions, so they only fail evaluation if they're
+ * reached, like they would when interpreting the bytecode directly.
+ */
+bool GdbExpression::compile(const vector<uint8_t>& bytecode,
+                            Program* program) {
+  struct Decoded {
+    Instruction insn;
+    size_t next_pc;
+    size_t target_pc;
+  };
+  vector<Decoded> decoded;
+  vector<int64_t> index_of_pc(bytecode.size(), -1);
+  vector<size_t> depth_of_pc(bytecode.size(), 0);
+  size_t stack_size = 1;
+  // A pc past the end of the bytecode means "fail".
+  const size_t error_pc = bytecode.size();
+
+  vector<pair<size_t, size_t>> unvisited;
+  unvisited.push_back(make_pair(0, 0));
+  while (!unvisited.empty()) {
+    size_t pc = unvisited.back().first;
+    size_t depth = unvisited.back().second;
+    unvisited.pop_back();
+    if (pc >= bytecode.size()) {
+      continue;
     }
+    if (index_of_pc[pc] >= 0) {
+      if (depth_of_pc[pc] != depth) {
+        LOG(debug) << "Inconsistent stack depth at " << pc;
+        return false;
+      }
+      continue;
+    }
+    index_of_pc[pc] = decoded.size();
+    depth_of_pc[pc] = depth;
+
+    Decoded d;
+    memset(&d, 0, sizeof(d));
+    d.insn.opcode = bytecode[pc];
+    d.next_pc = error_pc;
+    d.target_pc = error_pc;
+    // Number of stack entries consumed and produced.
+    size_t pops = 0;
+    size_t pushes = 0;
+    size_t length = 1;
     bool ok = true;
-    T v = t->read_mem(remote_ptr<T>(addr), &ok);
-    if (!ok) {
-      set_error();
-      return;
+    uint8_t u8 = 0;
+    uint16_t u16 = 0;
+    switch (d.insn.opcode) {
+      case OP_add:
+      case OP_sub:
+      case OP_mul:
+      case OP_div_signed:
+      case OP_div_unsigned:
+      case OP_rem_signed:
+      case OP_rem_unsigned:
+      case OP_lsh:
+      case OP_rsh_signed:
+      case OP_rsh_unsigned:
+      case OP_bit_and:
+      case OP_bit_or:
+      case OP_bit_xor:
+      case OP_equal:
+      case OP_less_signed:
+      case OP_less_unsigned:
+        pops = 2;
+        pushes = 1;
+        break;
+      case OP_log_not:
+      case OP_bit_not:
+      case OP_ref8:
+      case OP_ref16:
+      case OP_ref32:
+      case OP_ref64:
+        pops = 1;
+        pushes = 1;
+        break;
+      case OP_ext:
+      case OP_zero_ext:
+        length = 2;
+        ok = fetch(bytecode, pc + 1, &u8) &&
+             (d.insn.opcode == OP_zero_ext || u8 != 0);
+        d.insn.operand = u8;
+        if (u8 >= 64) {
+          // The value already has at least this many bits.
+          d.insn.opcode = OP_internal_nop;
+        } else {
+          pops = 1;
+          pushes = 1;
+        }
+        break;
+      case OP_dup:
+        pops = 1;
+        pushes = 2;
+        break;
+      case OP_swap:
+        pops = 2;
+        pushes = 2;
+        break;
+      case OP_pop:
+        pops = 1;
+        break;
+      case OP_pick:
+        length = 2;
+        ok = fetch(bytecode, pc + 1, &u8);
+        d.insn.operand = u8;
+        pops = u8 + 1;
+        pushes = u8 + 2;
+        break;
+      case OP_rot:
+        pops = 3;
+        pushes = 3;
+        break;
+      case OP_if_goto:
+        length = 3;
+        ok = fetch(bytecode, pc + 1, &u16);
+        d.target_pc = u16;
+        pops = 1;
+        break;
+      case OP_goto:
+        length = 3;
+        ok = fetch(bytecode, pc + 1, &u16);
+        break;
+      case OP_const8:
+        length = 2;
+        ok = fetch(bytecode, pc + 1, &u8);
+        d.insn.operand = u8;
+        pushes = 1;
+        break;
+      case OP_const16:
+        length = 3;
+        ok = fetch(bytecode, pc + 1, &u16);
+        d.insn.operand = u16;
+        pushes = 1;
+        break;
+      case OP_const32: {
+        uint32_t u32 = 0;
+        length = 5;
+        ok = fetch(bytecode, pc + 1, &u32);
+        d.insn.operand = u32;
+        pushes = 1;
+        break;
+      }
+      case OP_const64: {
+        uint64_t u64 = 0;
+        length = 9;
+        ok = fetch(bytecode, pc + 1, &u64);
+        d.insn.operand = u64;
+        pushes = 1;
+        break;
+      }
+      case OP_reg:
+        length = 3;
+        ok = fetch(bytecode, pc + 1, &u16);
+        d.insn.operand = u16;
+        pushes = 1;
+        break;
+      case OP_end:
+        pops = 1;
+        break;
+      default:
+        ok = false;
+        break;
     }
-    push(v);
-  }
-  void pick(size_t offset) {
-    if (offset >= stack.size()) {
-      set_error();
-      return;
+    if (!ok || depth < pops) {
+      d.insn.opcode = OP_internal_error;
+      decoded.push_back(d);
+      continue;
+    }
+    size_t new_depth = depth - pops + pushes;
+    if (new_depth > max_stack_size) {
+      LOG(debug) << "Expression stack too deep";
+      return false;
+    }
+    stack_size = max(stack_size, new_depth);
+
+    // Resolve the stack slots the instruction uses.
+    switch (d.insn.opcode) {
+      case OP_pick:
+        d.insn.a = depth - 1 - d.insn.operand;
+        d.insn.dest = depth;
+        break;
+      case OP_dup:
+        d.insn.a = depth - 1;
+        d.insn.dest = depth;
+        break;
+      case OP_rot:
+        d.insn.a = depth - 3;
+        d.insn.b = depth - 1;
+        break;
+      default:
+        if (pops >= 2) {
+          d.insn.a = depth - 2;
+          d.insn.b = depth - 1;
+        } else if (pops == 1) {
+          d.insn.a = depth - 1;
+        }
+        if (pushes) {
+          d.insn.dest = depth - pops;
+        }
+        break;
+    }
+
+    if (d.insn.opcode == OP_goto) {
+      d.next_pc = u16;
+    } else if (d.insn.opcode != OP_end) {
+      d.next_pc = pc + length;
+    }
+    if (d.next_pc != error_pc) {
+      unvisited.push_back(make_pair(d.next_pc, new_depth));
     }
-    push(stack[stack.size() - 1 - offset].i);
+    if (d.insn.opcode == OP_if_goto) {
+      unvisited.push_back(make_pair(d.target_pc, new_depth));
+    }
+    if (pushes == 1 && pops == 0 && d.insn.opcode != OP_reg &&
+        d.next_pc < bytecode.size() && is_load(bytecode[d.next_pc])) {
+      program->constant_loads.push_back(d.insn.operand);
+    }
+    decoded.push_back(d);
+  }
+
+  // Branches to invalid pcs go to a final error instruction.
+  size_t error_index = decoded.size();
+  auto resolve = [&](size_t pc) -> uint32_t {
+    return pc < bytecode.size() ? index_of_pc[pc] : error_index;
+  };
+  program->instructions.clear();
+  for (auto& d : decoded) {
+    d.insn.next = resolve(d.next_pc);
+    d.insn.target = resolve(d.target_pc);
+    program->instructions.push_back(d.insn);
   }
+  Instruction error;
+  memset(&error, 0, sizeof(error));
+  error.opcode = OP_internal_error;
+  program->instructions.push_back(error);
+  program->stack_size = stack_size;
+  return true;
+}
 
-  void step(Task* t) {
-    assert(!error);
-    BinaryOperands operands;
-    switch (fetch<uint8_t>()) {
+template <typename T>
+static bool load(GdbExpression::Cache& cache, int64_t addr, int64_t* v) {
+  T value;
+  if (!cache.read(remote_ptr<void>(addr), sizeof(T), (uint8_t*)&value)) {
+    return false;
+  }
+  *v = value;
+  return true;
+}
+
+bool GdbExpression::evaluate_program(const Program& program, Cache& cache,
+                                     Value* result) const {
+  cache.prefetch(program.constant_loads);
+
+  int64_t small_stack[32] = { 0 };
+  vector<int64_t> large_stack;
+  int64_t* stack = small_stack;
+  if (program.stack_size > sizeof(small_stack) / sizeof(small_stack[0])) {
+    large_stack.resize(program.stack_size);
+    stack = large_stack.data();
+  }
+
+  uint32_t pc = 0;
+  for (int steps = 0; steps < 10000; ++steps) {
+    const Instruction& insn = program.instructions[pc];
+    int64_t a = stack[insn.a];
+    int64_t b = stack[insn.b];
+    int64_t& dest = stack[insn.dest];
+    pc = insn.next;
+    switch (insn.opcode) {
       case OP_add:
-        operands = pop_a_b();
-        return push(operands.a + operands.b);
+        dest = a + b;
+        break;
       case OP_sub:
-        operands = pop_a_b();
-        return push(operands.a - operands.b);
+        dest = a - b;
+        break;
       case OP_mul:
-        operands = pop_a_b();
-        return push(operands.a * operands.b);
+        dest = a * b;
+        break;
       case OP_div_signed:
-        operands = pop_a_b();
-        return push(operands.a / nonzero(operands.b));
+        if (!b) {
+          return false;
+        }
+        dest = a / b;
+        break;
       case OP_div_unsigned:
-        operands = pop_a_b();
-        return push(uint64_t(operands.a) / uint64_t(nonzero(operands.b)));
+        if (!b) {
+          return false;
+        }
+        dest = uint64_t(a) / uint64_t(b);
+        break;
       case OP_rem_signed:
-        operands = pop_a_b();
-        return push(operands.a % nonzero(operands.b));
+        if (!b) {
+          return false;
+        }
+        dest = a % b;
+        break;
       case OP_rem_unsigned:
-        operands = pop_a_b();
-        return push(uint64_t(operands.a) % uint64_t(nonzero(operands.b)));
+        if (!b) {
+          return false;
+        }
+        dest = uint64_t(a) % uint64_t(b);
+        break;
       case OP_lsh:
-        operands = pop_a_b();
-        return push(operands.a << operands.b);
+        dest = a << b;
+        break;
       case OP_rsh_signed:
-        operands = pop_a_b();
-        return push(operands.a >> operands.b);
+        dest = a >> b;
+        break;
       case OP_rsh_unsigned:
-        operands = pop_a_b();
-        return push(uint64_t(operands.a) >> operands.b);
+        dest = uint64_t(a) >> b;
+        break;
       case OP_log_not:
-        return push(!pop_a());
+        dest = !a;
+        break;
       case OP_bit_and:
-        operands = pop_a_b();
-        return push(operands.a & operands.b);
+        dest = a & b;
+        break;
       case OP_bit_or:
-        operands = pop_a_b();
-        return push(operands.a | operands.b);
+        dest = a | b;
+        break;
       case OP_bit_xor:
-        operands = pop_a_b();
-        return push(operands.a ^ operands.b);
+        dest = a ^ b;
+        break;
       case OP_bit_not:
-        return push(~pop_a());
+        dest = ~a;
+        break;
       case OP_equal:
-        operands = pop_a_b();
-        return push(operands.a == operands.b);
+        dest = a == b;
+        break;
       case OP_less_signed:
-        operands = pop_a_b();
-        return push(operands.a < operands.b);
+        dest = a < b;
+        break;
       case OP_less_unsigned:
-        operands = pop_a_b();
-        return push(uint64_t(operands.a) < uint64_t(operands.b));
+        dest = uint64_t(a) < uint64_t(b);
+        break;
       case OP_ext: {
-        int64_t n = nonzero(fetch<uint8_t>());
-        if (n >= 64) {
-          return;
-        }
-        int64_t a = pop_a();
-        int64_t n_mask = (int64_t(1) << n) - 1;
-        int sign_bit = (a >> (n - 1)) & 1;
-        return push((sign_bit * ~n_mask) | (a & n_mask));
-      }
-      case OP_zero_ext: {
-        int64_t n = fetch<uint8_t>();
-        if (n >= 64) {
-          return;
-        }
-        int64_t a = pop_a();
-        int64_t n_mask = (int64_t(1) << n) - 1;
-        return push(a & n_mask);
+        int64_t n_mask = (int64_t(1) << insn.operand) - 1;
+        int sign_bit = (a >> (insn.operand - 1)) & 1;
+        dest = (sign_bit * ~n_mask) | (a & n_mask);
+        break;
       }
+      case OP_zero_ext:
+        dest = a & ((int64_t(1) << insn.operand) - 1);
+        break;
       case OP_ref8:
-        return load<uint8_t>(t);
+        if (!load<uint8_t>(cache, a, &dest)) {
+          return false;
+        }
+        break;
       case OP_ref16:
-        return load<uint16_t>(t);
+        if (!load<uint16_t>(cache, a, &dest)) {
+          return false;
+        }
+        break;
       case OP_ref32:
-        return load<uint32_t>(t);
+        if (!load<uint32_t>(cache, a, &dest)) {
+          return false;
+        }
+        break;
       case OP_ref64:
-        return load<uint64_t>(t);
+        if (!load<uint64_t>(cache, a, &dest)) {
+          return false;
+        }
+        break;
       case OP_dup:
-        return pick(0);
-      case OP_swap:
-        operands = pop_a_b();
-        push(operands.b);
-        return push(operands.a);
-      case OP_pop:
-        pop_a();
-        return;
       case OP_pick:
-        return pick(fetch<uint8_t>());
-      case OP_rot: {
-        int64_t c = pop_a();
-        int64_t b = pop_a();
-        int64_t a = pop_a();
-        push(c);
-        push(b);
-        return push(a);
-      }
-      case OP_if_goto: {
-        uint16_t offset = fetch<uint16_t>();
-        if (pop_a()) {
-          pc = offset;
+        dest = a;
+        break;
+      case OP_swap:
+      case OP_rot:
+        stack[insn.a] = b;
+        stack[insn.b] = a;
+        break;
+      case OP_if_goto:
+        if (a) {
+          pc = insn.target;
         }
-        return;
-      }
-      case OP_goto:
-        pc = fetch<uint16_t>();
-        return;
+        break;
       case OP_const8:
-        return push(fetch<uint8_t>());
       case OP_const16:
-        return push(fetch<uint16_t>());
       case OP_const32:
-        return push(fetch<uint32_t>());
       case OP_const64:
-        return push(fetch<uint64_t>());
+        dest = insn.operand;
+        break;
       case OP_reg: {
-        GdbRegisterValue v = GdbServer::get_reg(t->regs(), t->extra_regs(),
-                                                GdbRegister(fetch<uint16_t>()));
+        const GdbRegisterValue& v = cache.reg(GdbRegister(insn.operand));
         if (!v.defined) {
-          set_error();
-          return;
+          return false;
         }
         switch (v.size) {
           case 1:
-            return push(v.value1);
+            dest = v.value1;
+            break;
           case 2:
-            return push(v.value2);
+            dest = v.value2;
+            break;
           case 4:
-            return push(v.value4);
+            dest = v.value4;
+            break;
           case 8:
-            return push(v.value8);
+            dest = v.value8;
+            break;
+          default:
+            return false;
         }
-        set_error();
-        return;
+        break;
       }
       case OP_end:
-        end = true;
-        return;
+        *result = Value(a);
+        return true;
+      case OP_goto:
+      case OP_pop:
+      case OP_internal_nop:
+        break;
       default:
-        set_error();
-        return;
+        return false;
     }
   }
-
-  const vector<uint8_t>& bytecode;
-  vector<Value> stack;
-  size_t pc;
-  bool error;
-  bool end;
-};
+  return false;
+}
 
 #ifdef WORKAROUND_GDB_BUGS
 /* https://sourceware.org/bugzilla/show_bug.cgi?id=18617 means that
@@ -328,7 +633,9 @@ static T fetch(const uint8_t* data, size_t size, size_t pc) {
   return v;
 }
 
-GdbExpression::GdbExpression(const uint8_t* data, size_t size) {
+static vector<vector<uint8_t>> bytecode_variants(const uint8_t* data,
+                                                 size_t size) {
+  vector<vector<uint8_t>> bytecode_variants;
   vector<bool> instruction_starts;
   instruction_starts.resize(size);
   fill(instruction_starts.begin(), instruction_starts.end(), false);
@@ -351,7 +658,7 @@ GdbExpression::GdbExpression(const uint8_t* data, size_t size) {
           num_variants *= count_variants(data[pc + 1]);
           if (num_variants > 64) {
             // Too many variants, giving up on this expression
-            return;
+            return bytecode_variants;
           }
         }
         unvisited.push_back(pc + 2);
@@ -416,30 +723,296 @@ GdbExpression::GdbExpression(const uint8_t* data, size_t size) {
       bytecode_variants = move(variants);
     }
   }
+  return bytecode_variants;
 }
 #else
-GdbExpression::GdbExpression(const uint8_t* data, size_t size) {
+static vector<vector<uint8_t>> bytecode_variants(const uint8_t* data,
+                                                 size_t size) {
+  vector<vector<uint8_t>> bytecode_variants;
   bytecode_variants.push_back(vector<uint8_t>(data, data + size));
+  return bytecode_variants;
 }
 #endif
 
-bool GdbExpression::evaluate(Task* t, Value* result) const {
-  if (bytecode_variants.empty()) {
-    return false;
+GdbExpression::GdbExpression(const uint8_t* data, size_t size)
+    : invalid(false) {
+  for (auto& b : bytecode_variants(data, size)) {
+    programs.push_back(Program());
+    if (!compile(b, &programs.back())) {
+      invalid = true;
+      break;
+    }
   }
+}
 
-  bool first = true;
+static void emit(vector<uint8_t>* code, std::initializer_list<uint8_t> bytes) {
+  code->insert(code->end(), bytes);
+}
+
+template <typename T> static void emit_value(vector<uint8_t>* code, T v) {
+  uint8_t bytes[sizeof(T)];
+  memcpy(bytes, &v, sizeof(T));
+  code->insert(code->end(), bytes, bytes + sizeof(T));
+}
+
+// push disp32(%rsp)
+static void emit_push_stack_slot(vector<uint8_t>* code, uint32_t offset) {
+  emit(code, { 0xff, 0xb4, 0x24 });
+  emit_value(code, offset);
+}
+
+// mov $v,%rax
+static void emit_mov_rax_imm(vector<uint8_t>* code, uint64_t v) {
+  emit(code, { 0x48, 0xb8 });
+  emit_value(code, v);
+}
+
+bool GdbExpression::generate_x86_64_code(
+    remote_code_ptr ip, vector<uint8_t>* code, vector<MemoryRange>* loads,
+    const function<bool(const MemoryRange&)>& can_load) const {
+  if (programs.empty() || invalid) {
+    return false;
+  }
+  // The x86-64 encodings of rax, rbx, rcx, rdx, rsi, rdi, rbp and rsp, in
+  // gdb's register order.
+  static const uint8_t x86_64_reg_encodings[] = { 0, 3, 1, 2, 6, 7, 5, 4 };
 
-  for (auto& b : bytecode_variants) {
-    ExpressionState state(b);
-    for (int steps = 0; !state.end; ++steps) {
-      if (steps >= 10000 || state.error) {
+  // Each program's result is ORed into the accumulator: gdb breaks if any
+  // variant is nonzero, or if they disagree, which implies that.
+  for (auto& p : programs) {
+    if (p.stack_size > X86_64_MAX_STACK_DEPTH) {
+      return false;
+    }
+    // The expression stack is kept on the machine stack above the
+    // accumulator. Track which entries are known constants.
+    vector<pair<bool, int64_t>> constants;
+    for (size_t i = 0; i < p.instructions.size(); ++i) {
+      const Instruction& insn = p.instructions[i];
+      size_t depth = constants.size();
+      if (insn.opcode != OP_end && insn.next != i + 1) {
+        // Not straight-line code.
         return false;
       }
-      state.step(t);
+      switch (insn.opcode) {
+        case OP_add:
+        case OP_sub:
+        case OP_mul:
+        case OP_bit_and:
+        case OP_bit_or:
+        case OP_bit_xor:
+        case OP_lsh:
+        case OP_rsh_signed:
+        case OP_rsh_unsigned:
+        case OP_equal:
+        case OP_less_signed:
+        case OP_less_unsigned:
+          // pop %rcx; pop %rax
+          emit(code, { 0x59, 0x58 });
+          switch (insn.opcode) {
+            case OP_add:
+              emit(code, { 0x48, 0x01, 0xc8 });
+              break;
+            case OP_sub:
+              emit(code, { 0x48, 0x29, 0xc8 });
+              break;
+            case OP_mul:
+              emit(code, { 0x48, 0x0f, 0xaf, 0xc1 });
+              break;
+            case OP_bit_and:
+              emit(code, { 0x48, 0x21, 0xc8 });
+              break;
+            case OP_bit_or:
+              emit(code, { 0x48, 0x09, 0xc8 });
+              break;
+            case OP_bit_xor:
+              emit(code, { 0x48, 0x31, 0xc8 });
+              break;
+            case OP_lsh:
+              emit(code, { 0x48, 0xd3, 0xe0 });
+              break;
+            case OP_rsh_signed:
+              emit(code, { 0x48, 0xd3, 0xf8 });
+              break;
+            case OP_rsh_unsigned:
+              emit(code, { 0x48, 0xd3, 0xe8 });
+              break;
+            default:
+              // cmp %rcx,%rax; set<cc> %al; movzbl %al,%eax
+              emit(code, { 0x48, 0x39, 0xc8, 0x0f });
+              emit(code, { uint8_t(insn.opcode == OP_equal
+                                       ? 0x94
+                                       : insn.opcode == OP_less_signed ? 0x9c
+                                                                       : 0x92),
+                           0xc0, 0x0f, 0xb6, 0xc0 });
+              break;
+          }
+          emit(code, { 0x50 });
+          constants.pop_back();
+          constants.back().first = false;
+          break;
+        case OP_log_not:
+          // test %rax,%rax; sete %al; movzbl %al,%eax
+          emit(code, { 0x58, 0x48, 0x85, 0xc0, 0x0f, 0x94, 0xc0, 0x0f, 0xb6,
+                       0xc0, 0x50 });
+          constants.back().first = false;
+          break;
+        case OP_bit_not:
+          emit(code, { 0x58, 0x48, 0xf7, 0xd0, 0x50 });
+          constants.back().first = false;
+          break;
+        case OP_ext:
+        case OP_zero_ext: {
+          uint8_t shift = 64 - insn.operand;
+          emit(code, { 0x58 });
+          if (shift == 64) {
+            // xor %eax,%eax
+            emit(code, { 0x31, 0xc0 });
+          } else {
+            // shl $shift,%rax; sar/shr $shift,%rax
+            emit(code, { 0x48, 0xc1, 0xe0, shift, 0x48, 0xc1,
+                         uint8_t(insn.opcode == OP_ext ? 0xf8 : 0xe8),
+                         shift });
+          }
+          emit(code, { 0x50 });
+          constants.back().first = false;
+          break;
+        }
+        case OP_ref8:
+        case OP_ref16:
+        case OP_ref32:
+        case OP_ref64: {
+          if (!constants.back().first) {
+            return false;
+          }
+          remote_ptr<void> addr = constants.back().second;
+          size_t size = insn.opcode == OP_ref8
+                            ? 1
+                            : insn.opcode == OP_ref16
+                                  ? 2
+                                  : insn.opcode == OP_ref32 ? 4 : 8;
+          MemoryRange range(addr, size);
+          if (!can_load(range)) {
+            return false;
+          }
+          loads->push_back(range);
+          emit(code, { 0x58 });
+          emit_mov_rax_imm(code, addr.as_int());
+          switch (size) {
+            case 1:
+              emit(code, { 0x0f, 0xb6, 0x00 });
+              break;
+            case 2:
+              emit(code, { 0x0f, 0xb7, 0x00 });
+              break;
+            case 4:
+              emit(code, { 0x8b, 0x00 });
+              break;
+            default:
+              emit(code, { 0x48, 0x8b, 0x00 });
+              break;
+          }
+          emit(code, { 0x50 });
+          constants.back().first = false;
+          break;
+        }
+        case OP_dup:
+        case OP_pick: {
+          size_t offset = insn.opcode == OP_dup ? 0 : insn.operand;
+          emit_push_stack_slot(code, 8 * offset);
+          constants.push_back(constants[depth - 1 - offset]);
+          break;
+        }
+        case OP_swap:
+          emit(code, { 0x58, 0x59, 0x50, 0x51 });
+          swap(constants[depth - 1], constants[depth - 2]);
+          break;
+        case OP_pop:
+          emit(code, { 0x58 });
+          constants.pop_back();
+          break;
+        case OP_rot:
+          emit(code, { 0x58, 0x59, 0x5a, 0x50, 0x51, 0x52 });
+          swap(constants[depth - 1], constants[depth - 3]);
+          break;
+        case OP_const8:
+        case OP_const16:
+        case OP_const32:
+        case OP_const64:
+          emit_mov_rax_imm(code, insn.operand);
+          emit(code, { 0x50 });
+          constants.push_back(make_pair(true, insn.operand));
+          break;
+        case OP_reg:
+          if (insn.operand == DREG_RIP) {
+            emit_mov_rax_imm(code, ip.register_value());
+            emit(code, { 0x50 });
+            constants.push_back(make_pair(true, ip.register_value()));
+            break;
+          }
+          switch (insn.operand) {
+            case DREG_RAX:
+              emit_push_stack_slot(code, 8 * depth + X86_64_SAVED_RAX);
+              break;
+            case DREG_RCX:
+              emit_push_stack_slot(code, 8 * depth + X86_64_SAVED_RCX);
+              break;
+            case DREG_RDX:
+              emit_push_stack_slot(code, 8 * depth + X86_64_SAVED_RDX);
+              break;
+            case DREG_RSP:
+              emit_push_stack_slot(code, 8 * depth + X86_64_SAVED_RSP);
+              break;
+            default:
+              if (insn.operand < DREG_RSP) {
+                emit(code, { uint8_t(0x50 +
+                                     x86_64_reg_encodings[insn.operand]) });
+              } else if (insn.operand <= DREG_R15) {
+                emit(code, { 0x41, uint8_t(0x50 + insn.operand - DREG_R8) });
+              } else {
+                return false;
+              }
+              break;
+          }
+          constants.push_back(make_pair(false, 0));
+          break;
+        case OP_internal_nop:
+          break;
+        case OP_end: {
+          // pop %rax; discard the rest of the expression stack;
+          // or %rax,(%rsp)
+          emit(code, { 0x58 });
+          if (depth > 1) {
+            emit(code, { 0x48, 0x8d, 0xa4, 0x24 });
+            emit_value(code, uint32_t(8 * (depth - 1)));
+          }
+          emit(code, { 0x48, 0x09, 0x04, 0x24 });
+          // Skip the trailing error instruction.
+          i = p.instructions.size();
+          break;
+        }
+        default:
+          return false;
+      }
     }
-    Value v = state.pop();
-    if (state.error) {
+  }
+  return true;
+}
+
+bool GdbExpression::evaluate(Task* t, Value* result) const {
+  Cache cache(t);
+  return evaluate(cache, result);
+}
+
+bool GdbExpression::evaluate(Cache& cache, Value* result) const {
+  if (programs.empty() || invalid) {
+    return false;
+  }
+
+  bool first = true;
+
+  for (auto& p : programs) {
+    Value v;
+    if (!evaluate_program(p, cache, &v)) {
       return false;
     }
     if (first) {
@@ -6,8 +6,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
+#include <map>
 #include <vector>
 
+#include "GdbConnection.h"
+#include "MemoryRange.h"
+#include "remote_code_ptr.h"
+#include "remote_ptr.h"
+
 namespace rr {
 
 class Task;
@@ -16,6 +23,10 @@ class Task;
  * gdb has a simple bytecode language for writing expressions to be evaluated
  * in a remote target. This class implements evaluation of such expressions.
  * See https://sourceware.org/gdb/current/onlinedocs/gdb/Agent-Expressions.html
+ *
+ * Breakpoint conditions can be evaluated millions of times, so the bytecode
+ * is decoded once, up front, into a form where each instruction names the
+ * fixed stack slots it reads and writes and the instruction to run next.
  */
 class GdbExpression {
 public:
@@ -27,18 +38,111 @@ public:
     bool operator!=(const Value& v) { return !(*this == v); }
     int64_t i;
   };
+
+  /**
+   * Caches the registers and memory read by expressions evaluated while |t|
+   * is stopped. Must not outlive that stop.
+   */
+  class Cache {
+  public:
+    Cache(Task* t) : t(t) {}
+    Task* task() const { return t; }
+    const GdbRegisterValue& reg(GdbRegister which);
+    /**
+     * Read |size| bytes at |addr| into |buf|. Returns false if they're not
+     * all readable.
+     */
+    bool read(remote_ptr<void> addr, size_t size, uint8_t* buf);
+    /**
+     * Read the memory containing all of |addrs| with as few reads as
+     * possible.
+     */
+    void prefetch(const std::vector<remote_ptr<void>>& addrs);
+
+  private:
+    enum { CHUNK_SIZE = 64 };
+    struct Chunk {
+      uint8_t data[CHUNK_SIZE];
+      // Number of bytes at the start of |data| that could be read.
+      size_t valid;
+    };
+    void read_chunks(remote_ptr<void> start, size_t count);
+
+    Task* t;
+    std::map<GdbRegister, GdbRegisterValue> regs;
+    std::map<remote_ptr<void>, Chunk> chunks;
+  };
+
   /**
    * If evaluation succeeds, store the final result in *result and return true.
    * Otherwise return false.
    */
   bool evaluate(Task* t, Value* result) const;
+  /**
+   * Like evaluate(Task*, Value*), but reads the task's state through |cache|
+   * so several expressions evaluated at the same stop share their reads.
+   */
+  bool evaluate(Cache& cache, Value* result) const;
+
+  /**
+   * Stack layout expected by generate_x86_64_code: offsets from %rsp of
+   * the tracee's saved registers, including its %rsp. The code can push up
+   * to X86_64_MAX_STACK_DEPTH entries.
+   */
+  enum {
+    X86_64_SAVED_RDX = 8,
+    X86_64_SAVED_RCX = 16,
+    X86_64_SAVED_RAX = 24,
+    X86_64_SAVED_RSP = 40,
+    X86_64_MAX_STACK_DEPTH = 256
+  };
+  /**
+   * Append to |code| x86-64 code that evaluates the expression in the
+   * tracee at |ip| and ORs the result into the 64-bit accumulator at
+   * (%rsp). The other registers and the stack must be laid out as
+   * described above; the code may clobber %rax, %rcx, %rdx and flags.
+   * The code must not affect ticks or fault, so only straight-line
+   * expressions without division, over general-purpose registers and memory
+   * at constant addresses that |can_load| accepts, are supported.
+   * Those addresses are appended to |loads|. Returns false (leaving |code|
+   * and |loads| in an unspecified state) if the expression isn't supported.
+   */
+  bool generate_x86_64_code(
+      remote_code_ptr ip, std::vector<uint8_t>* code,
+      std::vector<MemoryRange>* loads,
+      const std::function<bool(const MemoryRange&)>& can_load) const;
+
+  struct Instruction {
+    uint8_t opcode;
+    // Stack slots of the result and the operands.
+    uint16_t dest;
+    uint16_t a;
+    uint16_t b;
+    // Index of the instruction to run next, and of the branch target.
+    uint32_t next;
+    uint32_t target;
+    int64_t operand;
+  };
+  struct Program {
+    std::vector<Instruction> instructions;
+    size_t stack_size;
+    // Addresses of loads from constant addresses, prefetched before
+    // evaluation.
+    std::vector<remote_ptr<void>> constant_loads;
+  };
 
 private:
+  static bool compile(const std::vector<uint8_t>& bytecode, Program* program);
+  bool evaluate_program(const Program& program, Cache& cache,
+                        Value* result) const;
+
   /**
    * To work around gdb bugs, we may generate and evaluate multiple versions of
    * the same expression program.
    */
-  std::vector<std::vector<uint8_t>> bytecode_variants;
+  std::vector<Program> programs;
+  // True if some variant couldn't be compiled, so evaluation always fails.
+  bool invalid;
 };
 
 } // namespace rr
@@ -3,12 +3,16 @@
 #include "GdbServer.h"
 
 #include <assert.h>
+#include <elf.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 #include <map>
 #include <sstream>
@@ -39,7 +43,9 @@ GdbServer::GdbServer(std::unique_ptr<GdbConnection>& dbg, Task* t)
       final_event(UINT32_MAX),
       stop_replaying_to_target(false),
       interrupt_pending(false),
-      emergency_debug_session(&t->session()) {
+      emergency_debug_session(&t->session()),
+      spare_diversion_source(nullptr),
+      diversions_at_this_stop(false) {
   memset(&stop_siginfo, 0, sizeof(stop_siginfo));
 }
 
@@ -254,15 +260,34 @@ public:
     }
   }
   virtual bool evaluate(Task* t) const {
+    GdbExpression::Cache cache(t);
     for (auto& e : expressions) {
       GdbExpression::Value v;
       // Break if evaluation fails or the result is nonzero
-      if (!e.evaluate(t, &v) || v.i != 0) {
+      if (!e.evaluate(cache, &v) || v.i != 0) {
         return true;
       }
     }
     return false;
   }
+  virtual bool generate_x86_64_code(AddressSpace& vm, remote_code_ptr addr,
+                                    vector<uint8_t>* code,
+                                    vector<MemoryRange>* loads) const {
+    auto can_load = [&vm](const MemoryRange& range) -> bool {
+      for (remote_ptr<void> p : { range.start(), range.end() - 1 }) {
+        if (!vm.has_mapping(p) || !(vm.mapping_of(p).map.prot() & PROT_READ)) {
+          return false;
+        }
+      }
+      return true;
+    };
+    for (auto& e : expressions) {
+      if (!e.generate_x86_64_code(addr, code, loads, can_load)) {
+        return false;
+      }
+    }
+    return true;
+  }
 
 private:
   vector<GdbExpression> expressions;
@@ -277,35 +302,302 @@ static unique_ptr<BreakpointCondition> breakpoint_condition(
       new GdbBreakpointCondition(request.watch().conditions));
 }
 
-static bool search_memory(Task* t, const MemoryRange& where,
-                          const vector<uint8_t>& find,
-                          remote_ptr<void>* result) {
+void GdbServer::read_mem_for_debugger(Task* t, remote_ptr<void> addr,
+                                      size_t len, vector<uint8_t>* result) {
+  result->clear();
+  remote_ptr<void> end = addr + len;
+  if (end < addr) {
+    end = remote_ptr<void>(UINTPTR_MAX);
+  }
+  remote_ptr<void> p = addr;
+  while (p < end) {
+    remote_ptr<void> page = floor_page_size(p);
+    auto key = make_pair(t->vm().get(), page);
+    auto it = mem_cache.find(key);
+    if (it == mem_cache.end()) {
+      vector<uint8_t> data;
+      data.resize(page_size());
+      // Mappings are page-aligned, so a partly readable page is readable
+      // from its start.
+      ssize_t nread = t->read_bytes_fallible(page, data.size(), data.data());
+      data.resize(max(ssize_t(0), nread));
+      t->vm()->replace_breakpoints_with_original_values(
+          data.data(), data.size(), page.cast<uint8_t>());
+      it = mem_cache.insert(make_pair(key, move(data))).first;
+    }
+    const vector<uint8_t>& data = it->second;
+    size_t offset = p - page;
+    size_t n = min<size_t>(end - p, page_size() - offset);
+    if (offset + n > data.size()) {
+      // Partly readable page; return what we have.
+      if (offset < data.size()) {
+        result->insert(result->end(), data.begin() + offset, data.end());
+      }
+      break;
+    }
+    result->insert(result->end(), data.begin() + offset,
+                   data.begin() + offset + n);
+    p = p + n;
+  }
+}
+
+// Large enough that the per-read syscall overhead doesn't matter.
+static const size_t search_chunk_size = 1024 * 1024;
+
+void GdbServer::search_memory(
+    Task* t, const MemoryRange& where, const vector<vector<uint8_t>>& patterns,
+    const function<bool(remote_ptr<void>, size_t)>& found) {
+  size_t min_size = SIZE_MAX;
+  size_t max_size = 0;
+  for (auto& p : patterns) {
+    ASSERT(t, !p.empty());
+    min_size = min(min_size, p.size());
+    max_size = max(max_size, p.size());
+  }
+  if (patterns.empty()) {
+    return;
+  }
+  // Consecutive chunks overlap by this much so we find matches that cross
+  // chunk boundaries.
+  size_t overlap = max_size - 1;
   vector<uint8_t> buf;
-  buf.resize(page_size() + find.size() - 1);
+  buf.resize(search_chunk_size + overlap);
+  vector<pair<remote_ptr<void>, size_t>> matches;
   for (const auto& m : t->vm()->maps()) {
-    MemoryRange r = MemoryRange(m.map.start(), m.map.end() + find.size() - 1)
-                        .intersect(where);
-    // We basically read page by page here, but we read past the end of the
-    // page to handle the case where a found string crosses page boundaries.
-    // This approach isn't great for handling long search strings but gdb's find
-    // command isn't really suited to that.
-    // Reading page by page lets us avoid problems where some pages in a
-    // mapping aren't readable (e.g. reading beyond end of file).
-    while (r.size() >= find.size()) {
-      ssize_t nread = t->read_bytes_fallible(
-          r.start(), std::min(buf.size(), r.size()), buf.data());
-      if (nread >= ssize_t(find.size())) {
-        void* found = memmem(buf.data(), nread, find.data(), find.size());
-        if (found) {
-          *result = r.start() + (static_cast<uint8_t*>(found) - buf.data());
-          return true;
+    // Read |overlap| bytes past the mapping to find matches that cross into
+    // the next one, but only accept matches starting in this mapping.
+    MemoryRange r =
+        MemoryRange(m.map.start(), m.map.end() + overlap).intersect(where);
+    remote_ptr<void> start = r.start();
+    while (start < m.map.end() && r.end() >= start + min_size) {
+      size_t want = min<size_t>(buf.size(), r.end() - start);
+      ssize_t nread = t->read_bytes_fallible(start, want, buf.data());
+      // Only matches starting before |accept_end| belong to this chunk; the
+      // next chunk finds the others.
+      size_t accept_end = max<ssize_t>(nread, 0);
+      remote_ptr<void> next;
+      if (nread < ssize_t(want)) {
+        // Some page isn't readable (e.g. beyond the end of a file). Skip it.
+        next = floor_page_size(start + accept_end) + page_size();
+      } else if (start + want < r.end()) {
+        accept_end -= overlap;
+        next = start + accept_end;
+      } else {
+        next = r.end();
+      }
+      accept_end = min<size_t>(accept_end, m.map.end() - start);
+      if (nread > 0) {
+        t->vm()->replace_breakpoints_with_original_values(
+            buf.data(), nread, start.cast<uint8_t>());
+        matches.clear();
+        for (size_t i = 0; i < patterns.size(); ++i) {
+          const vector<uint8_t>& p = patterns[i];
+          // glibc's memmem is vectorized.
+          const uint8_t* b = buf.data();
+          const uint8_t* end = buf.data() + nread;
+          while (true) {
+            auto hit = static_cast<const uint8_t*>(
+                memmem(b, end - b, p.data(), p.size()));
+            if (!hit || size_t(hit - buf.data()) >= accept_end) {
+              break;
+            }
+            matches.push_back(make_pair(start + (hit - buf.data()), i));
+            b = hit + 1;
+          }
+        }
+        sort(matches.begin(), matches.end());
+        for (auto& match : matches) {
+          if (!found(match.first, match.second)) {
+            return;
+          }
         }
       }
-      r = MemoryRange(
-          std::min(r.end(), floor_page_size(r.start()) + page_size()), r.end());
+      start = next;
     }
   }
-  return false;
+}
+
+static bool read_c_str_fallible(Task* t, remote_ptr<char> addr,
+                                string* result) {
+  char buf[PATH_MAX];
+  ssize_t nread = t->read_bytes_fallible(addr, sizeof(buf), buf);
+  if (nread <= 0) {
+    return false;
+  }
+  // The string may run into an unreadable page, so only require that its
+  // terminator was readable.
+  const char* end = static_cast<const char*>(memchr(buf, 0, nread));
+  if (!end) {
+    return false;
+  }
+  *result = string(buf, end - buf);
+  return true;
+}
+
+static string xml_escape(const string& s) {
+  string result;
+  for (char c : s) {
+    switch (c) {
+      case '&':
+        result += "&amp;";
+        break;
+      case '<':
+        result += "&lt;";
+        break;
+      case '>':
+        result += "&gt;";
+        break;
+      case '"':
+        result += "&quot;";
+        break;
+      case '\'':
+        result += "&apos;";
+        break;
+      default:
+        result += c;
+        break;
+    }
+  }
+  return result;
+}
+
+/**
+ * Build the qXfer:libraries-svr4 document for |t|'s address space by
+ * walking the dynamic linker's r_debug link map, which we find through the
+ * executable's program headers in the saved auxv. This is what gdb does
+ * itself with a long series of memory reads; gdb needs the link_map
+ * addresses (e.g. for TLS lookups), which only exist in the tracee.
+ */
+template <typename Arch> static string libraries_svr4_arch(Task* t) {
+  typedef typename Arch::unsigned_word word;
+  struct RDebug {
+    typename Arch::signed_int r_version;
+    word r_map;
+    word r_brk;
+    typename Arch::signed_int r_state;
+    word r_ldbase;
+  };
+  struct LinkMap {
+    word l_addr;
+    word l_name;
+    word l_ld;
+    word l_next;
+    word l_prev;
+  };
+
+  const vector<uint8_t>& auxv = t->vm()->saved_auxv();
+  word phdrs = 0;
+  size_t phnum = 0;
+  for (size_t i = 0; i + 2 * sizeof(word) <= auxv.size();
+       i += 2 * sizeof(word)) {
+    word pair[2];
+    memcpy(pair, auxv.data() + i, sizeof(pair));
+    if (pair[0] == AT_PHDR) {
+      phdrs = pair[1];
+    } else if (pair[0] == AT_PHNUM) {
+      phnum = pair[1];
+    }
+  }
+
+  word r_debug_addr = 0;
+  bool ok = true;
+  vector<typename Arch::ElfPhdr> headers;
+  if (phdrs) {
+    headers = t->read_mem(remote_ptr<typename Arch::ElfPhdr>(phdrs), phnum,
+                          &ok);
+  }
+  if (ok) {
+    word bias = 0;
+    remote_ptr<typename Arch::ElfDyn> dyn;
+    for (auto& h : headers) {
+      if (h.p_type == PT_PHDR) {
+        bias = phdrs - h.p_vaddr;
+      }
+    }
+    for (auto& h : headers) {
+      if (h.p_type == PT_DYNAMIC) {
+        dyn = bias + h.p_vaddr;
+      }
+    }
+    while (dyn && t->vm()->has_mapping(dyn)) {
+      auto d = t->read_mem(dyn, &ok);
+      if (!ok || d.d_tag == DT_NULL) {
+        break;
+      }
+      if (d.d_tag == DT_DEBUG) {
+        r_debug_addr = d.d_val;
+        break;
+      }
+      ++dyn;
+    }
+  }
+
+  stringstream ss;
+  ss << "<library-list-svr4 version=\"1.0\"";
+  RDebug r_debug;
+  memset(&r_debug, 0, sizeof(r_debug));
+  if (r_debug_addr) {
+    r_debug = t->read_mem(remote_ptr<RDebug>(r_debug_addr), &ok);
+  }
+  if (!ok || !r_debug.r_map) {
+    // The dynamic linker hasn't set up r_debug yet.
+    ss << "/>";
+    return ss.str();
+  }
+
+  ss << " main-lm=\"" << HEX(r_debug.r_map) << "\">";
+  remote_ptr<LinkMap> lm = r_debug.r_map;
+  // The first entry is the executable itself. Guard against a corrupt
+  // (cyclic) list.
+  LinkMap entry = t->read_mem(lm, &ok);
+  for (int count = 0; ok && entry.l_next && count < 100000; ++count) {
+    lm = entry.l_next;
+    entry = t->read_mem(lm, &ok);
+    string name;
+    if (!ok || !read_c_str_fallible(t, entry.l_name, &name) || name.empty()) {
+      continue;
+    }
+    ss << "<library name=\"" << xml_escape(name) << "\" lm=\""
+       << HEX(lm.as_int()) << "\" l_addr=\"" << HEX(entry.l_addr)
+       << "\" l_ld=\"" << HEX(entry.l_ld) << "\"/>";
+  }
+  ss << "</library-list-svr4>";
+  return ss.str();
+}
+
+static string libraries_svr4(Task* t) {
+  RR_ARCH_FUNCTION(libraries_svr4_arch, t->arch(), t);
+}
+
+/**
+ * Open |name| read-only for the debugger. Only files backing a mapping in
+ * |session| are served, preferring |t|'s address space, so the debugger
+ * can't read arbitrary files that rr can. Mapped files that the trace
+ * preserved are served from the trace, so the debugger reads the binaries
+ * that were actually recorded even if they've since changed.
+ */
+static int open_file_for_debugger(Session& session, Task* t,
+                                  const string& name, int flags) {
+  // The File-I/O protocol's O_RDONLY is 0; we refuse everything else.
+  if (flags != 0) {
+    errno = EACCES;
+    return -1;
+  }
+  vector<AddressSpace*> vms = session.vms();
+  if (t) {
+    vms.insert(vms.begin(), t->vm().get());
+  }
+  for (AddressSpace* vm : vms) {
+    for (const auto& m : vm->maps()) {
+      if (m.recorded_map.fsname() == name) {
+        LOG(debug) << "Opening " << m.map.fsname() << " for " << name;
+        return open(m.map.fsname().c_str(), O_RDONLY | O_CLOEXEC);
+      }
+    }
+  }
+  LOG(debug) << "Refusing to open " << name << ", which isn't mapped";
+  errno = EACCES;
+  return -1;
 }
 
 template <typename Arch> static size_t word_size_arch() {
@@ -368,6 +660,45 @@ void GdbServer::dispatch_debugger_request(Session& session,
       dbg->reply_get_thread_list(tids);
       return;
     }
+    case DREQ_FILE_OPEN: {
+      Task* t = req.file().pid > 0 ? session.find_task(req.file().pid)
+                                   : session.find_task(last_query_tuid);
+      int fd = open_file_for_debugger(session, t, req.file().name,
+                                      req.file().flags);
+      int err = errno;
+      if (fd >= 0) {
+        files[fd] = ScopedFd(fd);
+      }
+      dbg->reply_open_file(fd, err);
+      return;
+    }
+    case DREQ_FILE_PREAD: {
+      auto it = files.find(req.file().fd);
+      if (it == files.end()) {
+        dbg->reply_pread_file(vector<uint8_t>(), EBADF);
+        return;
+      }
+      vector<uint8_t> data;
+      data.resize(req.file().len);
+      ssize_t nread =
+          pread(it->second, data.data(), data.size(), req.file().offset);
+      int err = nread < 0 ? errno : 0;
+      data.resize(max<ssize_t>(nread, 0));
+      dbg->reply_pread_file(data, err);
+      return;
+    }
+    case DREQ_FILE_FSTAT: {
+      struct stat st;
+      memset(&st, 0, sizeof(st));
+      auto it = files.find(req.file().fd);
+      int err = it == files.end() ? EBADF
+                                  : (fstat(it->second, &st) < 0 ? errno : 0);
+      dbg->reply_fstat_file(st, err);
+      return;
+    }
+    case DREQ_FILE_CLOSE:
+      dbg->reply_close_file(files.erase(req.file().fd) ? 0 : EBADF);
+      return;
     case DREQ_INTERRUPT: {
       Task* t = session.find_task(last_continue_tuid);
       ASSERT(t, session.is_diversion())
@@ -424,19 +755,21 @@ void GdbServer::dispatch_debugger_request(Session& session,
     dbg->notify_no_such_thread(req);
     return;
   }
+  if (req.type >= DREQ_WATCH_FIRST && req.type <= DREQ_WATCH_LAST) {
+    // A spare diversion has the old breakpoints applied.
+    discard_spare_diversion();
+  }
   switch (req.type) {
     case DREQ_GET_AUXV: {
       dbg->reply_get_auxv(target->vm()->saved_auxv());
       return;
     }
+    case DREQ_GET_LIBRARIES_SVR4:
+      dbg->reply_get_libraries_svr4(libraries_svr4(target));
+      return;
     case DREQ_GET_MEM: {
       vector<uint8_t> mem;
-      mem.resize(req.mem().len);
-      ssize_t nread = target->read_bytes_fallible(req.mem().addr, req.mem().len,
-                                                  mem.data());
-      mem.resize(max(ssize_t(0), nread));
-      target->vm()->replace_breakpoints_with_original_values(
-          mem.data(), mem.size(), req.mem().addr);
+      read_mem_for_debugger(target, req.mem().addr, req.mem().len, &mem);
       maybe_intercept_mem_request(target, req, &mem);
       dbg->reply_get_mem(mem);
       return;
@@ -463,14 +796,22 @@ void GdbServer::dispatch_debugger_request(Session& session,
       // TODO fallible
       target->write_bytes_helper(req.mem().addr, req.mem().len,
                                  req.mem().data.data());
+      invalidate_mem_cache();
       dbg->reply_set_mem(true);
       return;
     }
     case DREQ_SEARCH_MEM: {
       remote_ptr<void> addr;
-      bool found =
-          search_memory(target, MemoryRange(req.mem().addr, req.mem().len),
-                        req.mem().data, &addr);
+      bool found = false;
+      if (!req.mem().data.empty()) {
+        search_memory(target, MemoryRange(req.mem().addr, req.mem().len),
+                      { req.mem().data },
+                      [&](remote_ptr<void> match, size_t) {
+                        addr = match;
+                        found = true;
+                        return false;
+                      });
+      }
       dbg->reply_search_mem(found, addr);
       return;
     }
@@ -586,6 +927,9 @@ void GdbServer::dispatch_debugger_request(Session& session,
       dbg->reply_write_siginfo();
       return;
     case DREQ_RR_CMD:
+      // Commands can move the timeline.
+      invalidate_mem_cache();
+      discard_spare_diversion();
       dbg->reply_rr_cmd(
           GdbCommandHandler::process_command(*this, target, req.text()));
       return;
@@ -643,6 +987,7 @@ bool GdbServer::diverter_process_debugger_requests(
     *req = dbg->get_request();
 
     if (req->is_resume_request()) {
+      invalidate_mem_cache();
       return diversion_refcount > 0;
     }
 
@@ -685,6 +1030,8 @@ bool GdbServer::diverter_process_debugger_requests(
 
       case DREQ_RR_CMD: {
         assert(req->type == DREQ_RR_CMD);
+        invalidate_mem_cache();
+        discard_spare_diversion();
         Task* task = diversion_session.find_task(last_continue_tuid);
         if (task) {
           std::string reply =
@@ -793,6 +1140,40 @@ static RunCommand compute_run_command_from_actions(Task* t,
   return RUN_CONTINUE;
 }
 
+/**
+ * Return the vCont;r action gdb requested for |t|, if any.
+ */
+static const GdbContAction* range_step_action(Task* t, const GdbRequest& req) {
+  for (auto& action : req.cont().actions) {
+    if (matches_threadid(t, action.target)) {
+      return action.type == ACTION_STEP &&
+                     action.range_start < action.range_end
+                 ? &action
+                 : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Return true if a range step of |tuid| should keep going after a step that
+ * stopped with |status|: nothing else stopped it and the pc is still in the
+ * range. gdb treats stops inside the range like any other stop, so giving
+ * up early is always safe.
+ */
+static bool continue_range_step(const GdbContAction& action,
+                                const TaskUid& tuid,
+                                const BreakStatus& status) {
+  Task* t = status.task;
+  if (!t || t->tuid() != tuid || !status.singlestep_complete ||
+      status.breakpoint_hit || status.signal ||
+      !status.watchpoints_hit.empty() || status.task_exit ||
+      status.approaching_ticks_target) {
+    return false;
+  }
+  return action.range_start <= t->ip() && t->ip() < action.range_end;
+}
+
 struct AllowedTasks {
   TaskUid task; // tid 0 means 'any member of debuggee_tguid'
   RunCommand command;
@@ -836,14 +1217,24 @@ static RunCommand compute_run_command_for_reverse_exec(
 GdbRequest GdbServer::divert(ReplaySession& replay) {
   GdbRequest req;
   LOG(debug) << "Starting debugging diversion for " << &replay;
+  invalidate_mem_cache();
 
-  if (timeline.is_running()) {
-    // Ensure breakpoints and watchpoints are applied before we fork the
-    // diversion, to ensure the diversion is consistent with the timeline
-    // breakpoint/watchpoint state.
-    timeline.apply_breakpoints_and_watchpoints();
+  DiversionSession::shr_ptr diversion_session;
+  if (spare_diversion && spare_diversion_source == &replay) {
+    LOG(debug) << "  using spare diversion " << spare_diversion.get();
+    diversion_session = move(spare_diversion);
+    spare_diversion_source = nullptr;
+  } else {
+    discard_spare_diversion();
+    if (timeline.is_running()) {
+      // Ensure breakpoints and watchpoints are applied before we fork the
+      // diversion, to ensure the diversion is consistent with the timeline
+      // breakpoint/watchpoint state.
+      timeline.apply_breakpoints_and_watchpoints();
+    }
+    diversion_session = replay.clone_diversion();
   }
-  DiversionSession::shr_ptr diversion_session = replay.clone_diversion();
+  diversions_at_this_stop = true;
   uint32_t diversion_refcount = 1;
   TaskUid saved_query_tuid = last_query_tuid;
 
@@ -870,8 +1261,17 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
     int signal_to_deliver;
     RunCommand command =
         compute_run_command_from_actions(t, req, &signal_to_deliver);
+    const GdbContAction* range = range_step_action(t, req);
+    TaskUid tuid = t->tuid();
     auto result =
         diversion_session->diversion_step(t, command, signal_to_deliver);
+    if (range) {
+      while (result.status == DiversionSession::DIVERSION_CONTINUE &&
+             continue_range_step(*range, tuid, result.break_status) &&
+             !dbg->sniff_packet()) {
+        result = diversion_session->diversion_step(t, RUN_SINGLESTEP);
+      }
+    }
 
     if (result.status == DiversionSession::DIVERSION_EXITED) {
       diversion_refcount = 0;
@@ -888,17 +1288,43 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
   assert(diversion_refcount == 0);
 
   diversion_session->kill_all_tasks();
+  invalidate_mem_cache();
 
   last_query_tuid = saved_query_tuid;
   return req;
 }
 
+void GdbServer::maybe_create_spare_diversion() {
+  if (!diversions_at_this_stop || spare_diversion || !timeline.is_running() ||
+      dbg->sniff_packet()) {
+    return;
+  }
+  // gdb is busy with the result of the last request, so this doesn't
+  // delay it, unless its next request arrives while we're cloning.
+  ReplaySession& replay = timeline.current_session();
+  timeline.apply_breakpoints_and_watchpoints();
+  spare_diversion = replay.clone_diversion();
+  spare_diversion_source = &replay;
+  LOG(debug) << "Created spare diversion " << spare_diversion.get();
+}
+
+void GdbServer::discard_spare_diversion() {
+  // Destroying the session kills its tasks.
+  spare_diversion = nullptr;
+  spare_diversion_source = nullptr;
+}
+
 /**
  * Reply to debugger requests until the debugger asks us to resume
  * execution, detach, restart, or interrupt.
  */
 GdbRequest GdbServer::process_debugger_requests(ReportState state) {
+  // Execution may have changed memory since we were last called.
+  invalidate_mem_cache();
+  discard_spare_diversion();
+  diversions_at_this_stop = false;
   while (true) {
+    maybe_create_spare_diversion();
     GdbRequest req = dbg->get_request();
     req.suppress_debugger_stop = false;
     try_lazy_reverse_singlesteps(req);
@@ -926,6 +1352,7 @@ GdbRequest GdbServer::process_debugger_requests(ReportState state) {
     }
 
     if (req.is_resume_request()) {
+      discard_spare_diversion();
       Task* t = current_session().find_task(last_continue_tuid);
       if (t) {
         maybe_singlestep_for_event(t, &req);
@@ -998,6 +1425,9 @@ void GdbServer::try_lazy_reverse_singlesteps(GdbRequest& req) {
 
   if (need_seek) {
     timeline.seek_to_mark(now);
+    invalidate_mem_cache();
+    discard_spare_diversion();
+    diversions_at_this_stop = false;
   }
 }
 
@@ -1090,10 +1520,22 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
       result = ReplayResult();
     } else {
       int signal_to_deliver;
-      RunCommand command = compute_run_command_from_actions(
-          timeline.current_session().current_task(), req, &signal_to_deliver);
+      Task* t = timeline.current_session().current_task();
+      RunCommand command =
+          compute_run_command_from_actions(t, req, &signal_to_deliver);
+      const GdbContAction* range = range_step_action(t, req);
+      TaskUid tuid = t->tuid();
       // Ignore gdb's |signal_to_deliver|; we just have to follow the replay.
       result = timeline.replay_step_forward(command, target.event);
+      if (range) {
+        // Step through the range here rather than making gdb send a packet
+        // per instruction.
+        while (result.status == REPLAY_CONTINUE &&
+               continue_range_step(*range, tuid, result.break_status) &&
+               !is_in_exec(timeline) && !dbg->sniff_packet()) {
+          result = timeline.replay_step_forward(RUN_SINGLESTEP, target.event);
+        }
+      }
     }
     if (result.status == REPLAY_EXITED) {
       return handle_exited_state(last_resume_request);
@@ -1231,6 +1673,8 @@ void GdbServer::activate_debugger() {
 }
 
 void GdbServer::restart_session(const GdbRequest& req) {
+  invalidate_mem_cache();
+  discard_spare_diversion();
   assert(req.type == DREQ_RESTART);
   assert(dbg);
 
@@ -1369,6 +1813,18 @@ static unique_ptr<GdbConnection> await_connection(
   return dbg;
 }
 
+/**
+ * Like await_connection(), but for a debugger that has already connected
+ * on |sock_fd|.
+ */
+static unique_ptr<GdbConnection> adopt_connection(
+    Task* t, ScopedFd& sock_fd, const GdbConnection::Features& features) {
+  auto dbg = unique_ptr<GdbConnection>(new GdbConnection(t->tgid(), features));
+  dbg->set_cpu_features(get_cpu_features(t->arch()));
+  dbg->set_debugger_fd(std::move(sock_fd));
+  return dbg;
+}
+
 static void print_debugger_launch_command(Task* t, unsigned short port,
                                           const char* debugger_name,
                                           FILE* out) {
@@ -1382,6 +1838,27 @@ static void print_debugger_launch_command(Task* t, unsigned short port,
   fprintf(out, "%s\n", t->vm()->exe_image().c_str());
 }
 
+static ScopedFd listen_for_debugger(const GdbServer::ConnectionFlags& flags,
+                                    unsigned short* port) {
+  *port = flags.dbg_port > 0 ? flags.dbg_port : getpid();
+  // Don't probe if the user specified a port.  Explicitly
+  // selecting a port is usually done by scripts, which would
+  // presumably break if a different port were to be selected by
+  // rr (otherwise why would they specify a port in the first
+  // place).  So fail with a clearer error message.
+  auto probe = flags.dbg_port > 0 ? DONT_PROBE : PROBE_PORT;
+  return open_socket(connection_addr, port, probe);
+}
+
+/*static*/ ScopedFd GdbServer::open_debugger_socket(
+    Task* t, const ConnectionFlags& flags) {
+  unsigned short port;
+  ScopedFd listen_fd = listen_for_debugger(flags, &port);
+  fputs("Launch gdb with\n  ", stderr);
+  print_debugger_launch_command(t, port, flags.debugger_name.c_str(), stderr);
+  return listen_fd;
+}
+
 void GdbServer::serve_replay(const ConnectionFlags& flags) {
   do {
     ReplayResult result =
@@ -1392,32 +1869,32 @@ void GdbServer::serve_replay(const ConnectionFlags& flags) {
     }
   } while (!at_target());
 
-  unsigned short port = flags.dbg_port > 0 ? flags.dbg_port : getpid();
-  // Don't probe if the user specified a port.  Explicitly
-  // selecting a port is usually done by scripts, which would
-  // presumably break if a different port were to be selected by
-  // rr (otherwise why would they specify a port in the first
-  // place).  So fail with a clearer error message.
-  auto probe = flags.dbg_port > 0 ? DONT_PROBE : PROBE_PORT;
   Task* t = timeline.current_session().current_task();
-  ScopedFd listen_fd = open_socket(connection_addr, &port, probe);
-  if (flags.debugger_params_write_pipe) {
-    DebuggerParams params;
-    memset(&params, 0, sizeof(params));
-    strncpy(params.exe_image, t->vm()->exe_image().c_str(),
-            sizeof(params.exe_image) - 1);
-    params.port = port;
-
-    ssize_t nwritten =
-        write(*flags.debugger_params_write_pipe, &params, sizeof(params));
-    assert(nwritten == sizeof(params));
+  if (flags.debugger_fd) {
+    dbg = adopt_connection(t, *flags.debugger_fd, GdbConnection::Features());
+    dbg->set_detach_on_hangup();
   } else {
-    fputs("Launch gdb with\n  ", stderr);
-    print_debugger_launch_command(t, port, flags.debugger_name.c_str(), stderr);
-  }
-  dbg = await_connection(t, listen_fd, GdbConnection::Features());
-  if (flags.debugger_params_write_pipe) {
-    flags.debugger_params_write_pipe->close();
+    unsigned short port;
+    ScopedFd listen_fd = listen_for_debugger(flags, &port);
+    if (flags.debugger_params_write_pipe) {
+      DebuggerParams params;
+      memset(&params, 0, sizeof(params));
+      strncpy(params.exe_image, t->vm()->exe_image().c_str(),
+              sizeof(params.exe_image) - 1);
+      params.port = port;
+
+      ssize_t nwritten =
+          write(*flags.debugger_params_write_pipe, &params, sizeof(params));
+      assert(nwritten == sizeof(params));
+    } else {
+      fputs("Launch gdb with\n  ", stderr);
+      print_debugger_launch_command(t, port, flags.debugger_name.c_str(),
+                                    stderr);
+    }
+    dbg = await_connection(t, listen_fd, GdbConnection::Features());
+    if (flags.debugger_params_write_pipe) {
+      flags.debugger_params_write_pipe->close();
+    }
   }
   debuggee_tguid = t->task_group()->tguid();
 
@@ -3,6 +3,7 @@
 #ifndef RR_GDB_SERVER_H_
 #define RR_GDB_SERVER_H_
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -47,8 +48,15 @@ public:
     // Name of the debugger to suggest. Only used if debugger_params_write_pipe
     // is null.
     std::string debugger_name;
+    // If non-null, a debugger that has already connected. It is served
+    // instead of listening for a new one, and when it hangs up
+    // serve_replay() returns instead of exiting rr.
+    ScopedFd* debugger_fd;
 
-    ConnectionFlags() : dbg_port(-1), debugger_params_write_pipe(nullptr) {}
+    ConnectionFlags()
+        : dbg_port(-1),
+          debugger_params_write_pipe(nullptr),
+          debugger_fd(nullptr) {}
   };
 
   /**
@@ -62,7 +70,9 @@ public:
         stop_replaying_to_target(false),
         interrupt_pending(false),
         timeline(std::move(session), flags),
-        emergency_debug_session(nullptr) {
+        emergency_debug_session(nullptr),
+        spare_diversion_source(nullptr),
+        diversions_at_this_stop(false) {
     memset(&stop_siginfo, 0, sizeof(stop_siginfo));
   }
 
@@ -71,6 +81,12 @@ public:
    */
   void serve_replay(const ConnectionFlags& flags);
 
+  /**
+   * Listen for debuggers of |t|'s replay on the port selected by |flags| and
+   * print the command to launch one. Returns the listening socket.
+   */
+  static ScopedFd open_debugger_socket(Task* t, const ConnectionFlags& flags);
+
   /**
    * exec()'s gdb using parameters read from params_pipe_fd (and sent through
    * the pipe passed to serve_replay_with_debugger).
@@ -110,6 +126,16 @@ public:
 
   ReplayTimeline& get_timeline() { return timeline; }
 
+  /**
+   * Search |where| in |t|'s memory, as the debugger sees it, for each of the
+   * nonempty |patterns|. Calls |found| with the address and pattern index of
+   * each match, in increasing address order, until it returns false.
+   */
+  static void search_memory(
+      Task* t, const MemoryRange& where,
+      const std::vector<std::vector<uint8_t>>& patterns,
+      const std::function<bool(remote_ptr<void>, size_t)>& found);
+
 private:
   GdbServer(std::unique_ptr<GdbConnection>& dbg, Task* t);
 
@@ -174,6 +200,16 @@ private:
    * resuming execution in that session.
    */
   GdbRequest divert(ReplaySession& replay);
+  /**
+   * If gdb has started diversions at this stop and is idle now, clone the
+   * next diversion ahead of time so the next one starts immediately.
+   */
+  void maybe_create_spare_diversion();
+  /**
+   * Must be called whenever the replay session, or the breakpoints and
+   * watchpoints applied to it, may have changed.
+   */
+  void discard_spare_diversion();
 
   /**
    * If |break_status| indicates a stop that we should report to gdb,
@@ -182,6 +218,17 @@ private:
   void maybe_notify_stop(const GdbRequest& req,
                          const BreakStatus& break_status);
 
+  /**
+   * Read up to |len| bytes at |addr| in |t| for the debugger, with
+   * breakpoints replaced by the original data, through |mem_cache|.
+   */
+  void read_mem_for_debugger(Task* t, remote_ptr<void> addr, size_t len,
+                             std::vector<uint8_t>* result);
+  /**
+   * Must be called whenever tracee memory may have changed.
+   */
+  void invalidate_mem_cache() { mem_cache.clear(); }
+
   /**
    * Return the checkpoint stored as |checkpoint_id| or nullptr if there
    * isn't one.
@@ -217,6 +264,14 @@ private:
 
   ReplayTimeline timeline;
   Session* emergency_debug_session;
+  // A diversion cloned from |spare_diversion_source| at the current stop,
+  // ready for the next inferior call. Declared after |timeline| so it's
+  // destroyed first.
+  DiversionSession::shr_ptr spare_diversion;
+  ReplaySession* spare_diversion_source;
+  // True when gdb has diverted since the replay last stopped. gdb tends to
+  // make many inferior calls at a stop (e.g. pretty-printers).
+  bool diversions_at_this_stop;
 
   struct Checkpoint {
     enum Explicit { EXPLICIT, NOT_EXPLICIT };
@@ -242,6 +297,16 @@ private:
   // gdb checkpoints, indexed by ID
   std::map<int, Checkpoint> checkpoints;
 
+  // Pages of tracee memory read by the debugger since tracees last ran,
+  // with breakpoints replaced by the original data. A page shorter than
+  // page_size() was only partly readable. gdb makes lots of small reads
+  // at each stop (unwinding, pretty-printers).
+  std::map<std::pair<AddressSpace*, remote_ptr<void>>, std::vector<uint8_t>>
+      mem_cache;
+
+  // Files opened by the debugger through vFile:open, indexed by fd.
+  std::map<int, ScopedFd> files;
+
   // Set of symbols to look up, for qSymbol.
   std::set<std::string> symbols;
   // Iterator into |symbols|.
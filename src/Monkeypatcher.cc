@@ -7,12 +7,14 @@
 #include "AddressSpace.h"
 #include "AutoRemoteSyscalls.h"
 #include "ElfReader.h"
+#include "RecordSession.h"
 #include "RecordTask.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "x86_decoder.h"
 
 using namespace std;
 
@@ -118,6 +120,7 @@ void Monkeypatcher::init_dynamic_syscall_patching(
 
 template <typename Arch>
 static bool patch_syscall_with_hook_arch(Monkeypatcher& patcher, RecordTask* t,
+                                         remote_ptr<uint8_t> syscall_start,
                                          const syscall_patch_hook& hook);
 
 template <typename StubPatch>
@@ -151,21 +154,17 @@ void substitute_extended_jump<X64SyscallStubExtendedJump>(
 }
 
 /**
- * Allocate an extended jump in an extended jump page and return its address.
- * The resulting address must be within 2G of from_end, and the instruction
- * there must jump to to_start.
+ * Allocate |size| bytes in an extended jump page and return their address.
+ * The resulting address must be within 2G of from_end.
  */
-template <typename ExtendedJumpPatch>
-static remote_ptr<uint8_t> allocate_extended_jump(
+static remote_ptr<uint8_t> allocate_extended_jump_space(
     RecordTask* t, vector<Monkeypatcher::ExtendedJumpPage>& pages,
-    remote_ptr<uint8_t> from_end, remote_code_ptr return_addr,
-    remote_code_ptr target_addr) {
+    remote_ptr<uint8_t> from_end, size_t size) {
   Monkeypatcher::ExtendedJumpPage* page = nullptr;
   for (auto& p : pages) {
     remote_ptr<uint8_t> page_jump_start = p.addr + p.allocated;
     int64_t offset = page_jump_start - from_end;
-    if ((int32_t)offset == offset &&
-        p.allocated + ExtendedJumpPatch::size <= page_size()) {
+    if ((int32_t)offset == offset && p.allocated + size <= page_size()) {
       page = &p;
       break;
     }
@@ -207,13 +206,49 @@ static remote_ptr<uint8_t> allocate_extended_jump(
     page = &pages.back();
   }
 
+  remote_ptr<uint8_t> result = page->addr + page->allocated;
+  page->allocated += size;
+  return result;
+}
+
+/**
+ * Return the |size| bytes at |start| most recently allocated by
+ * allocate_extended_jump_space, when they turn out not to be needed. A page
+ * it mapped stays mapped and empty for later patches to use.
+ */
+static void release_extended_jump_space(
+    vector<Monkeypatcher::ExtendedJumpPage>& pages, remote_ptr<uint8_t> start,
+    size_t size) {
+  for (auto& p : pages) {
+    if (p.addr + p.allocated == start + size) {
+      p.allocated -= size;
+      return;
+    }
+  }
+  assert(false && "Not the last extended jump allocation");
+}
+
+/**
+ * Allocate an extended jump in an extended jump page and return its address.
+ * The resulting address must be within 2G of from_end, and the instruction
+ * there must jump to to_start.
+ */
+template <typename ExtendedJumpPatch>
+static remote_ptr<uint8_t> allocate_extended_jump(
+    RecordTask* t, vector<Monkeypatcher::ExtendedJumpPage>& pages,
+    remote_ptr<uint8_t> from_end, remote_code_ptr return_addr,
+    remote_code_ptr target_addr) {
+  remote_ptr<uint8_t> jump_addr = allocate_extended_jump_space(
+      t, pages, from_end, ExtendedJumpPatch::size);
+  if (jump_addr.is_null()) {
+    return nullptr;
+  }
+
   uint8_t jump_patch[ExtendedJumpPatch::size];
-  remote_ptr<uint8_t> jump_addr = page->addr + page->allocated;
   substitute_extended_jump<ExtendedJumpPatch>(jump_patch, jump_addr.as_int(),
                                               return_addr.register_value(),
                                               target_addr.register_value());
   write_and_record_bytes(t, jump_addr, jump_patch);
-  page->allocated += sizeof(jump_patch);
   return jump_addr;
 }
 
@@ -222,6 +257,13 @@ bool Monkeypatcher::is_jump_stub_instruction(remote_code_ptr ip) {
   for (auto& p : extended_jump_pages) {
     if (p.addr <= pp.cast<uint8_t>() &&
         pp.cast<uint8_t>() < p.addr + p.allocated) {
+      // Relocated instructions are the tracee's own code, just running
+      // somewhere else.
+      for (auto& r : relocated_instruction_ranges) {
+        if (r.contains(pp)) {
+          return false;
+        }
+      }
       return true;
     }
   }
@@ -252,11 +294,12 @@ bool Monkeypatcher::is_jump_stub_instruction(remote_code_ptr ip) {
 template <typename JumpPatch, typename ExtendedJumpPatch>
 static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
                                            RecordTask* t,
+                                           remote_ptr<uint8_t> syscall_start,
                                            const syscall_patch_hook& hook) {
   uint8_t jump_patch[JumpPatch::size];
   // We're patching in a relative jump, so we need to compute the offset from
   // the end of the jump to our actual destination.
-  auto jump_patch_start = t->regs().ip().to_data_ptr<uint8_t>();
+  auto jump_patch_start = syscall_start;
   auto jump_patch_end = jump_patch_start + sizeof(jump_patch);
 
   remote_ptr<uint8_t> extended_jump_start =
@@ -291,24 +334,205 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
 template <>
 bool patch_syscall_with_hook_arch<X86Arch>(Monkeypatcher& patcher,
                                            RecordTask* t,
+                                           remote_ptr<uint8_t> syscall_start,
                                            const syscall_patch_hook& hook) {
   return patch_syscall_with_hook_x86ish<X86SysenterVsyscallSyscallHook,
-                                        X86SyscallStubExtendedJump>(patcher, t,
-                                                                    hook);
+                                        X86SyscallStubExtendedJump>(
+      patcher, t, syscall_start, hook);
 }
 
 template <>
 bool patch_syscall_with_hook_arch<X64Arch>(Monkeypatcher& patcher,
                                            RecordTask* t,
+                                           remote_ptr<uint8_t> syscall_start,
                                            const syscall_patch_hook& hook) {
   return patch_syscall_with_hook_x86ish<X64JumpMonkeypatch,
-                                        X64SyscallStubExtendedJump>(patcher, t,
-                                                                    hook);
+                                        X64SyscallStubExtendedJump>(
+      patcher, t, syscall_start, hook);
 }
 
 static bool patch_syscall_with_hook(Monkeypatcher& patcher, RecordTask* t,
+                                    remote_ptr<uint8_t> syscall_start,
                                     const syscall_patch_hook& hook) {
-  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t, hook);
+  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t,
+                   syscall_start, hook);
+}
+
+template <>
+void substitute_extended_jump<X64RdtscStubExtendedJump>(
+    uint8_t* buffer, uint64_t, uint64_t return_addr, uint64_t target_addr) {
+  X64RdtscStubExtendedJump::substitute(buffer, (uint32_t)return_addr,
+                                       (uint32_t)(return_addr >> 32),
+                                       target_addr);
+}
+
+/**
+ * Patch the |instruction_length|-byte instruction at |patch_start| (and the
+ * following instructions overwritten by the jump) to jump to an
+ * ExtendedJumpPatch stub that calls |hook_address|. The |relocated_length|
+ * bytes of whole instructions following the patched instruction are copied
+ * into the extended jump page after the stub and the |return_length| bytes
+ * of |return_bytes|, with RIP-relative operands adjusted. |hook_address|
+ * returns to |return_bytes| (or straight to the relocated instructions),
+ * which are followed by a jump back to the first instruction after the
+ * patched region.
+ * Returns the address of the relocated instructions, or null on failure.
+ */
+template <typename ExtendedJumpPatch>
+static remote_ptr<uint8_t> patch_with_relocation_x64(
+    Monkeypatcher& patcher, RecordTask* t, remote_ptr<uint8_t> patch_start,
+    size_t instruction_length, remote_code_ptr hook_address,
+    const uint8_t* return_bytes, size_t return_length,
+    const uint8_t* following_bytes, size_t relocated_length) {
+  uint8_t jump_patch[X64JumpMonkeypatch::size];
+  auto jump_patch_end = patch_start + sizeof(jump_patch);
+  auto patched_end = patch_start + instruction_length + relocated_length;
+
+  uint8_t jump_back[X64JumpMonkeypatch::size];
+  remote_ptr<uint8_t> extended_jump_start = allocate_extended_jump_space(
+      t, patcher.extended_jump_pages, jump_patch_end,
+      ExtendedJumpPatch::size + return_length + relocated_length +
+          sizeof(jump_back));
+  if (extended_jump_start.is_null()) {
+    return nullptr;
+  }
+  remote_ptr<uint8_t> return_start =
+      extended_jump_start + ExtendedJumpPatch::size;
+  remote_ptr<uint8_t> relocated_start = return_start + return_length;
+  remote_ptr<uint8_t> jump_back_end =
+      relocated_start + relocated_length + sizeof(jump_back);
+  int64_t jump_back_offset = patched_end - jump_back_end;
+  if ((int32_t)jump_back_offset != jump_back_offset) {
+    LOG(debug) << "Can't jump back from relocated instructions";
+    release_extended_jump_space(patcher.extended_jump_pages,
+                                extended_jump_start,
+                                jump_back_end - extended_jump_start);
+    return nullptr;
+  }
+
+  vector<uint8_t> relocated(relocated_length);
+  if (!relocate_x86_64_instructions(
+          following_bytes, relocated_length,
+          (patch_start + instruction_length).as_int(),
+          relocated_start.as_int(), relocated.data())) {
+    LOG(debug) << "Failed to relocate instructions to " << relocated_start;
+    release_extended_jump_space(patcher.extended_jump_pages,
+                                extended_jump_start,
+                                jump_back_end - extended_jump_start);
+    return nullptr;
+  }
+
+  uint8_t stub[ExtendedJumpPatch::size];
+  substitute_extended_jump<ExtendedJumpPatch>(
+      stub, extended_jump_start.as_int(), return_start.as_int(),
+      hook_address.register_value());
+  write_and_record_bytes(t, extended_jump_start, stub);
+  if (return_length) {
+    write_and_record_bytes(t, return_start, return_length, return_bytes);
+  }
+  write_and_record_bytes(t, relocated_start, relocated.size(),
+                         relocated.data());
+  X64JumpMonkeypatch::substitute(jump_back, (uint32_t)jump_back_offset);
+  write_and_record_bytes(t, relocated_start + relocated_length, jump_back);
+  patcher.relocated_instruction_ranges.push_back(
+      MemoryRange(relocated_start, jump_back_end));
+
+  intptr_t jump_offset = extended_jump_start - jump_patch_end;
+  int32_t jump_offset32 = (int32_t)jump_offset;
+  ASSERT(t, jump_offset32 == jump_offset)
+      << "allocate_extended_jump_space didn't work";
+  X64JumpMonkeypatch::substitute(jump_patch, jump_offset32);
+  write_and_record_bytes(t, patch_start, jump_patch);
+
+  // pad with NOPs to the next instruction
+  static const uint8_t NOP = 0x90;
+  vector<uint8_t> nops(patched_end - jump_patch_end, NOP);
+  write_and_record_bytes(t, jump_patch_end, nops.size(), nops.data());
+  return relocated_start;
+}
+
+/**
+ * Patch a syscall whose following instructions don't match any of the
+ * hooks in the preload library. |hook| must do nothing but the syscall.
+ */
+static bool patch_syscall_with_relocation_x64(Monkeypatcher& patcher,
+                                              RecordTask* t,
+                                              remote_ptr<uint8_t> syscall_start,
+                                              const syscall_patch_hook& hook,
+                                              const uint8_t* following_bytes,
+                                              size_t relocated_length) {
+  return !patch_with_relocation_x64<X64SyscallStubExtendedJump>(
+              patcher, t, syscall_start,
+              syscall_instruction_length(x86_64), hook.hook_address, nullptr,
+              0, following_bytes, relocated_length)
+              .is_null();
+}
+
+/**
+ * Search for a following short-jump instruction that targets an offset in
+ * [0, end) after the syscall. False positives are OK.
+ * glibc-2.23.1-8.fc24.x86_64's __clock_nanosleep needs this.
+ */
+static bool has_potential_interfering_branch(remote_ptr<uint8_t> following_start,
+                                             const uint8_t* following_bytes,
+                                             size_t bytes_count, int end) {
+  bool found_potential_interfering_branch = false;
+  for (size_t i = 0; i + 2 <= bytes_count; ++i) {
+    uint8_t b = following_bytes[i];
+    // Check for short conditional or unconditional jump
+    if (b == 0xeb || (b >= 0x70 && b < 0x80)) {
+      int offset = i + 2 + (int8_t)following_bytes[i + 1];
+      if (offset >= 0 && offset < end) {
+        LOG(debug) << "Found potential interfering branch at "
+                   << following_start + i;
+        // We can't patch this because it would jump straight back into
+        // the middle of our patch code.
+        found_potential_interfering_branch = true;
+      }
+    }
+  }
+  return found_potential_interfering_branch;
+}
+
+/**
+ * Returns the number of bytes of whole instructions following an
+ * |instruction_length|-byte instruction that we'd need to relocate to make
+ * room for a jump over that instruction, or 0 if those instructions can't be
+ * relocated.
+ */
+static size_t relocatable_length_after(const uint8_t* following_bytes,
+                                       size_t bytes_count,
+                                       size_t instruction_length) {
+  size_t needed = X64JumpMonkeypatch::size - instruction_length;
+  size_t length = 0;
+  while (length < needed) {
+    X86Instruction insn;
+    if (!decode_x86_64_instruction(following_bytes + length,
+                                   bytes_count - length, &insn) ||
+        insn.is_control_flow || insn.is_special) {
+      return 0;
+    }
+    length += insn.length;
+  }
+  return length;
+}
+
+/**
+ * Patch the syscall instruction at |syscall_start| using |hook|, relocating
+ * the |relocated_length| bytes of instructions after it if that's nonzero
+ * (see Monkeypatcher::find_syscall_hook).
+ */
+static bool patch_syscall_at(Monkeypatcher& patcher, RecordTask* t,
+                             remote_ptr<uint8_t> syscall_start,
+                             const syscall_patch_hook& hook,
+                             const uint8_t* following_bytes,
+                             size_t relocated_length) {
+  if (relocated_length) {
+    return patch_syscall_with_relocation_x64(patcher, t, syscall_start, hook,
+                                             following_bytes,
+                                             relocated_length);
+  }
+  return patch_syscall_with_hook(patcher, t, syscall_start, hook);
 }
 
 static string bytes_to_string(uint8_t* bytes, size_t size) {
@@ -372,57 +596,233 @@ bool Monkeypatcher::try_patch_syscall(RecordTask* t) {
     return false;
   }
 
+  RecordSession::SyscallPatchStatistics& stats =
+      t->session().syscall_patch_statistics();
+  ++stats.sites_tried;
+
   intptr_t syscallno = r.original_syscallno();
+  size_t relocated_length;
+  const syscall_patch_hook* hook =
+      find_syscall_hook(t->arch(), r.ip().to_data_ptr<uint8_t>(),
+                        following_bytes, bytes_count, &relocated_length);
+  if (!hook) {
+    LOG(debug) << "Failed to patch syscall at " << r.ip() << " syscall "
+               << syscall_name(syscallno, t->arch()) << " tid " << t->tid
+               << " bytes "
+               << bytes_to_string(
+                      following_bytes,
+                      sizeof(syscall_patch_hook::next_instruction_bytes))
+               << "; " << stats.patched() << "/" << stats.sites_tried
+               << " sites patched";
+    return false;
+  }
+
+  // Get out of executing the current syscall before we patch it.
+  t->exit_syscall_and_prepare_restart();
+
+  remote_ptr<uint8_t> syscall_start = t->regs().ip().to_data_ptr<uint8_t>();
+  if (patch_syscall_at(*this, t, syscall_start, *hook, following_bytes,
+                       relocated_length)) {
+    if (relocated_length) {
+      ++stats.patched_with_relocation;
+    } else {
+      ++stats.patched_with_hook;
+    }
+    LOG(debug) << "Patched syscall at " << r.ip() << " syscall "
+               << syscall_name(syscallno, t->arch()) << " tid " << t->tid
+               << (relocated_length ? " by relocating " : " bytes ")
+               << bytes_to_string(
+                      following_bytes,
+                      relocated_length
+                          ? relocated_length
+                          : sizeof(syscall_patch_hook::next_instruction_bytes))
+               << "; " << stats.patched() << "/" << stats.sites_tried
+               << " sites patched";
+    note_patched_syscall(t, syscall_start);
+  }
+  // Either way the syscall will be restarted; if patching failed it
+  // will just be processed as normal.
+  return true;
+}
+
+const syscall_patch_hook* Monkeypatcher::find_syscall_hook(
+    SupportedArch arch, remote_ptr<uint8_t> following_start,
+    const uint8_t* following_bytes, size_t bytes_count,
+    size_t* relocated_length) {
+  *relocated_length = 0;
   for (auto& hook : syscall_hooks) {
     if (memcmp(following_bytes, hook.next_instruction_bytes,
-               hook.next_instruction_length) == 0) {
-      // Search for a following short-jump instruction that targets an
-      // instruction
-      // after the syscall. False positives are OK.
-      // glibc-2.23.1-8.fc24.x86_64's __clock_nanosleep needs this.
-      bool found_potential_interfering_branch = false;
-      for (size_t i = 0; i + 2 <= bytes_count; ++i) {
-        uint8_t b = following_bytes[i];
-        // Check for short conditional or unconditional jump
-        if (b == 0xeb || (b >= 0x70 && b < 0x80)) {
-          int offset = i + 2 + (int8_t)following_bytes[i + 1];
-          if (hook.is_multi_instruction
-                  ? (offset >= 0 && offset < hook.next_instruction_length)
-                  : offset == 0) {
-            LOG(debug) << "Found potential interfering branch at "
-                       << r.ip().to_data_ptr<uint8_t>() + i;
-            // We can't patch this because it would jump straight back into
-            // the middle of our patch code.
-            found_potential_interfering_branch = true;
-          }
-        }
-      }
+               hook.next_instruction_length) == 0 &&
+        !has_potential_interfering_branch(
+            following_start, following_bytes, bytes_count,
+            hook.is_multi_instruction ? hook.next_instruction_length : 1)) {
+      return &hook;
+    }
+  }
 
-      if (!found_potential_interfering_branch) {
-        LOG(debug) << "Patched syscall at " << r.ip() << " syscall "
-                   << syscall_name(syscallno, t->arch()) << " tid " << t->tid
-                   << " bytes "
-                   << bytes_to_string(
-                          following_bytes,
-                          sizeof(syscall_patch_hook::next_instruction_bytes));
+  if (arch == x86_64) {
+    const syscall_patch_hook* hook = find_plain_syscall_hook();
+    size_t length = relocatable_length_after(
+        following_bytes, bytes_count, syscall_instruction_length(x86_64));
+    if (hook && length &&
+        !has_potential_interfering_branch(following_start, following_bytes,
+                                          bytes_count, length)) {
+      *relocated_length = length;
+      return hook;
+    }
+  }
+  return nullptr;
+}
 
-        // Get out of executing the current syscall before we patch it.
-        t->exit_syscall_and_prepare_restart();
+void Monkeypatcher::note_patched_syscall(RecordTask* t,
+                                         remote_ptr<uint8_t> syscall_start) {
+  const KernelMapping& km = t->vm()->mapping_of(syscall_start).map;
+  SyscallPatchCache& cache = t->session().syscall_patch_cache();
+  string build_id = cache.build_id(km);
+  if (!build_id.empty()) {
+    cache.add(build_id, syscall_start.as_int() - km.start().as_int() +
+                            km.file_offset_bytes());
+  }
+}
 
-        patch_syscall_with_hook(*this, t, hook);
+void Monkeypatcher::patch_cached_syscalls(RecordTask* t,
+                                          const KernelMapping& km) {
+  if (syscall_hooks.empty() || t->emulated_ptracer ||
+      !(km.prot() & PROT_EXEC)) {
+    return;
+  }
+  SyscallPatchCache& cache = t->session().syscall_patch_cache();
+  string build_id = cache.build_id(km);
+  if (build_id.empty()) {
+    return;
+  }
+
+  RecordSession::SyscallPatchStatistics& stats =
+      t->session().syscall_patch_statistics();
+  for (uint64_t offset : cache.patched_offsets(build_id)) {
+    if (offset < km.file_offset_bytes() ||
+        offset >= km.file_offset_bytes() + km.size()) {
+      continue;
+    }
+    remote_ptr<uint8_t> syscall_start =
+        km.start().cast<uint8_t>() + (offset - km.file_offset_bytes());
+    remote_code_ptr following_start = remote_code_ptr(syscall_start.as_int())
+        .increment_by_syscall_insn_length(t->arch());
+    if (tried_to_patch_syscall_addresses.count(following_start)) {
+      continue;
+    }
+    SupportedArch syscall_arch;
+    if (!get_syscall_instruction_arch(t, syscall_start.as_int(),
+                                      &syscall_arch) ||
+        syscall_arch != t->arch()) {
+      continue;
+    }
+    uint8_t following_bytes[256];
+    size_t bytes_count = t->read_bytes_fallible(
+        following_start.to_data_ptr<uint8_t>(), sizeof(following_bytes),
+        following_bytes);
+    if (bytes_count < sizeof(syscall_patch_hook::next_instruction_bytes)) {
+      continue;
+    }
+    size_t relocated_length;
+    const syscall_patch_hook* hook = find_syscall_hook(
+        t->arch(), following_start.to_data_ptr<uint8_t>(), following_bytes,
+        bytes_count, &relocated_length);
+    if (!hook) {
+      continue;
+    }
+    tried_to_patch_syscall_addresses.insert(following_start);
+    if (patch_syscall_at(*this, t, syscall_start, *hook, following_bytes,
+                         relocated_length)) {
+      ++stats.patched_from_cache;
+    }
+  }
+  LOG(debug) << "Applied cached syscall patches to " << km.fsname() << "; "
+             << stats.patched_from_cache << " sites patched from cache";
+}
 
-        // Return to caller, which resume normal execution.
-        return true;
+const syscall_patch_hook* Monkeypatcher::find_plain_syscall_hook() {
+  // The hook for "syscall; nop; nop; nop" performs the syscall and then
+  // returns straight to the stub's return address.
+  for (auto& hook : syscall_hooks) {
+    if (hook.next_instruction_length == 0) {
+      continue;
+    }
+    bool all_nops = true;
+    for (size_t i = 0; i < hook.next_instruction_length; ++i) {
+      if (hook.next_instruction_bytes[i] != 0x90) {
+        all_nops = false;
       }
     }
+    if (all_nops) {
+      return &hook;
+    }
   }
-  LOG(debug) << "Failed to patch syscall at " << r.ip() << " syscall "
-             << syscall_name(syscallno, t->arch()) << " tid " << t->tid
-             << " bytes "
-             << bytes_to_string(
-                    following_bytes,
-                    sizeof(syscall_patch_hook::next_instruction_bytes));
-  return false;
+  return nullptr;
+}
+
+/**
+ * Patch an rdtsc instruction once it has trapped this many times. Most rdtsc
+ * instructions execute only a handful of times, and each patch costs some
+ * extended jump page space.
+ */
+static const uint32_t RDTSC_PATCH_THRESHOLD = 8;
+
+remote_code_ptr Monkeypatcher::try_patch_rdtsc(RecordTask* t) {
+  if (rdtsc_hook.is_null() || t->arch() != x86_64) {
+    return nullptr;
+  }
+  if (t->emulated_ptracer) {
+    // See try_patch_syscall.
+    return nullptr;
+  }
+  if (t->is_in_syscallbuf()) {
+    // The syscallbuf code executes a real rdtsc when it can't buffer one.
+    return nullptr;
+  }
+
+  remote_code_ptr ip = t->ip();
+  if (tried_to_patch_rdtsc_addresses.count(ip)) {
+    return nullptr;
+  }
+  if (++rdtsc_trap_counts[ip] < RDTSC_PATCH_THRESHOLD) {
+    return nullptr;
+  }
+  rdtsc_trap_counts.erase(ip);
+  tried_to_patch_rdtsc_addresses.insert(ip);
+
+  static const size_t rdtsc_instruction_length = 2;
+  uint8_t following_bytes[256];
+  size_t bytes_count = t->read_bytes_fallible(
+      ip.to_data_ptr<uint8_t>() + rdtsc_instruction_length,
+      sizeof(following_bytes), following_bytes);
+  size_t relocated_length = relocatable_length_after(
+      following_bytes, bytes_count, rdtsc_instruction_length);
+  if (!relocated_length ||
+      has_potential_interfering_branch(ip.to_data_ptr<uint8_t>() +
+                                           rdtsc_instruction_length,
+                                       following_bytes, bytes_count,
+                                       relocated_length)) {
+    LOG(debug) << "Failed to patch rdtsc at " << ip << " bytes "
+               << bytes_to_string(following_bytes, min<size_t>(bytes_count, 8));
+    return nullptr;
+  }
+
+  uint8_t return_bytes[X64RdtscStubExtendedJumpReturn::size];
+  X64RdtscStubExtendedJumpReturn::substitute(return_bytes);
+  remote_ptr<uint8_t> relocated_start =
+      patch_with_relocation_x64<X64RdtscStubExtendedJump>(
+          *this, t, ip.to_data_ptr<uint8_t>(), rdtsc_instruction_length,
+          rdtsc_hook, return_bytes, sizeof(return_bytes), following_bytes,
+          relocated_length);
+  if (relocated_start.is_null()) {
+    return nullptr;
+  }
+  LOG(debug) << "Patched rdtsc at " << ip << " tid " << t->tid
+             << " by relocating "
+             << bytes_to_string(following_bytes, relocated_length);
+  ++t->session().syscall_patch_statistics().rdtsc_sites_patched;
+  return relocated_start.as_int();
 }
 
 class VdsoReader : public ElfReader {
@@ -686,6 +1086,7 @@ void patch_at_preload_init_arch<X64Arch>(RecordTask* t,
 
   patcher.init_dynamic_syscall_patching(t, params.syscall_patch_hook_count,
                                         params.syscall_patch_hooks);
+  patcher.rdtsc_hook = params.rdtsc_hook.rptr().as_int();
 }
 
 void Monkeypatcher::patch_after_exec(RecordTask* t) {
@@ -703,6 +1104,16 @@ void Monkeypatcher::patch_at_preload_init(RecordTask* t) {
   // we're processing the rrcall, because it's masked off all
   // signals.
   RR_ARCH_FUNCTION(patch_at_preload_init_arch, t->arch(), t, *this);
+
+  // Patching maps extended jump pages, so don't iterate over the maps
+  // while doing it.
+  vector<KernelMapping> mappings;
+  for (const auto& m : t->vm()->maps()) {
+    mappings.push_back(m.map);
+  }
+  for (auto& km : mappings) {
+    patch_cached_syscalls(t, km);
+  }
 }
 
 static void set_and_record_bytes(RecordTask* t, uint64_t file_offset,
@@ -756,6 +1167,8 @@ void Monkeypatcher::patch_after_mmap(RecordTask* t, remote_ptr<void> start,
       }
     }
   }
+
+  patch_cached_syscalls(t, map.map);
 }
 
 } // namespace rr
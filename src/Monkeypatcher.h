@@ -3,16 +3,20 @@
 #ifndef RR_MONKEYPATCHER_H_
 #define RR_MONKEYPATCHER_H_
 
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "preload/preload_interface.h"
 
+#include "MemoryRange.h"
+#include "kernel_abi.h"
 #include "remote_code_ptr.h"
 #include "remote_ptr.h"
 
 namespace rr {
 
+class KernelMapping;
 class RecordTask;
 class ScopedFd;
 class Task;
@@ -30,7 +34,13 @@ class Task;
  * our syscall hook in the preload library (x86 only).
  *
  * 3) Patch syscall instructions whose following instructions match a known
- * pattern to call the syscall hook.
+ * pattern to call the syscall hook. On x86-64, syscall instructions followed
+ * by other relocatable instructions are patched by moving those instructions
+ * into the extended jump stub.
+ *
+ * 4) Patch frequently executed rdtsc instructions to call a hook in the
+ * preload library that records the result in the syscall buffer, so they
+ * no longer trap to rr (x86-64 only).
  *
  * Monkeypatcher only runs during recording, never replay.
  */
@@ -63,6 +73,25 @@ public:
    */
   bool try_patch_syscall(RecordTask* t);
 
+  /**
+   * Eagerly patch the syscall instructions in the executable file mapping
+   * |km| that the SyscallPatchCache says were patched in earlier recordings
+   * of the same binary. Does nothing before the preload library has been
+   * initialized.
+   */
+  void patch_cached_syscalls(RecordTask* t, const KernelMapping& km);
+
+  /**
+   * |t| just trapped on an rdtsc instruction, which rr is emulating. If the
+   * instruction has trapped often enough, try to patch it to call the
+   * preload library's rdtsc hook. Returns null if it wasn't patched.
+   * Otherwise returns the address of the relocated copy of the instructions
+   * following the rdtsc, where execution must resume instead of after the
+   * rdtsc (which has been overwritten). Mapping operations and memory
+   * writes are recorded to the trace and must be replayed.
+   */
+  remote_code_ptr try_patch_rdtsc(RecordTask* t);
+
   void init_dynamic_syscall_patching(
       RecordTask* t, int syscall_patch_hook_count,
       remote_ptr<syscall_patch_hook> syscall_patch_hooks);
@@ -75,12 +104,16 @@ public:
 
   /**
    * Apply any necessary patching immediately after an mmap. We use this to
-   * patch libpthread.so.
+   * patch libpthread.so and to apply cached syscall patches.
    */
   void patch_after_mmap(RecordTask* t, remote_ptr<void> start, size_t size,
                         size_t offset_pages, int child_fd);
 
   remote_ptr<void> x86_sysenter_vsyscall;
+  /**
+   * The preload library's hook for patched rdtsc instructions, if any.
+   */
+  remote_code_ptr rdtsc_hook;
   /**
    * The list of pages we've allocated to hold our extended jumps.
    */
@@ -90,10 +123,36 @@ public:
     size_t allocated;
   };
   std::vector<ExtendedJumpPage> extended_jump_pages;
+  /**
+   * Ranges within extended_jump_pages holding instructions relocated from
+   * after a patched syscall (plus the jump back to the original code).
+   * These are not part of the syscallbuf code.
+   */
+  std::vector<MemoryRange> relocated_instruction_ranges;
 
   bool is_jump_stub_instruction(remote_code_ptr p);
 
 private:
+  /**
+   * Returns the hook that performs the syscall and nothing else, if any.
+   */
+  const syscall_patch_hook* find_plain_syscall_hook();
+  /**
+   * Returns the hook to use to patch a syscall instruction followed by the
+   * |bytes_count| bytes |following_bytes|, which are at |following_start|,
+   * or null if it can't be patched. If the hook is only usable by relocating
+   * the instructions after the syscall, sets |*relocated_length| to their
+   * length, otherwise sets it to zero.
+   */
+  const syscall_patch_hook* find_syscall_hook(
+      SupportedArch arch, remote_ptr<uint8_t> following_start,
+      const uint8_t* following_bytes, size_t bytes_count,
+      size_t* relocated_length);
+  /**
+   * Record a successfully patched syscall in the SyscallPatchCache.
+   */
+  void note_patched_syscall(RecordTask* t, remote_ptr<uint8_t> syscall_start);
+
   /**
    * The list of supported syscall patches obtained from the preload
    * library. Each one matches a specific byte signature for the instruction(s)
@@ -105,6 +164,14 @@ private:
    * (or are currently trying) to patch.
    */
   std::unordered_set<remote_code_ptr> tried_to_patch_syscall_addresses;
+  /**
+   * How many times each not-yet-patched rdtsc instruction has trapped.
+   */
+  std::unordered_map<remote_code_ptr, uint32_t> rdtsc_trap_counts;
+  /**
+   * The addresses of rdtsc instructions we've tried to patch.
+   */
+  std::unordered_set<remote_code_ptr> tried_to_patch_rdtsc_addresses;
 };
 
 } // namespace rr
@@ -0,0 +1,115 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <set>
+
+#include "AddressSpace.h"
+#include "BlobStore.h"
+#include "Command.h"
+#include "ScopedFd.h"
+#include "TraceStream.h"
+#include "main.h"
+
+using namespace std;
+
+namespace rr {
+
+class PackCommand : public Command {
+public:
+  virtual int run(vector<string>& args);
+
+protected:
+  PackCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static PackCommand singleton;
+};
+
+PackCommand PackCommand::singleton(
+    "pack",
+    " rr pack [<trace_dir>]\n"
+    "  Copy the mmapped files that the trace refers to in the blob store\n"
+    "  shared by all traces into the trace directory, so the trace can be\n"
+    "  moved to another directory or machine.\n");
+
+static bool copy_file(const string& from, const string& to) {
+  ScopedFd src(from.c_str(), O_RDONLY);
+  if (!src.is_open()) {
+    return false;
+  }
+  string tmp = to + ".tmp";
+  ScopedFd dest(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR);
+  if (!dest.is_open()) {
+    return false;
+  }
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t nread = read(src, buf, sizeof(buf));
+    if (nread < 0) {
+      unlink(tmp.c_str());
+      return false;
+    }
+    if (nread == 0) {
+      break;
+    }
+    ssize_t offset = 0;
+    while (offset < nread) {
+      ssize_t nwritten = write(dest, buf + offset, nread - offset);
+      if (nwritten <= 0) {
+        unlink(tmp.c_str());
+        return false;
+      }
+      offset += nwritten;
+    }
+  }
+  return rename(tmp.c_str(), to.c_str()) == 0;
+}
+
+static int pack(const string& trace_dir) {
+  TraceReader trace(trace_dir);
+  set<string> packed;
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    trace.read_mapped_region(&data, &found, TraceReader::DONT_VALIDATE,
+                             TraceReader::ANY_TIME);
+    if (!found) {
+      break;
+    }
+    if (data.blob_name.empty() || !packed.insert(data.blob_name).second) {
+      continue;
+    }
+    string dest =
+        trace.dir() + "/" + BlobStore::trace_file_name(data.blob_name);
+    if (data.file_name == dest) {
+      // Already packed.
+      continue;
+    }
+    // A hardlink is enough to make the trace independent of the store, and
+    // copying the trace directory elsewhere will copy the data.
+    if (link(data.file_name.c_str(), dest.c_str()) < 0 &&
+        !copy_file(data.file_name, dest)) {
+      fprintf(stderr, "rr: Failed to copy %s to %s\n", data.file_name.c_str(),
+              dest.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int PackCommand::run(vector<string>& args) {
+  while (parse_global_option(args)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return pack(trace_dir);
+}
+
+} // namespace rr
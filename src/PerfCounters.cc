@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <linux/perf_event.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +18,7 @@
 
 #include <algorithm>
 #include <string>
+#include <vector>
 
 #include "Flags.h"
 #include "kernel_metadata.h"
@@ -369,6 +371,132 @@ static void make_counter_async(ScopedFd& fd, int signal) {
   }
 }
 
+// Used when we can't measure the skid. Large enough for every CPU we've
+// seen.
+static const Ticks DEFAULT_SKID_SIZE = 100;
+// The smallest skid size we'll use however little skid we measure. Covers
+// the few ticks it takes the interrupt to be taken once it's raised, which
+// a quiet measurement may never see.
+static const Ticks MIN_SKID_SIZE = 20;
+// Enough trials that the 99th percentile is the second largest skid rather
+// than the largest. Each takes a few microseconds.
+static const int SKID_TRIALS = 100;
+static const Ticks SKID_TEST_PERIOD = 10000;
+
+static int skid_test_fd = -1;
+static volatile sig_atomic_t skid_test_fired;
+static volatile int64_t skid_test_count;
+static volatile uint32_t skid_test_sink;
+
+static void skid_test_handler(int) {
+  int64_t val;
+  if (read(skid_test_fd, &val, sizeof(val)) == sizeof(val)) {
+    skid_test_count = val;
+  }
+  skid_test_fired = 1;
+}
+
+/**
+ * Program a ticks interrupt for ourselves, like we do for tracees, and see
+ * how many ticks past the programmed period we get before the signal is
+ * delivered. A tracee is stopped at the same point, when it would run a
+ * signal handler. Returns the skids seen in increasing order, or an empty
+ * vector if we can't tell.
+ */
+static vector<Ticks> measure_skid() {
+  struct perf_event_attr attr = rr::ticks_attr;
+  attr.sample_period = SKID_TEST_PERIOD;
+  int sig = PerfCounters::TIME_SLICE_SIGNAL;
+
+  struct sigaction sa, old_sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = skid_test_handler;
+  sigaction(sig, &sa, &old_sa);
+  sigset_t set, old_set;
+  sigemptyset(&set);
+  sigaddset(&set, sig);
+  sigprocmask(SIG_UNBLOCK, &set, &old_set);
+
+  vector<Ticks> skids;
+  int trials = 0;
+  for (; trials < SKID_TRIALS; ++trials) {
+    ScopedFd fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    struct f_owner_ex own;
+    own.type = F_OWNER_TID;
+    own.pid = syscall(SYS_gettid);
+    if (!fd.is_open() || fcntl(fd, F_SETOWN_EX, &own) ||
+        fcntl(fd, F_SETSIG, sig)) {
+      break;
+    }
+    skid_test_fd = fd;
+    skid_test_fired = 0;
+    skid_test_count = 0;
+    if (fcntl(fd, F_SETFL, O_ASYNC)) {
+      break;
+    }
+    // Do conditional branches that can't be optimized out until the
+    // interrupt arrives. 'accumulator' is always odd and can't be zero.
+    uint32_t accumulator = uint32_t(getpid()) * 2 + 1;
+    for (Ticks i = 0; i < 100 * SKID_TEST_PERIOD && !skid_test_fired &&
+                      accumulator;
+         ++i) {
+      accumulator = ((accumulator * 7) + 2) & 0xffffff;
+    }
+    skid_test_sink = accumulator;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    skid_test_fd = -1;
+    if (!skid_test_fired || skid_test_count < SKID_TEST_PERIOD) {
+      break;
+    }
+    skids.push_back(skid_test_count - SKID_TEST_PERIOD);
+  }
+  skid_test_fd = -1;
+
+  // Discard any interrupt still queued before restoring the old handler.
+  struct timespec no_wait = { 0, 0 };
+  sigprocmask(SIG_BLOCK, &set, nullptr);
+  while (sigtimedwait(&set, nullptr, &no_wait) == sig) {
+  }
+  sigaction(sig, &old_sa, nullptr);
+  sigprocmask(SIG_SETMASK, &old_set, nullptr);
+
+  if (trials < SKID_TRIALS) {
+    LOG(debug) << "measure_skid failed after " << trials << " trials";
+    return vector<Ticks>();
+  }
+  sort(skids.begin(), skids.end());
+  return skids;
+}
+
+Ticks PerfCounters::skid_size() {
+  static Ticks skid_size = 0;
+  if (skid_size) {
+    return skid_size;
+  }
+
+  skid_size = DEFAULT_SKID_SIZE;
+  if (running_under_rr()) {
+    // Our emulated counters don't skid at all, but the outer rr's do and
+    // the test wouldn't see that.
+    return skid_size;
+  }
+
+  init_attributes();
+  vector<Ticks> skids = measure_skid();
+  if (!skids.empty()) {
+    // The skid is technically unbounded. Interrupt delivery gets slower
+    // under load than during this quiet measurement, so allow twice the
+    // 99th percentile, and never less than the largest skid we saw plus a
+    // little.
+    Ticks p99 = skids[skids.size() * 99 / 100 - 1];
+    Ticks max_skid = skids.back();
+    skid_size = max<Ticks>(MIN_SKID_SIZE, max(2 * p99, max_skid + 10));
+    LOG(debug) << "measured skid p99=" << p99 << " max=" << max_skid;
+  }
+  LOG(debug) << "skid_size=" << skid_size;
+  return skid_size;
+}
+
 static bool always_recreate_counters() {
   // When we have the KVM IN_TXCP bug, reenabling the TXCP counter after
   // disabling it does not work.
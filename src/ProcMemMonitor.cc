@@ -25,6 +25,12 @@ ProcMemMonitor::ProcMemMonitor(Task* t, const string& pathname) {
       Task* target = t->session().find_task(tid);
       if (target) {
         tuid = target->tuid();
+        if (t->session().is_recording()) {
+          // Writes through this file are writes to |target|'s memory.
+          auto rt = static_cast<RecordTask*>(t);
+          rt->session().scheduler().prepare_cross_process_write(
+              rt, static_cast<RecordTask*>(target));
+        }
       }
     }
   }
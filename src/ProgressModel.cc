@@ -0,0 +1,160 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "ProgressModel.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "TraceStream.h"
+#include "log.h"
+
+using namespace std;
+
+namespace rr {
+
+// The following parameters were estimated by running Firefox startup
+// and shutdown in an opt build on a Lenovo W530 laptop, replaying with
+// DUMP_STATS_PERIOD set to 100 (twice, and using only values from the
+// second run, to ensure caches are warm), and then minimizing least-squares
+// error. They're the starting point for the fitted weights.
+static const double microseconds_per_tick = 0.0020503143;
+static const double microseconds_per_syscall = 39.6793587609;
+static const double microseconds_per_byte_written = 0.001833611;
+static const double microseconds_constant = 997.8257239043;
+
+static const double microseconds_per_step_overhead_unit = 100;
+
+// Weight older observations by this factor per step, so the model follows
+// changes in the replayed workload.
+static const double forgetting_factor = 0.999;
+static const double initial_covariance = 1e-4;
+// Forgetting makes the covariance of weights that no observation constrains
+// (e.g. when the workload writes nothing) grow without bound; cap it.
+static const double max_covariance = 1;
+static const double min_weight = 0.01;
+static const double max_weight = 100;
+
+ProgressModel::ProgressModel()
+    : path(TraceStream::rr_data_dir() + "/progress-model"), dirty(false) {
+  for (int i = 0; i < FEATURE_COUNT; ++i) {
+    weights[i] = i == STEP_OVERHEAD ? 0 : 1;
+    for (int j = 0; j < FEATURE_COUNT; ++j) {
+      covariance[i][j] = i == j ? initial_covariance : 0;
+    }
+  }
+  load();
+}
+
+void ProgressModel::load() {
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f) {
+    return;
+  }
+  double w[FEATURE_COUNT];
+  if (fscanf(f, "weights %lf %lf %lf %lf", &w[0], &w[1], &w[2], &w[3]) ==
+      FEATURE_COUNT) {
+    for (int i = 0; i < FEATURE_COUNT; ++i) {
+      weights[i] = max(i == STEP_OVERHEAD ? 0 : min_weight,
+                       min(w[i], max_weight));
+    }
+    LOG(debug) << "Loaded progress model from " << path;
+  }
+  fclose(f);
+}
+
+void ProgressModel::save() {
+  if (!dirty) {
+    return;
+  }
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path.c_str(), getpid());
+  FILE* f = fopen(tmp, "w");
+  if (!f) {
+    return;
+  }
+  fprintf(f, "weights %.17g %.17g %.17g %.17g\n", weights[0], weights[1],
+          weights[2], weights[3]);
+  if (fclose(f) != 0 || rename(tmp, path.c_str()) < 0) {
+    unlink(tmp);
+    return;
+  }
+  dirty = false;
+}
+
+void ProgressModel::features(const Session::Statistics& stats,
+                             double result[FEATURE_COUNT]) const {
+  result[STEP_OVERHEAD] = microseconds_per_step_overhead_unit;
+  result[TICKS] = microseconds_per_tick * stats.ticks_processed;
+  result[SYSCALLS] = microseconds_per_syscall * stats.syscalls_performed;
+  result[BYTES_WRITTEN] = microseconds_per_byte_written * stats.bytes_written;
+}
+
+double ProgressModel::estimate(const Session::Statistics& stats) const {
+  double x[FEATURE_COUNT];
+  features(stats, x);
+  double result = microseconds_constant;
+  for (int i = 0; i < FEATURE_COUNT; ++i) {
+    if (i != STEP_OVERHEAD) {
+      result += weights[i] * x[i];
+    }
+  }
+  return result;
+}
+
+void ProgressModel::observe(const Session::Statistics& before,
+                            const Session::Statistics& after,
+                            double microseconds) {
+  if (after.ticks_processed < before.ticks_processed ||
+      after.syscalls_performed < before.syscalls_performed ||
+      after.bytes_written < before.bytes_written || microseconds <= 0) {
+    return;
+  }
+  Session::Statistics delta;
+  delta.ticks_processed = after.ticks_processed - before.ticks_processed;
+  delta.syscalls_performed =
+      after.syscalls_performed - before.syscalls_performed;
+  delta.bytes_written = after.bytes_written - before.bytes_written;
+  double x[FEATURE_COUNT];
+  features(delta, x);
+
+  // Standard recursive least squares update.
+  double px[FEATURE_COUNT];
+  double denominator = forgetting_factor;
+  double error = microseconds;
+  for (int i = 0; i < FEATURE_COUNT; ++i) {
+    px[i] = 0;
+    for (int j = 0; j < FEATURE_COUNT; ++j) {
+      px[i] += covariance[i][j] * x[j];
+    }
+    denominator += x[i] * px[i];
+    error -= weights[i] * x[i];
+  }
+  for (int i = 0; i < FEATURE_COUNT; ++i) {
+    double gain = px[i] / denominator;
+    weights[i] += gain * error;
+    for (int j = 0; j < FEATURE_COUNT; ++j) {
+      covariance[i][j] =
+          (covariance[i][j] - gain * px[j]) / forgetting_factor;
+    }
+  }
+  for (int i = 0; i < FEATURE_COUNT; ++i) {
+    if (covariance[i][i] > max_covariance) {
+      // Scaling row and column i keeps the matrix positive definite.
+      double scale = sqrt(max_covariance / covariance[i][i]);
+      for (int j = 0; j < FEATURE_COUNT; ++j) {
+        covariance[i][j] *= scale;
+        covariance[j][i] *= scale;
+      }
+    }
+    weights[i] =
+        max(i == STEP_OVERHEAD ? 0 : min_weight, min(weights[i], max_weight));
+  }
+  dirty = true;
+}
+
+} // namespace rr
@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PROGRESS_MODEL_H_
+#define RR_PROGRESS_MODEL_H_
+
+#include <string>
+
+#include "Session.h"
+
+namespace rr {
+
+/**
+ * A linear model of how long replay takes, in microseconds, as a function of
+ * the Session::Statistics it accumulates. ReplayTimeline uses it to space out
+ * its reverse-exec checkpoints.
+ *
+ * The coefficients start at values fitted once on a single machine and
+ * workload, and are refined online by recursive least squares from the
+ * measured wall-clock time of each replay step, with exponential forgetting
+ * so the model tracks the workload being replayed. A per-step overhead term
+ * absorbs the cost of short steps; it doesn't contribute to estimates.
+ * Coefficients are kept positive so estimates increase monotonically with
+ * execution.
+ *
+ * Fitted coefficients are saved in progress-model under the rr data
+ * directory so later replays on this machine start from them.
+ */
+class ProgressModel {
+public:
+  ProgressModel();
+
+  /**
+   * Estimate the replay time in microseconds represented by |stats|.
+   */
+  double estimate(const Session::Statistics& stats) const;
+
+  /**
+   * Update the model with a replay step that took |microseconds| and moved
+   * the session's statistics from |before| to |after|.
+   */
+  void observe(const Session::Statistics& before,
+               const Session::Statistics& after, double microseconds);
+
+  /**
+   * Persist the coefficients if they've been updated.
+   */
+  void save();
+
+private:
+  enum { STEP_OVERHEAD, TICKS, SYSCALLS, BYTES_WRITTEN, FEATURE_COUNT };
+
+  void load();
+  void features(const Session::Statistics& stats,
+                double result[FEATURE_COUNT]) const;
+
+  std::string path;
+  // Multipliers of the default coefficients (except STEP_OVERHEAD, which is
+  // in units of 100us).
+  double weights[FEATURE_COUNT];
+  // Covariance of the weights, up to the (unknown) noise variance.
+  double covariance[FEATURE_COUNT][FEATURE_COUNT];
+  bool dirty;
+};
+
+} // namespace rr
+
+#endif /* RR_PROGRESS_MODEL_H_ */
@@ -38,9 +38,16 @@ RecordCommand RecordCommand::singleton(
     "                             tests.\n"
     "  -n, --no-syscall-buffer    disable the syscall buffer preload \n"
     "                             library even if it would otherwise be used\n"
+    "  --no-blob-store            copy mmapped files that may change into\n"
+    "                             the trace instead of the blob store shared\n"
+    "                             by all traces. Traces that use the blob\n"
+    "                             store need `rr pack' before being moved.\n"
     "  --no-file-cloning          disable file cloning for mmapped files\n"
     "  --no-read-cloning          disable file-block cloning for syscallbuf\n"
     "                             reads\n"
+    "  --parallel                 let tracee processes that share no memory\n"
+    "                             run concurrently on different CPUs.\n"
+    "                             Implies --cpu-unbound.\n"
     "  -p --print-trace-dir=<NUM> print trace directory followed by a newline\n"
     "                             to given file descriptor\n"
     "  --syscall-buffer-size=<NUM> desired size of syscall buffer in kB.\n"
@@ -97,6 +104,9 @@ struct RecordFlags {
   /* Whether to use file-cloning optimization during recording. */
   bool use_file_cloning;
 
+  /* Whether to store copies of mmapped files in the shared blob store. */
+  bool use_blob_store;
+
   /* Whether to use read-cloning optimization during recording. */
   bool use_read_cloning;
 
@@ -110,6 +120,9 @@ struct RecordFlags {
   /* Whether to enable chaos mode in the scheduler */
   bool chaos;
 
+  /* Whether to run tasks in different scheduling domains concurrently */
+  bool parallel;
+
   /* True if we should wait for all processes to exit before finishing
    * recording. */
   bool wait_for_all;
@@ -129,10 +142,12 @@ struct RecordFlags {
         syscall_buffer_size(0),
         print_trace_dir(-1),
         use_file_cloning(true),
+        use_blob_store(true),
         use_read_cloning(true),
         bind_cpu(RecordSession::BIND_CPU),
         always_switch(false),
         chaos(false),
+        parallel(false),
         wait_for_all(false),
         ignore_nested(false),
         scarce_fds(false),
@@ -171,6 +186,8 @@ static bool parse_record_arg(vector<string>& args, RecordFlags& flags) {
     { 4, "scarce-fds", NO_PARAMETER },
     { 5, "setuid-sudo", NO_PARAMETER },
     { 6, "bind-to-cpu", HAS_PARAMETER },
+    { 7, "parallel", NO_PARAMETER },
+    { 8, "no-blob-store", NO_PARAMETER },
     { 'b', "force-syscall-buffer", NO_PARAMETER },
     { 'c', "num-cpu-ticks", HAS_PARAMETER },
     { 'h', "chaos", NO_PARAMETER },
@@ -257,6 +274,12 @@ static bool parse_record_arg(vector<string>& args, RecordFlags& flags) {
       }
       flags.bind_cpu = opt.int_value;
       break;
+    case 7:
+      flags.parallel = true;
+      break;
+    case 8:
+      flags.use_blob_store = false;
+      break;
     case 'u':
       flags.bind_cpu = RecordSession::UNBOUND_CPU;
       break;
@@ -310,9 +333,11 @@ static void setup_session_from_flags(RecordSession& session,
                                      const RecordFlags& flags) {
   session.scheduler().set_max_ticks(flags.max_ticks);
   session.scheduler().set_always_switch(flags.always_switch);
+  session.scheduler().set_parallel(flags.parallel);
   session.set_enable_chaos(flags.chaos);
   session.set_use_read_cloning(flags.use_read_cloning);
   session.set_use_file_cloning(flags.use_file_cloning);
+  session.set_use_blob_store(flags.use_blob_store);
   session.set_ignore_sig(flags.ignore_sig);
   session.set_continue_through_sig(flags.continue_through_sig);
   session.set_wait_for_all(flags.wait_for_all);
@@ -355,6 +380,16 @@ static WaitStatus record(const vector<string>& args, const RecordFlags& flags) {
 
   session->terminate_recording();
 
+  const RecordSession::SyscallPatchStatistics& patch_stats =
+      session->syscall_patch_statistics();
+  LOG(info) << "Patched " << patch_stats.patched() << " of "
+            << patch_stats.sites_tried << " syscall sites ("
+            << patch_stats.patched_with_relocation
+            << " by relocating following instructions), "
+            << patch_stats.patched_from_cache
+            << " syscall sites from the patch cache and "
+            << patch_stats.rdtsc_sites_patched << " rdtsc sites";
+
   switch (step_result.status) {
     case RecordSession::STEP_CONTINUE:
       // SIGINT or something like that interrupted us.
@@ -445,6 +480,16 @@ int RecordCommand::run(vector<string>& args) {
     return 1;
   }
 
+  if (flags.parallel) {
+    if (flags.chaos) {
+      fprintf(stderr, "rr: --parallel cannot be used with --chaos.\n");
+      return 1;
+    }
+    // Tasks in different scheduling domains need different CPUs to actually
+    // run in parallel.
+    flags.bind_cpu = RecordSession::UNBOUND_CPU;
+  }
+
   assert_prerequisites(flags.use_syscall_buffer);
   check_performance_settings();
 
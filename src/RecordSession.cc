@@ -259,6 +259,7 @@ static bool handle_ptrace_exit_event(RecordTask* t) {
   } else {
     LOG(warn)
         << "unstable exit; may misrecord CLONE_CHILD_CLEARTID memory race";
+    t->session().scheduler().stop_running_tasks(t->task_group()->task_set());
     t->task_group()->destabilize();
   }
 
@@ -1381,6 +1382,7 @@ void RecordSession::signal_state_changed(RecordTask* t, StepState* step_state) {
       // without letting the task execute at least one instruction, which
       // we don't want to do here.
       if (is_fatal && sig != get_continue_through_sig()) {
+        scheduler().stop_running_tasks(t->task_group()->task_set());
         preinject_signal(t);
         t->resume_execution(RESUME_CONT, RESUME_NONBLOCKING, RESUME_NO_TICKS,
                             sig);
@@ -1819,6 +1821,7 @@ RecordSession::RecordSession(const std::string& exe_path,
       use_syscall_buffer_(syscallbuf == ENABLE_SYSCALL_BUF),
       use_file_cloning_(true),
       use_read_cloning_(true),
+      use_blob_store_(true),
       enable_chaos_(false),
       wait_for_all_(false) {
   ScopedFd error_fd = create_spawn_task_error_pipe();
@@ -1960,6 +1963,9 @@ void RecordSession::terminate_recording() {
 
   LOG(info) << "Processing termination request ...";
 
+  // kill_all_tasks can only detach cleanly from stopped tasks.
+  scheduler().stop_all_running_tasks();
+
   pid_t ttid = t ? t->tid : 0;
   auto tticks = t ? t->tick_count() : 0;
 
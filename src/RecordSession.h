@@ -9,6 +9,7 @@
 #include "Scheduler.h"
 #include "SeccompFilterRewriter.h"
 #include "Session.h"
+#include "SyscallPatchCache.h"
 #include "TaskGroup.h"
 #include "TraceFrame.h"
 #include "WaitStatus.h"
@@ -42,6 +43,7 @@ public:
   size_t syscall_buffer_size() const { return syscall_buffer_size_; }
   bool use_read_cloning() const { return use_read_cloning_; }
   bool use_file_cloning() const { return use_file_cloning_; }
+  bool use_blob_store() const { return use_blob_store_; }
   void set_ignore_sig(int sig) { ignore_sig = sig; }
   int get_ignore_sig() const { return ignore_sig; }
   void set_continue_through_sig(int sig) { continue_through_sig = sig; }
@@ -109,12 +111,43 @@ public:
 
   void set_use_read_cloning(bool enable) { use_read_cloning_ = enable; }
   void set_use_file_cloning(bool enable) { use_file_cloning_ = enable; }
+  void set_use_blob_store(bool enable) { use_blob_store_ = enable; }
   void set_syscall_buffer_size(size_t size) { syscall_buffer_size_ = size; }
 
   void set_wait_for_all(bool wait_for_all) {
     this->wait_for_all_ = wait_for_all;
   }
 
+  /**
+   * Counts of syscall sites the Monkeypatcher has tried to patch, across
+   * all address spaces.
+   */
+  struct SyscallPatchStatistics {
+    SyscallPatchStatistics()
+        : sites_tried(0),
+          patched_with_hook(0),
+          patched_with_relocation(0),
+          patched_from_cache(0),
+          rdtsc_sites_patched(0) {}
+    uint32_t patched() const {
+      return patched_with_hook + patched_with_relocation;
+    }
+    uint32_t sites_tried;
+    // Patched using one of the preload library's syscall_patch_hooks.
+    uint32_t patched_with_hook;
+    // Patched by relocating the instructions following the syscall.
+    uint32_t patched_with_relocation;
+    // Patched eagerly because the SyscallPatchCache said to. These are not
+    // included in sites_tried.
+    uint32_t patched_from_cache;
+    // rdtsc instructions patched to call the preload library.
+    uint32_t rdtsc_sites_patched;
+  };
+  SyscallPatchStatistics& syscall_patch_statistics() {
+    return syscall_patch_statistics_;
+  }
+  SyscallPatchCache& syscall_patch_cache() { return syscall_patch_cache_; }
+
   virtual Task* new_task(pid_t tid, pid_t rec_tid, uint32_t serial,
                          SupportedArch a);
 
@@ -164,6 +197,8 @@ private:
   Scheduler scheduler_;
   TaskGroup::shr_ptr initial_task_group;
   SeccompFilterRewriter seccomp_filter_rewriter_;
+  SyscallPatchStatistics syscall_patch_statistics_;
+  SyscallPatchCache syscall_patch_cache_;
 
   int ignore_sig;
   int continue_through_sig;
@@ -173,6 +208,7 @@ private:
 
   bool use_file_cloning_;
   bool use_read_cloning_;
+  bool use_blob_store_;
   /**
    * When true, try to increase the probability of finding bugs.
    */
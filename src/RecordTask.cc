@@ -1002,6 +1002,7 @@ bool RecordTask::has_any_actionable_signal() {
 
 void RecordTask::emulate_SIGCONT() {
   // All threads in the process are resumed.
+  session().scheduler().stop_running_tasks(task_group()->task_set());
   for (Task* t : task_group()->task_set()) {
     auto rt = static_cast<RecordTask*>(t);
     LOG(debug) << "setting " << tid << " to NOT_STOPPED due to SIGCONT";
@@ -1027,6 +1028,7 @@ void RecordTask::signal_delivered(int sig) {
       // Fall through...
       case SIGSTOP:
         // All threads in the process are stopped.
+        session().scheduler().stop_running_tasks(task_group()->task_set());
         for (Task* t : task_group()->task_set()) {
           auto rt = static_cast<RecordTask*>(t);
           rt->apply_group_stop(sig);
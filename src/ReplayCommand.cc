@@ -57,6 +57,9 @@ ReplayCommand ReplayCommand::singleton(
     "                             here for convenience to support 'gdb -i=mi'\n"
     "                             and 'gdb --fullname' as suggested by GNU "
     "Emacs\n"
+    "  --checkpoint-memory=<MB>   keep the memory used by checkpoints for\n"
+    "                             reverse execution under <MB> megabytes\n"
+    "                             (default: a quarter of physical memory)\n"
     "  -d, --debugger=<FILE>      use <FILE> as the gdb command\n"
     "  -q, --no-redirect-output   don't replay writes to stdout/stderr\n"
     "  -s, --dbgport=<PORT>       only start a debug server on <PORT>;\n"
@@ -107,6 +110,10 @@ struct ReplayFlags {
   // to test the corresponding code.
   bool share_private_mappings;
 
+  // Memory budget for reverse-exec checkpoints in bytes, or 0 for the
+  // default.
+  uint64_t checkpoint_memory_budget;
+
   ReplayFlags()
       : goto_event(0),
         singlestep_to_event(0),
@@ -116,7 +123,8 @@ struct ReplayFlags {
         dbg_port(-1),
         gdb_binary_file_path("gdb"),
         redirect(true),
-        share_private_mappings(false) {}
+        share_private_mappings(false),
+        checkpoint_memory_budget(0) {}
 };
 
 static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
@@ -137,6 +145,7 @@ static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
     { 'x', "gdb-x", HAS_PARAMETER },
     { 0, "share-private-mappings", NO_PARAMETER },
     { 1, "fullname", NO_PARAMETER },
+    { 2, "checkpoint-memory", HAS_PARAMETER },
     { 'i', "interpreter", HAS_PARAMETER }
   };
   ParsedOption opt;
@@ -205,6 +214,12 @@ static bool parse_replay_arg(vector<string>& args, ReplayFlags& flags) {
     case 1:
       flags.gdb_options.push_back("--fullname");
       break;
+    case 2:
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.checkpoint_memory_budget = (uint64_t)opt.int_value * 1024 * 1024;
+      break;
     case 'i':
       flags.gdb_options.push_back("-i");
       flags.gdb_options.push_back(opt.value);
@@ -271,6 +286,7 @@ static ReplaySession::Flags session_flags(const ReplayFlags& flags) {
   ReplaySession::Flags result;
   result.redirect_stdio = flags.redirect;
   result.share_private_mappings = flags.share_private_mappings;
+  result.checkpoint_memory_budget = flags.checkpoint_memory_budget;
   return result;
 }
 
@@ -312,10 +328,17 @@ static void serve_replay_no_debugger(const string& trace_dir,
       Session::Statistics stats = replay_session->statistics();
       printf(
           "[ReplayStatistics] ticks %lld syscalls %lld bytes_written %lld "
-          "microseconds %lld\n",
+          "async_events %lld async_event_steps %lld raw_data_records %lld "
+          "raw_data_bytes %lld raw_data_allocations %lld microseconds %lld\n",
           (long long)(stats.ticks_processed - last_stats.ticks_processed),
           (long long)(stats.syscalls_performed - last_stats.syscalls_performed),
           (long long)(stats.bytes_written - last_stats.bytes_written),
+          (long long)(stats.async_events - last_stats.async_events),
+          (long long)(stats.async_event_steps - last_stats.async_event_steps),
+          (long long)(stats.raw_data_records - last_stats.raw_data_records),
+          (long long)(stats.raw_data_bytes - last_stats.raw_data_bytes),
+          (long long)(stats.raw_data_allocations -
+                      last_stats.raw_data_allocations),
           (long long)(to_microseconds(now) - to_microseconds(last_dump_time)));
       last_dump_time = now;
       last_stats = stats;
@@ -353,6 +376,25 @@ static void handle_SIGINT_in_parent(int sig) {
 
 static GdbServer* server_ptr = nullptr;
 
+/**
+ * Start replaying |trace_dir|, from the last checkpoint saved by
+ * `rr create-checkpoints` before the target event if there is one.
+ */
+static ReplaySession::shr_ptr create_session(const string& trace_dir,
+                                             const ReplayFlags& flags) {
+  if (flags.goto_event > 0 &&
+      flags.goto_event !=
+          numeric_limits<decltype(flags.goto_event)>::max() &&
+      flags.process_created_how == ReplayFlags::CREATED_NONE) {
+    auto session =
+        ReplaySession::create_from_checkpoint(trace_dir, flags.goto_event);
+    if (session) {
+      return session;
+    }
+  }
+  return ReplaySession::create(trace_dir);
+}
+
 static void handle_SIGINT_in_child(int sig) {
   assert(sig == SIGINT);
   if (server_ptr) {
@@ -383,7 +425,7 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
     if (target.event == numeric_limits<decltype(target.event)>::max()) {
       serve_replay_no_debugger(trace_dir, flags);
     } else {
-      auto session = ReplaySession::create(trace_dir);
+      auto session = create_session(trace_dir, flags);
       GdbServer::ConnectionFlags conn_flags;
       conn_flags.dbg_port = flags.dbg_port;
       conn_flags.debugger_name = flags.gdb_binary_file_path;
@@ -406,7 +448,7 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
 
     {
       ScopedFd debugger_params_write_pipe(debugger_params_pipe[1]);
-      auto session = ReplaySession::create(trace_dir);
+      auto session = create_session(trace_dir, flags);
       GdbServer::ConnectionFlags conn_flags;
       conn_flags.dbg_port = flags.dbg_port;
       conn_flags.debugger_params_write_pipe = &debugger_params_write_pipe;
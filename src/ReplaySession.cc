@@ -4,15 +4,28 @@
 
 #include "ReplaySession.h"
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <linux/futex.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <syscall.h>
 
 #include <algorithm>
+#include <sstream>
+
+#include "rr/rr.h"
 
 #include "AutoRemoteSyscalls.h"
+#include "CompressedReader.h"
+#include "CompressedWriter.h"
+#include "ElfReader.h"
 #include "Flags.h"
+#include "MagicSaveDataMonitor.h"
+#include "PreserveFileMonitor.h"
 #include "ReplayTask.h"
+#include "StdioMonitor.h"
 #include "TaskGroup.h"
 #include "fast_forward.h"
 #include "kernel_abi.h"
@@ -30,37 +43,30 @@ namespace rr {
  * there's a variable slack region, which is technically unbounded.
  * This means that an interrupt programmed for retired branch k might
  * fire at |k + 50|, for example.  To counteract the slack, we program
- * interrupts just short of our target, by the |SKID_SIZE| region
+ * interrupts just short of our target, by the skid region
  * below, and then more slowly advance to the real target.
  *
- * How was this magic number determined?  Trial and error: we want it
- * to be as small as possible for efficiency, but not so small that
+ * The region is PerfCounters::skid_size(), which measures how far this
+ * CPU skids past a programmed interrupt and adds a margin.  We want it
+ * to be as small as possible for efficiency, since every tick inside
+ * it costs us singlesteps or breakpoint hits, but not so small that
  * overshoots are observed.  If all other possible causes of overshoot
  * have been ruled out, like memory divergence, then you'll know that
- * this magic number needs to be increased if the following symptom is
+ * the skid was underestimated if the following symptom is
  * observed during replay.  Running with DEBUGLOG enabled (see above),
  * a sequence of log messages like the following will appear
  *
- * 1. programming interrupt for [target - SKID_SIZE] ticks
+ * 1. programming interrupt for [target - skid_size] ticks
  * 2. Error: Replay diverged.  Dumping register comparison.
  * 3. Error: [list of divergent registers; arbitrary]
  * 4. Error: overshot target ticks=[target] by [i]
  *
  * The key is that no other replayer log messages occur between (1)
  * and (2).  This spew means that the replayer programmed an interrupt
- * for ticks=[target-SKID_SIZE], but the tracee was actually interrupted
+ * for ticks=[target-skid_size], but the tracee was actually interrupted
  * at ticks=[target+i].  And that in turn means that the kernel/HW
  * skidded too far past the programmed target for rr to handle it.
- *
- * If that occurs, the SKID_SIZE needs to be increased by at least
- * [i].
- *
- * NB: there are probably deeper reasons for the target slack that
- * could perhaps let it be deduced instead of arrived at empirically;
- * perhaps pipeline depth and things of that nature are involved.  But
- * those reasons if they exit are currently not understood.
  */
-static const int SKID_SIZE = 100;
 
 static void debug_memory(ReplayTask* t) {
   if (should_dump_memory(t->current_trace_frame())) {
@@ -264,7 +270,8 @@ static bool compute_ticks_request(
     TicksRequest* ticks_request) {
   *ticks_request = RESUME_UNLIMITED_TICKS;
   if (constraints.ticks_target > 0) {
-    Ticks ticks_period = constraints.ticks_target - SKID_SIZE - t->tick_count();
+    Ticks ticks_period =
+        constraints.ticks_target - PerfCounters::skid_size() - t->tick_count();
     if (ticks_period <= 0) {
       // Behave as if we actually executed something. Callers assume we did.
       t->clear_wait_status();
@@ -489,6 +496,8 @@ void ReplaySession::continue_or_step(ReplayTask* t,
                                      ResumeRequest resume_how) {
   if (constraints.command == RUN_SINGLESTEP) {
     t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT, tick_request);
+  } else if (constraints.command == RUN_SINGLEBLOCK) {
+    t->resume_execution(RESUME_SINGLEBLOCK, RESUME_WAIT, tick_request);
   } else if (constraints.command == RUN_SINGLESTEP_FAST_FORWARD) {
     did_fast_forward |= fast_forward_through_instruction(
         t, RESUME_SINGLESTEP, constraints.stop_before_states);
@@ -617,9 +626,10 @@ Completion ReplaySession::emulate_async_signal(
   LOG(debug) << "advancing " << ticks_left << " ticks to reach " << ticks << "/"
              << ip;
 
+  Ticks skid_size = PerfCounters::skid_size();
   /* XXX should we only do this if (ticks > 10000)? */
-  while (ticks_left - SKID_SIZE > SKID_SIZE) {
-    LOG(debug) << "  programming interrupt for " << (ticks_left - SKID_SIZE)
+  while (ticks_left - skid_size > skid_size) {
+    LOG(debug) << "  programming interrupt for " << (ticks_left - skid_size)
                << " ticks";
 
     // Avoid overflow. If ticks_left > MAX_TICKS_REQUEST, execution will stop
@@ -627,7 +637,7 @@ Completion ReplaySession::emulate_async_signal(
     // continue as needed.
     continue_or_step(
         t, constraints,
-        (TicksRequest)(min<Ticks>(MAX_TICKS_REQUEST, ticks_left) - SKID_SIZE));
+        (TicksRequest)(min<Ticks>(MAX_TICKS_REQUEST, ticks_left) - skid_size));
     guard_unexpected_signal(t);
 
     ticks_left = ticks - t->tick_count();
@@ -755,6 +765,7 @@ Completion ReplaySession::emulate_async_signal(
 
     if (at_target) {
       /* Case (2) above: done. */
+      accumulate_async_event();
       return COMPLETE;
     }
 
@@ -807,6 +818,7 @@ Completion ReplaySession::emulate_async_signal(
         check_pending_sig(t);
       }
     }
+    accumulate_async_event_step();
     pending_SIGTRAP = SIGTRAP == t->stop_sig();
 
     /* Maintain the "'ticks_left'-is-up-to-date"
@@ -892,6 +904,15 @@ static bool treat_signal_event_as_deterministic(const SignalEvent& ev) {
   return ev.deterministic == DETERMINISTIC_SIG;
 }
 
+/**
+ * All patching effects have been recorded to the trace. Apply them to |t|.
+ */
+static void replay_monkeypatching(ReplayTask* t) {
+  t->apply_patch_mappings_from_trace();
+  // Now replay all data records.
+  t->apply_all_data_records_from_trace();
+}
+
 /**
  * Advance to the delivery of the deterministic signal |sig| and
  * update registers to what was recorded.  Return COMPLETE if successful or
@@ -935,6 +956,8 @@ Completion ReplaySession::emulate_deterministic_signal(
 
   if (EV_SEGV_RDTSC == ev.type()) {
     t->set_regs(trace_frame.regs());
+    // The recorder may have patched the rdtsc instruction.
+    replay_monkeypatching(t);
   }
 
   return COMPLETE;
@@ -947,18 +970,29 @@ Completion ReplaySession::emulate_deterministic_signal(
 void ReplaySession::prepare_syscallbuf_records(ReplayTask* t) {
   // Read the recorded syscall buffer back into the buffer
   // region.
-  auto buf = t->trace_reader().read_raw_data();
-  ASSERT(t, buf.data.size() >= sizeof(struct syscallbuf_hdr));
-  ASSERT(t, buf.data.size() <= t->syscallbuf_size);
+  TraceReader::RawData buf;
+  size_t size = t->trace_reader().read_raw_data_metadata(buf);
+  ASSERT(t, size >= sizeof(struct syscallbuf_hdr));
+  ASSERT(t, size <= t->syscallbuf_size);
   ASSERT(t, buf.addr == t->syscallbuf_child.cast<void>());
 
   struct syscallbuf_hdr recorded_hdr;
-  memcpy(&recorded_hdr, buf.data.data(), sizeof(struct syscallbuf_hdr));
+  t->trace_reader().read_raw_data_contents(&recorded_hdr,
+                                           sizeof(struct syscallbuf_hdr));
   // Don't overwrite syscallbuf_hdr. That needs to keep tracking the current
   // syscallbuf state.
-  t->write_bytes_helper(t->syscallbuf_child + 1,
-                        buf.data.size() - sizeof(struct syscallbuf_hdr),
-                        buf.data.data() + sizeof(struct syscallbuf_hdr));
+  size_t records_size = size - sizeof(struct syscallbuf_hdr);
+  if (uint8_t* local_records =
+          t->local_mapping(t->syscallbuf_child + 1, records_size)) {
+    // The syscallbuf is shared with us, so decompress the records straight
+    // into it.
+    t->trace_reader().read_raw_data_contents(local_records, records_size);
+  } else {
+    vector<uint8_t> records(records_size);
+    t->trace_reader().read_raw_data_contents(records.data(), records_size);
+    t->write_bytes_helper(t->syscallbuf_child + 1, records_size,
+                          records.data());
+  }
 
   ASSERT(t, recorded_hdr.num_rec_bytes + sizeof(struct syscallbuf_hdr) <=
                 t->syscallbuf_size);
@@ -1086,29 +1120,7 @@ Completion ReplaySession::patch_next_syscall(
   t->canonicalize_and_set_regs(t->regs(), t->arch());
   t->exit_syscall_and_prepare_restart();
 
-  // All patching effects have been recorded to the trace.
-  // First, replay any memory mapping done by Monkeypatcher. There should be
-  // at most one but we might as well be general.
-  while (true) {
-    TraceReader::MappedData data;
-    bool found;
-    KernelMapping km = t->trace_reader().read_mapped_region(&data, &found);
-    if (!found) {
-      break;
-    }
-    AutoRemoteSyscalls remote(t);
-    ASSERT(t, km.flags() & MAP_ANONYMOUS);
-    remote.infallible_mmap_syscall(km.start(), km.size(), km.prot(),
-                                   km.flags() | MAP_FIXED, -1, 0);
-    t->vm()->map(t, km.start(), km.size(), km.prot(), km.flags(), 0, string(),
-                 KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, nullptr,
-                 &km);
-    t->vm()->mapping_flags_of(km.start()) |=
-        AddressSpace::Mapping::IS_PATCH_STUBS;
-  }
-
-  // Now replay all data records.
-  t->apply_all_data_records_from_trace();
+  replay_monkeypatching(t);
   return COMPLETE;
 }
 
@@ -1134,7 +1146,7 @@ void ReplaySession::check_approaching_ticks_target(
     BreakStatus& break_status) {
   if (constraints.ticks_target > 0) {
     Ticks ticks_left = constraints.ticks_target - t->tick_count();
-    if (ticks_left <= SKID_SIZE) {
+    if (ticks_left <= PerfCounters::skid_size()) {
       break_status.approaching_ticks_target = true;
     }
   }
@@ -1182,6 +1194,13 @@ Completion ReplaySession::try_one_trace_step(
       return emulate_deterministic_signal(t, current_step.target.signo,
                                           constraints);
     case TSTEP_PROGRAM_ASYNC_SIGNAL_INTERRUPT:
+      if (constraints.command == RUN_SINGLEBLOCK) {
+        // A block step could run past the point where the signal must be
+        // delivered, so step single instructions instead.
+        StepConstraints singlestep = constraints;
+        singlestep.command = RUN_SINGLESTEP;
+        return emulate_async_signal(t, singlestep, current_step.target.ticks);
+      }
       return emulate_async_signal(t, constraints, current_step.target.ticks);
     case TSTEP_DELIVER_SIGNAL:
       return emulate_signal_delivery(t, current_step.target.signo);
@@ -1533,4 +1552,1137 @@ ReplayTask* ReplaySession::find_task(const TaskUid& tuid) const {
   return static_cast<ReplayTask*>(Session::find_task(tuid));
 }
 
+/**
+ * Checkpoints saved to disk live in <trace>/checkpoints/<time>/, where <time>
+ * is the time of the trace frame the session was about to replay. "state" is
+ * a compressed stream holding the session, task, address space and fd table
+ * state, and "memory" is a sparse file holding the contents of the tracees'
+ * mappings and of emulated files at page-aligned offsets.
+ *
+ * Restoring a checkpoint replays the trace up to the initial exec, forks the
+ * resulting task once per checkpointed address space and then replaces the
+ * forked address spaces' contents, much like process_execve does. Private
+ * mappings of files are mapped from the same file again and only the pages
+ * that differ from the file are saved; other private memory is restored as
+ * private anonymous memory. The forks inherit the bootstrap task's kernel
+ * state, so the signal dispositions and masks, fds, resource limits and
+ * working directory are saved and restored too.
+ *
+ * Checkpoints depend on the exact rr build that wrote them, so the header
+ * holds the build ID of the rr binary as well as CHECKPOINT_VERSION, which
+ * must still be bumped when the format changes.
+ */
+static const char checkpoint_magic[] = "rr-checkpoint";
+static const uint32_t CHECKPOINT_VERSION = 4;
+static const size_t CHECKPOINT_CHUNK_SIZE = 1024 * 1024;
+
+enum CheckpointMappingKind {
+  CHECKPOINT_PRIVATE,
+  CHECKPOINT_PRIVATE_FILE,
+  CHECKPOINT_SYSCALLBUF,
+  CHECKPOINT_EMUFS
+};
+
+/**
+ * Identifies the rr binary: its ELF build ID, or failing that its size and
+ * modification time.
+ */
+static const string& rr_build_id() {
+  static string build_id;
+  if (build_id.empty()) {
+    ScopedFd fd("/proc/self/exe", O_RDONLY);
+    if (fd.is_open()) {
+      build_id = ElfFileReader(fd).read_buildid();
+    }
+    struct stat st;
+    if (build_id.empty() && stat("/proc/self/exe", &st) == 0) {
+      stringstream ss;
+      ss << st.st_size << "-" << st.st_mtim.tv_sec << "."
+         << st.st_mtim.tv_nsec;
+      build_id = ss.str();
+    }
+  }
+  return build_id;
+}
+
+static string checkpoints_dir(const string& trace_dir) {
+  return trace_dir + "/checkpoints";
+}
+
+static string checkpoint_dir(const string& trace_dir, TraceFrame::Time time) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "/%lld", (long long)time);
+  return checkpoints_dir(trace_dir) + buf;
+}
+
+static void remove_checkpoint_dir(const string& dir) {
+  unlink((dir + "/state").c_str());
+  unlink((dir + "/memory").c_str());
+  rmdir(dir.c_str());
+}
+
+static void write_data(CompressedWriter& out, const void* data, size_t size) {
+  out << size;
+  out.write(data, size);
+}
+
+static vector<uint8_t> read_data(CompressedReader& in) {
+  size_t size;
+  in >> size;
+  vector<uint8_t> data(size);
+  in.read(data.data(), size);
+  return data;
+}
+
+static string read_string(CompressedReader& in) {
+  string value;
+  in >> value;
+  return value;
+}
+
+static void write_km(CompressedWriter& out, const KernelMapping& km) {
+  out << km.start().as_int() << km.end().as_int() << km.fsname()
+      << km.device() << km.inode() << km.prot() << km.flags()
+      << km.file_offset_bytes();
+}
+
+static KernelMapping read_km(CompressedReader& in) {
+  uintptr_t start, end;
+  in >> start >> end;
+  string fsname = read_string(in);
+  dev_t device;
+  ino_t inode;
+  int prot, flags;
+  uint64_t offset;
+  in >> device >> inode >> prot >> flags >> offset;
+  return KernelMapping(start, end, fsname, device, inode, prot, flags, offset);
+}
+
+static void write_captured_state(CompressedWriter& out,
+                                 const Task::CapturedState& state) {
+  out << state.rec_tid << state.serial << state.ticks;
+  out << state.regs.arch();
+  auto raw_regs = state.regs.get_ptrace_for_arch(state.regs.arch());
+  write_data(out, raw_regs.data(), raw_regs.size());
+  out << state.extra_regs.arch() << state.extra_regs.format();
+  write_data(out, state.extra_regs.data_bytes(), state.extra_regs.data_size());
+  out << state.prname << state.thread_areas;
+  out << state.syscallbuf_child.as_int() << state.syscallbuf_size
+      << state.num_syscallbuf_bytes << state.preload_globals.as_int()
+      << state.scratch_ptr.as_int() << state.scratch_size
+      << state.top_of_stack.as_int() << state.cloned_file_data_offset;
+  out.write(state.thread_locals, sizeof(state.thread_locals));
+  out << state.desched_fd_child << state.cloned_file_data_fd_child
+      << state.wait_status.get();
+}
+
+static Task::CapturedState read_captured_state(CompressedReader& in) {
+  Task::CapturedState state;
+  in >> state.rec_tid >> state.serial >> state.ticks;
+  SupportedArch arch;
+  in >> arch;
+  auto raw_regs = read_data(in);
+  state.regs.set_arch(arch);
+  state.regs.set_from_ptrace_for_arch(arch, raw_regs.data(), raw_regs.size());
+  ExtraRegisters::Format format;
+  in >> arch >> format;
+  auto extra_regs = read_data(in);
+  if (extra_regs.empty()) {
+    state.extra_regs = ExtraRegisters(arch);
+  } else {
+    state.extra_regs.set_to_raw_data(arch, format, extra_regs);
+  }
+  state.prname = read_string(in);
+  in >> state.thread_areas;
+  uintptr_t syscallbuf_child, preload_globals, scratch_ptr, top_of_stack;
+  in >> syscallbuf_child >> state.syscallbuf_size >>
+      state.num_syscallbuf_bytes >> preload_globals >> scratch_ptr >>
+      state.scratch_size >> top_of_stack >> state.cloned_file_data_offset;
+  state.syscallbuf_child = syscallbuf_child;
+  state.preload_globals = preload_globals;
+  state.scratch_ptr = scratch_ptr;
+  state.top_of_stack = top_of_stack;
+  in.read(state.thread_locals, sizeof(state.thread_locals));
+  int wait_status;
+  in >> state.desched_fd_child >> state.cloned_file_data_fd_child >>
+      wait_status;
+  state.wait_status = WaitStatus(wait_status);
+  return state;
+}
+
+/**
+ * Write |data| at |offset| in |fd|, leaving holes for all-zero pages.
+ */
+static bool write_sparse(int fd, const uint8_t* data, size_t size,
+                         uint64_t offset) {
+  for (size_t i = 0; i < size; i += page_size()) {
+    size_t len = min(page_size(), size - i);
+    if (is_zero(data + i, len)) {
+      continue;
+    }
+    if (pwrite(fd, data + i, len, offset + i) != (ssize_t)len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool save_memory(Task* t, const MemoryRange& range, int fd,
+                        uint64_t offset) {
+  vector<uint8_t> buf(CHECKPOINT_CHUNK_SIZE);
+  remote_ptr<void> addr = range.start();
+  while (addr < range.end()) {
+    size_t len = min(buf.size(), range.end().as_int() - addr.as_int());
+    ssize_t nread = t->read_bytes_fallible(addr, len, buf.data());
+    if (nread <= 0) {
+      // Pages we can't read (e.g. PROT_NONE guard pages) are restored as
+      // zeroes.
+      addr = floor_page_size(addr) + page_size();
+      continue;
+    }
+    if (!write_sparse(fd, buf.data(), nread,
+                      offset + (addr.as_int() - range.start().as_int()))) {
+      return false;
+    }
+    addr += nread;
+  }
+  return true;
+}
+
+/**
+ * Write the contents of |range| saved at |offset| in |fd| to tracee memory,
+ * which must be zero-filled. Zero pages are skipped.
+ */
+static void restore_memory(Task* t, const MemoryRange& range,
+                           const ScopedFd& fd, uint64_t offset) {
+  vector<uint8_t> buf(CHECKPOINT_CHUNK_SIZE);
+  for (size_t done = 0; done < range.size(); done += buf.size()) {
+    size_t len = min(buf.size(), range.size() - done);
+    ASSERT(t, pread(fd, buf.data(), len, offset + done) == (ssize_t)len)
+        << "Truncated checkpoint memory file";
+    size_t run_start = 0;
+    for (size_t i = 0; i <= len; i += page_size()) {
+      if (i < len && !is_zero(buf.data() + i, min(page_size(), len - i))) {
+        continue;
+      }
+      if (i > run_start) {
+        t->write_bytes_helper(range.start() + done + run_start, i - run_start,
+                              buf.data() + run_start);
+      }
+      run_start = i + page_size();
+    }
+  }
+}
+
+static bool is_file_backed(const KernelMapping& km) {
+  return !(km.flags() & MAP_ANONYMOUS) &&
+         km.inode() != KernelMapping::NO_INODE && !km.fsname().empty() &&
+         km.fsname()[0] == '/';
+}
+
+/**
+ * Like save_memory, for a private mapping of |file|. Only the pages that
+ * differ from the file are saved, and |dirty| gets one entry per page saying
+ * whether it was.
+ */
+static bool save_file_memory(Task* t, const KernelMapping& km,
+                             const ScopedFd& file, int fd, uint64_t offset,
+                             vector<uint8_t>* dirty) {
+  dirty->assign(km.size() / page_size(), 0);
+  vector<uint8_t> buf(CHECKPOINT_CHUNK_SIZE);
+  vector<uint8_t> file_buf(CHECKPOINT_CHUNK_SIZE);
+  remote_ptr<void> addr = km.start();
+  while (addr < km.end()) {
+    size_t len = min(buf.size(), km.end().as_int() - addr.as_int());
+    ssize_t nread = t->read_bytes_fallible(addr, len, buf.data());
+    if (nread <= 0) {
+      // Pages we can't read keep the file's contents.
+      addr = floor_page_size(addr) + page_size();
+      continue;
+    }
+    uint64_t mapping_offset = addr.as_int() - km.start().as_int();
+    ssize_t file_nread = pread(file, file_buf.data(), nread,
+                               km.file_offset_bytes() + mapping_offset);
+    if (file_nread < 0) {
+      return false;
+    }
+    // Past the end of the file, the mapping reads as zeroes.
+    memset(file_buf.data() + file_nread, 0, nread - file_nread);
+    for (ssize_t i = 0; i < nread; i += page_size()) {
+      size_t page_len = min<size_t>(page_size(), nread - i);
+      if (!memcmp(buf.data() + i, file_buf.data() + i, page_len)) {
+        continue;
+      }
+      (*dirty)[(mapping_offset + i) / page_size()] = 1;
+      if (!write_sparse(fd, buf.data() + i, page_len,
+                        offset + mapping_offset + i)) {
+        return false;
+      }
+    }
+    addr += nread;
+  }
+  return true;
+}
+
+/**
+ * Write the pages of |range| marked in |dirty|, saved at |offset| in |fd|, to
+ * tracee memory.
+ */
+static void restore_dirty_pages(Task* t, const MemoryRange& range,
+                                const vector<uint8_t>& dirty,
+                                const ScopedFd& fd, uint64_t offset) {
+  vector<uint8_t> buf;
+  for (size_t i = 0; i < dirty.size();) {
+    if (!dirty[i]) {
+      ++i;
+      continue;
+    }
+    size_t end = i;
+    while (end < dirty.size() && dirty[end] &&
+           (end - i) * page_size() < CHECKPOINT_CHUNK_SIZE) {
+      ++end;
+    }
+    size_t len = (end - i) * page_size();
+    buf.resize(len);
+    ASSERT(t, pread(fd, buf.data(), len, offset + i * page_size()) ==
+                  (ssize_t)len)
+        << "Truncated checkpoint memory file";
+    t->write_bytes_helper(range.start() + i * page_size(), len, buf.data());
+    i = end;
+  }
+}
+
+/**
+ * An open fd of a checkpointed process. Fds whose target is a path are
+ * reopened; others (pipes, sockets, etc) can only be inherited from the
+ * bootstrap task.
+ */
+struct CheckpointFd {
+  int fd;
+  string path;
+  int flags;
+  int64_t pos;
+
+  bool can_reopen() const {
+    static const char deleted[] = " (deleted)";
+    return !path.empty() && path[0] == '/' &&
+           (path.size() < sizeof(deleted) - 1 ||
+            path.compare(path.size() - (sizeof(deleted) - 1), string::npos,
+                         deleted) != 0);
+  }
+};
+
+static vector<CheckpointFd> read_fds(pid_t tid) {
+  vector<CheckpointFd> result;
+  char dir_name[PATH_MAX];
+  sprintf(dir_name, "/proc/%d/fd", tid);
+  DIR* dir = opendir(dir_name);
+  if (!dir) {
+    return result;
+  }
+  while (struct dirent* e = readdir(dir)) {
+    char* end;
+    long fd = strtol(e->d_name, &end, 10);
+    if (e->d_name[0] < '0' || e->d_name[0] > '9' || *end) {
+      continue;
+    }
+    CheckpointFd f;
+    f.fd = fd;
+    f.flags = 0;
+    f.pos = 0;
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    int path_len = snprintf(path, sizeof(path), "%s/%ld", dir_name, fd);
+    if (path_len < 0 || path_len >= (int)sizeof(path)) {
+      continue;
+    }
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len < 0) {
+      continue;
+    }
+    f.path = string(target, len);
+    path_len = snprintf(path, sizeof(path), "/proc/%d/fdinfo/%ld", tid, fd);
+    if (path_len < 0 || path_len >= (int)sizeof(path)) {
+      continue;
+    }
+    FILE* info = fopen(path, "r");
+    if (info) {
+      char line[256];
+      while (fgets(line, sizeof(line), info)) {
+        long long pos;
+        unsigned int flags;
+        if (sscanf(line, "pos: %lld", &pos) == 1) {
+          f.pos = pos;
+        } else if (sscanf(line, "flags: %o", &flags) == 1) {
+          f.flags = flags;
+        }
+      }
+      fclose(info);
+    }
+    result.push_back(f);
+  }
+  closedir(dir);
+  sort(result.begin(), result.end(),
+       [](const CheckpointFd& a, const CheckpointFd& b) {
+         return a.fd < b.fd;
+       });
+  return result;
+}
+
+/**
+ * Seek |fd| to |pos|. Returns false if that failed, except for fds that
+ * have no offset (ttys, fifos, pipes, sockets).
+ */
+static bool restore_fd_offset(AutoRemoteSyscalls& remote, int fd,
+                              int64_t pos) {
+  long ret;
+  if (remote.arch() == x86) {
+    AutoRestoreMem mem(remote, &pos, sizeof(pos));
+    ret = remote.syscall(syscall_number_for__llseek(remote.arch()), fd,
+                         pos >> 32, pos, mem.get(), SEEK_SET);
+  } else {
+    ret = remote.syscall(syscall_number_for_lseek(remote.arch()), fd, pos,
+                         SEEK_SET);
+  }
+  return ret >= 0 || ret == -ESPIPE;
+}
+
+/**
+ * Make the fd table of |remote|'s task match |fds|. Returns false if an fd
+ * couldn't be restored exactly; the restored process would then differ
+ * from the checkpointed one.
+ */
+static bool restore_fds(AutoRemoteSyscalls& remote,
+                        const vector<CheckpointFd>& fds) {
+  Task* t = remote.task();
+  map<int, CheckpointFd> current;
+  for (auto& f : read_fds(t->tid)) {
+    current[f.fd] = f;
+  }
+  set<int> wanted;
+  for (auto& f : fds) {
+    wanted.insert(f.fd);
+  }
+  for (auto& c : current) {
+    if (!wanted.count(c.first) && c.first != RR_RESERVED_ROOT_DIR_FD) {
+      remote.infallible_syscall(syscall_number_for_close(remote.arch()),
+                                c.first);
+    }
+  }
+  for (auto& f : fds) {
+    auto it = current.find(f.fd);
+    bool inherited = it != current.end() && it->second.path == f.path &&
+                     it->second.flags == f.flags;
+    if (!inherited) {
+      if (!f.can_reopen()) {
+        LOG(warn) << "Can't restore fd " << f.fd << " (" << f.path << ")";
+        return false;
+      }
+      // Open relative to the real root in case the tracee is chrooted.
+      string rel = f.path.size() > 1 ? f.path.substr(1) : string(".");
+      AutoRestoreMem child_path(remote, rel.c_str());
+      int flags = f.flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+      long fd = remote.syscall(syscall_number_for_openat(remote.arch()),
+                               RR_RESERVED_ROOT_DIR_FD, child_path.get(),
+                               flags);
+      if (fd < 0) {
+        LOG(warn) << "Can't reopen " << f.path << " as fd " << f.fd;
+        return false;
+      }
+      if (fd != f.fd) {
+        remote.infallible_syscall(syscall_number_for_dup3(remote.arch()), fd,
+                                  f.fd, f.flags & O_CLOEXEC);
+        remote.infallible_syscall(syscall_number_for_close(remote.arch()),
+                                  fd);
+      }
+    }
+    // Inherited fds share their offset with the bootstrap task's, so this
+    // matters even when the saved offset is 0.
+    if (!restore_fd_offset(remote, f.fd, f.pos)) {
+      LOG(warn) << "Can't restore the offset of fd " << f.fd << " ("
+                << f.path << ")";
+      return false;
+    }
+  }
+  return true;
+}
+
+static void restore_cwd(AutoRemoteSyscalls& remote, const string& cwd) {
+  string rel = cwd.size() > 1 ? cwd.substr(1) : string(".");
+  AutoRestoreMem child_path(remote, rel.c_str());
+  long fd = remote.syscall(syscall_number_for_openat(remote.arch()),
+                           RR_RESERVED_ROOT_DIR_FD, child_path.get(),
+                           O_PATH | O_DIRECTORY);
+  if (fd < 0) {
+    LOG(warn) << "Can't restore working directory " << cwd;
+    return;
+  }
+  remote.infallible_syscall(syscall_number_for_fchdir(remote.arch()), fd);
+  remote.infallible_syscall(syscall_number_for_close(remote.arch()), fd);
+}
+
+static vector<struct rlimit> read_rlimits(pid_t tid) {
+  vector<struct rlimit> result(RLIM_NLIMITS);
+  for (int r = 0; r < RLIM_NLIMITS; ++r) {
+    if (prlimit(tid, (__rlimit_resource)r, nullptr, &result[r]) < 0) {
+      FATAL() << "Can't read resource limit " << r << " of " << tid;
+    }
+  }
+  return result;
+}
+
+static void restore_rlimits(pid_t tid, const vector<struct rlimit>& limits) {
+  for (size_t r = 0; r < limits.size(); ++r) {
+    if (prlimit(tid, (__rlimit_resource)r, &limits[r], nullptr) < 0) {
+      LOG(warn) << "Can't restore resource limit " << r << " of " << tid;
+    }
+  }
+}
+
+template <typename Arch>
+static vector<uint8_t> read_sigactions_arch(AutoRemoteSyscalls& remote) {
+  size_t size = sizeof(typename Arch::kernel_sigaction);
+  vector<uint8_t> result((_NSIG - 1) * size);
+  AutoRestoreMem mem(remote, nullptr, size);
+  for (int sig = 1; sig < _NSIG; ++sig) {
+    remote.infallible_syscall(Arch::rt_sigaction, sig, nullptr, mem.get(),
+                              sizeof(typename Arch::kernel_sigset_t));
+    remote.task()->read_bytes_helper(mem.get(), size,
+                                     result.data() + (sig - 1) * size);
+  }
+  return result;
+}
+
+static vector<uint8_t> read_sigactions(AutoRemoteSyscalls& remote) {
+  RR_ARCH_FUNCTION(read_sigactions_arch, remote.arch(), remote);
+}
+
+template <typename Arch>
+static void restore_sigactions_arch(AutoRemoteSyscalls& remote,
+                                    const vector<uint8_t>& sigactions) {
+  size_t size = sizeof(typename Arch::kernel_sigaction);
+  ASSERT(remote.task(), sigactions.size() == (_NSIG - 1) * size)
+      << "Corrupt signal dispositions in checkpoint";
+  AutoRestoreMem mem(remote, nullptr, size);
+  for (int sig = 1; sig < _NSIG; ++sig) {
+    if (sig == SIGKILL || sig == SIGSTOP) {
+      continue;
+    }
+    remote.task()->write_bytes_helper(mem.get(), size,
+                                      sigactions.data() + (sig - 1) * size);
+    remote.infallible_syscall(Arch::rt_sigaction, sig, mem.get(), nullptr,
+                              sizeof(typename Arch::kernel_sigset_t));
+  }
+}
+
+static void restore_sigactions(AutoRemoteSyscalls& remote,
+                               const vector<uint8_t>& sigactions) {
+  RR_ARCH_FUNCTION(restore_sigactions_arch, remote.arch(), remote,
+                   sigactions);
+}
+
+bool ReplaySession::can_save_checkpoint() {
+  if (!can_clone() || current_step.action != TSTEP_NONE ||
+      !can_checkpoint_at(trace_frame)) {
+    return false;
+  }
+  for (auto& v : vm_map) {
+    AddressSpace* vm = v.second;
+    Task* leader = *vm->task_set().begin();
+    for (auto m : vm->maps()) {
+      if (m.monitored_shared_memory ||
+          (m.flags & AddressSpace::Mapping::IS_SIGBUS_REGION)) {
+        LOG(debug) << "Can't save checkpoint with mapping " << m.map;
+        return false;
+      }
+      if ((m.map.flags() & MAP_SHARED) && !m.local_addr &&
+          !emu_fs->has_file_for(m.recorded_map) && !m.map.is_vsyscall()) {
+        LOG(debug) << "Can't save checkpoint with shared mapping " << m.map;
+        return false;
+      }
+    }
+    for (auto& fd : leader->fd_table()->monitors()) {
+      switch (fd.second->type()) {
+        case FileMonitor::MagicSaveData:
+        case FileMonitor::Preserve:
+        case FileMonitor::Stdio:
+          break;
+        default:
+          LOG(debug) << "Can't save checkpoint with monitored fd " << fd.first;
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+void ReplaySession::save_checkpoint_task(CompressedWriter& out, Task* t) {
+  write_captured_state(out, t->capture_state());
+  sig_set_t sigmask;
+  t->xptrace(PTRACE_GETSIGMASK, remote_ptr<void>(sizeof(sigmask)), &sigmask);
+  out << t->stopping_breakpoint_table.register_value()
+      << t->stopping_breakpoint_table_entry_size << t->seccomp_bpf_enabled
+      << sigmask;
+}
+
+bool ReplaySession::save_checkpoint() {
+  finish_initializing();
+  if (!can_save_checkpoint()) {
+    return false;
+  }
+  clear_syscall_bp();
+
+  string dir = checkpoints_dir(trace_in.dir());
+  if (mkdir(dir.c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+    return false;
+  }
+  string tmp_dir = dir + "/tmp.XXXXXX";
+  if (!mkdtemp(&tmp_dir[0])) {
+    return false;
+  }
+  ScopedFd memory((tmp_dir + "/memory").c_str(),
+                  O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL, 0400);
+  CompressedWriter out(tmp_dir + "/state", 1024 * 1024, 1);
+  uint64_t memory_end = 0;
+  bool ok = memory.is_open();
+
+  out << string(checkpoint_magic) << CHECKPOINT_VERSION << rr_build_id();
+  out << trace_in.position_of_last_frame() << statistics_ << next_task_serial_
+      << visible_execution_ << ticks_at_start_of_event << last_siginfo_;
+
+  // Emulated files are shared by all the address spaces that map them.
+  map<pair<dev_t, ino_t>, EmuFile::shr_ptr> emu_files;
+  for (auto& v : vm_map) {
+    for (auto m : v.second->maps()) {
+      if ((m.recorded_map.flags() & MAP_SHARED) &&
+          emu_fs->has_file_for(m.recorded_map)) {
+        auto file = emu_fs->at(m.recorded_map);
+        emu_files[make_pair(file->device(), file->inode())] = file;
+      }
+    }
+  }
+  out << emu_files.size();
+  for (auto& f : emu_files) {
+    struct stat st;
+    ok = ok && fstat(f.second->fd(), &st) == 0;
+    KernelMapping km(remote_ptr<void>(), remote_ptr<void>(),
+                     f.second->emu_path(), f.second->device(),
+                     f.second->inode(), 0, MAP_SHARED);
+    write_km(out, km);
+    out << (uint64_t)st.st_size << memory_end;
+    vector<uint8_t> buf(CHECKPOINT_CHUNK_SIZE);
+    for (uint64_t done = 0; ok && done < (uint64_t)st.st_size;) {
+      ssize_t nread = pread(f.second->fd(), buf.data(), buf.size(), done);
+      ok = nread > 0 && write_sparse(memory, buf.data(), nread,
+                                     memory_end + done);
+      done += nread;
+    }
+    memory_end += ceil_page_size(st.st_size);
+  }
+
+  out << vm_map.size();
+  for (auto& v : vm_map) {
+    AddressSpace* vm = v.second;
+    // As in copy_state_to, pick an arbitrary task to be group leader.
+    Task* leader = *vm->task_set().begin();
+    TaskGroup* tg = leader->task_group().get();
+
+    out << vm->exe << vm->leader_tid_ << vm->leader_serial << vm->exec_count
+        << vm->brk_start.as_int() << vm->brk_end.as_int()
+        << vm->vdso_start_addr.as_int() << vm->syscallbuf_enabled_
+        << vm->has_shared_mappings_ << vm->saved_auxv_
+        << vm->first_run_event_;
+    out << vm->dont_fork.size();
+    for (auto& r : vm->dont_fork) {
+      out << r.start().as_int() << r.end().as_int();
+    }
+
+    vector<AddressSpace::Mapping> mappings;
+    for (auto m : vm->maps()) {
+      // The rr page and thread-locals mapping are recreated by the fork.
+      if (m.map.start() != AddressSpace::rr_page_start() &&
+          !(m.flags & AddressSpace::Mapping::IS_THREAD_LOCALS) &&
+          !m.map.is_vsyscall()) {
+        mappings.push_back(m);
+      }
+    }
+    out << mappings.size();
+    for (auto& m : mappings) {
+      CheckpointMappingKind kind = CHECKPOINT_PRIVATE;
+      ScopedFd file;
+      if (m.flags & AddressSpace::Mapping::IS_SYSCALLBUF) {
+        kind = CHECKPOINT_SYSCALLBUF;
+      } else if ((m.recorded_map.flags() & MAP_SHARED) &&
+                 emu_fs->has_file_for(m.recorded_map)) {
+        kind = CHECKPOINT_EMUFS;
+      } else if (is_file_backed(m.map)) {
+        // If the file has been replaced, save the memory like anonymous
+        // memory.
+        file = ScopedFd(m.map.fsname().c_str(), O_RDONLY);
+        struct stat st;
+        if (file.is_open() && fstat(file, &st) == 0 &&
+            st.st_dev == m.map.device() && st.st_ino == m.map.inode()) {
+          kind = CHECKPOINT_PRIVATE_FILE;
+        }
+      }
+      write_km(out, m.map);
+      write_km(out, m.recorded_map);
+      out << m.flags << kind << memory_end;
+      if (kind == CHECKPOINT_PRIVATE_FILE) {
+        vector<uint8_t> dirty;
+        ok = ok && save_file_memory(leader, m.map, file, memory, memory_end,
+                                    &dirty);
+        out << dirty;
+        memory_end += m.map.size();
+      } else if (kind != CHECKPOINT_EMUFS) {
+        ok = ok && save_memory(leader, m.map, memory, memory_end);
+        memory_end += m.map.size();
+      }
+    }
+
+    out << tg->tgid << tg->tguid().serial() << !!tg->parent();
+    if (tg->parent()) {
+      out << tg->parent()->tguid().tid() << tg->parent()->tguid().serial();
+    }
+    out << tg->exit_status.get() << tg->dumpable << tg->execed
+        << tg->received_sigframe_SIGSEGV;
+
+    auto& monitors = leader->fd_table()->monitors();
+    out << monitors.size();
+    for (auto& fd : monitors) {
+      out << fd.first << fd.second->type();
+      if (fd.second->type() == FileMonitor::Stdio) {
+        out << static_cast<StdioMonitor*>(fd.second.get())->original_fd();
+      }
+    }
+
+    vector<uint8_t> sigactions;
+    {
+      AutoRemoteSyscalls remote(leader);
+      sigactions = read_sigactions(remote);
+    }
+    auto fds = read_fds(leader->tid);
+    out << sigactions << read_rlimits(leader->tid) << fds.size();
+    for (auto& f : fds) {
+      out << f.fd << f.path << f.flags << f.pos;
+    }
+    char cwd_link[PATH_MAX];
+    char cwd[PATH_MAX];
+    sprintf(cwd_link, "/proc/%d/cwd", leader->tid);
+    ssize_t cwd_len = readlink(cwd_link, cwd, sizeof(cwd) - 1);
+    ok = ok && cwd_len > 0;
+    out << string(cwd, max<ssize_t>(cwd_len, 0));
+
+    save_checkpoint_task(out, leader);
+    out << tg->task_set().size() - 1;
+    for (Task* t : tg->task_set()) {
+      if (t != leader) {
+        save_checkpoint_task(out, t);
+      }
+    }
+  }
+
+  out.close();
+  ok = ok && out.good() && ftruncate(memory, memory_end) == 0;
+  memory.close();
+  string final_dir = checkpoint_dir(trace_in.dir(), trace_frame.time());
+  if (!ok || rename(tmp_dir.c_str(), final_dir.c_str()) < 0) {
+    // If the rename failed because the checkpoint already exists, there's
+    // nothing more to do.
+    bool exists = ok && (errno == EEXIST || errno == ENOTEMPTY);
+    remove_checkpoint_dir(tmp_dir);
+    return exists;
+  }
+  LOG(debug) << "Saved checkpoint " << final_dir << " (" << memory_end
+             << " bytes of memory)";
+  return true;
+}
+
+/*static*/ vector<TraceFrame::Time> ReplaySession::saved_checkpoints(
+    const string& dir) {
+  vector<TraceFrame::Time> result;
+  DIR* d = opendir(checkpoints_dir(dir).c_str());
+  if (!d) {
+    return result;
+  }
+  while (struct dirent* e = readdir(d)) {
+    char* end;
+    long long time = strtoll(e->d_name, &end, 10);
+    if (e->d_name[0] >= '0' && e->d_name[0] <= '9' && !*end) {
+      result.push_back(time);
+    }
+  }
+  closedir(d);
+  sort(result.begin(), result.end());
+  return result;
+}
+
+void ReplaySession::restore_checkpoint_task(CompressedReader& in, Task* t) {
+  uintptr_t stopping_breakpoint_table;
+  sig_set_t sigmask;
+  in >> stopping_breakpoint_table >> t->stopping_breakpoint_table_entry_size >>
+      t->seccomp_bpf_enabled >> sigmask;
+  t->stopping_breakpoint_table = stopping_breakpoint_table;
+  t->xptrace(PTRACE_SETSIGMASK, remote_ptr<void>(sizeof(sigmask)), &sigmask);
+}
+
+bool ReplaySession::restore_checkpoint_vm(CompressedReader& in,
+                                          const ScopedFd& memory,
+                                          Task* bootstrap_task) {
+  string exe = read_string(in);
+  pid_t leader_tid;
+  uint32_t leader_serial, exec_count;
+  uintptr_t brk_start, brk_end, vdso_start_addr;
+  bool syscallbuf_enabled, has_shared_mappings;
+  vector<uint8_t> saved_auxv;
+  TraceFrame::Time first_run_event;
+  in >> leader_tid >> leader_serial >> exec_count >> brk_start >> brk_end >>
+      vdso_start_addr >> syscallbuf_enabled >> has_shared_mappings >>
+      saved_auxv >> first_run_event;
+  set<MemoryRange> dont_fork;
+  size_t count;
+  in >> count;
+  for (size_t i = 0; i < count; ++i) {
+    uintptr_t start, end;
+    in >> start >> end;
+    dont_fork.insert(MemoryRange(start, end));
+  }
+
+  struct SavedMapping {
+    KernelMapping map;
+    KernelMapping recorded_map;
+    uint32_t flags;
+    CheckpointMappingKind kind;
+    uint64_t memory_offset;
+    // CHECKPOINT_PRIVATE_FILE only: which pages differ from the file.
+    vector<uint8_t> dirty;
+  };
+  vector<SavedMapping> mappings;
+  in >> count;
+  for (size_t i = 0; i < count; ++i) {
+    SavedMapping m;
+    m.map = read_km(in);
+    m.recorded_map = read_km(in);
+    in >> m.flags >> m.kind >> m.memory_offset;
+    if (m.kind == CHECKPOINT_PRIVATE_FILE) {
+      in >> m.dirty;
+    }
+    mappings.push_back(m);
+  }
+
+  pid_t tgid, parent_tgid = 0;
+  uint32_t tg_serial, parent_serial = 0;
+  bool has_parent;
+  in >> tgid >> tg_serial >> has_parent;
+  if (has_parent) {
+    in >> parent_tgid >> parent_serial;
+  }
+  int exit_status;
+  bool dumpable, execed, received_sigframe_SIGSEGV;
+  in >> exit_status >> dumpable >> execed >> received_sigframe_SIGSEGV;
+
+  vector<pair<int, FileMonitor*>> monitors;
+  in >> count;
+  for (size_t i = 0; i < count; ++i) {
+    int fd;
+    FileMonitor::Type type;
+    in >> fd >> type;
+    switch (type) {
+      case FileMonitor::MagicSaveData:
+        monitors.push_back(make_pair(fd, new MagicSaveDataMonitor()));
+        break;
+      case FileMonitor::Preserve:
+        monitors.push_back(make_pair(fd, new PreserveFileMonitor()));
+        break;
+      case FileMonitor::Stdio: {
+        int original_fd;
+        in >> original_fd;
+        monitors.push_back(make_pair(fd, new StdioMonitor(original_fd)));
+        break;
+      }
+      default:
+        FATAL() << "Unexpected monitor type " << type << " in checkpoint";
+    }
+  }
+
+  vector<uint8_t> sigactions;
+  vector<struct rlimit> rlimits;
+  vector<CheckpointFd> open_fds;
+  in >> sigactions >> rlimits >> count;
+  for (size_t i = 0; i < count; ++i) {
+    CheckpointFd f;
+    in >> f.fd >> f.path >> f.flags >> f.pos;
+    open_fds.push_back(f);
+  }
+  string cwd = read_string(in);
+
+  Task::CapturedState leader_state = read_captured_state(in);
+  Task* leader = bootstrap_task->os_fork_into(this, leader_state.rec_tid,
+                                              leader_state.serial);
+  on_create(leader);
+  restore_checkpoint_task(in, leader);
+  LOG(debug) << "  forked new group leader " << leader->tid << " for "
+             << leader_state.rec_tid;
+
+  // The fork gave the leader copies of the bootstrap task's task group and
+  // address space. Give them their checkpointed identities.
+  leader->tg->erase_task(leader);
+  leader->tg = nullptr;
+  TaskGroup* parent =
+      has_parent ? find_task_group(TaskGroupUid(parent_tgid, parent_serial))
+                 : nullptr;
+  leader->tg = TaskGroup::shr_ptr(
+      new TaskGroup(this, parent, tgid, leader->tid, tg_serial));
+  leader->tg->insert_task(leader);
+  leader->tg->exit_status = WaitStatus(exit_status);
+  leader->tg->dumpable = dumpable;
+  leader->tg->execed = execed;
+  leader->tg->received_sigframe_SIGSEGV = received_sigframe_SIGSEGV;
+
+  AddressSpace* vm = leader->vm().get();
+  vm_map.erase(vm->uid());
+  vm->exe = exe;
+  vm->leader_tid_ = leader_tid;
+  vm->leader_serial = leader_serial;
+  vm->exec_count = exec_count;
+  vm_map[vm->uid()] = vm;
+
+  {
+    // As in process_execve, the tracee's stack is about to go away, so
+    // don't use memory parameters.
+    AutoRemoteSyscalls remote(leader,
+                              AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
+    vector<MemoryRange> unmaps;
+    for (auto m : vm->maps()) {
+      if (m.map.start() != AddressSpace::rr_page_start() &&
+          !(m.flags & AddressSpace::Mapping::IS_THREAD_LOCALS) &&
+          !m.map.is_vsyscall()) {
+        unmaps.push_back(m.map);
+      }
+    }
+    for (auto& r : unmaps) {
+      remote.infallible_syscall(syscall_number_for_munmap(remote.arch()),
+                                r.start(), r.size());
+      vm->unmap(leader, r.start(), r.size());
+    }
+
+    for (auto& m : mappings) {
+      if (m.kind != CHECKPOINT_PRIVATE) {
+        continue;
+      }
+      int prot = m.map.prot() | PROT_READ | PROT_WRITE;
+      remote.infallible_mmap_syscall(m.map.start(), m.map.size(), prot,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                                     -1, 0);
+      restore_memory(leader, m.map, memory, m.memory_offset);
+      if (prot != m.map.prot()) {
+        remote.infallible_syscall(syscall_number_for_mprotect(remote.arch()),
+                                  m.map.start(), m.map.size(), m.map.prot());
+      }
+      vm->map(leader, m.map.start(), m.map.size(), m.map.prot(),
+              MAP_PRIVATE | MAP_ANONYMOUS | (m.map.flags() & MAP_GROWSDOWN), 0,
+              string(), KernelMapping::NO_DEVICE, KernelMapping::NO_INODE,
+              nullptr, &m.recorded_map);
+      if (m.flags) {
+        vm->mapping_flags_of(m.map.start()) = m.flags;
+      }
+    }
+  }
+
+  vm->brk_start = brk_start;
+  vm->brk_end = brk_end;
+  vm->vdso_start_addr = vdso_start_addr;
+  vm->syscallbuf_enabled_ = syscallbuf_enabled;
+  vm->has_shared_mappings_ = has_shared_mappings;
+  vm->saved_auxv_ = saved_auxv;
+  vm->first_run_event_ = first_run_event;
+  vm->dont_fork = dont_fork;
+
+  vector<Task::CapturedState> member_states;
+  in >> count;
+  for (size_t i = 0; i < count; ++i) {
+    member_states.push_back(read_captured_state(in));
+  }
+
+  // The stack is back, so we can use memory parameters again.
+  leader->set_regs(leader_state.regs);
+  {
+    AutoRemoteSyscalls remote(leader);
+    for (auto& m : mappings) {
+      if (m.kind == CHECKPOINT_SYSCALLBUF) {
+        AddressSpace::Mapping saved(m.map, m.recorded_map, nullptr);
+        saved.flags = m.flags;
+        recreate_shared_mmap(remote, saved);
+        restore_memory(leader, m.map, memory, m.memory_offset);
+      } else if (m.kind == CHECKPOINT_PRIVATE_FILE) {
+        int remote_fd;
+        {
+          AutoRestoreMem child_path(remote, m.map.fsname().c_str());
+          remote_fd = remote.syscall(syscall_number_for_openat(remote.arch()),
+                                     RR_RESERVED_ROOT_DIR_FD,
+                                     child_path.get() + 1, O_RDONLY);
+        }
+        if (remote_fd < 0) {
+          LOG(warn) << "Can't open " << m.map.fsname() << " to restore "
+                    << m.map;
+          return false;
+        }
+        struct stat real_file = leader->stat_fd(remote_fd);
+        if (real_file.st_dev != m.map.device() ||
+            real_file.st_ino != m.map.inode()) {
+          LOG(warn) << m.map.fsname() << " changed since the checkpoint";
+          remote.infallible_syscall(syscall_number_for_close(remote.arch()),
+                                    remote_fd);
+          return false;
+        }
+        int prot = m.map.prot() | PROT_READ | PROT_WRITE;
+        remote.infallible_mmap_syscall(
+            m.map.start(), m.map.size(), prot, m.map.flags() | MAP_FIXED,
+            remote_fd, m.map.file_offset_bytes() / page_size());
+        remote.infallible_syscall(syscall_number_for_close(remote.arch()),
+                                  remote_fd);
+        restore_dirty_pages(leader, m.map, m.dirty, memory, m.memory_offset);
+        if (prot != m.map.prot()) {
+          remote.infallible_syscall(syscall_number_for_mprotect(remote.arch()),
+                                    m.map.start(), m.map.size(),
+                                    m.map.prot());
+        }
+        vm->map(leader, m.map.start(), m.map.size(), m.map.prot(),
+                m.map.flags(), m.map.file_offset_bytes(), m.map.fsname(),
+                real_file.st_dev, real_file.st_ino, nullptr, &m.recorded_map);
+        if (m.flags) {
+          vm->mapping_flags_of(m.map.start()) = m.flags;
+        }
+      } else if (m.kind == CHECKPOINT_EMUFS) {
+        EmuFile::shr_ptr emu_file = emu_fs->at(m.recorded_map);
+        int remote_fd;
+        {
+          string path = emu_file->proc_path();
+          AutoRestoreMem child_path(remote, path.c_str());
+          remote_fd = remote.infallible_syscall(
+              syscall_number_for_openat(remote.arch()),
+              RR_RESERVED_ROOT_DIR_FD, child_path.get() + 1, O_RDWR);
+        }
+        struct stat real_file = leader->stat_fd(remote_fd);
+        string real_file_name = leader->file_name_of_fd(remote_fd);
+        remote.infallible_mmap_syscall(
+            m.map.start(), m.map.size(), m.map.prot(),
+            (m.map.flags() & ~MAP_ANONYMOUS) | MAP_FIXED, remote_fd,
+            m.map.file_offset_bytes() / page_size());
+        vm->map(leader, m.map.start(), m.map.size(), m.map.prot(),
+                m.map.flags(), m.map.file_offset_bytes(), real_file_name,
+                real_file.st_dev, real_file.st_ino, nullptr, &m.recorded_map,
+                emu_file);
+        remote.infallible_syscall(syscall_number_for_close(remote.arch()),
+                                  remote_fd);
+      }
+    }
+
+    // This also reopens the cloned file data the tasks' syscallbufs read
+    // from, at the offsets they had reached.
+    if (!restore_fds(remote, open_fds)) {
+      return false;
+    }
+    restore_cwd(remote, cwd);
+    restore_sigactions(remote, sigactions);
+
+    for (auto& state : member_states) {
+      Task* t = Task::os_clone_into(state, leader, remote);
+      on_create(t);
+      restore_checkpoint_task(in, t);
+      t->copy_state(state);
+    }
+  }
+  leader->copy_state(leader_state);
+
+  auto fds = leader->fd_table();
+  vector<int> old_fds;
+  for (auto& fd : fds->monitors()) {
+    old_fds.push_back(fd.first);
+  }
+  for (int fd : old_fds) {
+    fds->did_close(fd);
+  }
+  for (auto& fd : monitors) {
+    fds->add_monitor(fd.first, fd.second);
+  }
+  restore_rlimits(leader->tid, rlimits);
+  return true;
+}
+
+/*static*/ ReplaySession::shr_ptr ReplaySession::create_from_checkpoint(
+    const string& dir, TraceFrame::Time time) {
+  string trace_dir = TraceReader(dir).dir();
+  auto times = saved_checkpoints(trace_dir);
+  auto it = lower_bound(times.begin(), times.end(), time);
+  if (it == times.begin()) {
+    return nullptr;
+  }
+  string checkpoint = checkpoint_dir(trace_dir, *--it);
+  CompressedReader in(checkpoint + "/state");
+  ScopedFd memory((checkpoint + "/memory").c_str(), O_CLOEXEC | O_RDONLY);
+  string magic = read_string(in);
+  uint32_t version = 0;
+  in >> version;
+  string build_id = version == CHECKPOINT_VERSION ? read_string(in) : "";
+  if (!in.good() || !memory.is_open() || magic != checkpoint_magic ||
+      version != CHECKPOINT_VERSION || build_id != rr_build_id()) {
+    LOG(warn) << "Ignoring unusable checkpoint " << checkpoint;
+    return nullptr;
+  }
+  LOG(debug) << "Restoring checkpoint " << checkpoint;
+
+  // Replay up to the initial exec to get a task we can fork the
+  // checkpointed processes from.
+  shr_ptr bootstrap = create(trace_dir);
+  while (!bootstrap->done_initial_exec()) {
+    if (bootstrap->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+      return nullptr;
+    }
+  }
+  Task* bootstrap_task = bootstrap->tasks().begin()->second;
+
+  shr_ptr session(new ReplaySession(*bootstrap));
+  TraceReader::Position position;
+  in >> position >> session->statistics_ >> session->next_task_serial_ >>
+      session->visible_execution_ >> session->ticks_at_start_of_event >>
+      session->last_siginfo_;
+  session->trace_in.seek(position);
+  session->trace_frame = session->trace_in.read_frame();
+  session->current_step.action = TSTEP_NONE;
+
+  // Keep the emulated files alive until mappings refer to them.
+  vector<EmuFile::shr_ptr> emu_files;
+  size_t count;
+  in >> count;
+  for (size_t i = 0; i < count; ++i) {
+    KernelMapping km = read_km(in);
+    uint64_t size, offset;
+    in >> size >> offset;
+    auto file = session->emufs().get_or_create(km, size);
+    vector<uint8_t> buf(CHECKPOINT_CHUNK_SIZE);
+    for (uint64_t done = 0; done < size;) {
+      ssize_t len = min<uint64_t>(buf.size(), size - done);
+      if (pread(memory, buf.data(), len, offset + done) != len ||
+          pwrite(file->fd(), buf.data(), len, done) != len) {
+        FATAL() << "Can't restore emulated file " << km.fsname();
+      }
+      done += len;
+    }
+    emu_files.push_back(file);
+  }
+
+  in >> count;
+  for (size_t i = 0; i < count; ++i) {
+    if (!session->restore_checkpoint_vm(in, memory, bootstrap_task)) {
+      LOG(warn) << "Can't restore checkpoint " << checkpoint;
+      return nullptr;
+    }
+  }
+  if (!in.good()) {
+    FATAL() << "Corrupt checkpoint " << checkpoint;
+  }
+  return session;
+}
+
 } // namespace rr
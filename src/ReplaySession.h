@@ -5,6 +5,7 @@
 
 #include <memory>
 #include <set>
+#include <vector>
 
 #include "AddressSpace.h"
 #include "CPUIDBugDetector.h"
@@ -17,6 +18,8 @@ struct syscallbuf_hdr;
 
 namespace rr {
 
+class CompressedReader;
+class CompressedWriter;
 class ReplayTask;
 
 /**
@@ -199,6 +202,39 @@ public:
   ReplayTask* find_task(pid_t rec_tid) const;
   ReplayTask* find_task(const TaskUid& tuid) const;
 
+  /**
+   * Buffers that ReplayTask reads a trace frame's raw data records into
+   * before applying them. They're kept between frames so we don't have to
+   * allocate for each one.
+   */
+  struct RawDataArena {
+    struct Record {
+      ReplayTask* t;
+      remote_ptr<void> addr;
+      // Of the record's bytes in |data|.
+      size_t offset;
+      size_t size;
+    };
+    std::vector<uint8_t> data;
+    std::vector<Record> records;
+
+    // Buffers bigger than this are freed after the frame that needed them,
+    // so one huge frame doesn't pin its memory for the rest of the replay.
+    static const size_t max_kept_bytes = 1024 * 1024;
+    /**
+     * Call when done with a frame's raw data.
+     */
+    void release_oversized() {
+      if (data.capacity() > max_kept_bytes) {
+        std::vector<uint8_t>().swap(data);
+      }
+      if (records.capacity() * sizeof(Record) > max_kept_bytes) {
+        std::vector<Record>().swap(records);
+      }
+    }
+  };
+  RawDataArena& raw_data_arena() { return raw_data_arena_; }
+
   /**
    * Returns true if the next step for this session is to exit a syscall with
    * the given number.
@@ -222,6 +258,31 @@ public:
    */
   static shr_ptr create(const std::string& dir);
 
+  /**
+   * Save the state of this session to disk as a checkpoint in the trace
+   * directory, so that later replays can start from here instead of from the
+   * beginning of the trace. This is only possible between trace frames when
+   * can_clone() is true, and not for all tracee states (e.g. tracees with
+   * /proc/<pid>/mem open or monitored shared memory). Returns false if no
+   * checkpoint was saved.
+   */
+  bool save_checkpoint();
+
+  /**
+   * Return the times of the checkpoints saved in the trace directory 'dir',
+   * in increasing order.
+   */
+  static std::vector<TraceFrame::Time> saved_checkpoints(
+      const std::string& dir);
+
+  /**
+   * Like create(), but start from the latest checkpoint saved for the trace
+   * whose current frame is before 'time'. Returns null if there is no such
+   * checkpoint.
+   */
+  static shr_ptr create_from_checkpoint(const std::string& dir,
+                                        TraceFrame::Time time);
+
   struct StepConstraints {
     explicit StepConstraints(RunCommand command)
         : command(command), stop_at_time(0), ticks_target(0) {}
@@ -234,10 +295,7 @@ public:
     // regardless.
     std::vector<const Registers*> stop_before_states;
 
-    bool is_singlestep() const {
-      return command == RUN_SINGLESTEP ||
-             command == RUN_SINGLESTEP_FAST_FORWARD;
-    }
+    bool is_singlestep() const { return rr::is_singlestep(command); }
   };
   /**
    * Take a single replay step.
@@ -272,10 +330,16 @@ public:
   static bool is_ignored_signal(int sig);
 
   struct Flags {
-    Flags() : redirect_stdio(false), share_private_mappings(false) {}
+    Flags()
+        : redirect_stdio(false),
+          share_private_mappings(false),
+          checkpoint_memory_budget(0) {}
     Flags(const Flags& other) = default;
     bool redirect_stdio;
     bool share_private_mappings;
+    // How much memory ReplayTimeline's reverse-exec checkpoints may use, in
+    // bytes. 0 means a default based on the machine's memory.
+    uint64_t checkpoint_memory_budget;
   };
   bool redirect_stdio() { return flags.redirect_stdio; }
   bool share_private_mappings() { return flags.share_private_mappings; }
@@ -327,6 +391,12 @@ private:
 
   void clear_syscall_bp();
 
+  bool can_save_checkpoint();
+  void save_checkpoint_task(CompressedWriter& out, Task* t);
+  void restore_checkpoint_task(CompressedReader& in, Task* t);
+  bool restore_checkpoint_vm(CompressedReader& in, const ScopedFd& memory,
+                             Task* bootstrap_task);
+
   std::shared_ptr<EmuFs> emu_fs;
   TraceReader trace_in;
   TraceFrame trace_frame;
@@ -336,6 +406,7 @@ private:
   siginfo_t last_siginfo_;
   Flags flags;
   bool did_fast_forward;
+  RawDataArena raw_data_arena_;
 
   std::shared_ptr<AddressSpace> syscall_bp_vm;
   remote_code_ptr syscall_bp_addr;
@@ -2,6 +2,8 @@
 
 #include "ReplayTask.h"
 
+#include <sys/uio.h>
+
 #include "AutoRemoteSyscalls.h"
 #include "PreserveFileMonitor.h"
 #include "ReplaySession.h"
@@ -118,26 +120,156 @@ const TraceFrame& ReplayTask::current_trace_frame() {
   return session().current_trace_frame();
 }
 
+/**
+ * Make sure |arena| has room for |size| bytes. Returns the number of
+ * allocations that took.
+ */
+static uint64_t reserve_raw_data(vector<uint8_t>& arena, size_t size) {
+  if (size <= arena.size()) {
+    return 0;
+  }
+  uint64_t allocations = size > arena.capacity() ? 1 : 0;
+  arena.resize(max(size, 2 * arena.size()));
+  return allocations;
+}
+
+static void write_raw_data_record(
+    ReplayTask* t, const uint8_t* data,
+    const ReplaySession::RawDataArena::Record& r) {
+  t->write_bytes_helper(r.addr, r.size, data + r.offset);
+  t->vm()->maybe_update_breakpoints(t, r.addr.cast<uint8_t>(), r.size);
+}
+
 ssize_t ReplayTask::set_data_from_trace() {
-  auto buf = trace_reader().read_raw_data();
-  if (!buf.addr.is_null() && buf.data.size() > 0) {
-    auto t = session().find_task(buf.rec_tid);
-    t->write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
-    t->vm()->maybe_update_breakpoints(t, buf.addr.cast<uint8_t>(),
-                                      buf.data.size());
+  auto& arena = session().raw_data_arena();
+  TraceReader::RawData buf;
+  size_t size = trace_reader().read_raw_data_metadata(buf);
+  uint64_t allocations = reserve_raw_data(arena.data, size);
+  trace_reader().read_raw_data_contents(arena.data.data(), size);
+  if (!buf.addr.is_null() && size > 0) {
+    write_raw_data_record(session().find_task(buf.rec_tid), arena.data.data(),
+                          { nullptr, buf.addr, 0, size });
+    session().accumulate_raw_data(1, size, allocations);
+  } else {
+    session().accumulate_raw_data(0, 0, allocations);
+  }
+  arena.release_oversized();
+  return size;
+}
+
+/**
+ * Write |count| |records| of |data| to |t|'s memory.
+ */
+static void write_raw_data(ReplayTask* t, const uint8_t* data,
+                           const ReplaySession::RawDataArena::Record* records,
+                           size_t count) {
+  static const size_t max_iovecs = 64;
+  struct iovec local_iov[max_iovecs];
+  struct iovec remote_iov[max_iovecs];
+  size_t i = 0;
+  while (i < count) {
+    // Gather the following records that aren't in memory shared with us, to
+    // write them with a single process_vm_writev.
+    size_t n = 0;
+    while (i + n < count && n < max_iovecs &&
+           !t->local_mapping(records[i + n].addr, records[i + n].size)) {
+      auto& r = records[i + n];
+      local_iov[n].iov_base = const_cast<uint8_t*>(data + r.offset);
+      local_iov[n].iov_len = r.size;
+      remote_iov[n].iov_base = (void*)r.addr.as_int();
+      remote_iov[n].iov_len = r.size;
+      ++n;
+    }
+    if (n <= 1) {
+      // write_bytes_helper just memcpys to memory shared with us, and a
+      // single record costs it no more than process_vm_writev would.
+      write_raw_data_record(t, data, records[i]);
+      ++i;
+      continue;
+    }
+
+    ssize_t nwritten =
+        process_vm_writev(t->tid, local_iov, n, remote_iov, n, 0);
+    if (nwritten < 0) {
+      nwritten = 0;
+    }
+    for (size_t end = i + n; i < end; ++i) {
+      auto& r = records[i];
+      if (nwritten >= (ssize_t)r.size) {
+        nwritten -= r.size;
+        t->vm()->notify_written(r.addr, r.size);
+        t->vm()->maybe_update_breakpoints(t, r.addr.cast<uint8_t>(), r.size);
+      } else {
+        // process_vm_writev stops at the first page the tracee can't write,
+        // e.g. read-only pages or pages protected for software watchpoints.
+        // write_bytes_helper can write those.
+        nwritten = 0;
+        write_raw_data_record(t, data, r);
+      }
+    }
   }
-  return buf.data.size();
 }
 
 void ReplayTask::apply_all_data_records_from_trace() {
-  TraceReader::RawData buf;
-  while (trace_reader().read_raw_data_for_frame(current_trace_frame(), buf)) {
-    if (!buf.addr.is_null() && buf.data.size() > 0) {
-      auto t = session().find_task(buf.rec_tid);
-      t->write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
-      t->vm()->maybe_update_breakpoints(t, buf.addr.cast<uint8_t>(),
-                                        buf.data.size());
+  // Read all of the frame's records before writing any, so records for the
+  // same task can be written together.
+  auto& arena = session().raw_data_arena();
+  arena.records.clear();
+  size_t used = 0;
+  uint64_t allocations = 0;
+  while (trace_reader().has_raw_data_for_frame(current_trace_frame())) {
+    TraceReader::RawData buf;
+    size_t size = trace_reader().read_raw_data_metadata(buf);
+    allocations += reserve_raw_data(arena.data, used + size);
+    trace_reader().read_raw_data_contents(arena.data.data() + used, size);
+    if (!buf.addr.is_null() && size > 0) {
+      if (arena.records.size() == arena.records.capacity()) {
+        ++allocations;
+      }
+      arena.records.push_back(
+          { session().find_task(buf.rec_tid), buf.addr, used, size });
+      used += size;
+    }
+  }
+  if (arena.records.empty()) {
+    session().accumulate_raw_data(0, 0, allocations);
+    arena.release_oversized();
+    return;
+  }
+
+  auto& records = arena.records;
+  for (size_t i = 0; i < records.size();) {
+    size_t end = i + 1;
+    while (end < records.size() && records[end].t == records[i].t) {
+      ++end;
+    }
+    write_raw_data(records[i].t, arena.data.data(), &records[i], end - i);
+    i = end;
+  }
+  LOG(debug) << "Applied " << records.size() << " raw data records ("
+             << used << " bytes)";
+  session().accumulate_raw_data(records.size(), used, allocations);
+  arena.release_oversized();
+}
+
+void ReplayTask::apply_patch_mappings_from_trace() {
+  // There should be at most one per patched site but we might as well be
+  // general.
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    KernelMapping km = trace_reader().read_mapped_region(&data, &found);
+    if (!found) {
+      break;
     }
+    AutoRemoteSyscalls remote(this);
+    ASSERT(this, km.flags() & MAP_ANONYMOUS);
+    remote.infallible_mmap_syscall(km.start(), km.size(), km.prot(),
+                                   km.flags() | MAP_FIXED, -1, 0);
+    vm()->map(this, km.start(), km.size(), km.prot(), km.flags(), 0, string(),
+              KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, nullptr, &km);
+    vm()->mapping_flags_of(km.start()) |=
+        AddressSpace::Mapping::IS_PATCH_STUBS;
   }
 }
 
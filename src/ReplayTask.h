@@ -54,6 +54,11 @@ public:
   ssize_t set_data_from_trace();
   /** Restore all remaining chunks of saved data for the current trace frame. */
   void apply_all_data_records_from_trace();
+  /**
+   * Map all remaining extended jump pages that the Monkeypatcher created
+   * during the current trace frame.
+   */
+  void apply_patch_mappings_from_trace();
   /**
    * Set the syscall-return-value register of this to what was
    * saved in the current trace frame.
@@ -2,10 +2,20 @@
 
 #include "ReplayTimeline.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "fast_forward.h"
 #include "log.h"
+#include "util.h"
 
 using namespace std;
 
@@ -77,6 +87,7 @@ ReplayTimeline::~ReplayTimeline() {
       itv->checkpoint = nullptr;
     }
   }
+  progress_model.save();
 }
 
 static bool equal_regs(const Registers& r1, const Registers& r2) {
@@ -305,8 +316,13 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
     if (current_key < key) {
       // We can use the current session, so do nothing.
     } else {
-      // nowhere earlier to go, so restart from beginning.
-      current = ReplaySession::create(current->trace_reader().dir());
+      // nowhere earlier to go, so restart from the last checkpoint saved to
+      // disk before |key|, or from the beginning.
+      string dir = current->trace_reader().dir();
+      current = ReplaySession::create_from_checkpoint(dir, key.trace_time);
+      if (!current) {
+        current = ReplaySession::create(dir);
+      }
       breakpoints_applied = false;
       current_at_or_after_mark = nullptr;
       current->set_flags(session_flags);
@@ -409,7 +425,7 @@ ReplayResult ReplayTimeline::replay_step_to_mark(
     ReplaySession::StepConstraints constraints =
         strategy.setup_step_constraints();
     constraints.stop_at_time = mark.ptr->proto.key.trace_time;
-    result = current->replay_step(constraints);
+    result = replay_step_measured(constraints);
     update_strategy_and_fix_watchpoint_quirk(strategy, constraints, result,
                                              before);
     return result;
@@ -429,7 +445,7 @@ ReplayResult ReplayTimeline::replay_step_to_mark(
     ReplaySession::StepConstraints constraints =
         strategy.setup_step_constraints();
     constraints.ticks_target = mark.ptr->proto.key.ticks - 1;
-    result = current->replay_step(constraints);
+    result = replay_step_measured(constraints);
     bool approaching_ticks_target =
         result.break_status.approaching_ticks_target;
     result.break_status.approaching_ticks_target = false;
@@ -461,7 +477,7 @@ ReplayResult ReplayTimeline::replay_step_to_mark(
     ASSERT(t, succeeded);
     ReplaySession::StepConstraints constraints =
         strategy.setup_step_constraints();
-    result = current->replay_step(constraints);
+    result = replay_step_measured(constraints);
     t->vm()->remove_breakpoint(mark_addr_code, BKPT_USER);
     // If we hit our breakpoint and there is no client breakpoint there,
     // pretend we didn't hit it.
@@ -484,7 +500,7 @@ ReplayResult ReplayTimeline::replay_step_to_mark(
   // to the state before the mark and return, then the next call to
   // replay_step_to_mark will singlestep into the mark state.
   constraints.stop_before_states.push_back(&mark.ptr->proto.regs);
-  result = current->replay_step(constraints);
+  result = replay_step_measured(constraints);
   // Hide internal singlestep but preserve other break statuses
   result.break_status.singlestep_complete = false;
   return result;
@@ -497,7 +513,7 @@ void ReplayTimeline::seek_to_proto_mark(const ProtoMark& pmark) {
     if (current->trace_reader().time() < pmark.key.trace_time) {
       ReplaySession::StepConstraints constraints(RUN_CONTINUE);
       constraints.stop_at_time = pmark.key.trace_time;
-      current->replay_step(constraints);
+      replay_step_measured(constraints);
     } else {
       ReplayTask* t = current->current_task();
       remote_code_ptr mark_addr = pmark.regs.ip();
@@ -507,12 +523,12 @@ void ReplayTimeline::seek_to_proto_mark(const ProtoMark& pmark) {
         // this IP.
         ReplaySession::StepConstraints constraints(RUN_SINGLESTEP_FAST_FORWARD);
         constraints.stop_before_states.push_back(&pmark.regs);
-        current->replay_step(constraints);
+        replay_step_measured(constraints);
       } else {
         // Get a shared reference to t->vm() in case t dies during replay_step
         shared_ptr<AddressSpace> vm = t->vm();
         vm->add_breakpoint(mark_addr, BKPT_USER);
-        current->replay_step(RUN_CONTINUE);
+        replay_step_measured(RUN_CONTINUE);
         vm->remove_breakpoint(mark_addr, BKPT_USER);
       }
     }
@@ -578,7 +594,7 @@ bool ReplayTimeline::fix_watchpoint_coalescing_quirk(ReplayResult& result,
         // RUN_SINGLESTEP_FAST_FORWARD always avoids the coalescing quirk, so
         // if a watchpoint is triggered by the string instruction at
         // string_instruction_ip, it will have the correct timing.
-        result = current->replay_step(RUN_SINGLESTEP_FAST_FORWARD);
+        result = replay_step_measured(RUN_SINGLESTEP_FAST_FORWARD);
         if (!result.break_status.watchpoints_hit.empty()) {
           LOG(debug) << "Fixed x86-string coalescing quirk; now at "
                      << current_mark_key() << " (new cx "
@@ -588,12 +604,12 @@ bool ReplayTimeline::fix_watchpoint_coalescing_quirk(ReplayResult& result,
       } else {
         ReplaySession::StepConstraints constraints(RUN_CONTINUE);
         constraints.ticks_target = after_ticks - 1;
-        result = current->replay_step(constraints);
+        result = replay_step_measured(constraints);
         approaching_ticks_target = result.break_status.approaching_ticks_target;
       }
       ASSERT(t, t->tick_count() <= after_ticks) << "We went too far!";
     } else {
-      current->replay_step(RUN_CONTINUE);
+      replay_step_measured(RUN_CONTINUE);
     }
   }
   return true;
@@ -622,6 +638,7 @@ void ReplayTimeline::remove_breakpoint(ReplayTask* t, remote_code_ptr addr) {
   ASSERT(t, has_breakpoint_at_address(t, addr));
   auto it = breakpoints.lower_bound(make_tuple(t->vm()->uid(), addr, nullptr));
   breakpoints.erase(it);
+  maybe_free_condition_stub_pages();
 }
 
 bool ReplayTimeline::has_breakpoint_at_address(ReplayTask* t,
@@ -675,6 +692,7 @@ void ReplayTimeline::remove_breakpoints_and_watchpoints() {
   unapply_breakpoints_and_watchpoints();
   breakpoints.clear();
   watchpoints.clear();
+  maybe_free_condition_stub_pages();
 }
 
 void ReplayTimeline::apply_breakpoints_internal() {
@@ -734,7 +752,7 @@ void ReplayTimeline::unapply_breakpoints_and_watchpoints() {
 ReplayResult ReplayTimeline::singlestep_with_breakpoints_disabled() {
   apply_breakpoints_and_watchpoints();
   unapply_breakpoints_internal();
-  auto result = current->replay_step(RUN_SINGLESTEP);
+  auto result = replay_step_measured(RUN_SINGLESTEP);
   apply_breakpoints_internal();
   return result;
 }
@@ -762,7 +780,7 @@ bool ReplayTimeline::run_forward_to_intermediate_point(const Mark& end,
     ReplaySession::StepConstraints constraints(RUN_CONTINUE);
     constraints.stop_at_time = mid;
     while (current->trace_reader().time() < mid) {
-      current->replay_step(constraints);
+      replay_step_measured(constraints);
     }
     assert(current->trace_reader().time() == mid);
     LOG(debug) << "Ran forward to mid event " << current_mark_key();
@@ -774,7 +792,7 @@ bool ReplayTimeline::run_forward_to_intermediate_point(const Mark& end,
     ReplaySession::StepConstraints constraints(RUN_CONTINUE);
     constraints.stop_at_time = end.ptr->proto.key.trace_time;
     while (current->trace_reader().time() < end.ptr->proto.key.trace_time) {
-      current->replay_step(constraints);
+      replay_step_measured(constraints);
     }
     assert(current->trace_reader().time() == end.ptr->proto.key.trace_time);
     LOG(debug) << "Ran forward to event " << current_mark_key();
@@ -799,11 +817,11 @@ bool ReplayTimeline::run_forward_to_intermediate_point(const Mark& end,
     // We can only try stepping if we won't end up at `end`
     ReplaySession::StepConstraints constraints(RUN_CONTINUE);
     constraints.ticks_target = target;
-    ReplayResult result = current->replay_step(constraints);
+    ReplayResult result = replay_step_measured(constraints);
     if (!m.equal_states(*current)) {
       while (t->tick_count() < target &&
              !result.break_status.approaching_ticks_target) {
-        result = current->replay_step(constraints);
+        result = replay_step_measured(constraints);
       }
       LOG(debug) << "Ran forward to " << current_mark_key();
       return true;
@@ -834,7 +852,7 @@ bool ReplayTimeline::run_forward_to_intermediate_point(const Mark& end,
     ReplaySession::StepConstraints constraints =
         ReplaySession::StepConstraints(RUN_SINGLESTEP_FAST_FORWARD);
     constraints.stop_before_states.push_back(&end.ptr->proto.regs);
-    ReplayResult result = current->replay_step(constraints);
+    ReplayResult result = replay_step_measured(constraints);
     if (at_mark(end)) {
       assert(tmp_session);
       current = move(tmp_session);
@@ -861,6 +879,231 @@ static ReplayTask* to_replay_task(const BreakStatus& status) {
   return static_cast<ReplayTask*>(status.task);
 }
 
+bool ReplayTimeline::seek_to_disk_checkpoint(TraceFrame::Time time) {
+  ReplaySession::shr_ptr session = ReplaySession::create_from_checkpoint(
+      current->trace_reader().dir(), time + 1);
+  if (!session) {
+    LOG(warn) << "Couldn't restore disk checkpoint at event " << time;
+    return false;
+  }
+  current = move(session);
+  breakpoints_applied = false;
+  current_at_or_after_mark = nullptr;
+  current->set_flags(session_flags);
+  current->set_visible_execution(false);
+  return true;
+}
+
+void ReplayTimeline::scan_interval_for_break(
+    TraceFrame::Time start, TraceFrame::Time end,
+    const std::function<bool(ReplayTask* t)>& stop_filter, int result_fd) {
+  // This process has copies of our parent's sessions, but isn't the tracer
+  // of their tasks. Leak them so their destructors never touch those tasks.
+  new ReplaySession::shr_ptr(current);
+  char found = 'n';
+  current = ReplaySession::create_from_checkpoint(
+      current->trace_reader().dir(), start + 1);
+  if (!current) {
+    found = 'e';
+  } else {
+    current->set_flags(session_flags);
+    current->set_visible_execution(false);
+    breakpoints_applied = false;
+    current_at_or_after_mark = nullptr;
+    bool at_breakpoint = false;
+    while (current->current_trace_frame().time() < end) {
+      apply_breakpoints_and_watchpoints();
+      ReplayResult result;
+      if (at_breakpoint) {
+        result = singlestep_with_breakpoints_disabled();
+      } else {
+        ReplaySession::StepConstraints constraints(RUN_CONTINUE);
+        constraints.stop_at_time = end;
+        result = replay_step_measured(constraints);
+      }
+      if (result.status == REPLAY_EXITED) {
+        break;
+      }
+      at_breakpoint = result.break_status.breakpoint_hit;
+      evaluate_conditions(result);
+      if (result.break_status.any_break() &&
+          !stop_filter(to_replay_task(result.break_status))) {
+        result.break_status = BreakStatus();
+      }
+      if (result.break_status.any_break() ||
+          is_start_of_reverse_execution_barrier_event()) {
+        found = 'y';
+        break;
+      }
+    }
+  }
+  if (write(result_fd, &found, 1) != 1) {
+    _exit(1);
+  }
+  _exit(0);
+}
+
+bool ReplayTimeline::find_break_interval_in_parallel(
+    Mark& end, const std::function<bool(ReplayTask* t)>& stop_filter,
+    const std::function<bool()>& interrupt_check) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 2) {
+    return false;
+  }
+  // Only consider the disk checkpoints before |end|, and only if we have no
+  // in-memory checkpoint between the last of them and |end| that the
+  // sequential search could use more cheaply.
+  vector<TraceFrame::Time> times =
+      ReplaySession::saved_checkpoints(current->trace_reader().dir());
+  const MarkKey& end_key = end.ptr->proto.key;
+  while (!times.empty() && times.back() > end_key.trace_time) {
+    times.pop_back();
+  }
+  // Checkpoints below the reverse execution barrier are useless.
+  while (!times.empty() && times.front() < reverse_execution_barrier_event) {
+    times.erase(times.begin());
+  }
+  if (times.size() < 3) {
+    return false;
+  }
+  auto it = marks_with_checkpoints.lower_bound(end_key);
+  if (it != marks_with_checkpoints.begin() &&
+      (--it)->first.trace_time >= times.back()) {
+    return false;
+  }
+
+  // Hold on to the current session so we can go back to it if we end up
+  // not taking the parallel path.
+  ReplaySession::shr_ptr saved_session = current;
+  bool saved_breakpoints_applied = breakpoints_applied;
+  shared_ptr<InternalMark> saved_at_or_after_mark = current_at_or_after_mark;
+  auto restore_saved_session = [&]() {
+    current = move(saved_session);
+    breakpoints_applied = saved_breakpoints_applied;
+    current_at_or_after_mark = move(saved_at_or_after_mark);
+    return false;
+  };
+
+  // The intervals between disk checkpoints are only complete if the
+  // sequential search has already covered everything from the last one to
+  // |end|, i.e. |end| is the state of the last checkpoint.
+  if (!seek_to_disk_checkpoint(times.back())) {
+    return false;
+  }
+  if (!(mark() == end)) {
+    // Let the sequential search cover [times.back(), end) from |end|.
+    return restore_saved_session();
+  }
+
+  // Scan the intervals [times[i], times[i + 1]), latest first, using one
+  // process per interval. The answer is the latest interval with a break,
+  // once all the intervals after it are known to have none.
+  enum IntervalState { UNKNOWN, RUNNING, NO_BREAK, BREAK };
+  size_t interval_count = times.size() - 1;
+  vector<IntervalState> states(interval_count, UNKNOWN);
+  struct Worker {
+    pid_t pid;
+    size_t interval;
+    int fd;
+  };
+  vector<Worker> workers;
+  size_t max_workers = min<size_t>(cpus, interval_count);
+  size_t next = interval_count;
+  ssize_t answer = -2;
+  bool failed = false;
+  LOG(debug) << "Scanning " << interval_count << " intervals before " << end
+             << " with up to " << max_workers << " processes";
+  while (answer == -2 && !failed) {
+    while (workers.size() < max_workers && next > 0) {
+      --next;
+      int fds[2];
+      if (pipe2(fds, O_CLOEXEC) < 0) {
+        failed = true;
+        break;
+      }
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(fds[0]);
+        scan_interval_for_break(times[next], times[next + 1], stop_filter,
+                                fds[1]);
+      }
+      close(fds[1]);
+      if (pid < 0) {
+        close(fds[0]);
+        failed = true;
+        break;
+      }
+      states[next] = RUNNING;
+      workers.push_back({ pid, next, fds[0] });
+    }
+    if (failed || workers.empty()) {
+      break;
+    }
+
+    vector<struct pollfd> pfds;
+    for (auto& w : workers) {
+      pfds.push_back({ w.fd, POLLIN, 0 });
+    }
+    int ret = poll(pfds.data(), pfds.size(), 100);
+    if (ret < 0 && errno != EINTR) {
+      failed = true;
+    }
+    if (interrupt_check()) {
+      failed = true;
+    }
+    for (ssize_t i = pfds.size() - 1; !failed && i >= 0; --i) {
+      if (!pfds[i].revents) {
+        continue;
+      }
+      char found = 0;
+      if (read(workers[i].fd, &found, 1) != 1 || found == 'e') {
+        failed = true;
+        break;
+      }
+      states[workers[i].interval] = found == 'y' ? BREAK : NO_BREAK;
+      close(workers[i].fd);
+      waitpid(workers[i].pid, nullptr, 0);
+      workers.erase(workers.begin() + i);
+    }
+
+    answer = -1;
+    for (ssize_t i = interval_count - 1; i >= 0; --i) {
+      if (states[i] == BREAK) {
+        answer = i;
+        break;
+      }
+      if (states[i] != NO_BREAK) {
+        answer = -2;
+        break;
+      }
+    }
+  }
+  // Cancel the intervals we no longer need.
+  for (auto& w : workers) {
+    kill(w.pid, SIGKILL);
+    close(w.fd);
+    waitpid(w.pid, nullptr, 0);
+  }
+  if (failed) {
+    return restore_saved_session();
+  }
+
+  TraceFrame::Time time;
+  if (answer >= 0) {
+    LOG(debug) << "Last break before " << end << " is between events "
+               << times[answer] << " and " << times[answer + 1];
+    time = times[answer + 1];
+  } else {
+    LOG(debug) << "No break between events " << times[0] << " and " << end;
+    time = times[0];
+  }
+  if (!seek_to_disk_checkpoint(time)) {
+    return restore_saved_session();
+  }
+  end = mark();
+  return true;
+}
+
 ReplayResult ReplayTimeline::reverse_continue(
     const std::function<bool(ReplayTask* t)>& stop_filter,
     const std::function<bool()>& interrupt_check) {
@@ -880,6 +1123,7 @@ ReplayResult ReplayTimeline::reverse_continue(
     if (start >= end) {
       checkpoint_at_first_break = true;
       if (restart_points.empty()) {
+        find_break_interval_in_parallel(end, stop_filter, interrupt_check);
         seek_to_before_key(end.ptr->proto.key);
         start = mark();
         if (start >= end) {
@@ -1067,6 +1311,15 @@ ReplayResult ReplayTimeline::reverse_singlestep(
     Mark end = outer;
     Mark start;
     bool seen_barrier;
+    // Once we're within the PMU skid of the target, block-step to it and
+    // only singlestep the last block. A block step can run past |end|, in
+    // which case we redo this interval, block-stepping only while the
+    // stepping task's ticks are below |block_step_limit|. That was the
+    // start of the overshooting block, which follows a taken branch, so no
+    // block step starting before it can run past it. The approach point
+    // where PMU interrupt skid leaves us varies between runs, so the limit
+    // is in ticks rather than a count of blocks.
+    Ticks block_step_limit = INT64_MAX;
 
     while (true) {
       MarkKey current_key = end.ptr->proto.key;
@@ -1097,6 +1350,8 @@ ReplayResult ReplayTimeline::reverse_singlestep(
       ReplaySession::StepConstraints constraints(RUN_CONTINUE);
       bool approaching_ticks_target = false;
       bool seen_other_task_break = false;
+      bool block_step_overshot = false;
+      bool first_block_step = true;
       while (!at_mark(end)) {
         ReplayTask* t = current->current_task();
         if (stop_filter(t) && current->done_initial_exec()) {
@@ -1110,13 +1365,38 @@ ReplayResult ReplayTimeline::reverse_singlestep(
             unapply_breakpoints_and_watchpoints();
             constraints.ticks_target =
                 constraints.command == RUN_CONTINUE ? ticks_target : 0;
+            Ticks ticks_before = t->tick_count();
+            if (constraints.command == RUN_SINGLEBLOCK &&
+                ticks_before >= block_step_limit) {
+              // Block-stepping from here ran past |end| last time.
+              constraints =
+                  ReplaySession::StepConstraints(RUN_SINGLESTEP_FAST_FORWARD);
+            }
             ReplayResult result;
-            result = current->replay_step(constraints);
+            result = replay_step_measured(constraints);
             if (result.break_status.approaching_ticks_target) {
               LOG(debug) << "   approached ticks target at "
                          << current_mark_key();
-              constraints =
-                  ReplaySession::StepConstraints(RUN_SINGLESTEP_FAST_FORWARD);
+              constraints = ReplaySession::StepConstraints(
+                  block_step_limit > 0 ? RUN_SINGLEBLOCK
+                                       : RUN_SINGLESTEP_FAST_FORWARD);
+            } else if (constraints.command == RUN_SINGLEBLOCK) {
+              ReplayTask* stepped = current->find_task(step_tuid);
+              if (stepped) {
+                current->accumulate_block_step(ticks_before,
+                                               stepped->tick_count());
+              }
+              // Only a key before end's proves we haven't passed |end|.
+              if (!(current_mark_key() < end.ptr->proto.key)) {
+                LOG(debug) << "   block step overshot to "
+                           << current_mark_key();
+                block_step_overshot = true;
+                // If the first block step overshot, we may not have started
+                // it at a block boundary, so don't block-step at all.
+                block_step_limit = first_block_step ? 0 : ticks_before;
+                break;
+              }
+              first_block_step = false;
             }
           } else {
             if (seen_other_task_break) {
@@ -1125,7 +1405,7 @@ ReplayResult ReplayTimeline::reverse_singlestep(
               apply_breakpoints_and_watchpoints();
             }
             constraints.ticks_target = 0;
-            ReplayResult result = current->replay_step(RUN_CONTINUE);
+            ReplayResult result = replay_step_measured(RUN_CONTINUE);
             if (result.break_status.any_break()) {
               seen_other_task_break = true;
             }
@@ -1133,7 +1413,7 @@ ReplayResult ReplayTimeline::reverse_singlestep(
         } else {
           unapply_breakpoints_and_watchpoints();
           constraints.ticks_target = 0;
-          current->replay_step(RUN_CONTINUE);
+          replay_step_measured(RUN_CONTINUE);
         }
         if (is_start_of_reverse_execution_barrier_event()) {
           seen_barrier = true;
@@ -1141,6 +1421,12 @@ ReplayResult ReplayTimeline::reverse_singlestep(
         maybe_add_reverse_exec_checkpoint(EXPECT_SHORT_REVERSE_EXECUTION);
       }
 
+      if (block_step_overshot) {
+        LOG(debug) << "Redoing interval, block-stepping below "
+                   << block_step_limit << " ticks";
+        current->accumulate_block_step_overshoot();
+        continue;
+      }
       if (approaching_ticks_target || seen_barrier) {
         break;
       }
@@ -1178,13 +1464,13 @@ ReplayResult ReplayTimeline::reverse_singlestep(
           ReplaySession::StepConstraints constraints(
               RUN_SINGLESTEP_FAST_FORWARD);
           constraints.stop_before_states.push_back(&end.ptr->proto.regs);
-          result = current->replay_step(constraints);
+          result = replay_step_measured(constraints);
           update_observable_break_status(now, result);
           if (result.break_status.breakpoint_hit) {
             // If we hit a breakpoint while singlestepping, we didn't
             // make any progress.
             unapply_breakpoints_and_watchpoints();
-            result = current->replay_step(constraints);
+            result = replay_step_measured(constraints);
             update_observable_break_status(now, result);
           }
           if (result.break_status.singlestep_complete) {
@@ -1201,14 +1487,14 @@ ReplayResult ReplayTimeline::reverse_singlestep(
             step_start = now;
           }
         } else {
-          result = current->replay_step(RUN_CONTINUE);
+          result = replay_step_measured(RUN_CONTINUE);
           update_observable_break_status(now, result);
           if (result.break_status.any_break()) {
             seen_other_task_break = true;
           }
           if (result.break_status.breakpoint_hit) {
             unapply_breakpoints_and_watchpoints();
-            result = current->replay_step(RUN_SINGLESTEP_FAST_FORWARD);
+            result = replay_step_measured(RUN_SINGLESTEP_FAST_FORWARD);
             update_observable_break_status(now, result);
             if (result.break_status.any_break()) {
               seen_other_task_break = true;
@@ -1217,7 +1503,7 @@ ReplayResult ReplayTimeline::reverse_singlestep(
         }
       } else {
         unapply_breakpoints_and_watchpoints();
-        result = current->replay_step(RUN_CONTINUE);
+        result = replay_step_measured(RUN_CONTINUE);
         no_watchpoints_hit_interval_start = Mark();
         now = mark();
       }
@@ -1320,7 +1606,7 @@ ReplayResult ReplayTimeline::replay_step_forward(
   current->set_visible_execution(true);
   ReplaySession::StepConstraints constraints(command);
   constraints.stop_at_time = stop_at_time;
-  result = current->replay_step(constraints);
+  result = replay_step_measured(constraints);
   current->set_visible_execution(false);
   if (command == RUN_CONTINUE) {
     // Since it's easy for us to fix the coalescing quirk for forward
@@ -1354,21 +1640,86 @@ ReplayResult ReplayTimeline::reverse_singlestep(
                             interrupt_check);
 }
 
+ReplayTimeline::Progress ReplayTimeline::progress_of(
+    const Session::Statistics& stats) {
+  return Progress(progress_model.estimate(stats));
+}
+
 ReplayTimeline::Progress ReplayTimeline::estimate_progress() {
-  Session::Statistics stats = current->statistics();
-  // The following parameters were estimated by running Firefox startup
-  // and shutdown in an opt build on a Lenovo W530 laptop, replaying with
-  // DUMP_STATS_PERIOD set to 100 (twice, and using only values from the
-  // second run, to ensure caches are warm), and then minimizing least-squares
-  // error.
-  static const double microseconds_per_tick = 0.0020503143;
-  static const double microseconds_per_syscall = 39.6793587609;
-  static const double microseconds_per_byte_written = 0.001833611;
-  static const double microseconds_constant = 997.8257239043;
-  return Progress(microseconds_per_tick * stats.ticks_processed +
-                  microseconds_per_syscall * stats.syscalls_performed +
-                  microseconds_per_byte_written * stats.bytes_written +
-                  microseconds_constant);
+  return progress_of(current->statistics());
+}
+
+void ReplayTimeline::install_condition_stubs() {
+  auto it = breakpoints.begin();
+  while (it != breakpoints.end()) {
+    AddressSpaceUid auid = get<0>(*it);
+    remote_code_ptr addr = get<1>(*it);
+    AddressSpace* vm = current->find_address_space(auid);
+    vector<uint8_t> code;
+    vector<MemoryRange> loads;
+    int user_refs = 0;
+    bool ok = vm && !vm->task_set().empty();
+    // Every breakpoint at this address needs a condition we can evaluate
+    // in the tracee.
+    for (; it != breakpoints.end() && get<0>(*it) == auid &&
+           get<1>(*it) == addr;
+         ++it) {
+      ++user_refs;
+      const BreakpointCondition* cond = get<2>(*it).get();
+      ok = ok && cond && cond->generate_x86_64_code(*vm, addr, &code, &loads);
+    }
+    if (ok) {
+      vm->install_condition_stub(*vm->task_set().begin(), addr, user_refs,
+                                 code, loads);
+    }
+  }
+}
+
+void ReplayTimeline::remove_condition_stubs() {
+  for (AddressSpace* vm : current->vms()) {
+    vm->remove_condition_stubs();
+  }
+}
+
+void ReplayTimeline::maybe_free_condition_stub_pages() {
+  for (auto& bp : breakpoints) {
+    if (get<2>(bp)) {
+      return;
+    }
+  }
+  // Sessions restored from checkpoints made while we had conditional
+  // breakpoints may still have the pages too, so this is also checked
+  // before each step.
+  for (AddressSpace* vm : current->vms()) {
+    if (vm->has_condition_stubs() && !vm->task_set().empty()) {
+      vm->free_condition_stub_pages(*vm->task_set().begin());
+    }
+  }
+}
+
+ReplayResult ReplayTimeline::replay_step_measured(
+    const ReplaySession::StepConstraints& constraints) {
+  // Stopping inside a stub would be hard to handle, so don't use them when
+  // the step may be interrupted asynchronously, either to reach the next
+  // event or by the ticks interrupt for |ticks_target|.
+  const Event& ev = current->current_trace_frame().event();
+  bool use_condition_stubs = constraints.command == RUN_CONTINUE &&
+                             constraints.ticks_target == 0 &&
+                             breakpoints_applied && ev.type() != EV_SCHED &&
+                             !ev.is_signal_event();
+  maybe_free_condition_stub_pages();
+  if (use_condition_stubs) {
+    install_condition_stubs();
+  }
+  Session::Statistics before = current->statistics();
+  double start = monotonic_now_sec();
+  ReplayResult result = current->replay_step(constraints);
+  progress_model.observe(before, current->statistics(),
+                         (monotonic_now_sec() - start) * 1000000);
+  if (use_condition_stubs) {
+    remove_condition_stubs();
+  }
+  return result;
 }
 
 /*
@@ -1432,6 +1783,46 @@ static ReplayTimeline::Progress next_interval_length(
   return len + expecting_reverse_exec_inter_checkpoint_interval;
 }
 
+/**
+ * Return the dirty memory private to |tid|'s address space. A checkpoint's
+ * processes start out sharing all their memory copy-on-write with the
+ * session they were cloned from, and gain private pages as that session
+ * writes to its copies. Those private pages are what discarding the
+ * checkpoint frees. Pages that several checkpoints still share are only
+ * charged once all but one of them are gone.
+ */
+static uint64_t private_dirty_bytes(pid_t tid) {
+  char path[PATH_MAX];
+  sprintf(path, "/proc/%d/smaps_rollup", tid);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    // smaps_rollup needs Linux 4.14.
+    sprintf(path, "/proc/%d/smaps", tid);
+    f = fopen(path, "r");
+    if (!f) {
+      return 0;
+    }
+  }
+  static const char field[] = "Private_Dirty:";
+  uint64_t total_kb = 0;
+  char line[1000];
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, field, sizeof(field) - 1) == 0) {
+      total_kb += strtoull(line + sizeof(field) - 1, nullptr, 10);
+    }
+  }
+  fclose(f);
+  return total_kb * 1024;
+}
+
+static uint64_t checkpoint_memory(ReplaySession& checkpoint) {
+  uint64_t total = 0;
+  for (AddressSpace* vm : checkpoint.vms()) {
+    total += private_dirty_bytes((*vm->task_set().begin())->tid);
+  }
+  return total;
+}
+
 void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
     CheckpointStrategy strategy) {
   discard_future_reverse_exec_checkpoints();
@@ -1439,7 +1830,7 @@ void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
   Progress now = estimate_progress();
   auto it = reverse_exec_checkpoints.rbegin();
   if (it != reverse_exec_checkpoints.rend() &&
-      it->second >= now - inter_checkpoint_interval(strategy)) {
+      progress_of(it->second) >= now - inter_checkpoint_interval(strategy)) {
     // Latest checkpoint is close enough; we don't need to do anything.
     return;
   }
@@ -1455,20 +1846,20 @@ void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
 
   Mark m = add_explicit_checkpoint();
   LOG(debug) << "Creating reverse-exec checkpoint at " << m;
-  reverse_exec_checkpoints[m] = now;
+  reverse_exec_checkpoints[m] = current->statistics();
 }
 
 void ReplayTimeline::discard_future_reverse_exec_checkpoints() {
   Progress now = estimate_progress();
   while (true) {
     auto it = reverse_exec_checkpoints.rbegin();
-    if (it == reverse_exec_checkpoints.rend() || it->second <= now) {
+    if (it == reverse_exec_checkpoints.rend() ||
+        progress_of(it->second) <= now) {
       break;
     }
     LOG(debug) << "Discarding reverse-exec future checkpoint at "
                << *it->first.ptr;
-    remove_explicit_checkpoint(it->first);
-    reverse_exec_checkpoints.erase(it->first);
+    discard_reverse_exec_checkpoint(it->first);
   }
 }
 
@@ -1488,7 +1879,7 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
     // checkpoint entry < start in 'tmp_it'.
     auto tmp_it = it;
     while (tmp_it != reverse_exec_checkpoints.rend() &&
-           tmp_it->second >= start) {
+           progress_of(tmp_it->second) >= start) {
       ++checkpoints_in_range;
       ++tmp_it;
     }
@@ -1507,9 +1898,78 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
 
   for (auto& m : checkpoints_to_delete) {
     LOG(debug) << "Discarding reverse-exec checkpoint at " << m;
-    remove_explicit_checkpoint(m);
-    reverse_exec_checkpoints.erase(m);
+    discard_reverse_exec_checkpoint(m);
   }
+
+  enforce_reverse_exec_checkpoint_budget(now);
+}
+
+static uint64_t default_checkpoint_memory_budget() {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  return pages > 0 ? (uint64_t)pages * page_size() / 4 : UINT64_MAX;
+}
+
+void ReplayTimeline::enforce_reverse_exec_checkpoint_budget(Progress now) {
+  uint64_t budget = session_flags.checkpoint_memory_budget
+                        ? session_flags.checkpoint_memory_budget
+                        : default_checkpoint_memory_budget();
+  struct Checkpoint {
+    Mark mark;
+    Progress progress;
+    uint64_t memory;
+  };
+  vector<Checkpoint> checkpoints;
+  uint64_t total = 0;
+  // Checkpoints gain private memory as the replay moves on, so measure them
+  // again each time we add one.
+  for (auto& c : reverse_exec_checkpoints) {
+    uint64_t memory = checkpoint_memory(*c.first.ptr->checkpoint);
+    checkpoints.push_back({ c.first, progress_of(c.second), memory });
+    total += memory;
+  }
+
+  while (total > budget) {
+    // Reverse execution to a point between two checkpoints replays from the
+    // earlier one, so its expected cost grows with the square of the
+    // interval. Removing a checkpoint joining intervals of lengths a and b
+    // adds (a+b)^2 - a^2 - b^2 = 2ab to the total.
+    size_t victim = 0;
+    double best = -1;
+    for (size_t i = 0; i < checkpoints.size(); ++i) {
+      if (!checkpoints[i].memory) {
+        continue;
+      }
+      double a = checkpoints[i].progress -
+                 (i > 0 ? checkpoints[i - 1].progress : 0);
+      double b = (i + 1 < checkpoints.size() ? checkpoints[i + 1].progress
+                                             : now) -
+                 checkpoints[i].progress;
+      double cost = 2 * a * b / checkpoints[i].memory;
+      if (best < 0 || cost < best) {
+        victim = i;
+        best = cost;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    Mark m = checkpoints[victim].mark;
+    LOG(debug) << "Discarding reverse-exec checkpoint at " << m << " using "
+               << checkpoints[victim].memory << " bytes to stay within "
+               << budget << " bytes";
+    total -= checkpoints[victim].memory;
+    checkpoints.erase(checkpoints.begin() + victim);
+    discard_reverse_exec_checkpoint(m);
+  }
+  LOG(debug) << "Reverse-exec checkpoints (" << checkpoints.size()
+             << ") use " << total << " of " << budget << " bytes";
+}
+
+void ReplayTimeline::discard_reverse_exec_checkpoint(const Mark& m) {
+  // Copy |m| first; it may refer to a key we're about to erase.
+  Mark mark = m;
+  remove_explicit_checkpoint(mark);
+  reverse_exec_checkpoints.erase(mark);
 }
 
 ReplayTimeline::Mark ReplayTimeline::set_short_checkpoint() {
@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "BreakpointCondition.h"
+#include "ProgressModel.h"
 #include "Registers.h"
 #include "ReplaySession.h"
 #include "ReplayTask.h"
@@ -391,6 +392,33 @@ private:
   Mark find_singlestep_before(const Mark& mark);
   bool is_start_of_reverse_execution_barrier_event();
 
+  /**
+   * Replace the current session with one restored from the checkpoint saved
+   * on disk at |time|. Returns false, leaving the current session alone, if
+   * the checkpoint can't be restored.
+   */
+  bool seek_to_disk_checkpoint(TraceFrame::Time time);
+  /**
+   * Run in a forked process: replay from the disk checkpoint at |start| to
+   * event |end| and write to |result_fd| whether a breakpoint, watchpoint or
+   * signal accepted by |stop_filter| fired. Never returns.
+   */
+  void scan_interval_for_break(
+      TraceFrame::Time start, TraceFrame::Time end,
+      const std::function<bool(ReplayTask* t)>& stop_filter, int result_fd);
+  /**
+   * When reverse_continue has searched back to |end| without finding a break
+   * and the trace has disk checkpoints before |end|, replay the intervals
+   * between them concurrently in forked processes to find the latest one
+   * with a break, cancelling the scans of earlier intervals once it's
+   * known. On success, seeks to the checkpoint ending that interval (or the
+   * first checkpoint, if there was no break), sets |end| to it and returns
+   * true. Otherwise returns false with the current session unchanged.
+   */
+  bool find_break_interval_in_parallel(
+      Mark& end, const std::function<bool(ReplayTask* t)>& stop_filter,
+      const std::function<bool()>& interrupt_check);
+
   void update_observable_break_status(ReplayTimeline::Mark& now,
                                       const ReplayResult& result);
   ReplayResult reverse_singlestep(
@@ -402,6 +430,30 @@ private:
   static bool less_than(const Mark& m1, const Mark& m2);
 
   Progress estimate_progress();
+  Progress progress_of(const Session::Statistics& stats);
+
+  /**
+   * Run current->replay_step, feeding the time it took into progress_model.
+   * While continuing, breakpoint conditions are evaluated in the tracee when
+   * possible.
+   */
+  ReplayResult replay_step_measured(
+      const ReplaySession::StepConstraints& constraints);
+  ReplayResult replay_step_measured(RunCommand command) {
+    return replay_step_measured(ReplaySession::StepConstraints(command));
+  }
+
+  /**
+   * Install stubs in the tracees that evaluate the conditions of conditional
+   * breakpoints without stopping, where possible.
+   */
+  void install_condition_stubs();
+  void remove_condition_stubs();
+  /**
+   * If no breakpoint has a condition, unmap the condition stub pages from
+   * the current session's address spaces.
+   */
+  void maybe_free_condition_stub_pages();
 
   /**
    * Called when the current session has moved forward to a new execution
@@ -416,11 +468,18 @@ private:
    * this to stop the number of checkpoints growing out of control.
    */
   void discard_past_reverse_exec_checkpoints(CheckpointStrategy strategy);
+  /**
+   * Discard reverse-exec checkpoints until the memory they use is within
+   * session_flags.checkpoint_memory_budget, choosing the checkpoints whose
+   * loss slows reverse execution the least per byte freed.
+   */
+  void enforce_reverse_exec_checkpoint_budget(Progress now);
   /**
    * Discard all reverse-exec checkpoints that are in the future (they're
    * useless).
    */
   void discard_future_reverse_exec_checkpoints();
+  void discard_reverse_exec_checkpoint(const Mark& m);
 
   Mark set_short_checkpoint();
 
@@ -472,7 +531,14 @@ private:
   /**
    * Checkpoints used to accelerate reverse execution.
    */
-  std::map<Mark, Progress> reverse_exec_checkpoints;
+  std::map<Mark, Session::Statistics> reverse_exec_checkpoints;
+
+  /**
+   * Converts Session::Statistics to Progress. Checkpoints are stored with
+   * their statistics rather than their Progress because the model changes
+   * as it's fitted.
+   */
+  ProgressModel progress_model;
 
   /**
    * When these are non-null, then when singlestepping from
@@ -39,6 +39,8 @@ protected:
 RerunCommand RerunCommand::singleton(
     "rerun",
     " rr rerun [OPTION]... [<trace-dir>]\n"
+    "  -b, --singleblock          step to each taken branch instead of each\n"
+    "                             instruction\n"
     "  -e, --trace-end=<EVENT>    end tracing at <EVENT>\n"
     "  -r, --singlestep-registers=<REGS>\n"
     "                             dump registers <REGS> after each singlestep\n"
@@ -52,7 +54,9 @@ RerunCommand RerunCommand::singleton(
     "instruction repetitions are treated as a single instruction if not\n"
     "interrupted. A 'singlestep' includes events such as system-call-exit\n"
     "where tracee state changes without any user-level instructions actually\n"
-    "being executed.\n");
+    "being executed.\n"
+    "With --singleblock, registers are dumped after each taken branch, and\n"
+    "'icount' counts those steps instead of instructions.\n");
 
 enum TraceFieldKind {
   TRACE_EVENT_NUMBER,      // outputs 64-bit value
@@ -198,8 +202,12 @@ struct RerunFlags {
 
   vector<TraceField> singlestep_trace;
 
+  bool singleblock;
+
   RerunFlags()
-      : trace_start(0), trace_end(numeric_limits<decltype(trace_end)>::max()) {}
+      : trace_start(0),
+        trace_end(numeric_limits<decltype(trace_end)>::max()),
+        singleblock(false) {}
 };
 
 static int find_gp_reg(const string& reg) {
@@ -266,6 +274,7 @@ static bool parse_rerun_arg(vector<string>& args, RerunFlags& flags) {
   }
 
   static const OptionSpec options[] = {
+    { 'b', "singleblock", NO_PARAMETER },
     { 'e', "trace-end", NO_PARAMETER },
     { 'r', "singlestep-registers", HAS_PARAMETER },
     { 's', "trace-start", HAS_PARAMETER },
@@ -276,6 +285,9 @@ static bool parse_rerun_arg(vector<string>& args, RerunFlags& flags) {
   }
 
   switch (opt.short_name) {
+    case 'b':
+      flags.singleblock = true;
+      break;
     case 'e':
       if (!opt.verify_valid_int(1, UINT32_MAX)) {
         return false;
@@ -346,19 +358,23 @@ static void clear_breakpoint_after_cpuid(Task* t) {
 static int rerun(const string& trace_dir, const RerunFlags& flags) {
   ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
   uint64_t instruction_count_within_event = 0;
+  RunCommand step_command =
+      flags.singleblock ? RUN_SINGLEBLOCK : RUN_SINGLESTEP_FAST_FORWARD;
 
   while (replay_session->trace_reader().time() < flags.trace_end) {
     RunCommand cmd = RUN_CONTINUE;
     if (replay_session->done_initial_exec() &&
         !flags.singlestep_trace.empty() &&
         replay_session->trace_reader().time() >= flags.trace_start) {
-      cmd = RUN_SINGLESTEP_FAST_FORWARD;
+      cmd = step_command;
     }
 
     TraceFrame::Time before_time = replay_session->trace_reader().time();
     Event replayed_event = replay_session->current_trace_frame().event();
     Task* old_task = replay_session->current_task();
     remote_code_ptr old_ip = old_task ? old_task->ip() : remote_code_ptr();
+    TaskUid old_tuid = old_task ? old_task->tuid() : TaskUid();
+    Ticks old_ticks = old_task ? old_task->tick_count() : 0;
 
     bool set_breakpoint = maybe_set_breakpoint_after_cpuid(old_task);
     auto result = replay_session->replay_step(cmd);
@@ -382,8 +398,11 @@ static int rerun(const string& trace_dir, const RerunFlags& flags) {
     assert(result.status == REPLAY_CONTINUE);
     assert(result.break_status.watchpoints_hit.empty());
     assert(!result.break_status.breakpoint_hit);
-    assert(cmd == RUN_SINGLESTEP_FAST_FORWARD ||
-           !result.break_status.singlestep_complete);
+    assert(is_singlestep(cmd) || !result.break_status.singlestep_complete);
+    if (cmd == RUN_SINGLEBLOCK && replay_session->find_task(old_tuid)) {
+      replay_session->accumulate_block_step(old_ticks,
+                                            old_task->tick_count());
+    }
 
     // Treat singlesteps that partially executed a string instruction (that
     // was not interrupted) as not really singlestepping.
@@ -392,7 +411,7 @@ static int rerun(const string& trace_dir, const RerunFlags& flags) {
         !ignore_singlestep_for_event(replayed_event) &&
         (!result.did_fast_forward || old_ip != after_ip ||
          before_time < after_time);
-    if (!flags.singlestep_trace.empty() && cmd == RUN_SINGLESTEP_FAST_FORWARD &&
+    if (!flags.singlestep_trace.empty() && cmd == step_command &&
         (singlestep_really_complete ||
          (before_time < after_time &&
           treat_event_completion_as_singlestep_complete(replayed_event)))) {
@@ -409,6 +428,14 @@ static int rerun(const string& trace_dir, const RerunFlags& flags) {
     }
   }
 
+  if (flags.singleblock) {
+    auto stats = replay_session->statistics();
+    fprintf(stderr, "rr: %llu block steps retired %llu ticks, saving at least "
+                    "%llu singlesteps\n",
+            (unsigned long long)stats.block_steps,
+            (unsigned long long)stats.block_step_ticks,
+            (unsigned long long)stats.block_step_min_stops_saved);
+  }
   LOG(info) << "Rerun successfully finished";
   return 0;
 }
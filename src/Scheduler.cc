@@ -94,7 +94,8 @@ Scheduler::Scheduler(RecordSession& session)
       enable_chaos(false),
       enable_poll(false),
       last_reschedule_in_high_priority_only_interval(false),
-      must_run_task(nullptr) {}
+      must_run_task(nullptr),
+      parallel_(false) {}
 
 void Scheduler::set_enable_chaos(bool enable_chaos) {
   this->enable_chaos = enable_chaos;
@@ -128,6 +129,112 @@ int Scheduler::choose_random_priority(RecordTask* t) {
   return random_frac() < prob;
 }
 
+/**
+ * Tasks in different scheduling domains share no memory, so in parallel mode
+ * they can run at the same time. Tasks whose address space may share memory
+ * with another process, and tasks involved in emulated ptrace (where rr
+ * accesses one tracee's state on behalf of another), all belong to a single
+ * domain.
+ */
+static const void* compute_scheduling_domain(RecordTask* t) {
+  if (t->vm()->has_shared_mappings() || t->emulated_ptracer ||
+      !t->emulated_ptrace_tracees.empty()) {
+    return nullptr;
+  }
+  return t->vm().get();
+}
+
+/**
+ * True if |t| was resumed into a timeslice (i.e. not just into a blocking
+ * syscall) and we haven't seen it stop yet.
+ */
+static bool is_running_in_timeslice(RecordTask* t) {
+  return t->is_running() && !t->may_be_blocked() && !t->unstable;
+}
+
+const void* Scheduler::scheduling_domain(RecordTask* t) {
+  auto it = task_domains.find(t);
+  if (it != task_domains.end() && is_running_in_timeslice(t)) {
+    // Whatever happened to |t|'s address space or ptrace relationships while
+    // it was running, it stays in the domain it was started in until it
+    // stops.
+    return it->second;
+  }
+  const void* domain = compute_scheduling_domain(t);
+  task_domains[t] = domain;
+  return domain;
+}
+
+void Scheduler::stop_running_task(RecordTask* t) {
+  if (!is_running_in_timeslice(t)) {
+    return;
+  }
+  LOG(debug) << "  stopping " << t->tid << ", which we left running";
+  // A task running in a timeslice stops at the latest when its timeslice
+  // expires or it blocks.
+  t->wait();
+  LOG(debug) << "  deferring status " << t->status() << " of " << t->tid;
+  deferred_stops.insert(t);
+}
+
+void Scheduler::stop_running_tasks(const HasTaskSet::TaskSet& tasks) {
+  if (!parallel_) {
+    return;
+  }
+  for (Task* t : tasks) {
+    stop_running_task(static_cast<RecordTask*>(t));
+  }
+}
+
+void Scheduler::stop_all_running_tasks() {
+  if (!parallel_) {
+    return;
+  }
+  for (auto& p : session.tasks()) {
+    stop_running_task(static_cast<RecordTask*>(p.second));
+  }
+}
+
+void Scheduler::prepare_cross_process_write(RecordTask* t,
+                                            RecordTask* target) {
+  if (!parallel_ || t->vm() == target->vm()) {
+    return;
+  }
+  // Memory another process writes to is as good as shared.
+  t->vm()->set_has_shared_mappings();
+  target->vm()->set_has_shared_mappings();
+  stop_running_tasks(target->vm()->task_set());
+  stop_other_running_tasks_in_domain(t);
+}
+
+void Scheduler::stop_other_running_tasks_in_domain(RecordTask* t) {
+  while (RecordTask* other = other_running_task_in_domain(t)) {
+    stop_running_task(other);
+  }
+}
+
+void Scheduler::update_running_domains() {
+  running_in_domain.clear();
+  for (auto& p : session.tasks()) {
+    RecordTask* t = static_cast<RecordTask*>(p.second);
+    if (is_running_in_timeslice(t)) {
+      running_in_domain[scheduling_domain(t)] = t;
+    }
+  }
+}
+
+RecordTask* Scheduler::other_running_task_in_domain(RecordTask* t) {
+  const void* domain = scheduling_domain(t);
+  for (auto& p : session.tasks()) {
+    RecordTask* other = static_cast<RecordTask*>(p.second);
+    if (other != t && is_running_in_timeslice(other) &&
+        scheduling_domain(other) == domain) {
+      return other;
+    }
+  }
+  return nullptr;
+}
+
 static bool treat_syscall_as_nonblocking(int syscallno, SupportedArch arch) {
   return is_sched_yield_syscall(syscallno, arch) ||
          is_exit_syscall(syscallno, arch) ||
@@ -144,12 +251,39 @@ bool Scheduler::is_task_runnable(RecordTask* t, bool* by_waitpid) {
   ASSERT(t, !must_run_task) << "is_task_runnable called again after it "
                                "returned a task that must run!";
 
+  if (parallel_) {
+    auto it = running_in_domain.find(scheduling_domain(t));
+    if (it != running_in_domain.end() && it->second != t) {
+      LOG(debug) << "  " << t->tid << " shares a scheduling domain with "
+                 << it->second->tid << ", which is running";
+      return false;
+    }
+    if (deferred_stops.erase(t)) {
+      *by_waitpid = true;
+      must_run_task = t;
+      LOG(debug) << "  " << t->tid << " has deferred status " << t->status();
+      return true;
+    }
+  }
+
   if (t->unstable) {
     LOG(debug) << "  " << t->tid << " is unstable";
     return true;
   }
 
   if (!t->may_be_blocked()) {
+    if (parallel_ && t->is_running()) {
+      // We left it running in its timeslice while we processed events for
+      // other domains.
+      if (t->try_wait()) {
+        *by_waitpid = true;
+        must_run_task = t;
+        LOG(debug) << "  " << t->tid << " stopped with status " << t->status();
+        return true;
+      }
+      LOG(debug) << "  " << t->tid << " is still running";
+      return false;
+    }
     LOG(debug) << "  " << t->tid << " isn't blocked";
     return true;
   }
@@ -354,6 +488,56 @@ void Scheduler::validate_scheduled_task() {
                        current_ == task_round_robin_queue.front());
 }
 
+RecordTask* Scheduler::wait_for_any_task(WaitStatus* status) {
+  RecordTask* next;
+  do {
+    int raw_status;
+    if (enable_poll) {
+      struct itimerval timer = { { 0, 0 }, { 1, 0 } };
+      if (setitimer(ITIMER_REAL, &timer, nullptr) < 0) {
+        FATAL() << "Failed to set itimer";
+      }
+      LOG(debug) << "  Arming one-second timer for polling";
+    }
+    pid_t tid = waitpid(-1, &raw_status, __WALL | WSTOPPED | WUNTRACED);
+    if (enable_poll) {
+      struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+      if (setitimer(ITIMER_REAL, &timer, nullptr) < 0) {
+        FATAL() << "Failed to set itimer";
+      }
+      LOG(debug) << "  Disarming one-second timer for polling";
+    }
+    *status = WaitStatus(raw_status);
+    if (-1 == tid) {
+      if (EINTR == errno) {
+        LOG(debug) << "  waitpid(-1) interrupted";
+        return nullptr;
+      }
+      FATAL() << "Failed to waitpid()";
+    }
+    LOG(debug) << "  " << tid << " changed status to " << *status;
+
+    next = session.find_task(tid);
+    if (status->ptrace_event() == PTRACE_EVENT_EXEC) {
+      if (next) {
+        // Other threads may have unexpectedly died, in which case this
+        // will be marked as unstable even though it's actually not. There's
+        // no way to know until we see the EXEC event that we weren't really
+        // in an unstable exit.
+        next->unstable = false;
+      } else {
+        // The thread-group-leader died and now the exec'ing thread has
+        // changed its thread ID to be thread-group leader.
+        next = session.revive_task_for_exec(tid);
+      }
+    }
+    if (!next) {
+      LOG(debug) << "    ... but it's dead";
+    }
+  } while (!next);
+  return next;
+}
+
 Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
   Rescheduled result;
   result.interrupted_by_signal = false;
@@ -369,10 +553,26 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
 
   maybe_reset_priorities(now);
 
+  // Parallel mode only: current_ is un-switchable and still running, and
+  // we're looking for a task in another domain to run alongside it.
+  bool current_keeps_running = false;
   if (current_ && switchable == PREVENT_SWITCH) {
     LOG(debug) << "  (" << current_->tid << " is un-switchable at "
                << current_->ev() << ")";
-    if (current_->is_running()) {
+    if (current_->is_running() && parallel_) {
+      if (current_->try_wait()) {
+        result.by_waitpid = true;
+        LOG(debug) << "  and stopped; new status is " << current_->status();
+      } else {
+        LOG(debug) << "  and running; looking for tasks in other domains";
+        current_keeps_running = true;
+        // We can't service the round-robin queue in order while current_ is
+        // still running.
+        while (RecordTask* t = get_round_robin_task()) {
+          maybe_pop_round_robin_task(t);
+        }
+      }
+    } else if (current_->is_running()) {
       LOG(debug) << "  and running; waiting for state change";
       /* |current| is un-switchable, but already running. Wait for it to change
        * state before "scheduling it", so avoid busy-waiting with our client. */
@@ -386,9 +586,19 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
 #endif
       result.by_waitpid = true;
       LOG(debug) << "  new status is " << current_->status();
+    } else if (parallel_) {
+      // current_ must run next, so nothing else in its domain may be running.
+      // It may have moved into a busy domain while we processed its event.
+      stop_other_running_tasks_in_domain(current_);
+      if (deferred_stops.erase(current_)) {
+        result.by_waitpid = true;
+        LOG(debug) << "  deferred status is " << current_->status();
+      }
+    }
+    if (!current_keeps_running) {
+      validate_scheduled_task();
+      return result;
     }
-    validate_scheduled_task();
-    return result;
   }
 
   RecordTask* next;
@@ -396,8 +606,11 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
     maybe_reset_high_priority_only_intervals(now);
     last_reschedule_in_high_priority_only_interval =
         in_high_priority_only_interval(now);
+    if (parallel_) {
+      update_running_domains();
+    }
 
-    if (current_) {
+    if (current_ && !current_keeps_running) {
       // Determine if we should run current_ again
       RecordTask* round_robin_task = get_round_robin_task();
       if (!round_robin_task) {
@@ -486,72 +699,61 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
                << task_priority_set.size() << " total)";
 
     WaitStatus status;
-    do {
-      int raw_status;
-      if (enable_poll) {
-        struct itimerval timer = { { 0, 0 }, { 1, 0 } };
-        if (setitimer(ITIMER_REAL, &timer, nullptr) < 0) {
-          FATAL() << "Failed to set itimer";
-        }
-        LOG(debug) << "  Arming one-second timer for polling";
-      }
-      pid_t tid = waitpid(-1, &raw_status, __WALL | WSTOPPED | WUNTRACED);
-      if (enable_poll) {
-        struct itimerval timer = { { 0, 0 }, { 0, 0 } };
-        if (setitimer(ITIMER_REAL, &timer, nullptr) < 0) {
-          FATAL() << "Failed to set itimer";
-        }
-        LOG(debug) << "  Disarming one-second timer for polling";
-      }
-      status = WaitStatus(raw_status);
+    while (true) {
+      next = wait_for_any_task(&status);
       now = -1; // invalid, don't use
-      if (-1 == tid) {
-        if (EINTR == errno) {
-          LOG(debug) << "  waitpid(-1) interrupted";
-          ASSERT(current_, !must_run_task);
-          result.interrupted_by_signal = true;
-          return result;
-        }
-        FATAL() << "Failed to waitpid()";
+      if (!next) {
+        ASSERT(current_, !must_run_task);
+        result.interrupted_by_signal = true;
+        return result;
       }
-      LOG(debug) << "  " << tid << " changed status to " << status;
-
-      next = session.find_task(tid);
-      if (status.ptrace_event() == PTRACE_EVENT_EXEC) {
-        if (next) {
-          // Other threads may have unexpectedly died, in which case this
-          // will be marked as unstable even though it's actually not. There's
-          // no way to know until we see the EXEC event that we weren't really
-          // in an unstable exit.
-          next->unstable = false;
-        } else {
-          // The thread-group-leader died and now the exec'ing thread has
-          // changed its thread ID to be thread-group leader.
-          next = session.revive_task_for_exec(tid);
-        }
+      ASSERT(next, next->unstable || next->may_be_blocked() ||
+                       (parallel_ && next->is_running()) ||
+                       status.ptrace_event() == PTRACE_EVENT_EXIT)
+          << "Scheduled task should have been blocked or unstable";
+      next->did_waitpid(status);
+      if (!parallel_) {
+        break;
       }
-      if (!next) {
-        LOG(debug) << "    ... but it's dead";
+      RecordTask* running = other_running_task_in_domain(next);
+      if (!running) {
+        break;
       }
-    } while (!next);
-    ASSERT(next, next->unstable || next->may_be_blocked() ||
-                     status.ptrace_event() == PTRACE_EVENT_EXIT)
-        << "Scheduled task should have been blocked or unstable";
-    next->did_waitpid(status);
+      LOG(debug) << "  deferring status of " << next->tid << " while "
+                 << running->tid << " is running in its domain";
+      deferred_stops.insert(next);
+    }
     result.by_waitpid = true;
     must_run_task = next;
   }
 
+  if (current_keeps_running && next == current_) {
+    LOG(debug) << "  Carrying on with task " << current_->tid;
+    validate_scheduled_task();
+    return result;
+  }
+
   if (current_ && current_ != next) {
     LOG(debug) << "Switching from " << current_->tid << "(" << current_->name()
                << ") to " << next->tid << "(" << next->name() << ") (priority "
                << current_->priority << " to " << next->priority << ") at "
                << current_->trace_writer().time();
+    if (parallel_ && is_running_in_timeslice(current_)) {
+      LOG(debug) << "  leaving " << current_->tid << " running";
+      running_timeslice_ends[current_] = current_timeslice_end_;
+    }
   }
 
   maybe_reset_high_priority_only_intervals(now);
   current_ = next;
   validate_scheduled_task();
+  auto it = running_timeslice_ends.find(next);
+  if (it != running_timeslice_ends.end()) {
+    // Carry on with the timeslice |next| was running in.
+    current_timeslice_end_ = it->second;
+    running_timeslice_ends.erase(it);
+    return result;
+  }
   setup_new_timeslice();
   result.started_new_timeslice = true;
   return result;
@@ -600,6 +802,9 @@ void Scheduler::on_destroy(RecordTask* t) {
   if (t == current_) {
     current_ = nullptr;
   }
+  running_timeslice_ends.erase(t);
+  deferred_stops.erase(t);
+  task_domains.erase(t);
 
   if (t->in_round_robin_queue) {
     auto iter =
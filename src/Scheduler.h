@@ -5,9 +5,12 @@
 
 #include <deque>
 #include <set>
+#include <unordered_map>
 
+#include "HasTaskSet.h"
 #include "Ticks.h"
 #include "TraceFrame.h"
+#include "WaitStatus.h"
 #include "util.h"
 
 namespace rr {
@@ -52,6 +55,17 @@ class RecordTask;
  *
  * The main parameter to the scheduler is |max_ticks|, which controls the
  * length of each timeslice.
+ *
+ * In parallel mode, tasks are partitioned into scheduling domains: tasks in
+ * different address spaces that share no memory with other processes are in
+ * different domains. Each domain has at most one task running in a timeslice
+ * at a time, just like the whole session in normal mode, but tasks in
+ * different domains run concurrently: when the current task is
+ * un-switchable and running, instead of waiting for it we look for a task in
+ * another domain to run, and only then wait for any task to change state.
+ * Events are still processed one at a time, so the trace is a single stream
+ * in the order rr observed the events. A status change for a task whose
+ * domain has another task running is deferred until that domain is free.
  */
 class Scheduler {
 public:
@@ -91,6 +105,28 @@ public:
     this->always_switch = always_switch;
   }
   void set_enable_chaos(bool enable_chaos);
+  void set_parallel(bool parallel) { parallel_ = parallel; }
+  bool parallel() const { return parallel_; }
+
+  /**
+   * Parallel mode only: wait for each of |tasks| that we left running in a
+   * timeslice to stop, so its state can be examined and changed. The stop is
+   * processed when the task is next scheduled. Call this before acting on
+   * tasks other than the current one.
+   */
+  void stop_running_tasks(const HasTaskSet::TaskSet& tasks);
+  /**
+   * Parallel mode only: like stop_running_tasks, for every task.
+   */
+  void stop_all_running_tasks();
+  /**
+   * Parallel mode only: |t| is about to write |target|'s memory directly
+   * (process_vm_writev, /proc/<pid>/mem). Put both into the shared scheduling
+   * domain, so they never run at the same time, and stop |target| if we
+   * left it running. Otherwise the order of the write against |target|'s own
+   * execution would depend on timing.
+   */
+  void prepare_cross_process_write(RecordTask* t, RecordTask* target);
 
   /**
    * Schedule a new runnable task (which may be the same as current()).
@@ -176,6 +212,30 @@ private:
   bool treat_as_high_priority(RecordTask* t);
   bool is_task_runnable(RecordTask* t, bool* by_waitpid);
   void validate_scheduled_task();
+  /**
+   * Wait for any task to change state. Returns null if interrupted by a
+   * signal.
+   */
+  RecordTask* wait_for_any_task(WaitStatus* status);
+  /**
+   * Returns |t|'s scheduling domain. A task's domain only changes while it's
+   * stopped.
+   */
+  const void* scheduling_domain(RecordTask* t);
+  void stop_running_task(RecordTask* t);
+  /**
+   * Stop any task other than |t| running in a timeslice in |t|'s domain.
+   */
+  void stop_other_running_tasks_in_domain(RecordTask* t);
+  /**
+   * Recompute |running_in_domain|.
+   */
+  void update_running_domains();
+  /**
+   * Returns a task other than |t| in |t|'s scheduling domain that's running
+   * in a timeslice, or null if there is none.
+   */
+  RecordTask* other_running_task_in_domain(RecordTask* t);
 
   RecordSession& session;
 
@@ -229,6 +289,30 @@ private:
   bool last_reschedule_in_high_priority_only_interval;
 
   RecordTask* must_run_task;
+
+  /**
+   * When true, run tasks in different scheduling domains concurrently.
+   */
+  bool parallel_;
+  /**
+   * Parallel mode only: for each scheduling domain with a task running in a
+   * timeslice, that task.
+   */
+  std::unordered_map<const void*, RecordTask*> running_in_domain;
+  /**
+   * Parallel mode only: the domain each task was last found to be in.
+   */
+  std::unordered_map<RecordTask*, const void*> task_domains;
+  /**
+   * Parallel mode only: the timeslice ends of tasks we left running while
+   * switching to a task in another domain.
+   */
+  std::unordered_map<RecordTask*, Ticks> running_timeslice_ends;
+  /**
+   * Parallel mode only: tasks whose status change we've consumed with
+   * waitpid but not processed yet, because their domain was busy.
+   */
+  std::set<RecordTask*> deferred_stops;
 };
 
 } // namespace rr
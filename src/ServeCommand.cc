@@ -0,0 +1,216 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Command.h"
+#include "GdbServer.h"
+#include "ReplaySession.h"
+#include "ScopedFd.h"
+#include "log.h"
+#include "main.h"
+
+using namespace std;
+
+namespace rr {
+
+class ServeCommand : public Command {
+public:
+  virtual int run(vector<string>& args);
+
+protected:
+  ServeCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static ServeCommand singleton;
+};
+
+ServeCommand ServeCommand::singleton(
+    "serve",
+    " rr serve [OPTION]... [<trace-dir>]\n"
+    "  -g, --goto=<EVENT-NUM>     start serving on reaching <EVENT-NUM>\n"
+    "  -s, --dbgport=<PORT>       listen on <PORT>\n"
+    "  -q, --no-redirect-output   don't replay writes to stdout/stderr\n"
+    "  --checkpoint-memory=<MB>   keep the memory used by checkpoints for\n"
+    "                             reverse execution under <MB> megabytes\n"
+    "  Replay the trace and serve debuggers on a local port until killed.\n"
+    "  The trace is replayed to <EVENT-NUM> once and a checkpoint is saved\n"
+    "  there, in the trace directory; it is left there afterwards, like\n"
+    "  those of `rr create-checkpoints`. Each debugger that connects is\n"
+    "  served by its own rr process, starting from that checkpoint, so\n"
+    "  several can be attached at once. Nothing else is shared between\n"
+    "  debuggers: the checkpoints and marks a debugger's replay creates are\n"
+    "  discarded when it disconnects, and the next debugger starts again\n"
+    "  from <EVENT-NUM>.\n");
+
+struct ServeFlags {
+  TraceFrame::Time goto_event;
+  int dbg_port;
+  bool redirect;
+  uint64_t checkpoint_memory_budget;
+
+  ServeFlags()
+      : goto_event(0),
+        dbg_port(-1),
+        redirect(true),
+        checkpoint_memory_budget(0) {}
+};
+
+static bool parse_serve_arg(vector<string>& args, ServeFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = {
+    { 'g', "goto", HAS_PARAMETER },
+    { 'q', "no-redirect-output", NO_PARAMETER },
+    { 's', "dbgport", HAS_PARAMETER },
+    { 0, "checkpoint-memory", HAS_PARAMETER }
+  };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'g':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.goto_event = opt.int_value;
+      break;
+    case 'q':
+      flags.redirect = false;
+      break;
+    case 's':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.dbg_port = opt.int_value;
+      break;
+    case 0:
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.checkpoint_memory_budget = (uint64_t)opt.int_value * 1024 * 1024;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * Serve the debugger connected on |sock_fd| from the checkpoint at |start|.
+ * Returns when the debugger disconnects.
+ */
+static void serve_debugger(const string& trace_dir, TraceFrame::Time start,
+                           const ServeFlags& flags, ScopedFd& sock_fd) {
+  auto session = ReplaySession::create_from_checkpoint(trace_dir, start + 1);
+  if (!session) {
+    session = ReplaySession::create(trace_dir);
+  }
+
+  ReplaySession::Flags session_flags;
+  session_flags.redirect_stdio = flags.redirect;
+  session_flags.checkpoint_memory_budget = flags.checkpoint_memory_budget;
+  GdbServer::Target target;
+  target.event = flags.goto_event;
+  GdbServer::ConnectionFlags conn_flags;
+  conn_flags.debugger_fd = &sock_fd;
+  GdbServer(session, session_flags, target).serve_replay(conn_flags);
+}
+
+static int serve(const string& trace_dir, const ServeFlags& flags) {
+  ReplaySession::shr_ptr session;
+  if (flags.goto_event > 0) {
+    session =
+        ReplaySession::create_from_checkpoint(trace_dir, flags.goto_event);
+  }
+  if (!session) {
+    session = ReplaySession::create(trace_dir);
+  }
+
+  // Replay to the target once and save a checkpoint there, so every
+  // debugger's rr process can start from it. The debuggers' own timelines
+  // live in their rr processes and die with them; tracees can't be handed
+  // from one tracer to another, so there's no warm timeline to share.
+  while (!session->done_initial_exec() || !session->current_task() ||
+         session->current_trace_frame().time() <= flags.goto_event) {
+    if (session->replay_step(RUN_CONTINUE).status == REPLAY_EXITED) {
+      fprintf(stderr, "Trace ended before event %u\n", flags.goto_event);
+      return 1;
+    }
+  }
+  string dir = session->trace_reader().dir();
+  TraceFrame::Time start = session->current_trace_frame().time();
+  auto saved = ReplaySession::saved_checkpoints(dir);
+  if (!binary_search(saved.begin(), saved.end(), start)) {
+    if (session->save_checkpoint()) {
+      fprintf(stderr, "Saved a checkpoint at event %u in %s\n", start,
+              dir.c_str());
+    } else {
+      LOG(warn) << "Couldn't save a checkpoint at event " << start
+                << "; each debugger will replay to it separately";
+    }
+  }
+
+  GdbServer::ConnectionFlags conn_flags;
+  conn_flags.dbg_port = flags.dbg_port;
+  conn_flags.debugger_name = "gdb";
+  ScopedFd listen_fd =
+      GdbServer::open_debugger_socket(session->current_task(), conn_flags);
+  // Tracees can't be shared with the forked servers, so drop ours.
+  session = nullptr;
+
+  while (true) {
+    ScopedFd sock_fd(accept(listen_fd, nullptr, nullptr));
+    int err = errno;
+    // Reap the servers of debuggers that have gone away.
+    while (waitpid(-1, nullptr, WNOHANG) > 0) {
+    }
+    if (!sock_fd.is_open()) {
+      if (err == EINTR) {
+        continue;
+      }
+      FATAL() << "Couldn't accept debugger connection";
+    }
+    LOG(debug) << "Debugger connected; forking a server for it";
+    pid_t child = fork();
+    if (child < 0) {
+      FATAL() << "Couldn't fork a server for the debugger";
+    }
+    if (child == 0) {
+      listen_fd.close();
+      serve_debugger(dir, start, flags, sock_fd);
+      exit(0);
+    }
+    // The child has its own copy of |sock_fd|.
+  }
+  return 0;
+}
+
+int ServeCommand::run(vector<string>& args) {
+  ServeFlags flags;
+  bool found_dir = false;
+  string trace_dir;
+  while (!args.empty()) {
+    if (parse_serve_arg(args, flags)) {
+      continue;
+    }
+    if (!found_dir && parse_optional_trace_dir(args, &trace_dir)) {
+      found_dir = true;
+      continue;
+    }
+    print_help(stderr);
+    return 1;
+  }
+
+  return serve(trace_dir, flags);
+}
+
+} // namespace rr
@@ -395,59 +395,97 @@ void Session::finish_initializing() const {
   self->clone_completion = nullptr;
 }
 
-static void remap_shared_mmap(AutoRemoteSyscalls& remote, EmuFs& emu_fs,
-                              EmuFs& dest_emu_fs,
-                              const AddressSpace::Mapping& m_in_mem) {
-  AddressSpace::Mapping m = m_in_mem;
-
-  LOG(debug) << "    remapping shared region at " << m.map.start() << "-"
-             << m.map.end();
-  remote.infallible_syscall(syscall_number_for_munmap(remote.arch()),
-                            m.map.start(), m.map.size());
-
-  EmuFile::shr_ptr emu_file;
-  if (dest_emu_fs.has_file_for(m.recorded_map)) {
-    emu_file = dest_emu_fs.at(m.recorded_map);
-  } else {
-    emu_file = dest_emu_fs.clone_file(emu_fs.at(m.recorded_map));
-  }
+// Number of shared regions remapped per batch of remote syscalls. Each
+// region in a batch holds an fd open in the tracee until the batch's mmaps
+// run, so this bounds how close to its RLIMIT_NOFILE we can push the tracee.
+static const size_t remap_shared_mmaps_batch_size = 64;
+
+// Remap the shared regions |maps| to the files of |dest_emu_fs|, so the
+// clone doesn't share them with the original. Opening the files and mapping
+// them are each done as one batch of remote syscalls.
+static void remap_shared_mmaps_batch(
+    AutoRemoteSyscalls& remote, EmuFs& emu_fs, EmuFs& dest_emu_fs,
+    vector<AddressSpace::Mapping>::const_iterator maps_begin,
+    vector<AddressSpace::Mapping>::const_iterator maps_end) {
+  vector<AddressSpace::Mapping> maps(maps_begin, maps_end);
+  vector<EmuFile::shr_ptr> emu_files;
+  RemoteSyscallBatch opens(remote);
+  for (auto& m : maps) {
+    LOG(debug) << "    remapping shared region at " << m.map.start() << "-"
+               << m.map.end();
+    EmuFile::shr_ptr emu_file;
+    if (dest_emu_fs.has_file_for(m.recorded_map)) {
+      emu_file = dest_emu_fs.at(m.recorded_map);
+    } else {
+      emu_file = dest_emu_fs.clone_file(emu_fs.at(m.recorded_map));
+    }
+    emu_files.push_back(emu_file);
 
-  // TODO: this duplicates some code in replay_syscall.cc, but
-  // it's somewhat nontrivial to factor that code out.
-  int remote_fd;
-  {
-    string path = emu_file->proc_path();
-    AutoRestoreMem child_path(remote, path.c_str());
+    // TODO: this duplicates some code in replay_syscall.cc, but
+    // it's somewhat nontrivial to factor that code out.
     // Always open the emufs file O_RDWR, even if the current mapping prot
     // is read-only. We might mprotect it to read-write later.
     // skip leading '/' since we want the path to be relative to the root fd
-    remote_fd = remote.infallible_syscall(
-        syscall_number_for_openat(remote.arch()), RR_RESERVED_ROOT_DIR_FD,
-        child_path.get() + 1, O_RDWR);
+    string path = emu_file->proc_path();
+    opens.add(syscall_number_for_openat(remote.arch()),
+              RR_RESERVED_ROOT_DIR_FD, opens.add_data(path.c_str() + 1),
+              O_RDWR);
+  }
+  opens.run();
+
+  vector<struct stat> real_files;
+  vector<string> real_file_names;
+  RemoteSyscallBatch mmaps(remote);
+  for (size_t i = 0; i < maps.size(); ++i) {
+    auto& m = maps[i];
+    int remote_fd = opens.result(i);
     if (0 > remote_fd) {
-      FATAL() << "Couldn't open " << path << " in tracee";
+      FATAL() << "Couldn't open " << emu_files[i]->proc_path() << " in tracee";
     }
+    real_files.push_back(remote.task()->stat_fd(remote_fd));
+    real_file_names.push_back(remote.task()->file_name_of_fd(remote_fd));
+    // XXX this condition is x86/x64-specific, I imagine.
+    // MAP_FIXED replaces the old mapping, so there's no need to unmap it
+    // first.
+    mmaps.add_mmap(m.map.start(), m.map.size(), m.map.prot(),
+                   // The remapped segment *must* be
+                   // remapped at the same address,
+                   // or else many things will go
+                   // haywire.
+                   (m.map.flags() & ~MAP_ANONYMOUS) | MAP_FIXED, remote_fd,
+                   m.map.file_offset_bytes() / page_size());
+    mmaps.add(syscall_number_for_close(remote.arch()), remote_fd);
   }
-  struct stat real_file = remote.task()->stat_fd(remote_fd);
-  string real_file_name = remote.task()->file_name_of_fd(remote_fd);
-  // XXX this condition is x86/x64-specific, I imagine.
-  remote.infallible_mmap_syscall(m.map.start(), m.map.size(), m.map.prot(),
-                                 // The remapped segment *must* be
-                                 // remapped at the same address,
-                                 // or else many things will go
-                                 // haywire.
-                                 (m.map.flags() & ~MAP_ANONYMOUS) | MAP_FIXED,
-                                 remote_fd,
-                                 m.map.file_offset_bytes() / page_size());
-
-  // We update the AddressSpace mapping too, since that tracks the real file
-  // name and we need to update that.
-  remote.task()->vm()->map(
-      remote.task(), m.map.start(), m.map.size(), m.map.prot(), m.map.flags(),
-      m.map.file_offset_bytes(), real_file_name, real_file.st_dev,
-      real_file.st_ino, nullptr, &m.recorded_map, emu_file);
+  mmaps.run();
+
+  for (size_t i = 0; i < maps.size(); ++i) {
+    auto& m = maps[i];
+    remote_ptr<void> addr = mmaps.infallible_result_ptr(2 * i);
+    ASSERT(remote.task(), addr == m.map.start())
+        << "MAP_FIXED at " << m.map.start() << " but got " << addr;
+    mmaps.infallible_result(2 * i + 1);
+
+    // We update the AddressSpace mapping too, since that tracks the real file
+    // name and we need to update that.
+    remote.task()->vm()->map(
+        remote.task(), m.map.start(), m.map.size(), m.map.prot(),
+        m.map.flags(), m.map.file_offset_bytes(), real_file_names[i],
+        real_files[i].st_dev, real_files[i].st_ino, nullptr, &m.recorded_map,
+        emu_files[i]);
+  }
+}
 
-  remote.infallible_syscall(syscall_number_for_close(remote.arch()), remote_fd);
+// Remap |maps| in batches of remap_shared_mmaps_batch_size, so the number
+// of times we resume the task grows slowly with the number of regions but
+// the number of extra fds the tracee holds stays bounded.
+static void remap_shared_mmaps(AutoRemoteSyscalls& remote, EmuFs& emu_fs,
+                               EmuFs& dest_emu_fs,
+                               const vector<AddressSpace::Mapping>& maps) {
+  for (size_t i = 0; i < maps.size(); i += remap_shared_mmaps_batch_size) {
+    size_t end = min(maps.size(), i + remap_shared_mmaps_batch_size);
+    remap_shared_mmaps_batch(remote, emu_fs, dest_emu_fs, maps.begin() + i,
+                             maps.begin() + end);
+  }
 }
 
 KernelMapping Session::create_shared_mmap(
@@ -637,28 +675,62 @@ static vector<uint8_t> capture_syscallbuf(const AddressSpace::Mapping& m,
   return clone_leader->read_mem(start, data_size);
 }
 
+/**
+ * Fork group_leaders[i..] into |dest|, storing the new leaders in
+ * |clone_leaders|. Forking a task group copies its page tables, which
+ * dominates the cost of cloning a session with large processes, so each
+ * fork is started before recursing and finished as the recursion unwinds.
+ * That keeps all the forks in flight at once while every AutoRemoteSyscalls
+ * stays on the stack.
+ */
+/*static*/ void Session::fork_task_groups(Session& dest,
+                                         const vector<Task*>& group_leaders,
+                                         size_t i,
+                                         vector<Task*>& clone_leaders) {
+  if (i == group_leaders.size()) {
+    return;
+  }
+  Task* group_leader = group_leaders[i];
+  LOG(debug) << "  forking tg " << group_leader->tgid()
+             << " (real: " << group_leader->real_tgid() << ")";
+  AutoRemoteSyscalls remote(group_leader,
+                            AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
+  group_leader->start_os_fork_into(remote);
+  fork_task_groups(dest, group_leaders, i + 1, clone_leaders);
+  clone_leaders[i] = group_leader->finish_os_fork_into(&dest, remote);
+  LOG(debug) << "  forked new group leader " << clone_leaders[i]->tid;
+  // Destroying |remote| restores the original group leader's state, which
+  // copy_state_to captures afterward.
+}
+
 void Session::copy_state_to(Session& dest, EmuFs& emu_fs, EmuFs& dest_emu_fs) {
   assert_fully_initialized();
   assert(!dest.clone_completion);
 
   auto completion = unique_ptr<CloneCompletion>(new CloneCompletion());
 
+  vector<Task*> group_leaders;
   for (auto vm : vm_map) {
     // Pick an arbitrary task to be group leader. The actual group leader
     // might have died already.
-    Task* group_leader = *vm.second->task_set().begin();
-    LOG(debug) << "  forking tg " << group_leader->tgid()
-               << " (real: " << group_leader->real_tgid() << ")";
+    group_leaders.push_back(*vm.second->task_set().begin());
+  }
 
+  vector<Task*> clone_leaders(group_leaders.size());
+  fork_task_groups(dest, group_leaders, 0, clone_leaders);
+  for (Task* clone_leader : clone_leaders) {
     completion->task_groups.push_back(CloneCompletion::TaskGroup());
-    auto& group = completion->task_groups.back();
+    completion->task_groups.back().clone_leader = clone_leader;
+    dest.on_create(clone_leader);
+  }
 
-    group.clone_leader = group_leader->os_fork_into(&dest);
-    dest.on_create(group.clone_leader);
-    LOG(debug) << "  forked new group leader " << group.clone_leader->tid;
+  for (size_t i = 0; i < group_leaders.size(); ++i) {
+    Task* group_leader = group_leaders[i];
+    auto& group = completion->task_groups[i];
 
     {
       AutoRemoteSyscalls remote(group.clone_leader);
+      vector<AddressSpace::Mapping> shared_maps;
       for (auto m : group.clone_leader->vm()->maps()) {
         // Special case the syscallbuf as a performance optimization. The amount
         // of data we need to capture is usually significantly smaller than the
@@ -672,9 +744,10 @@ void Session::copy_state_to(Session& dest, EmuFs& emu_fs, EmuFs& dest_emu_fs) {
                  m.map.start() == AddressSpace::preload_thread_locals_start());
         } else if ((m.recorded_map.flags() & MAP_SHARED) &&
                    emu_fs.has_file_for(m.recorded_map)) {
-          remap_shared_mmap(remote, emu_fs, dest_emu_fs, m);
+          shared_maps.push_back(m);
         }
       }
+      remap_shared_mmaps(remote, emu_fs, dest_emu_fs, shared_maps);
 
       for (auto t : group_leader->task_group()->task_set()) {
         if (group_leader == t) {
@@ -96,11 +96,17 @@ enum RunCommand {
   // Like RUN_SINGLESTEP, but a single-instruction loop is allowed (but not
   // required) to execute multiple times if we don't reach a different
   // instruction. Usable with ReplaySession::replay_step only.
-  RUN_SINGLESTEP_FAST_FORWARD
+  RUN_SINGLESTEP_FAST_FORWARD,
+  // Like RUN_SINGLESTEP, but execute until the next taken branch instead of
+  // a single instruction. The step may stop earlier (e.g. at a syscall,
+  // signal or breakpoint) and is reported as singlestep_complete.
+  // Usable with ReplaySession::replay_step only.
+  RUN_SINGLEBLOCK
 };
 
 inline bool is_singlestep(RunCommand command) {
-  return command == RUN_SINGLESTEP || command == RUN_SINGLESTEP_FAST_FORWARD;
+  return command == RUN_SINGLESTEP || command == RUN_SINGLESTEP_FAST_FORWARD ||
+         command == RUN_SINGLEBLOCK;
 }
 
 /**
@@ -234,10 +240,46 @@ public:
 
   struct Statistics {
     Statistics()
-        : bytes_written(0), ticks_processed(0), syscalls_performed(0) {}
+        : bytes_written(0),
+          ticks_processed(0),
+          syscalls_performed(0),
+          async_events(0),
+          async_event_steps(0),
+          software_watch_faults(0),
+          software_watch_fault_time(0),
+          raw_data_records(0),
+          raw_data_bytes(0),
+          raw_data_allocations(0),
+          block_steps(0),
+          block_step_ticks(0),
+          block_step_min_stops_saved(0),
+          block_step_overshoots(0) {}
     uint64_t bytes_written;
     Ticks ticks_processed;
     uint32_t syscalls_performed;
+    // Async signal and timeslice events replayed, and the singlesteps and
+    // breakpoint stops it took to get from the ticks interrupt to their exact
+    // execution points.
+    uint32_t async_events;
+    uint64_t async_event_steps;
+    // Write faults on pages protected for software watchpoints, and the
+    // seconds spent stepping over them.
+    uint64_t software_watch_faults;
+    double software_watch_fault_time;
+    // Raw data records applied to tracees from the trace, their total size,
+    // and the buffer allocations made to read them.
+    uint64_t raw_data_records;
+    uint64_t raw_data_bytes;
+    uint64_t raw_data_allocations;
+    // RUN_SINGLEBLOCK steps, the ticks they retired, and a lower bound on the
+    // singlesteps they saved: every conditional branch a block step retired
+    // would have needed a singlestep of its own.
+    uint64_t block_steps;
+    uint64_t block_step_ticks;
+    uint64_t block_step_min_stops_saved;
+    // Reverse-singlestep intervals where a block step ran past the
+    // destination and had to be redone.
+    uint64_t block_step_overshoots;
   };
   void accumulate_bytes_written(uint64_t bytes_written) {
     statistics_.bytes_written += bytes_written;
@@ -246,6 +288,29 @@ public:
   void accumulate_ticks_processed(Ticks ticks) {
     statistics_.ticks_processed += ticks;
   }
+  void accumulate_async_event_step() { statistics_.async_event_steps += 1; }
+  void accumulate_async_event() { statistics_.async_events += 1; }
+  void accumulate_software_watch_fault(double seconds) {
+    statistics_.software_watch_faults += 1;
+    statistics_.software_watch_fault_time += seconds;
+  }
+  void accumulate_raw_data(uint64_t records, uint64_t bytes,
+                           uint64_t allocations) {
+    statistics_.raw_data_records += records;
+    statistics_.raw_data_bytes += bytes;
+    statistics_.raw_data_allocations += allocations;
+  }
+  void accumulate_block_step(Ticks ticks_before, Ticks ticks_after) {
+    Ticks retired = ticks_after - ticks_before;
+    statistics_.block_steps += 1;
+    statistics_.block_step_ticks += retired;
+    if (retired > 1) {
+      statistics_.block_step_min_stops_saved += retired - 1;
+    }
+  }
+  void accumulate_block_step_overshoot() {
+    statistics_.block_step_overshoots += 1;
+  }
   Statistics statistics() { return statistics_; }
 
   virtual Task* new_task(pid_t tid, pid_t rec_tid, uint32_t serial,
@@ -301,6 +366,9 @@ protected:
   void check_for_watchpoint_changes(Task* t, BreakStatus& break_status);
 
   void copy_state_to(Session& dest, EmuFs& emu_fs, EmuFs& dest_emu_fs);
+  static void fork_task_groups(Session& dest,
+                               const std::vector<Task*>& group_leaders,
+                               size_t i, std::vector<Task*>& clone_leaders);
 
   // XXX Move CloneCompletion/CaptureState etc to ReplayTask/ReplaySession
   struct CloneCompletion;
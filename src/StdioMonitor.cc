@@ -15,8 +15,8 @@ Switchable StdioMonitor::will_write(Task* t) {
     char buf[256];
     snprintf(buf, sizeof(buf) - 1, "[rr %d %d]", t->tgid(), t->trace_time());
     ssize_t len = strlen(buf);
-    if (write(original_fd, buf, len) != len) {
-      ASSERT(t, false) << "Couldn't write to " << original_fd;
+    if (write(original_fd_, buf, len) != len) {
+      ASSERT(t, false) << "Couldn't write to " << original_fd_;
     }
   }
 
@@ -33,8 +33,8 @@ void StdioMonitor::did_write(Task* t, const std::vector<Range>& ranges,
     for (auto& r : ranges) {
       auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length);
       if (bytes.size() !=
-          (size_t)write(original_fd, bytes.data(), bytes.size())) {
-        ASSERT(t, false) << "Couldn't write to " << original_fd;
+          (size_t)write(original_fd_, bytes.data(), bytes.size())) {
+        ASSERT(t, false) << "Couldn't write to " << original_fd_;
       }
     }
   }
@@ -20,10 +20,12 @@ public:
    * Note that it's possible for a tracee to have a StdioMonitor associated
    * with a different fd, thanks to dup() etc.
    */
-  StdioMonitor(int original_fd) : original_fd(original_fd) {}
+  StdioMonitor(int original_fd) : original_fd_(original_fd) {}
 
   virtual Type type() override { return Stdio; }
 
+  int original_fd() const { return original_fd_; }
+
   /**
    * Make writes to stdout/stderr blocking, to avoid nondeterminism in the
    * order in which the kernel actually performs such writes.
@@ -44,7 +46,7 @@ public:
                          LazyOffset&) override;
 
 private:
-  int original_fd;
+  int original_fd_;
 };
 
 } // namespace rr
@@ -0,0 +1,127 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "SyscallPatchCache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "AddressSpace.h"
+#include "ElfReader.h"
+#include "ScopedFd.h"
+#include "TraceStream.h"
+#include "log.h"
+
+using namespace std;
+
+namespace rr {
+
+SyscallPatchCache::SyscallPatchCache()
+    : dir(TraceStream::rr_data_dir() + "/patch-cache"),
+      dir_state(DIR_UNKNOWN) {}
+
+bool SyscallPatchCache::ensure_dir() {
+  if (dir_state == DIR_UNKNOWN) {
+    // Only create the cache directory if the data directory exists; we don't
+    // want to create ~/.local/share/rr as a side effect of recording with
+    // _RR_TRACE_DIR set.
+    if ((mkdir(dir.c_str(), S_IRWXU) < 0 && errno != EEXIST) ||
+        access(dir.c_str(), W_OK) < 0) {
+      LOG(debug) << "Syscall patch cache " << dir << " unusable";
+      dir_state = DIR_UNUSABLE;
+    } else {
+      dir_state = DIR_OK;
+    }
+  }
+  return dir_state == DIR_OK;
+}
+
+string SyscallPatchCache::path(const string& build_id) {
+  return dir + "/" + build_id;
+}
+
+string SyscallPatchCache::build_id(const KernelMapping& km) {
+  if (km.fsname().empty() || km.inode() == KernelMapping::NO_INODE) {
+    return string();
+  }
+  auto key = make_pair(km.device(), km.inode());
+  auto it = build_ids.find(key);
+  if (it != build_ids.end()) {
+    return it->second;
+  }
+
+  string result;
+  ScopedFd fd(km.fsname().c_str(), O_RDONLY);
+  if (fd.is_open()) {
+    result = ElfFileReader(fd).read_buildid();
+  }
+  build_ids[key] = result;
+  return result;
+}
+
+const set<uint64_t>& SyscallPatchCache::patched_offsets(
+    const string& build_id) {
+  return load(build_id);
+}
+
+set<uint64_t>& SyscallPatchCache::load(const string& build_id) {
+  auto it = offsets.find(build_id);
+  if (it != offsets.end()) {
+    return it->second;
+  }
+
+  set<uint64_t>& result = offsets[build_id];
+  if (!ensure_dir()) {
+    return result;
+  }
+  ScopedFd fd(path(build_id).c_str(), O_RDONLY);
+  if (!fd.is_open()) {
+    return result;
+  }
+  string contents;
+  char buf[4096];
+  while (true) {
+    ssize_t ret = read(fd, buf, sizeof(buf));
+    if (ret <= 0) {
+      break;
+    }
+    contents.append(buf, ret);
+  }
+  stringstream ss(contents);
+  string line;
+  while (getline(ss, line)) {
+    char* end;
+    uint64_t offset = strtoull(line.c_str(), &end, 16);
+    if (!line.empty() && *end == 0) {
+      result.insert(offset);
+    }
+  }
+  LOG(debug) << "Loaded " << result.size() << " cached syscall patch sites for "
+             << build_id;
+  return result;
+}
+
+void SyscallPatchCache::add(const string& build_id, uint64_t offset) {
+  set<uint64_t>& known = load(build_id);
+  if (!known.insert(offset).second || !ensure_dir()) {
+    return;
+  }
+  ScopedFd fd(path(build_id).c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+  if (!fd.is_open()) {
+    return;
+  }
+  // A single small O_APPEND write, so concurrent recordings can't interleave
+  // partial lines.
+  stringstream ss;
+  ss << hex << offset << "\n";
+  string line = ss.str();
+  if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+    LOG(debug) << "Failed to write syscall patch cache entry for " << build_id;
+  }
+}
+
+} // namespace rr
@@ -0,0 +1,68 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_SYSCALL_PATCH_CACHE_H_
+#define RR_SYSCALL_PATCH_CACHE_H_
+
+#include <sys/types.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+namespace rr {
+
+class KernelMapping;
+
+/**
+ * A persistent record of which syscall instructions Monkeypatcher has
+ * successfully patched, shared by all recordings made by this user. Sites are
+ * identified by the GNU build ID of the ELF file containing them and the file
+ * offset of the syscall instruction, so the same binary can be patched
+ * eagerly as soon as it's mapped, instead of one trap per syscall site.
+ *
+ * The cache lives in patch-cache/ under the rr data directory, with one text
+ * file per build ID listing hex file offsets, one per line. Entries are only
+ * ever appended. If the directory can't be used the cache silently does
+ * nothing.
+ *
+ * Cached entries are hints; Monkeypatcher still checks the code before
+ * patching.
+ */
+class SyscallPatchCache {
+public:
+  SyscallPatchCache();
+
+  /**
+   * Returns the build ID of the file mapped by |km|, or an empty string if
+   * it doesn't have one or can't be read.
+   */
+  std::string build_id(const KernelMapping& km);
+
+  /**
+   * Returns the file offsets of syscall instructions previously patched in
+   * the ELF file with build ID |build_id|.
+   */
+  const std::set<uint64_t>& patched_offsets(const std::string& build_id);
+
+  /**
+   * Record that the syscall instruction at |offset| in the ELF file with
+   * build ID |build_id| was patched.
+   */
+  void add(const std::string& build_id, uint64_t offset);
+
+private:
+  std::set<uint64_t>& load(const std::string& build_id);
+  std::string path(const std::string& build_id);
+  bool ensure_dir();
+
+  std::string dir;
+  enum { DIR_UNKNOWN, DIR_OK, DIR_UNUSABLE } dir_state;
+  // Keyed by (device, inode) of the mapped file.
+  std::map<std::pair<dev_t, ino_t>, std::string> build_ids;
+  std::map<std::string, std::set<uint64_t>> offsets;
+};
+
+} // namespace rr
+
+#endif /* RR_SYSCALL_PATCH_CACHE_H_ */
@@ -24,6 +24,7 @@
 #include <sys/wait.h>
 #include <syscall.h>
 
+#include <algorithm>
 #include <limits>
 #include <set>
 #include <sstream>
@@ -89,7 +90,8 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       session_(&session),
       top_of_stack(),
       seen_ptrace_exit_event(false),
-      expecting_ptrace_interrupt_stop(0) {
+      expecting_ptrace_interrupt_stop(0),
+      software_watch_suspended(0) {
   memset(&thread_locals, 0, sizeof(thread_locals));
 }
 
@@ -819,7 +821,8 @@ TrapReasons Task::compute_trap_reasons() {
   // During replay we execute syscall instructions in certain cases, e.g.
   // mprotect with syscallbuf. The kernel does not set DS_SINGLESTEP when we
   // step over those instructions so we need to detect that here.
-  if (how_last_execution_resumed == RESUME_SINGLESTEP &&
+  if ((how_last_execution_resumed == RESUME_SINGLESTEP ||
+       how_last_execution_resumed == RESUME_SINGLEBLOCK) &&
       is_at_syscall_instruction(this, address_of_last_execution_resume) &&
       ip() ==
           address_of_last_execution_resume +
@@ -973,6 +976,16 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
                             TicksRequest tick_period, int sig) {
   will_resume_execution(how, wait_how, tick_period, sig);
 
+  // Any resume that runs tracee code can fault on a protected page, e.g.
+  // the RESUME_CONT that replays a syscallbuf flush.
+  bool may_hit_software_watchpoints =
+      RESUME_WAIT == wait_how && !software_watch_suspended;
+  if (may_hit_software_watchpoints &&
+      vm()->software_watch_protection_dirty()) {
+    vm()->update_software_watch_protection(this);
+  }
+  Ticks ticks_at_resume = tick_count();
+
   if (tick_period != RESUME_NO_TICKS) {
     if (tick_period == RESUME_UNLIMITED_TICKS) {
       hpc.reset(0);
@@ -1034,7 +1047,68 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
   extra_registers_known = false;
   if (RESUME_WAIT == wait_how) {
     wait();
+    if (may_hit_software_watchpoints && vm()->has_software_watchpoints() &&
+        status().stop_sig() == SIGSEGV &&
+        vm()->is_software_watchpoint_fault(get_siginfo())) {
+      step_over_software_watchpoint_faults(how, tick_period, ticks_at_resume);
+    }
+  }
+}
+
+void Task::step_over_software_watchpoint_faults(ResumeRequest how,
+                                                TicksRequest tick_period,
+                                                Ticks ticks_at_resume) {
+  ++software_watch_suspended;
+  while (true) {
+    double start = monotonic_now_sec();
+    // A single instruction can write to more than one protected page.
+    vector<remote_ptr<void>> unprotected;
+    do {
+      auto page = floor_page_size(
+          remote_ptr<void>((uintptr_t)get_siginfo().si_addr));
+      ASSERT(this, find(unprotected.begin(), unprotected.end(), page) ==
+                       unprotected.end());
+      vm()->set_software_watch_page_writable(this, page, true);
+      unprotected.push_back(page);
+      resume_execution(RESUME_SINGLESTEP, RESUME_WAIT, RESUME_UNLIMITED_TICKS);
+    } while (status().stop_sig() == SIGSEGV &&
+             vm()->is_software_watchpoint_fault(get_siginfo()));
+    bool triggered = false;
+    for (auto page : unprotected) {
+      vm()->set_software_watch_page_writable(this, page, false);
+      triggered |= vm()->notify_software_watchpoint_write(page);
+    }
+    session().accumulate_software_watch_fault(monotonic_now_sec() - start);
+
+    if (status().stop_sig() != SIGTRAP ||
+        (debug_status() & DS_WATCHPOINT_ANY)) {
+      // Something else happened during the step; report it.
+      break;
+    }
+    if (RESUME_SINGLESTEP == how || RESUME_SYSEMU_SINGLESTEP == how ||
+        RESUME_SINGLEBLOCK == how) {
+      // The step we took completes the requested step.
+      break;
+    }
+    if (triggered) {
+      // Report the watchpoint as if the write had trapped.
+      set_debug_status(0);
+      break;
+    }
+
+    TicksRequest remaining = tick_period;
+    if (tick_period > 0) {
+      remaining = (TicksRequest)max<Ticks>(
+          1, ticks_at_resume + tick_period - tick_count());
+    }
+    resume_execution(how, RESUME_WAIT, remaining);
+    if (status().stop_sig() != SIGSEGV ||
+        !vm()->is_software_watchpoint_fault(get_siginfo())) {
+      break;
+    }
   }
+  how_last_execution_resumed = how;
+  --software_watch_suspended;
 }
 
 void Task::set_regs(const Registers& regs) {
@@ -1499,6 +1573,21 @@ void Task::did_waitpid(WaitStatus status) {
   }
   last_resume_orig_cx = 0;
 
+  // If we stopped in a breakpoint condition stub, make it look like we
+  // stopped in the original code.
+  if (did_read_regs && as->has_condition_stubs()) {
+    bool trapped;
+    remote_code_ptr orig_ip =
+        as->translate_condition_stub_ip(registers.ip(), &trapped);
+    if (!orig_ip.is_null()) {
+      LOG(debug) << "Stopped at " << registers.ip() << " in condition stub; "
+                 << (trapped ? "condition true" : "translating")
+                 << " to " << orig_ip;
+      registers.set_ip(orig_ip);
+      need_to_set_regs = true;
+    }
+  }
+
   // We might have singlestepped at the resumption address and just exited
   // the kernel without executing the breakpoint at that address.
   // The kernel usually (always?) singlesteps an extra instruction when
@@ -1703,20 +1792,38 @@ Task* Task::clone(CloneReason reason, int flags, remote_ptr<void> stack,
   return t;
 }
 
-Task* Task::os_fork_into(Session* session) {
+static void perform_remote_clone(Task* parent, AutoRemoteSyscalls& remote,
+                                 AutoRemoteSyscalls::SyscallWaiting wait,
+                                 unsigned base_flags, remote_ptr<void> stack,
+                                 remote_ptr<int> ptid, remote_ptr<void> tls,
+                                 remote_ptr<int> ctid);
+
+Task* Task::os_fork_into(Session* session, pid_t new_rec_tid,
+                         uint32_t new_serial) {
   AutoRemoteSyscalls remote(this, AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
-  Task* child = os_clone(Task::SESSION_CLONE_LEADER, this, session, remote,
-                         rec_tid, serial,
-                         // Most likely, we'll be setting up a
-                         // CLEARTID futex.  That's not done
-                         // here, but rather later in
-                         // |copy_state()|.
-                         //
-                         // We also don't use any of the SETTID
-                         // flags because that earlier work will
-                         // be copied by fork()ing the address
-                         // space.
-                         SIGCHLD);
+  start_os_fork_into(remote);
+  return finish_os_fork_into(session, remote, new_rec_tid, new_serial);
+}
+
+// Most likely, we'll be setting up a CLEARTID futex.  That's not done
+// here, but rather later in |copy_state()|.
+//
+// We also don't use any of the SETTID flags because that earlier work
+// will be copied by fork()ing the address space.
+static const unsigned fork_into_flags = SIGCHLD;
+
+void Task::start_os_fork_into(AutoRemoteSyscalls& remote) {
+  perform_remote_clone(this, remote, AutoRemoteSyscalls::DONT_WAIT,
+                       fork_into_flags, nullptr, nullptr, nullptr, nullptr);
+}
+
+Task* Task::finish_os_fork_into(Session* session, AutoRemoteSyscalls& remote,
+                                pid_t new_rec_tid, uint32_t new_serial) {
+  remote.wait_syscall();
+  Task* child = finish_os_clone(Task::SESSION_CLONE_LEADER, this, session,
+                                remote, new_rec_tid, new_serial,
+                                fork_into_flags, nullptr, nullptr, nullptr,
+                                nullptr);
   // When we forked ourselves, the child inherited the setup we
   // did to make the clone() call.  So we have to "finish" the
   // remote calls (i.e. undo fudged state) in the child too,
@@ -2289,25 +2396,32 @@ void Task::at_preload_init() {
 
 template <typename Arch>
 static void perform_remote_clone_arch(
-    AutoRemoteSyscalls& remote, unsigned base_flags, remote_ptr<void> stack,
-    remote_ptr<int> ptid, remote_ptr<void> tls, remote_ptr<int> ctid) {
+    AutoRemoteSyscalls& remote, AutoRemoteSyscalls::SyscallWaiting wait,
+    unsigned base_flags, remote_ptr<void> stack, remote_ptr<int> ptid,
+    remote_ptr<void> tls, remote_ptr<int> ctid) {
+  Registers callregs = remote.regs();
+  callregs.set_arg1(base_flags);
+  callregs.set_arg2(stack);
+  callregs.set_arg3(ptid);
   switch (Arch::clone_parameter_ordering) {
     case Arch::FlagsStackParentTLSChild:
-      remote.syscall(Arch::clone, base_flags, stack, ptid.as_int(),
-                     tls.as_int(), ctid.as_int());
+      callregs.set_arg4(tls);
+      callregs.set_arg5(ctid);
       break;
     case Arch::FlagsStackParentChildTLS:
-      remote.syscall(Arch::clone, base_flags, stack, ptid.as_int(),
-                     ctid.as_int(), tls.as_int());
+      callregs.set_arg4(ctid);
+      callregs.set_arg5(tls);
       break;
   }
+  remote.syscall_helper(wait, Arch::clone, callregs);
 }
 
 static void perform_remote_clone(Task* parent, AutoRemoteSyscalls& remote,
+                                 AutoRemoteSyscalls::SyscallWaiting wait,
                                  unsigned base_flags, remote_ptr<void> stack,
                                  remote_ptr<int> ptid, remote_ptr<void> tls,
                                  remote_ptr<int> ctid) {
-  RR_ARCH_FUNCTION(perform_remote_clone_arch, parent->arch(), remote,
+  RR_ARCH_FUNCTION(perform_remote_clone_arch, parent->arch(), remote, wait,
                    base_flags, stack, ptid, tls, ctid);
 }
 
@@ -2317,12 +2431,23 @@ static void perform_remote_clone(Task* parent, AutoRemoteSyscalls& remote,
                                 unsigned base_flags, remote_ptr<void> stack,
                                 remote_ptr<int> ptid, remote_ptr<void> tls,
                                 remote_ptr<int> ctid) {
-  perform_remote_clone(parent, remote, base_flags, stack, ptid, tls, ctid);
+  perform_remote_clone(parent, remote, AutoRemoteSyscalls::WAIT, base_flags,
+                       stack, ptid, tls, ctid);
+  return finish_os_clone(reason, parent, session, remote, rec_child_tid,
+                         new_serial, base_flags, stack, ptid, tls, ctid);
+}
+
+/*static*/ Task* Task::finish_os_clone(
+    CloneReason reason, Task* parent, Session* session,
+    AutoRemoteSyscalls& remote, pid_t rec_child_tid, uint32_t new_serial,
+    unsigned base_flags, remote_ptr<void> stack, remote_ptr<int> ptid,
+    remote_ptr<void> tls, remote_ptr<int> ctid) {
   while (!parent->clone_syscall_is_complete()) {
     // clone syscalls can fail with EAGAIN due to temporary load issues.
     // Just retry the system call until it succeeds.
     if (parent->regs().syscall_result_signed() == -EAGAIN) {
-      perform_remote_clone(parent, remote, base_flags, stack, ptid, tls, ctid);
+      perform_remote_clone(parent, remote, AutoRemoteSyscalls::WAIT,
+                           base_flags, stack, ptid, tls, ctid);
     } else {
       // XXX account for ReplaySession::is_ignored_signal?
       parent->resume_execution(RESUME_SYSCALL, RESUME_WAIT, RESUME_NO_TICKS);
@@ -78,6 +78,8 @@ enum ResumeRequest {
   RESUME_SYSCALL = PTRACE_SYSCALL,
   RESUME_SYSEMU = PTRACE_SYSEMU,
   RESUME_SYSEMU_SINGLESTEP = PTRACE_SYSEMU_SINGLESTEP,
+  // Run until the next taken branch (x86 BTF).
+  RESUME_SINGLEBLOCK = PTRACE_SINGLEBLOCK,
 };
 enum WaitRequest {
   // After resuming, blocking-waitpid() until tracee status
@@ -104,7 +106,8 @@ enum TicksRequest {
  * apply. Also, none can apply, e.g. if someone sent us a SIGTRAP via kill().
  */
 struct TrapReasons {
-  /* Singlestep completed (RESUME_SINGLESTEP, RESUME_SYSEMU_SINGLESTEP). */
+  /* Singlestep completed (RESUME_SINGLESTEP, RESUME_SYSEMU_SINGLESTEP,
+   * RESUME_SINGLEBLOCK). */
   bool singlestep;
   /* Hardware watchpoint fired. This includes cases where the actual values
    * did not change (i.e. AddressSpace::has_any_watchpoint_changes may return
@@ -126,6 +129,7 @@ void fixup_syscall_registers(Registers& registers, SupportedArch arch);
  * so no distinction is made here.
  */
 class Task {
+  friend class AutoRemoteSyscalls;
   friend class Session;
   friend class RecordSession;
   friend class ReplaySession;
@@ -809,6 +813,12 @@ public:
     return seen_ptrace_exit_event || detected_unexpected_exit;
   }
 
+  /**
+   * If the given memory region is mapped into the local address space, obtain
+   * the local address from which the `size` bytes at `addr` can be accessed.
+   */
+  uint8_t* local_mapping(remote_ptr<void> addr, size_t size);
+
 protected:
   Task(Session& session, pid_t tid, pid_t rec_tid, uint32_t serial,
        SupportedArch a);
@@ -873,12 +883,6 @@ protected:
    */
   void xptrace(int request, remote_ptr<void> addr, void* data);
 
-  /**
-   * If the given memory region is mapped into the local address space, obtain
-   * the local address from which the `size` bytes at `addr` can be accessed.
-   */
-  uint8_t* local_mapping(remote_ptr<void> addr, size_t size);
-
   /**
    * Read tracee memory using PTRACE_PEEKDATA calls. Slow, only use
    * as fallback. Returns number of bytes actually read.
@@ -917,14 +921,31 @@ protected:
    * checkpointing.
    *
    * For |os_fork_into()|, |session| will be tracking the
-   * returned fork child.
+   * returned fork child. The child gets |new_rec_tid| and |new_serial|,
+   * by default the same as this task's.
    *
    * For |os_clone_into()|, |task_leader| is the "main thread"
    * in the process into which the copy of this task will be
    * created.  |task_leader| will perform the actual OS calls to
    * create the new child.
    */
-  Task* os_fork_into(Session* session);
+  Task* os_fork_into(Session* session) {
+    return os_fork_into(session, rec_tid, serial);
+  }
+  Task* os_fork_into(Session* session, pid_t new_rec_tid, uint32_t new_serial);
+  /**
+   * |os_fork_into()| in two steps: start the fork syscall in this task, then
+   * wait for it to finish. Other tasks can be worked on in between, e.g.
+   * to have the kernel fork several processes at once. |remote| must be
+   * prepared on this task with DISABLE_MEMORY_PARAMS and must not be used
+   * for anything else in between.
+   */
+  void start_os_fork_into(AutoRemoteSyscalls& remote);
+  Task* finish_os_fork_into(Session* session, AutoRemoteSyscalls& remote) {
+    return finish_os_fork_into(session, remote, rec_tid, serial);
+  }
+  Task* finish_os_fork_into(Session* session, AutoRemoteSyscalls& remote,
+                            pid_t new_rec_tid, uint32_t new_serial);
   static Task* os_clone_into(const CapturedState& state, Task* task_leader,
                              AutoRemoteSyscalls& remote);
 
@@ -950,6 +971,16 @@ protected:
                         remote_ptr<int> ptid = nullptr,
                         remote_ptr<void> tls = nullptr,
                         remote_ptr<int> ctid = nullptr);
+  /**
+   * The rest of |os_clone()| once the clone syscall has been started and
+   * has reached its first stop.
+   */
+  static Task* finish_os_clone(CloneReason reason, Task* parent,
+                               Session* session, AutoRemoteSyscalls& remote,
+                               pid_t rec_child_tid, uint32_t new_serial,
+                               unsigned base_flags, remote_ptr<void> stack,
+                               remote_ptr<int> ptid, remote_ptr<void> tls,
+                               remote_ptr<int> ctid);
 
   /**
    * Fork and exec the initial task. If something goes wrong later
@@ -963,6 +994,16 @@ protected:
 
   void maybe_workaround_singlestep_bug();
 
+  /**
+   * Called when a resume stopped with a write fault on a page
+   * write-protected for software watchpoints. Steps over the faulting
+   * write(s) with the page writable, checks the watchpoints, and resumes
+   * with |how| until a watchpoint triggers or some other stop happens.
+   */
+  void step_over_software_watchpoint_faults(ResumeRequest how,
+                                            TicksRequest tick_period,
+                                            Ticks ticks_at_resume);
+
   uint32_t serial;
   // The address space of this task.
   AddressSpace::shr_ptr as;
@@ -1020,6 +1061,10 @@ protected:
   // A counter for the number of stops for which the stop may have been caused
   // by PTRACE_INTERRUPT. See description in do_waitpid
   int expecting_ptrace_interrupt_stop;
+  // Nonzero while step_over_software_watchpoint_faults or an
+  // AutoRemoteSyscalls is resuming us, when resume_execution must leave
+  // software watchpoint protection alone.
+  int software_watch_suspended;
 
   Task(Task&) = delete;
   Task operator=(Task&) = delete;
@@ -150,6 +150,8 @@ static void ensure_default_rr_trace_dir() {
   ensure_dir(default_rr_trace_dir(), S_IRWXU);
 }
 
+string TraceStream::rr_data_dir() { return default_rr_trace_dir(); }
+
 string TraceStream::file_data_clone_file_name(const TaskUid& tuid) {
   stringstream ss;
   ss << trace_dir << "/cloned_data_" << tuid.tid() << "_" << tuid.serial();
@@ -238,6 +240,7 @@ TraceFrame TraceReader::read_frame() {
   // Read the common event info first, to see if we also have
   // exec info to read.
   auto& events = reader(EVENTS);
+  events.get_position(&last_frame_block_offset, &last_frame_offset_in_block);
   BasicInfo basic_info;
   events >> basic_info;
   TraceFrame frame(basic_info.global_time, basic_info.tid_,
@@ -383,6 +386,16 @@ bool TraceWriter::try_clone_file(const string& file_name, string* new_name) {
   return true;
 }
 
+bool TraceWriter::try_store_blob(const string& file_name,
+                                 const struct stat& stat, string* new_name) {
+  string name = blob_store.add(file_name, stat);
+  if (name.empty()) {
+    return false;
+  }
+  *new_name = BlobStore::trace_file_name(name);
+  return true;
+}
+
 TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
     Task* t, const KernelMapping& km, const struct stat& stat,
     MappingOrigin origin) {
@@ -405,7 +418,18 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
   } else if (should_copy_mmap_region(km, stat) &&
              files_assumed_immutable.find(make_pair(
                  stat.st_dev, stat.st_ino)) == files_assumed_immutable.end()) {
-    source = TraceReader::SOURCE_TRACE;
+    // We'd copy the file's current contents into the trace here. A blob in
+    // the shared store is the same snapshot, and the next trace mapping the
+    // same file can reuse it. Later changes to the mapped memory, such as
+    // the tracee's own copy-on-write stores, are replayed the same way
+    // either way.
+    if ((km.flags() & MAP_PRIVATE) &&
+        t->session().as_record()->use_blob_store() &&
+        try_store_blob(km.fsname(), stat, &backing_file_name)) {
+      source = TraceReader::SOURCE_FILE;
+    } else {
+      source = TraceReader::SOURCE_TRACE;
+    }
   } else {
     source = TraceReader::SOURCE_FILE;
     // Try hardlinking file into the trace directory. This will avoid
@@ -464,14 +488,32 @@ KernelMapping TraceReader::read_mapped_region(MappedData* data, bool* found,
   assert(time_constraint == ANY_TIME || time == global_time);
   if (data) {
     data->source = source;
+    data->blob_name.clear();
     if (data->source == SOURCE_FILE) {
       static const string clone_prefix("mmap_clone_");
       bool is_clone =
           backing_file_name.substr(0, clone_prefix.size()) == clone_prefix;
+      data->blob_name = BlobStore::blob_name(backing_file_name);
       if (backing_file_name[0] != '/') {
         backing_file_name = dir() + "/" + backing_file_name;
       }
-      if (!is_clone && validate == VALIDATE) {
+      if (!data->blob_name.empty()) {
+        // Blobs are looked up in the trace directory first, where `rr pack`
+        // puts them, then in the shared store. They are snapshots, so
+        // there's no metadata to validate.
+        if (access(backing_file_name.c_str(), F_OK) != 0) {
+          backing_file_name =
+              BlobStore::for_trace(dir()).path(data->blob_name);
+          if (validate == VALIDATE &&
+              access(backing_file_name.c_str(), R_OK) != 0) {
+            FATAL() << "Blob " << data->blob_name << " for "
+                    << original_file_name << " not found in " << dir()
+                    << " or " << backing_file_name
+                    << ": replay is impossible. Run `rr pack' on the trace "
+                       "before moving it.";
+          }
+        }
+      } else if (!is_clone && validate == VALIDATE) {
         struct stat backing_stat;
         if (stat(backing_file_name.c_str(), &backing_stat)) {
           FATAL() << "Failed to stat " << backing_file_name
@@ -509,19 +551,35 @@ void TraceWriter::write_raw(pid_t rec_tid, const void* d, size_t len,
 }
 
 TraceReader::RawData TraceReader::read_raw_data() {
-  auto& data = reader(RAW_DATA);
+  RawData d;
+  d.data.resize(read_raw_data_metadata(d));
+  read_raw_data_contents(d.data.data(), d.data.size());
+  return d;
+}
+
+size_t TraceReader::read_raw_data_metadata(RawData& d) {
   auto& data_header = reader(RAW_DATA_HEADER);
   TraceFrame::Time time;
-  RawData d;
   size_t num_bytes;
   data_header >> time >> d.rec_tid >> d.addr >> num_bytes;
   assert(time == global_time);
-  d.data.resize(num_bytes);
-  data.read((char*)d.data.data(), num_bytes);
-  return d;
+  d.data.clear();
+  return num_bytes;
+}
+
+void TraceReader::read_raw_data_contents(void* buf, size_t size) {
+  reader(RAW_DATA).read((char*)buf, size);
 }
 
 bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
+  if (!has_raw_data_for_frame(frame)) {
+    return false;
+  }
+  d = read_raw_data();
+  return true;
+}
+
+bool TraceReader::has_raw_data_for_frame(const TraceFrame& frame) {
   auto& data_header = reader(RAW_DATA_HEADER);
   if (data_header.at_end()) {
     return false;
@@ -531,11 +589,7 @@ bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
   data_header >> time;
   data_header.restore_state();
   assert(time >= frame.time());
-  if (time > frame.time()) {
-    return false;
-  }
-  d = read_raw_data();
-  return true;
+  return time == frame.time();
 }
 
 void TraceWriter::write_generic(const void* d, size_t len) {
@@ -576,6 +630,9 @@ void TraceWriter::close() {
   for (auto& w : writers) {
     w->close();
   }
+  LOG(debug) << "Blob store: " << blob_store.bytes_stored()
+             << " bytes stored, " << blob_store.bytes_shared()
+             << " bytes already present";
 }
 
 static string make_trace_dir(const string& exe_path) {
@@ -606,9 +663,13 @@ TraceWriter::TraceWriter(const std::string& file_name, int bind_to_cpu)
                   // global time from 1.
                   1),
       mmap_count(0),
-      supports_file_data_cloning_(false) {
+      supports_file_data_cloning_(false),
+      blob_store(BlobStore::for_trace(trace_dir)) {
   this->bind_to_cpu = bind_to_cpu;
 
+  // Traces that used blobs may have been deleted since the last recording.
+  blob_store.collect_garbage();
+
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
         path(s), substream(s).block_size, substream(s).threads));
@@ -670,12 +731,16 @@ TraceFrame TraceReader::peek_frame() {
   auto& events = reader(EVENTS);
   events.save_state();
   auto saved_time = global_time;
+  auto saved_block_offset = last_frame_block_offset;
+  auto saved_offset_in_block = last_frame_offset_in_block;
   TraceFrame frame;
   if (!at_end()) {
     frame = read_frame();
   }
   events.restore_state();
   global_time = saved_time;
+  last_frame_block_offset = saved_block_offset;
+  last_frame_offset_in_block = saved_offset_in_block;
   return frame;
 }
 
@@ -684,11 +749,36 @@ void TraceReader::rewind() {
     reader(s).rewind();
   }
   global_time = 0;
+  last_frame_block_offset = 0;
+  last_frame_offset_in_block = 0;
   assert(good());
 }
 
+TraceReader::Position TraceReader::position_of_last_frame() const {
+  Position position;
+  position.time = time() - 1;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    reader(s).get_position(&position.block_offsets[s],
+                           &position.offsets_in_block[s]);
+  }
+  position.block_offsets[EVENTS] = last_frame_block_offset;
+  position.offsets_in_block[EVENTS] = last_frame_offset_in_block;
+  return position;
+}
+
+void TraceReader::seek(const Position& position) {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    reader(s).seek(position.block_offsets[s], position.offsets_in_block[s]);
+  }
+  global_time = position.time;
+  last_frame_block_offset = position.block_offsets[EVENTS];
+  last_frame_offset_in_block = position.offsets_in_block[EVENTS];
+}
+
 TraceReader::TraceReader(const string& dir)
-    : TraceStream(dir.empty() ? latest_trace_symlink() : dir, 1) {
+    : TraceStream(dir.empty() ? latest_trace_symlink() : dir, 1),
+      last_frame_block_offset(0),
+      last_frame_offset_in_block(0) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     readers[s] = unique_ptr<CompressedReader>(new CompressedReader(path(s)));
   }
@@ -741,7 +831,9 @@ TraceReader::TraceReader(const string& dir)
  * clone won't affect the state of 'other' (and vice versa).
  */
 TraceReader::TraceReader(const TraceReader& other)
-    : TraceStream(other.dir(), other.time()) {
+    : TraceStream(other.dir(), other.time()),
+      last_frame_block_offset(other.last_frame_block_offset),
+      last_frame_offset_in_block(other.last_frame_offset_in_block) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     readers[s] =
         unique_ptr<CompressedReader>(new CompressedReader(other.reader(s)));
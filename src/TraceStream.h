@@ -10,6 +10,7 @@
 #include <string>
 #include <vector>
 
+#include "BlobStore.h"
 #include "CompressedReader.h"
 #include "CompressedWriter.h"
 #include "Event.h"
@@ -70,6 +71,13 @@ public:
 
   std::string file_data_clone_file_name(const TaskUid& tuid);
 
+  /**
+   * Return rr's per-user data directory. Traces are saved there unless
+   * _RR_TRACE_DIR is set, and persistent caches live there. The directory
+   * might not exist yet.
+   */
+  static std::string rr_data_dir();
+
 protected:
   TraceStream(const string& trace_dir, TraceFrame::Time initial_time)
       : trace_dir(trace_dir), global_time(initial_time) {}
@@ -177,6 +185,8 @@ public:
 private:
   std::string try_hardlink_file(const std::string& file_name);
   bool try_clone_file(const std::string& file_name, std::string* new_name);
+  bool try_store_blob(const std::string& file_name, const struct stat& stat,
+                      std::string* new_name);
 
   CompressedWriter& writer(Substream s) { return *writers[s]; }
   const CompressedWriter& writer(Substream s) const { return *writers[s]; }
@@ -189,6 +199,7 @@ private:
   std::set<std::pair<dev_t, ino_t>> files_assumed_immutable;
   uint32_t mmap_count;
   bool supports_file_data_cloning_;
+  BlobStore blob_store;
 };
 
 class TraceReader : public TraceStream {
@@ -228,6 +239,8 @@ public:
     uint64_t data_offset_bytes;
     /** Original size of mapped file. */
     uint64_t file_size_bytes;
+    /** If the data comes from the blob store, the name of the blob. */
+    string blob_name;
   };
   /**
    * Read the next mapped region descriptor and return it.
@@ -253,12 +266,25 @@ public:
    */
   RawData read_raw_data();
 
+  /**
+   * Read the next raw data record like |read_raw_data()|, except that
+   * |d.data| is left empty; the caller must then read the returned number
+   * of data bytes with |read_raw_data_contents()|, in one or more pieces.
+   * This lets the data be decompressed directly into place.
+   */
+  size_t read_raw_data_metadata(RawData& d);
+  void read_raw_data_contents(void* buf, size_t size);
+
   /**
    * Reads the next raw data record for 'frame' from the current point in
    * the trace. If there are no more raw data records for 'frame', returns
    * false.
    */
   bool read_raw_data_for_frame(const TraceFrame& frame, RawData& d);
+  /**
+   * Returns true if the next raw data record is for 'frame'.
+   */
+  bool has_raw_data_for_frame(const TraceFrame& frame);
 
   void read_generic(std::vector<uint8_t>& out);
   bool read_generic_for_frame(const TraceFrame& frame,
@@ -287,6 +313,23 @@ public:
    */
   void rewind();
 
+  /**
+   * The position of all the substreams from which reading resumes with the
+   * frame last returned by read_frame(), followed by whatever data has not
+   * been read yet for that frame.
+   */
+  struct Position {
+    TraceFrame::Time time;
+    uint64_t block_offsets[SUBSTREAM_COUNT];
+    uint64_t offsets_in_block[SUBSTREAM_COUNT];
+  };
+  Position position_of_last_frame() const;
+  /**
+   * Return to |position|. The next read_frame() returns the frame that was
+   * last read when |position| was obtained.
+   */
+  void seek(const Position& position);
+
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
 
@@ -308,6 +351,9 @@ private:
   const CompressedReader& reader(Substream s) const { return *readers[s]; }
 
   std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
+  // Position of the EVENTS substream before the last read_frame().
+  uint64_t last_frame_block_offset;
+  uint64_t last_frame_offset_in_block;
 };
 
 } // namespace rr
@@ -144,6 +144,39 @@ templates = {
         RawBytes(0xff, 0x25, 0x00, 0x00, 0x00, 0x00),       # jmp *0(%rip)
         Field('jump_target', 8),
     ),
+    'X64RdtscStubExtendedJump': AssemblyTemplate(
+        # Save the flags and the registers the syscall hook clobbers but rdtsc
+        # doesn't, below the red zone. Then proceed as
+        # X64SyscallStubExtendedJump. return_addr must point to an
+        # X64RdtscStubExtendedJumpReturn.
+        RawBytes(0x48, 0x8d, 0x64, 0x24, 0x80),             # lea -128(%rsp),%rsp
+        RawBytes(0x9c),                                     # pushfq
+        RawBytes(0x51),                                     # pushq %rcx
+        RawBytes(0x41, 0x53),                               # pushq %r11
+        RawBytes(0x48, 0x89, 0x24, 0x25, 0x10, 0x10, 0x00, 0x70), # movq %rsp,(stub_scratch_1)
+        RawBytes(0xFF, 0x04, 0x25, 0x18, 0x10, 0x00, 0x70),       # incl (alt_stack_nesting_level)
+        RawBytes(0x83, 0x3c, 0x25, 0x18, 0x10, 0x00, 0x70, 0x01), # cmpl 1,(alt_stack_nesting_level)
+        RawBytes(0x75, 0x0a),                                     # jne dont_switch
+        RawBytes(0x48, 0x8b, 0x24, 0x25, 0x00, 0x10, 0x00, 0x70), # movq (syscallbuf_stub_alt_stack),%rsp
+        RawBytes(0xeb, 0x07),                                     # jmp after_adjust
+        # dont_switch:
+        RawBytes(0x48, 0x81, 0xec, 0x00, 0x01, 0x00, 0x00), # subq $256, %rsp
+        # after adjust
+        RawBytes(0xff, 0x34, 0x25, 0x10, 0x10, 0x00, 0x70), # pushq (stub_scratch_1)
+        RawBytes(0x50),                                     # pushq rax
+        RawBytes(0xc7, 0x04, 0x24),                         # movl $return_addr_lo,(%rsp)
+        Field('return_addr_lo', 4),
+        RawBytes(0xc7, 0x44, 0x24, 0x04),                   # movl $return_addr_hi,(%rsp+4)
+        Field('return_addr_hi', 4),
+        RawBytes(0xff, 0x25, 0x00, 0x00, 0x00, 0x00),       # jmp *0(%rip)
+        Field('jump_target', 8),
+    ),
+    'X64RdtscStubExtendedJumpReturn': AssemblyTemplate(
+        RawBytes(0x41, 0x5b),                               # popq %r11
+        RawBytes(0x59),                                     # popq %rcx
+        RawBytes(0x9d),                                     # popfq
+        RawBytes(0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00), # lea 128(%rsp),%rsp
+    ),
 }
 
 def byte_array_name(name):
@@ -57,6 +57,24 @@ def write_rr_page(f, is_64, is_replay):
     ff_bytes = bytearray([0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff])
     f.write(ff_bytes)
 
+    # rdtsc record-only, used by the syscallbuf rdtsc hook. Clearing
+    # %eax/%edx keeps registers identical between recording and replay.
+    if is_64:
+        clear_bytes = bytearray([
+            0x31, 0xc0, # xor %eax,%eax
+            0x31, 0xd2, # xor %edx,%edx
+            0xc3, # ret
+        ])
+        if is_replay:
+            f.write(clear_bytes)
+        else:
+            f.write(bytearray([
+                0x0f, 0x31, # rdtsc
+                0x89, 0x07, # mov %eax,(%rdi)
+                0x89, 0x57, 0x04, # mov %edx,4(%rdi)
+            ]))
+            f.write(clear_bytes)
+
 generators_for = {
     'rr_page_32': lambda stream: write_rr_page(stream, False, False),
     'rr_page_64': lambda stream: write_rr_page(stream, True, False),
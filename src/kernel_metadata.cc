@@ -82,6 +82,7 @@ string ptrace_req_name(int request) {
     // These aren't part of the official ptrace-request enum.
     CASE(PTRACE_SYSEMU);
     CASE(PTRACE_SYSEMU_SINGLESTEP);
+    CASE(PTRACE_SINGLEBLOCK);
     default: {
       char buf[100];
       sprintf(buf, "PTRACE_REQUEST(%d)", request);
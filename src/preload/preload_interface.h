@@ -101,6 +101,10 @@ static inline int strprefix(const char* s1, const char* s2) {
 #define RR_PAGE_SYSCALL_PRIVILEGED_UNTRACED_RECORDING_ONLY                     \
   RR_PAGE_SYSCALL_ADDR(7)
 #define RR_PAGE_FF_BYTES (RR_PAGE_ADDR + RR_PAGE_SYSCALL_STUB_SIZE * 8)
+/* x86-64 only. During recording, executes rdtsc and stores the result to the
+ * 8 bytes pointed to by %rdi. During replay, does nothing. Either way it
+ * clears %eax and %edx. */
+#define RR_PAGE_RDTSC_RECORDING_ONLY (RR_PAGE_FF_BYTES + 8)
 
 /* PRELOAD_THREAD_LOCALS_ADDR should not change.
  * Tools depend on this address. */
@@ -151,6 +155,13 @@ static inline int strprefix(const char* s1, const char* s2) {
  * fourth parameter is the prot.
  */
 #define SYS_rrcall_mprotect_record 447
+/**
+ * Not a real syscall. Monkeypatcher redirects hot rdtsc instructions to a
+ * hook that enters the syscallbuf code with this syscall number, so the
+ * timestamp counter value can be recorded in the syscall buffer. The result
+ * is returned in %eax and %edx, like rdtsc.
+ */
+#define SYS_rrcall_rdtsc 448
 
 /* Define macros that let us compile a struct definition either "natively"
  * (when included by preload.c) or as a template over Arch for use by rr.
@@ -338,6 +349,8 @@ struct rrcall_init_preload_params {
    * particular syscallbuf record. */
   PTR(void) breakpoint_table;
   int breakpoint_table_entry_size;
+  /* Where patched rdtsc instructions should jump to (x86-64 only) */
+  PTR(void) rdtsc_hook;
 };
 
 /**
@@ -56,6 +56,7 @@
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/ptrace.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
@@ -517,6 +518,7 @@ static void __attribute__((constructor)) init_process(void) {
   extern RR_HIDDEN void _syscall_hook_trampoline_90_90_90(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_ba_01_00_00_00(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_89_c1_31_d2(void);
+  extern RR_HIDDEN void _rdtsc_hook_trampoline(void);
 
   struct syscall_patch_hook syscall_patch_hooks[] = {
     /* Many glibc syscall wrappers (e.g. read) have 'syscall' followed
@@ -590,10 +592,12 @@ static void __attribute__((constructor)) init_process(void) {
   params.syscallhook_vsyscall_entry = (void*)__morestack;
   params.get_pc_thunks_start = &_get_pc_thunks_start;
   params.get_pc_thunks_end = &_get_pc_thunks_end;
+  params.rdtsc_hook = NULL;
 #else
   params.syscallhook_vsyscall_entry = NULL;
   params.get_pc_thunks_start = NULL;
   params.get_pc_thunks_end = NULL;
+  params.rdtsc_hook = (void*)_rdtsc_hook_trampoline;
 #endif
   params.syscallbuf_code_start = &_syscallbuf_code_start;
   params.syscallbuf_code_end = &_syscallbuf_code_end;
@@ -2018,6 +2022,55 @@ static long sys_recvmsg(const struct syscall_info* call) {
 }
 #endif
 
+// The alignment of this struct is incorrect, but as long as it's not
+// used inside other structures, defining it this way makes the code below
+// easier.
+typedef uint64_t kernel_sigset_t;
+
+#if defined(__x86_64__)
+/**
+ * Execute a real rdtsc, which traps to rr, and return its result the way
+ * sys_rrcall_rdtsc does.
+ */
+static long traced_rdtsc(const struct syscall_info* call) {
+  uint32_t low, high;
+  __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+  ((struct syscall_info*)call)->args[2] = high;
+  return low;
+}
+
+static long sys_rrcall_rdtsc(const struct syscall_info* call) {
+  const int syscallno = SYS_rrcall_rdtsc;
+  void (*rdtsc_recording_only)(uint32_t*) =
+      (void (*)(uint32_t*))RR_PAGE_RDTSC_RECORDING_ONLY;
+
+  void* ptr = prep_syscall();
+  uint32_t* tsc = ptr;
+  ptr += 2 * sizeof(*tsc);
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_rdtsc(call);
+  }
+  /* rr makes rdtsc trap with PR_TSC_SIGSEGV. Allow it just for the
+   * duration of the rr page rdtsc, which during replay does nothing and
+   * leaves the recorded value in the buffer. Signals are blocked meanwhile
+   * so a handler can't run an untrapped rdtsc. */
+  kernel_sigset_t all = ~(kernel_sigset_t)0;
+  kernel_sigset_t old_mask;
+  privileged_untraced_syscall4(SYS_rt_sigprocmask, SIG_SETMASK, &all,
+                               &old_mask, sizeof(kernel_sigset_t));
+  privileged_untraced_syscall2(SYS_prctl, PR_SET_TSC, PR_TSC_ENABLE);
+  rdtsc_recording_only(tsc);
+  privileged_untraced_syscall2(SYS_prctl, PR_SET_TSC, PR_TSC_SIGSEGV);
+  privileged_untraced_syscall4(SYS_rt_sigprocmask, SIG_SETMASK, &old_mask,
+                               NULL, sizeof(kernel_sigset_t));
+  ((struct syscall_info*)call)->args[2] = tsc[1];
+  return commit_raw_syscall(syscallno, ptr, tsc[0]);
+}
+#endif
+
 #ifdef SYS_sendmsg
 static long sys_sendmsg(const struct syscall_info* call) {
   const int syscallno = SYS_sendmsg;
@@ -2280,11 +2333,6 @@ static long sys_getrusage(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
-// The alignment of this struct is incorrect, but as long as it's not
-// used inside other structures, defining it this way makes the code below
-// easier.
-typedef uint64_t kernel_sigset_t;
-
 static long sys_rt_sigprocmask(const struct syscall_info* call) {
   const int syscallno = SYS_rt_sigprocmask;
   long ret;
@@ -2417,6 +2465,9 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     CASE(ptrace);
     CASE(read);
     CASE(readlink);
+#if defined(__x86_64__)
+    CASE(rrcall_rdtsc);
+#endif
 #if defined(SYS_recvfrom)
     CASE(recvfrom);
 #endif
@@ -2484,6 +2535,11 @@ RR_HIDDEN long syscall_hook(const struct syscall_info* call) {
 
   if (!thread_locals->buffer || buffer_hdr()->locked) {
     /* We may be reentering via a signal handler. Bail. */
+#if defined(__x86_64__)
+    if (call->no == SYS_rrcall_rdtsc) {
+      return traced_rdtsc(call);
+    }
+#endif
     return traced_raw_syscall(call);
   }
 
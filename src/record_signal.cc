@@ -103,10 +103,18 @@ static bool try_handle_rdtsc(RecordTask* t, siginfo_t* si) {
     return false;
   }
 
+  // Patching records memory changes that replay applies at this event.
+  remote_code_ptr resume_ip = t->vm()->monkeypatcher().try_patch_rdtsc(t);
+
   unsigned long long current_time = rdtsc();
   Registers r = t->regs();
   r.set_rdtsc_output(current_time);
-  r.set_ip(r.ip() + sizeof(rdtsc_insn));
+  if (resume_ip.is_null()) {
+    r.set_ip(r.ip() + sizeof(rdtsc_insn));
+  } else {
+    // The instructions after the rdtsc have been moved.
+    r.set_ip(resume_ip);
+  }
   t->set_regs(r);
 
   t->push_event(Event(EV_SEGV_RDTSC, HAS_EXEC_INFO, t->arch()));
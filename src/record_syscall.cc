@@ -2831,6 +2831,10 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
         prepare_exit(t, (int)regs.arg1());
         return ALLOW_SWITCH;
       }
+      // The other threads are about to be killed; don't leave any of them
+      // running in a timeslice we'd have to account for later.
+      t->session().scheduler().stop_running_tasks(
+          t->task_group()->task_set());
       return PREVENT_SWITCH;
 
     case Arch::execve: {
@@ -3898,8 +3902,15 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
 
     case Arch::brk:
     case Arch::munmap:
+    case Arch::process_vm_writev: {
+      RecordTask* dest = t->session().find_task((pid_t)regs.arg1());
+      if (dest) {
+        t->session().scheduler().prepare_cross_process_write(t, dest);
+      }
+      return PREVENT_SWITCH;
+    }
+
     case Arch::process_vm_readv:
-    case Arch::process_vm_writev:
     case SYS_rrcall_notify_syscall_hook_exit:
     case Arch::mremap:
     case Arch::shmat:
@@ -4248,6 +4259,9 @@ static void process_mmap(RecordTask* t, size_t length, int prot, int flags,
   size_t size = ceil_page_size(length);
   off64_t offset = offset_pages * 4096;
   remote_ptr<void> addr = t->regs().syscall_result();
+  if (flags & MAP_SHARED) {
+    t->vm()->set_has_shared_mappings();
+  }
   if (flags & MAP_ANONYMOUS) {
     KernelMapping km;
     if (flags & MAP_PRIVATE) {
@@ -4392,6 +4406,7 @@ static void process_shmat(RecordTask* t, int shmid, int shm_flags,
 
   int prot = shm_flags_to_mmap_prot(shm_flags);
   int flags = MAP_SHARED;
+  t->vm()->set_has_shared_mappings();
 
   // Read the kernel's mapping for the shm segment. There doesn't seem to be
   // any other way to get the correct device number. (The inode number seems to
@@ -81,6 +81,12 @@ static string maybe_dump_written_string(ReplayTask* t) {
 static void __ptrace_cont(ReplayTask* t, ResumeRequest resume_how,
                           int expect_syscallno, int expect_syscallno2 = -1,
                           pid_t new_tid = -1) {
+  // The kernel can't write to pages we've write-protected for software
+  // watchpoints. Unprotect them until the tracee next runs user code.
+  if (t->vm()->has_software_watchpoints()) {
+    AutoRemoteSyscalls remote(t, AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
+    t->vm()->drop_software_watch_protection(remote);
+  }
   do {
     t->resume_execution(resume_how, RESUME_NONBLOCKING, RESUME_NO_TICKS);
     if (new_tid > 0) {
@@ -860,7 +866,9 @@ static void process_mmap(ReplayTask* t, const TraceFrame& trace_frame,
     // Finally, we finish by emulating the return value.
     remote.regs().set_syscall_result(trace_frame.regs().syscall_result());
   }
-  // Monkeypatcher can emit data records that need to be applied now
+  // Monkeypatcher can emit mappings and data records that need to be applied
+  // now
+  t->apply_patch_mappings_from_trace();
   t->apply_all_data_records_from_trace();
   t->validate_regs();
 }
@@ -1322,6 +1330,9 @@ static void rep_process_syscall_arch(ReplayTask* t, ReplayTraceStep* step,
 
     case SYS_rrcall_init_preload:
       t->at_preload_init();
+      // Monkeypatcher may have allocated extended jump pages while applying
+      // cached syscall patches. The data records are applied on syscall exit.
+      t->apply_patch_mappings_from_trace();
       return;
 
     case SYS_rrcall_reload_auxv: {
@@ -1653,6 +1653,7 @@ rrcall_notify_syscall_hook_exit = IrregularEmulatedSyscall(x86=444, x64=444)
 rrcall_notify_control_msg = IrregularEmulatedSyscall(x86=445, x64=445)
 rrcall_reload_auxv = IrregularEmulatedSyscall(x86=446, x64=446)
 rrcall_mprotect_record = IrregularEmulatedSyscall(x86=447, x64=447)
+rrcall_rdtsc = IrregularEmulatedSyscall(x86=448, x64=448)
 
 # These syscalls are also subsumed under socketcall on x86.
 socket = EmulatedSyscall(x86=359, x64=41)
@@ -0,0 +1,23 @@
+from rrutil import *
+
+send_gdb('handle SIGKILL stop')
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('cond 1 var==2500')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('p var')
+expect_gdb(' = 2500')
+
+send_gdb('c')
+expect_gdb('EXIT-SUCCESS')
+expect_gdb('SIGKILL')
+
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 1')
+send_gdb('p var')
+expect_gdb(' = 2500')
+
+ok()
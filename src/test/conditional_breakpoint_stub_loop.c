@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static int iteration;
+
+/* Each loop's back-edge targets the instruction right after a breakpoint
+   site, so a condition stub must not displace more than the instruction at
+   the breakpoint. long_site's instruction is big enough for a jump to the
+   stub; short_site's isn't. */
+static __attribute__((noinline)) int loops(void) {
+  int sum = 0;
+  __asm__ __volatile__(".globl long_site\n"
+                       "long_site:\n\t"
+#ifdef __x86_64__
+                       "movq $1,%%rdx\n"
+#else
+                       "movl $1,%%edx\n"
+#endif
+                       "1:\n\t"
+                       "add %%edx,%0\n\t"
+                       "dec %%edx\n\t"
+                       "add $2,%%edx\n\t"
+                       "cmp $20,%%edx\n\t"
+                       "jne 1b\n\t"
+                       ".globl short_site\n"
+                       "short_site:\n\t"
+                       "inc %%edx\n"
+                       "2:\n\t"
+                       "add %%edx,%0\n\t"
+                       "dec %%edx\n\t"
+                       "jnz 2b\n\t"
+                       : "+r"(sum)
+                       :
+                       : "edx", "cc");
+  return sum;
+}
+
+int main(void) {
+  for (iteration = 0; iteration < 3000; ++iteration) {
+    /* 1 + ... + 19, then 21 + 20 + ... + 1 */
+    test_assert(loops() == 190 + 231);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
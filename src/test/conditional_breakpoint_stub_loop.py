@@ -0,0 +1,31 @@
+from rrutil import *
+
+send_gdb('handle SIGKILL stop')
+
+send_gdb('b *long_site')
+expect_gdb('Breakpoint 1')
+send_gdb('cond 1 iteration==1000')
+send_gdb('b *short_site')
+expect_gdb('Breakpoint 2')
+send_gdb('cond 2 iteration==2000')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('p iteration')
+expect_gdb(' = 1000')
+
+send_gdb('c')
+expect_gdb('Breakpoint 2')
+send_gdb('p iteration')
+expect_gdb(' = 2000')
+
+send_gdb('c')
+expect_gdb('EXIT-SUCCESS')
+expect_gdb('SIGKILL')
+
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 2')
+send_gdb('p iteration')
+expect_gdb(' = 2000')
+
+ok()
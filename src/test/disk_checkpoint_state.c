@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define FILENAME "disk_checkpoint_state.data"
+#define DIRNAME "disk_checkpoint_state.dir"
+#define NUM_ITERATIONS 100
+
+static volatile int caught;
+
+static void handler(__attribute__((unused)) int sig) { caught = 1; }
+
+int main(void) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  char* buf = malloc(2 * page);
+  char* p;
+  char c;
+  int fd;
+  int i;
+  struct rlimit limit;
+  sigset_t set;
+
+  /* Kernel state that replay doesn't track itself and that a restored
+     checkpoint must have. */
+  memset(buf, 'a', 2 * page);
+  test_assert(0 == mkdir(DIRNAME, 0700));
+  test_assert(0 == chdir(DIRNAME));
+  fd = open(FILENAME, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert((ssize_t)(2 * page) == write(fd, buf, 2 * page));
+  test_assert(0 == lseek(fd, 0, SEEK_SET));
+  test_assert(1 == read(fd, &c, 1));
+
+  p = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  test_assert(p != MAP_FAILED);
+  p[page] = 'b';
+
+  test_assert(0 == getrlimit(RLIMIT_NOFILE, &limit));
+  limit.rlim_cur = limit.rlim_cur > 100 ? 100 : limit.rlim_cur;
+  test_assert(0 == setrlimit(RLIMIT_NOFILE, &limit));
+
+  signal(SIGUSR1, handler);
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  test_assert(0 == sigprocmask(SIG_BLOCK, &set, NULL));
+
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    sched_yield();
+    test_assert(p[0] == 'a' && p[page] == 'b');
+  }
+
+  test_assert(1 == read(fd, &c, 1) && c == 'a');
+  test_assert(0 == unlink(FILENAME));
+  test_assert(0 == chdir(".."));
+  test_assert(0 == rmdir(DIRNAME));
+  raise(SIGUSR1);
+  test_assert(!caught);
+  test_assert(0 == sigprocmask(SIG_UNBLOCK, &set, NULL));
+  test_assert(caught);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
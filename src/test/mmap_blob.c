@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define FILENAME "mmap_blob.data"
+
+int main(void) {
+  size_t num_bytes = 4 * sysconf(_SC_PAGESIZE);
+  char* buf = malloc(num_bytes);
+  char* p;
+  int fd;
+  size_t i;
+  uint32_t sum = 0;
+
+  for (i = 0; i < num_bytes; ++i) {
+    buf[i] = (char)(i * 7);
+  }
+  /* A user-writable, non-executable file outside tmpfs: rr would normally
+     copy its contents into the trace. */
+  fd = open(FILENAME, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert((ssize_t)num_bytes == write(fd, buf, num_bytes));
+
+  p = mmap(NULL, num_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  test_assert(p != MAP_FAILED);
+
+  for (i = 0; i < num_bytes; ++i) {
+    test_assert(p[i] == buf[i]);
+    sum = sum * 31 + (uint8_t)p[i];
+  }
+  atomic_printf("sum=%u\n", sum);
+
+  /* Rewrite the file to the same size right away, most likely without
+     moving its ctime. The new contents must still be what gets recorded. */
+  for (i = 0; i < num_bytes; ++i) {
+    buf[i] = (char)(i * 13);
+  }
+  test_assert((ssize_t)num_bytes == pwrite(fd, buf, num_bytes, 0));
+  p = mmap(NULL, num_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  test_assert(p != MAP_FAILED);
+  test_assert(0 == close(fd));
+  test_assert(0 == unlink(FILENAME));
+
+  sum = 0;
+  for (i = 0; i < num_bytes; ++i) {
+    test_assert(p[i] == buf[i]);
+    sum = sum * 31 + (uint8_t)p[i];
+  }
+  atomic_printf("sum=%u\n", sum);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static volatile uint32_t flag;
+
+/* Spin until |flag| reaches |value|. How many spins that takes depends on
+   when the parent's write lands, which replay has to reproduce. */
+static uint32_t spin_until(uint32_t value) {
+  uint32_t spins = 0;
+  while (flag != value) {
+    ++spins;
+  }
+  return spins;
+}
+
+int main(void) {
+  uint32_t value;
+  struct iovec local;
+  struct iovec remote;
+  char path[100];
+  int pipe_fds[2];
+  pid_t child;
+  int status;
+  int fd;
+  char ch;
+
+  test_assert(0 == pipe(pipe_fds));
+  child = fork();
+  if (0 == child) {
+    uint32_t spins;
+    test_assert(1 == write(pipe_fds[1], "x", 1));
+    spins = spin_until(1);
+    spins += spin_until(2);
+    atomic_printf("child spun %u times\n", spins);
+    return 0;
+  }
+  test_assert(1 == read(pipe_fds[0], &ch, 1));
+
+  value = 1;
+  local.iov_base = &value;
+  local.iov_len = sizeof(value);
+  remote.iov_base = (void*)&flag;
+  remote.iov_len = sizeof(value);
+  test_assert(sizeof(value) ==
+              process_vm_writev(child, &local, 1, &remote, 1, 0));
+
+  sprintf(path, "/proc/%d/mem", child);
+  fd = open(path, O_RDWR);
+  test_assert(fd >= 0);
+  value = 2;
+  test_assert(sizeof(value) ==
+              pwrite64(fd, &value, sizeof(value), (uintptr_t)&flag));
+  close(fd);
+
+  test_assert(child == waitpid(child, &status, 0));
+  test_assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
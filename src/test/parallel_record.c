@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_CHILDREN 4
+#define NUM_ROUNDS 100
+#define ROUND_LENGTH 10000
+
+static uint32_t run_round(uint32_t v) {
+  int i;
+  for (i = 0; i < ROUND_LENGTH; ++i) {
+    v = v * 1103515245 + 12345;
+    if (v & 0x100) {
+      v ^= i;
+    }
+  }
+  return v;
+}
+
+static uint32_t compute(uint32_t seed, int fd) {
+  int i;
+  uint32_t v = seed;
+  for (i = 0; i < NUM_ROUNDS; ++i) {
+    v = run_round(v);
+    if (fd >= 0) {
+      test_assert(sizeof(v) == write(fd, &v, sizeof(v)));
+    }
+  }
+  return v;
+}
+
+int main(void) {
+  int fds[NUM_CHILDREN][2];
+  pid_t children[NUM_CHILDREN];
+  pid_t sharing_child;
+  volatile uint32_t* shared;
+  int status;
+  int i;
+
+  /* These children share no memory with anything, so they can be recorded
+     in parallel. */
+  for (i = 0; i < NUM_CHILDREN; ++i) {
+    test_assert(0 == pipe(fds[i]));
+    children[i] = fork();
+    if (0 == children[i]) {
+      close(fds[i][0]);
+      compute(i, fds[i][1]);
+      return 0;
+    }
+    test_assert(children[i] > 0);
+    close(fds[i][1]);
+  }
+
+  /* This child shares memory with us, so we must be serialized with it. */
+  shared = (uint32_t*)mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  test_assert(shared != MAP_FAILED);
+  *shared = 0;
+  sharing_child = fork();
+  if (0 == sharing_child) {
+    *shared = compute(NUM_CHILDREN, -1);
+    return 0;
+  }
+  test_assert(sharing_child > 0);
+
+  for (i = 0; i < NUM_CHILDREN; ++i) {
+    uint32_t v = i;
+    uint32_t got;
+    int round;
+    for (round = 0; round < NUM_ROUNDS; ++round) {
+      v = run_round(v);
+      test_assert(sizeof(got) == read(fds[i][0], &got, sizeof(got)));
+      test_assert(got == v);
+    }
+    test_assert(0 == read(fds[i][0], &got, sizeof(got)));
+    test_assert(children[i] == waitpid(children[i], &status, 0));
+    test_assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    atomic_printf("child %d computed %x\n", i, v);
+  }
+
+  test_assert(sharing_child == waitpid(sharing_child, &status, 0));
+  test_assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+  test_assert(*shared == compute(NUM_CHILDREN, -1));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
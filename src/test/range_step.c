@@ -0,0 +1,15 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static int loop(void) {
+  int i, s = 0;
+  for (i = 0; i < 1000; ++i) s += i;
+  return s;
+}
+
+int main(void) {
+  test_assert(loop() == 499500);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
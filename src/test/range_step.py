@@ -0,0 +1,21 @@
+from rrutil import *
+
+send_gdb('b loop')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('next')
+expect_gdb('for')
+# rr steps through the loop itself when gdb uses vCont;r.
+send_gdb('next')
+expect_gdb('return s')
+send_gdb('p s')
+expect_gdb(' = 499500')
+
+send_gdb('reverse-next')
+expect_gdb('for')
+send_gdb('p s')
+expect_gdb(' = 0')
+
+ok()
@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#ifdef __x86_64__
+/* Executed often enough for the Monkeypatcher to patch the rdtsc. The
+   patched code must preserve the flags, %rcx and %r11 like rdtsc does. */
+static uint64_t checked_rdtsc(void) {
+  uint32_t lo, hi;
+  uint64_t rcx, r11;
+  uint8_t zf;
+  __asm__ __volatile__("mov $0x1234,%%ecx\n\t"
+                       "mov $0x5678,%%r11d\n\t"
+                       "xor %%eax,%%eax\n\t"
+                       "rdtsc\n\t"
+                       "setz %2\n\t"
+                       "mov %%r11,%3\n\t"
+                       : "=a"(lo), "=d"(hi), "=&q"(zf), "=&r"(r11), "=&c"(rcx)
+                       :
+                       : "r11", "cc");
+  test_assert(zf == 1);
+  test_assert(rcx == 0x1234);
+  test_assert(r11 == 0x5678);
+  return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
+int main(void) {
+#ifdef __x86_64__
+  int i;
+  uint64_t last_tsc = 0;
+
+  for (i = 0; i < 1000; ++i) {
+    uint64_t tsc = checked_rdtsc();
+    test_assert(last_tsc < tsc);
+    last_tsc = tsc;
+  }
+#endif
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
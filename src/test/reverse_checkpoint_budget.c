@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define BUF_SIZE (1024 * 1024)
+#define NUM_ITERATIONS 64
+
+static void breakpoint(void) {}
+
+int main(void) {
+  char* buf = malloc(BUF_SIZE);
+  int i;
+  test_assert(buf != NULL);
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    /* Rewrite the same buffer between events, so each reverse-exec
+       checkpoint ends up with its own private copy of it. */
+    memset(buf, i + 1, BUF_SIZE);
+    getpid();
+    breakpoint();
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
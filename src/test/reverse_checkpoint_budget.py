@@ -0,0 +1,18 @@
+from rrutil import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('disable 1')
+send_gdb('c')
+expect_gdb('exited normally')
+
+send_gdb('enable 1')
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 1')
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 1')
+
+ok()
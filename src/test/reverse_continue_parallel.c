@@ -0,0 +1,23 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ITERATIONS 400
+#define BREAK_ITERATION 100
+
+static void breakpoint(void) {}
+
+int main(void) {
+  int i;
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    /* Each unbuffered syscall is an event, so the trace gets plenty of
+       disk checkpoints between the break and the end. */
+    getpid();
+    if (i == BREAK_ITERATION) {
+      breakpoint();
+    }
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,20 @@
+from rrutil import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('exited normally')
+
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 1')
+send_gdb('up')
+expect_gdb('main')
+send_gdb('p i')
+expect_gdb(' = 100')
+
+send_gdb('reverse-continue')
+expect_gdb('stopped')
+
+ok()
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ITERATIONS 1000
+
+static volatile int always = 1;
+static volatile int counter;
+
+static void breakpoint(void) {}
+
+int main(void) {
+  int i;
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    /* The conditional branches skipping these increments are never taken,
+       so they all retire in a single block step, which runs from the
+       previous iteration's return straight past the call to breakpoint(). */
+    if (always) {
+      ++counter;
+    }
+    if (always) {
+      ++counter;
+    }
+    if (always) {
+      ++counter;
+    }
+    if (always) {
+      ++counter;
+    }
+    if (always) {
+      ++counter;
+    }
+    if (always) {
+      ++counter;
+    }
+    if (always) {
+      ++counter;
+    }
+    if (always) {
+      ++counter;
+    }
+    breakpoint();
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
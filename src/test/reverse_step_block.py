@@ -0,0 +1,29 @@
+from rrutil import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('ignore 1 500')
+expect_gdb('Will ignore next 500 crossings')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# Block-step toward the call to breakpoint(), overshoot it, and redo the
+# interval, block-stepping up to the overshooting block and singlestepping
+# only that one.
+send_gdb('reverse-stepi')
+expect_gdb('main')
+send_gdb('p i')
+expect_gdb(' = 500')
+send_gdb('reverse-stepi')
+expect_gdb('main')
+send_gdb('p i')
+expect_gdb(' = 500')
+
+send_gdb('block-step-stats')
+expect_gdb('block steps retired .* overshoots redone')
+
+send_gdb('stepi')
+send_gdb('stepi')
+expect_gdb('breakpoint')
+
+ok()
@@ -8,6 +8,8 @@
 char buf[1024] = { 99, 1, 2, 2, 3, 0xff, 0xfa, 0xde, 0xbc };
 char* p;
 char* p_end;
+char* q;
+char* q_end;
 int* argc_ptr;
 
 static void breakpoint(void) {}
@@ -40,6 +42,16 @@ int main(int argc, __attribute__((unused)) char* argv[]) {
   test_assert(0 == munmap(p + page_size * 3, page_size));
   test_assert(0 == mprotect(p + page_size, page_size, PROT_NONE));
 
+  /* Two adjacent mappings, with a pattern at the start of the second. */
+  q = (char*)mmap(NULL, page_size * 2, PROT_READ | PROT_WRITE,
+                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  test_assert(q != MAP_FAILED);
+  q_end = q + page_size * 2;
+  q[page_size] = 0x5a;
+  q[page_size + 1] = 0xa5;
+  q[page_size + 2] = 0x3c;
+  test_assert(0 == mprotect(q + page_size, page_size, PROT_READ));
+
   breakpoint();
 
   atomic_puts("EXIT-SUCCESS");
@@ -39,6 +39,11 @@ expect_gdb('Pattern not found')
 send_gdb('find p, p_end,(char)0,(char)0,(char)1')
 expect_gdb('1 pattern found')
 
+# A match at the start of a mapping is only found once, even though the
+# search of the previous mapping reads past its end.
+send_gdb('find q, q_end,(char)0x5a,(char)0xa5,(char)0x3c')
+expect_gdb('1 pattern found')
+
 # Search the whole address space
 send_gdb('find 0,-10L,0xabcdef01')
 expect_gdb('Pattern not found')
@@ -48,6 +53,16 @@ send_gdb('find 0,-10L,(char)0,(char)1,(char)2,(char)2,(char)3,(char)0xff,(char)0
 expect_gdb('<buf>')
 expect_gdb('3 patterns found')
 
+send_gdb('find-all /w 0xabcdef01')
+expect_gdb(' 0 matches found')
+
+# 'buf' and its two copies in 'p' at least.
+send_gdb('find-all /w 0xdefaff03 0xabcdef01')
+expect_gdb(': 0xdefaff03')
+expect_gdb(': 0xdefaff03')
+expect_gdb(': 0xdefaff03')
+expect_gdb('matches found')
+
 send_gdb('up');
 send_gdb('find 0,-10L,&argc')
 expect_gdb('<argc_ptr>')
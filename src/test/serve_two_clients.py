@@ -0,0 +1,17 @@
+from rrutil import *
+import os, time
+
+send_gdb('b C')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1, C')
+
+if os.environ['SERVE_CLIENT'] == 'first':
+    # Stay attached while the second debugger runs to the breakpoint too.
+    open('first-stopped', 'w').close()
+    while not os.path.exists('second-done'):
+        time.sleep(0.1)
+    send_gdb('bt')
+    expect_gdb('#0 .*C \\(\\)')
+
+ok()
@@ -0,0 +1,19 @@
+from rrutil import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# The library list comes from qXfer:libraries-svr4 and the libraries
+# themselves are read through vFile.
+send_gdb('info sharedlibrary')
+expect_gdb('libc')
+send_gdb('bt')
+expect_gdb('main')
+
+# Files that don't back a mapping can't be read through vFile.
+send_gdb('remote get /etc/passwd passwd.copy')
+expect_gdb('Permission denied')
+
+ok()
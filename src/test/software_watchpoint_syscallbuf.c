@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void breakpoint(void) {}
+
+/* Watching all of these uses up the debug registers. */
+static long watched[4];
+static char buf[8];
+
+int main(void) {
+  int fds[2];
+  int i;
+
+  test_assert(0 == pipe(fds));
+  breakpoint();
+
+  /* Both syscalls are buffered, so replay copies the data into |buf| while
+     it replays the syscallbuf flush. */
+  test_assert(sizeof(buf) == write(fds[1], "abcdefgh", sizeof(buf)));
+  test_assert(sizeof(buf) == read(fds[0], buf, sizeof(buf)));
+  buf[0] = 'z';
+
+  for (i = 0; i < 4; ++i) {
+    watched[i] = i + 1;
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
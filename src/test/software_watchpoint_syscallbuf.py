@@ -0,0 +1,31 @@
+from rrutil import *
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+for i in range(4):
+    send_gdb('watch watched[%d]' % i)
+    expect_gdb('atchpoint %d' % (i + 2))
+# There are no debug registers left for this one, so replay write-protects
+# its page instead.
+send_gdb('watch -l *(long*)buf')
+expect_gdb('atchpoint 6')
+
+# 'abcdefgh' written by the syscallbuf flush
+send_gdb('c')
+expect_gdb('Old value = 0')
+expect_gdb('New value = 7523094288207667809')
+
+# 'zbcdefgh' written by main
+send_gdb('c')
+expect_gdb('Old value = 7523094288207667809')
+expect_gdb('New value = 7523094288207667834')
+
+send_gdb('delete 6')
+send_gdb('c')
+expect_gdb('Old value = 0')
+expect_gdb('New value = 1')
+
+ok()
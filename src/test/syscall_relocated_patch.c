@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#ifdef __x86_64__
+static int result;
+
+/* The instruction after this syscall doesn't match any of the preload
+   library's syscall hooks, and is RIP-relative, so the Monkeypatcher has to
+   relocate it to patch the syscall. */
+static int raw_getpid(void) {
+  long ret;
+  __asm__ __volatile__("syscall\n\t"
+                       "movl %%eax,result(%%rip)\n\t"
+                       : "=a"(ret)
+                       : "a"(SYS_getpid)
+                       : "rcx", "r11", "memory");
+  return (int)ret;
+}
+#endif
+
+int main(void) {
+#ifdef __x86_64__
+  int i;
+  pid_t pid = getpid();
+
+  for (i = 0; i < 10; ++i) {
+    result = -1;
+    test_assert(raw_getpid() == pid);
+    test_assert(result == pid);
+  }
+#endif
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
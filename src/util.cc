@@ -76,6 +76,15 @@ int clone_flags_to_task_flags(int flags_arg) {
 
 size_t page_size() { return sysconf(_SC_PAGE_SIZE); }
 
+bool is_zero(const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
 size_t ceil_page_size(size_t sz) {
   size_t page_mask = ~(page_size() - 1);
   return (sz + page_size() - 1) & page_mask;
@@ -151,6 +151,9 @@ remote_ptr<void> floor_page_size(remote_ptr<void> addr);
 /** Return the system page size. */
 size_t page_size();
 
+/** Return true if all |size| bytes at |data| are zero. */
+bool is_zero(const uint8_t* data, size_t size);
+
 /** Return the default action of |sig|. */
 enum signal_action { DUMP_CORE, TERMINATE, CONTINUE, STOP, IGNORE };
 signal_action default_action(int sig);
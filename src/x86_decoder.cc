@@ -0,0 +1,514 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "x86_decoder.h"
+
+#include <string.h>
+
+namespace rr {
+
+static const size_t MAX_X86_INSTRUCTION_LENGTH = 15;
+
+enum ImmediateKind {
+  IMM_NONE,
+  // 8-bit immediate.
+  IMM_8,
+  // 16-bit immediate.
+  IMM_16,
+  // 16-bit immediate followed by an 8-bit immediate (ENTER).
+  IMM_16_8,
+  // 16 bits with an operand-size prefix, otherwise 32 bits.
+  IMM_Z,
+  // Like IMM_Z, but 64 bits with REX.W (MOV r64, imm64).
+  IMM_V,
+  // A memory offset the size of an address (MOV to/from moffs).
+  IMM_MOFFS
+};
+
+struct OpcodeInfo {
+  OpcodeInfo()
+      : valid(true),
+        has_modrm(false),
+        immediate(IMM_NONE),
+        is_control_flow(false),
+        is_special(false) {}
+  bool valid;
+  bool has_modrm;
+  ImmediateKind immediate;
+  bool is_control_flow;
+  bool is_special;
+};
+
+static OpcodeInfo one_byte_opcode_info(uint8_t op) {
+  OpcodeInfo info;
+  if (op < 0x40) {
+    switch (op) {
+      // Invalid in 64-bit mode: PUSH/POP of segment registers, DAA, DAS,
+      // AAA, AAS.
+      case 0x06:
+      case 0x07:
+      case 0x0E:
+      case 0x16:
+      case 0x17:
+      case 0x1E:
+      case 0x1F:
+      case 0x27:
+      case 0x2F:
+      case 0x37:
+      case 0x3F:
+        info.valid = false;
+        return info;
+    }
+    // ALU operations: r/m forms, then AL/eAX immediate forms.
+    switch (op & 7) {
+      case 0:
+      case 1:
+      case 2:
+      case 3:
+        info.has_modrm = true;
+        break;
+      case 4:
+        info.immediate = IMM_8;
+        break;
+      case 5:
+        info.immediate = IMM_Z;
+        break;
+    }
+    return info;
+  }
+  if (op >= 0x70 && op < 0x80) {
+    // Jcc rel8
+    info.immediate = IMM_8;
+    info.is_control_flow = true;
+    return info;
+  }
+  if (op >= 0xB0 && op < 0xB8) {
+    info.immediate = IMM_8;
+    return info;
+  }
+  if (op >= 0xB8 && op < 0xC0) {
+    info.immediate = IMM_V;
+    return info;
+  }
+  if (op >= 0xD8 && op < 0xE0) {
+    // x87
+    info.has_modrm = true;
+    return info;
+  }
+  switch (op) {
+    case 0x63:
+    case 0x84:
+    case 0x85:
+    case 0x86:
+    case 0x87:
+    case 0x88:
+    case 0x89:
+    case 0x8A:
+    case 0x8B:
+    case 0x8C:
+    case 0x8D:
+    case 0x8E:
+    case 0x8F:
+    case 0xD0:
+    case 0xD1:
+    case 0xD2:
+    case 0xD3:
+    case 0xF6:
+    case 0xF7:
+    case 0xFE:
+    case 0xFF:
+      info.has_modrm = true;
+      break;
+    case 0x69:
+    case 0x81:
+    case 0xC7:
+      info.has_modrm = true;
+      info.immediate = IMM_Z;
+      break;
+    case 0x6B:
+    case 0x80:
+    case 0x83:
+    case 0xC0:
+    case 0xC1:
+    case 0xC6:
+      info.has_modrm = true;
+      info.immediate = IMM_8;
+      break;
+    case 0x68:
+    case 0xA9:
+      info.immediate = IMM_Z;
+      break;
+    case 0x6A:
+    case 0xA8:
+    case 0xE4:
+    case 0xE5:
+    case 0xE6:
+    case 0xE7:
+      info.immediate = IMM_8;
+      break;
+    case 0xA0:
+    case 0xA1:
+    case 0xA2:
+    case 0xA3:
+      info.immediate = IMM_MOFFS;
+      break;
+    case 0xC8:
+      info.immediate = IMM_16_8;
+      break;
+    case 0xC2:
+    case 0xCA:
+      info.immediate = IMM_16;
+      info.is_control_flow = true;
+      break;
+    case 0xCD:
+    case 0xE0:
+    case 0xE1:
+    case 0xE2:
+    case 0xE3:
+    case 0xEB:
+      info.immediate = IMM_8;
+      info.is_control_flow = true;
+      break;
+    case 0xE8:
+    case 0xE9:
+      // rel32. With an operand-size prefix AMD CPUs take a rel16 while Intel
+      // CPUs ignore the prefix, so the caller rejects that form.
+      info.immediate = IMM_Z;
+      info.is_control_flow = true;
+      break;
+    case 0xC3:
+    case 0xCB:
+    case 0xCC:
+    case 0xCF:
+    case 0xF1:
+    case 0xF4:
+      info.is_control_flow = true;
+      break;
+    // Invalid in 64-bit mode, or the first byte of a VEX/EVEX prefix, which
+    // we don't decode.
+    case 0x60:
+    case 0x61:
+    case 0x62:
+    case 0x82:
+    case 0x9A:
+    case 0xC4:
+    case 0xC5:
+    case 0xCE:
+    case 0xD4:
+    case 0xD5:
+    case 0xD6:
+    case 0xEA:
+      info.valid = false;
+      break;
+    default:
+      // 0x40-0x4F (REX) are handled by the caller. Everything else left
+      // has no operands encoded in the instruction stream.
+      break;
+  }
+  return info;
+}
+
+static OpcodeInfo two_byte_opcode_info(uint8_t op) {
+  OpcodeInfo info;
+  if (op >= 0x80 && op < 0x90) {
+    // Jcc rel32
+    info.immediate = IMM_Z;
+    info.is_control_flow = true;
+    return info;
+  }
+  if (op >= 0xC8 && op < 0xD0) {
+    // BSWAP
+    return info;
+  }
+  switch (op) {
+    case 0x05: // SYSCALL
+    case 0x07: // SYSRET
+    case 0x0B: // UD2
+    case 0x34: // SYSENTER
+    case 0x35: // SYSEXIT
+    case 0xAA: // RSM
+      info.is_control_flow = true;
+      break;
+    case 0xB9: // UD1
+    case 0xFF: // UD0
+      info.has_modrm = true;
+      info.is_control_flow = true;
+      break;
+    case 0x30: // WRMSR
+    case 0x31: // RDTSC
+    case 0x32: // RDMSR
+    case 0x33: // RDPMC
+    case 0xA2: // CPUID
+      info.is_special = true;
+      break;
+    case 0x06:
+    case 0x08:
+    case 0x09:
+    case 0x0E:
+    case 0x36:
+    case 0x37:
+    case 0x77:
+    case 0xA0:
+    case 0xA1:
+    case 0xA8:
+    case 0xA9:
+      break;
+    case 0x70:
+    case 0x71:
+    case 0x72:
+    case 0x73:
+    case 0xA4:
+    case 0xAC:
+    case 0xBA:
+    case 0xC2:
+    case 0xC4:
+    case 0xC5:
+    case 0xC6:
+      info.has_modrm = true;
+      info.immediate = IMM_8;
+      break;
+    // Invalid, or 3DNow! (0x0F), which has a trailing opcode byte we don't
+    // bother with.
+    case 0x04:
+    case 0x0A:
+    case 0x0C:
+    case 0x0F:
+    case 0x39:
+    case 0x3B:
+    case 0x3C:
+    case 0x3D:
+    case 0x3E:
+    case 0x3F:
+      info.valid = false;
+      break;
+    default:
+      info.has_modrm = true;
+      break;
+  }
+  return info;
+}
+
+bool decode_x86_64_instruction(const uint8_t* code, size_t size,
+                               X86Instruction* decoded) {
+  *decoded = X86Instruction();
+  if (size > MAX_X86_INSTRUCTION_LENGTH) {
+    size = MAX_X86_INSTRUCTION_LENGTH;
+  }
+
+  bool operand_size_prefix = false;
+  bool address_size_prefix = false;
+  size_t i = 0;
+  bool done = false;
+  while (!done) {
+    if (i >= size) {
+      return false;
+    }
+    switch (code[i]) {
+      case 0x66:
+        operand_size_prefix = true;
+        ++i;
+        break;
+      case 0x67:
+        address_size_prefix = true;
+        ++i;
+        break;
+      case 0x26:
+      case 0x2E:
+      case 0x36:
+      case 0x3E:
+      case 0x64:
+      case 0x65:
+      case 0xF0:
+      case 0xF2:
+      case 0xF3:
+        ++i;
+        break;
+      default:
+        done = true;
+        break;
+    }
+  }
+
+  bool rex_w = false;
+  if ((code[i] & 0xF0) == 0x40) {
+    rex_w = (code[i] & 0x08) != 0;
+    ++i;
+    if (i >= size) {
+      return false;
+    }
+  }
+
+  uint8_t op = code[i++];
+  bool two_byte = false;
+  OpcodeInfo info;
+  if (op == 0x0F) {
+    if (i >= size) {
+      return false;
+    }
+    two_byte = true;
+    op = code[i++];
+    if (op == 0x38 || op == 0x3A) {
+      // Three-byte opcode maps. All of these take a ModRM byte, and the
+      // 0x0F 0x3A map takes an 8-bit immediate too.
+      if (i >= size) {
+        return false;
+      }
+      ++i;
+      info.has_modrm = true;
+      info.immediate = op == 0x3A ? IMM_8 : IMM_NONE;
+    } else {
+      info = two_byte_opcode_info(op);
+    }
+  } else if ((op & 0xF0) == 0x40) {
+    // A REX prefix must immediately precede the opcode.
+    return false;
+  } else {
+    info = one_byte_opcode_info(op);
+  }
+  if (!info.valid) {
+    return false;
+  }
+
+  if (!two_byte && (op == 0xE8 || op == 0xE9) && operand_size_prefix) {
+    // The length depends on the CPU vendor.
+    return false;
+  }
+
+  uint8_t modrm = 0;
+  uint8_t modrm_reg = 0;
+  if (info.has_modrm) {
+    if (i >= size) {
+      return false;
+    }
+    modrm = code[i++];
+    uint8_t mod = modrm >> 6;
+    uint8_t rm = modrm & 7;
+    modrm_reg = (modrm >> 3) & 7;
+    if (two_byte && op == 0x01 && modrm == 0xF9) {
+      // RDTSCP
+      info.is_special = true;
+    }
+    size_t displacement = 0;
+    if (mod != 3) {
+      if (rm == 4) {
+        if (i >= size) {
+          return false;
+        }
+        uint8_t sib = code[i++];
+        if (mod == 0 && (sib & 7) == 5) {
+          displacement = 4;
+        }
+      } else if (mod == 0 && rm == 5) {
+        decoded->is_rip_relative = true;
+        decoded->displacement_offset = i;
+        displacement = 4;
+        if (address_size_prefix) {
+          // EIP-relative; not worth supporting.
+          info.is_special = true;
+        }
+      }
+      if (mod == 1) {
+        displacement = 1;
+      } else if (mod == 2) {
+        displacement = 4;
+      }
+    }
+    i += displacement;
+  }
+
+  if (!two_byte) {
+    switch (op) {
+      case 0x8F:
+        if (modrm_reg != 0) {
+          // XOP prefix.
+          return false;
+        }
+        break;
+      case 0xC6:
+      case 0xC7:
+        if (modrm == 0xF8) {
+          // XABORT imm8 / XBEGIN rel16/32: both can transfer control to the
+          // transaction's fallback address.
+          info.is_control_flow = true;
+        }
+        break;
+      case 0xF6:
+        if (modrm_reg < 2) {
+          info.immediate = IMM_8;
+        }
+        break;
+      case 0xF7:
+        if (modrm_reg < 2) {
+          info.immediate = IMM_Z;
+        }
+        break;
+      case 0xFF:
+        if (modrm_reg >= 2 && modrm_reg <= 5) {
+          // Indirect CALL/JMP
+          info.is_control_flow = true;
+        }
+        break;
+    }
+  }
+
+  switch (info.immediate) {
+    case IMM_NONE:
+      break;
+    case IMM_8:
+      i += 1;
+      break;
+    case IMM_16:
+      i += 2;
+      break;
+    case IMM_16_8:
+      i += 3;
+      break;
+    case IMM_Z:
+      i += operand_size_prefix ? 2 : 4;
+      break;
+    case IMM_V:
+      i += rex_w ? 8 : (operand_size_prefix ? 2 : 4);
+      break;
+    case IMM_MOFFS:
+      i += address_size_prefix ? 4 : 8;
+      break;
+  }
+  if (i > size) {
+    return false;
+  }
+
+  decoded->length = i;
+  decoded->is_control_flow = info.is_control_flow;
+  decoded->is_special = info.is_special;
+  return true;
+}
+
+bool relocate_x86_64_instructions(const uint8_t* code, size_t size,
+                                  uint64_t from, uint64_t to, uint8_t* out) {
+  size_t offset = 0;
+  while (offset < size) {
+    X86Instruction insn;
+    if (!decode_x86_64_instruction(code + offset, size - offset, &insn) ||
+        insn.is_control_flow || insn.is_special) {
+      return false;
+    }
+    memcpy(out + offset, code + offset, insn.length);
+    if (insn.is_rip_relative) {
+      // The displacement is relative to the end of the instruction, which
+      // moves by the same amount as the instruction start.
+      int32_t displacement;
+      memcpy(&displacement, code + offset + insn.displacement_offset,
+             sizeof(displacement));
+      int64_t new_displacement = int64_t(displacement) + int64_t(from - to);
+      if (int32_t(new_displacement) != new_displacement) {
+        return false;
+      }
+      int32_t new_displacement32 = int32_t(new_displacement);
+      memcpy(out + offset + insn.displacement_offset, &new_displacement32,
+             sizeof(new_displacement32));
+    }
+    offset += insn.length;
+  }
+  return offset == size;
+}
+
+} // namespace rr
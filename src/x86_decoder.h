@@ -0,0 +1,60 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_X86_DECODER_H_
+#define RR_X86_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace rr {
+
+/**
+ * The result of decoding a single x86-64 instruction with
+ * decode_x86_64_instruction.
+ */
+struct X86Instruction {
+  X86Instruction()
+      : length(0),
+        displacement_offset(0),
+        is_rip_relative(false),
+        is_control_flow(false),
+        is_special(false) {}
+  // Total length of the instruction in bytes, including prefixes.
+  size_t length;
+  // When is_rip_relative, the offset of the 32-bit displacement within the
+  // instruction bytes.
+  size_t displacement_offset;
+  // True if the instruction has a RIP-relative memory operand.
+  bool is_rip_relative;
+  // True if the instruction can transfer control somewhere other than the
+  // next instruction (branches, calls, returns, traps, system calls).
+  bool is_control_flow;
+  // True if rr needs to see the instruction at its original address (e.g.
+  // because it traps into rr and rr inspects the code at the trapping ip).
+  bool is_special;
+};
+
+/**
+ * Decode the length and relocation-relevant properties of the x86-64
+ * instruction at |code|, of which |size| bytes are available. Returns false
+ * if the instruction is truncated, invalid in 64-bit mode, or uses an
+ * encoding we don't understand (e.g. VEX/EVEX/XOP/3DNow!). This is a length
+ * decoder only; it doesn't care what the instruction does.
+ */
+bool decode_x86_64_instruction(const uint8_t* code, size_t size,
+                               X86Instruction* decoded);
+
+/**
+ * Copy |size| bytes of x86-64 instructions from |code|, which were at
+ * address |from| in the tracee, to |out|, so that they can be executed at
+ * address |to|. RIP-relative operands are adjusted. Returns false if
+ * the bytes don't decode into exactly |size| bytes of instructions or some
+ * instruction can't be executed at |to| (control flow, special instructions
+ * or RIP-relative operands that would be out of range).
+ */
+bool relocate_x86_64_instructions(const uint8_t* code, size_t size,
+                                  uint64_t from, uint64_t to, uint8_t* out);
+
+} // namespace rr
+
+#endif /* RR_X86_DECODER_H_ */